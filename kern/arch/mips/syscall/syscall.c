@@ -283,6 +283,9 @@ syscall(struct trapframe *tf)
 	    case SYS_close:
 		err = sys_close((int)tf->tf_a0);
 		break;
+	    case SYS_futex:
+		err = sys_futex((userptr_t)tf->tf_a0, (int)tf->tf_a1, (int)tf->tf_a2, &retval);
+		break;
 
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -707,7 +707,7 @@ emufs_isseekable(struct vnode *v)
 }
 
 /*
- * VOP_FSYNC
+ * VOP_FSYNC and VOP_FDATASYNC
  */
 static
 int
@@ -1087,8 +1087,11 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_gettype = emufs_file_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_fsync,
+	.vop_fdatasync = emufs_fsync,
 	.vop_mmap = emufs_mmap,
 	.vop_truncate = emufs_truncate,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_punch = vopfail_punch_nosys,
 	.vop_namefile = emufs_uio_op_notdir,
 
 	.vop_creat = emufs_creat_notdir,
@@ -1121,8 +1124,11 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
+	.vop_fdatasync = emufs_void_op_isdir,
 	.vop_mmap = emufs_void_op_isdir,
 	.vop_truncate = emufs_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
+	.vop_punch = vopfail_punch_isdir,
 	.vop_namefile = emufs_namefile,
 
 	.vop_creat = emufs_creat,
@@ -1225,6 +1231,18 @@ emufs_sync(struct fs *fs)
 	return 0;
 }
 
+/*
+ * FSOP_WRITEBACK
+ */
+static
+int
+emufs_writeback(struct fs *fs, time_t cutoff)
+{
+	(void)fs;
+	(void)cutoff;
+	return 0;
+}
+
 /*
  * FSOP_GETVOLNAME
  */
@@ -1275,6 +1293,7 @@ emufs_unmount(struct fs *fs)
  */
 static const struct fs_ops emufs_fsops = {
 	.fsop_sync = emufs_sync,
+	.fsop_writeback = emufs_writeback,
 	.fsop_getvolname = emufs_getvolname,
 	.fsop_getroot = emufs_getroot,
 	.fsop_unmount = emufs_unmount,
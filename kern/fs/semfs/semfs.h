@@ -31,6 +31,7 @@
 #define SEMFS_H
 
 #include <array.h>
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
 
@@ -43,6 +44,7 @@
  */
 
 #define SEMFS_ROOTDIR	0xffffffffU		/* semnum for root dir */
+#define SEMFS_DIRHASH_MIN 64			/* initial name hash size */
 
 /*
  * A user-facing semaphore.
@@ -50,22 +52,38 @@
  * We don't use the kernel-level semaphore to implement it (although
  * that would be tidy) because we'd have to violate its abstraction.
  * XXX: or would we? review once all this is done.
+ *
+ * The count is protected by a spinlock rather than a sleep lock so
+ * that P and V on an uncontended semaphore are a handful of
+ * instructions; the wait channel is only touched when sems_sleepers
+ * is nonzero. sems_sleepers counts threads asleep on the wchan that
+ * have not yet been picked to wake up, so V can wake exactly as many
+ * as it can satisfy.
+ *
+ * sems_vnode and sems_linked are protected by semfs_tablelock.
  */
 struct semfs_sem {
-	struct lock *sems_lock;			/* Lock to protect count */
-	struct cv *sems_cv;			/* CV to wait */
+	char *sems_name;			/* Name (for the wchan) */
+	struct spinlock sems_lock;		/* Lock to protect count */
+	struct wchan *sems_wchan;		/* Channel to wait on */
 	unsigned sems_count;			/* Semaphore count */
-	bool sems_hasvnode;			/* The vnode exists */
+	unsigned sems_sleepers;			/* Threads waiting for count */
+	struct semfs_vnode *sems_vnode;		/* The vnode, if it exists */
 	bool sems_linked;			/* In the directory */
 };
 DECLARRAY(semfs_sem, SEMFS_INLINE);
 
 /*
  * Directory entry; name and reference to a semaphore.
+ *
+ * Entries are kept densely packed in semfs_dents (for getdirentry)
+ * and also chained into a hash table on the name (for lookup).
  */
 struct semfs_direntry {
 	char *semd_name;			/* Name */
 	unsigned semd_semnum;			/* Which semaphore */
+	unsigned semd_slot;			/* Index in semfs_dents */
+	struct semfs_direntry *semd_next;	/* Hash chain */
 };
 DECLARRAY(semfs_direntry, SEMFS_INLINE);
 
@@ -80,6 +98,7 @@ struct semfs_vnode {
 	struct vnode semv_absvn;		/* Abstract vnode */
 	struct semfs *semv_semfs;		/* Back-pointer to fs */
 	unsigned semv_semnum;			/* Which semaphore */
+	struct semfs_sem *semv_sem;		/* The semaphore (not for root) */
 };
 
 /*
@@ -90,11 +109,15 @@ struct semfs {
 	struct fs semfs_absfs;			/* Abstract fs object */
 
 	struct lock *semfs_tablelock;		/* Lock for following */
-	struct vnodearray *semfs_vnodes;	/* Currently extant vnodes */
+	struct semfs_vnode *semfs_rootvnode;	/* Root vnode, if it exists */
+	unsigned semfs_nvnodes;			/* Number of extant vnodes */
 	struct semfs_semarray *semfs_sems;	/* Semaphores */
+	unsigned semfs_semhint;			/* No free slots below this */
 
-	struct lock *semfs_dirlock;		/* Lock for following */
+	struct rwlock *semfs_dirlock;		/* Lock for following */
 	struct semfs_direntryarray *semfs_dents; /* The root directory */
+	struct semfs_direntry **semfs_dirhash;	/* Name hash table */
+	unsigned semfs_dirhashsize;		/* Buckets (power of 2) */
 };
 
 /*
@@ -112,9 +135,15 @@ DEFARRAY(semfs_direntry, SEMFS_INLINE);
 /* in semfs_obj.c */
 struct semfs_sem *semfs_sem_create(const char *name);
 int semfs_sem_insert(struct semfs *, struct semfs_sem *, unsigned *);
+void semfs_sem_remove(struct semfs *, unsigned semnum);
 void semfs_sem_destroy(struct semfs_sem *);
 struct semfs_direntry *semfs_direntry_create(const char *name, unsigned semno);
 void semfs_direntry_destroy(struct semfs_direntry *);
+int semfs_dir_init(struct semfs *);
+void semfs_dir_cleanup(struct semfs *);
+struct semfs_direntry *semfs_dir_find(struct semfs *, const char *name);
+int semfs_dir_insert(struct semfs *, struct semfs_direntry *);
+void semfs_dir_remove(struct semfs *, struct semfs_direntry *);
 
 /* in semfs_vnops.c */
 int semfs_getvnode(struct semfs *, unsigned, struct vnode **ret);
@@ -50,6 +50,18 @@ semfs_sync(struct fs *fs)
 	return 0;
 }
 
+/*
+ * Nor does writeback; there's no file data.
+ */
+static
+int
+semfs_writeback(struct fs *fs, time_t cutoff)
+{
+	(void)fs;
+	(void)cutoff;
+	return 0;
+}
+
 /*
  * We have only one volume name and it's hardwired.
  */
@@ -100,7 +112,9 @@ semfs_destroy(struct semfs *semfs)
 	num = semfs_semarray_num(semfs->semfs_sems);
 	for (i=0; i<num; i++) {
 		sem = semfs_semarray_get(semfs->semfs_sems, i);
-		semfs_sem_destroy(sem);
+		if (sem != NULL) {
+			semfs_sem_destroy(sem);
+		}
 	}
 	semfs_semarray_setsize(semfs->semfs_sems, 0);
 
@@ -111,10 +125,10 @@ semfs_destroy(struct semfs *semfs)
 	}
 	semfs_direntryarray_setsize(semfs->semfs_dents, 0);
 
+	semfs_dir_cleanup(semfs);
 	semfs_direntryarray_destroy(semfs->semfs_dents);
-	lock_destroy(semfs->semfs_dirlock);
+	rwlock_destroy(semfs->semfs_dirlock);
 	semfs_semarray_destroy(semfs->semfs_sems);
-	vnodearray_destroy(semfs->semfs_vnodes);
 	lock_destroy(semfs->semfs_tablelock);
 	kfree(semfs);
 }
@@ -130,7 +144,7 @@ semfs_unmount(struct fs *fs)
 	struct semfs *semfs = fs->fs_data;
 
 	lock_acquire(semfs->semfs_tablelock);
-	if (vnodearray_num(semfs->semfs_vnodes) > 0) {
+	if (semfs->semfs_nvnodes > 0) {
 		lock_release(semfs->semfs_tablelock);
 		return EBUSY;
 	}
@@ -146,6 +160,7 @@ semfs_unmount(struct fs *fs)
  */
 static const struct fs_ops semfs_fsops = {
 	.fsop_sync = semfs_sync,
+	.fsop_writeback = semfs_writeback,
 	.fsop_getvolname = semfs_getvolname,
 	.fsop_getroot = semfs_getroot,
 	.fsop_unmount = semfs_unmount,
@@ -169,16 +184,15 @@ semfs_create(void)
 	if (semfs->semfs_tablelock == NULL) {
 		goto fail_semfs;
 	}
-	semfs->semfs_vnodes = vnodearray_create();
-	if (semfs->semfs_vnodes == NULL) {
-		goto fail_tablelock;
-	}
+	semfs->semfs_rootvnode = NULL;
+	semfs->semfs_nvnodes = 0;
 	semfs->semfs_sems = semfs_semarray_create();
 	if (semfs->semfs_sems == NULL) {
-		goto fail_vnodes;
+		goto fail_tablelock;
 	}
+	semfs->semfs_semhint = 0;
 
-	semfs->semfs_dirlock = lock_create("semfs_dir");
+	semfs->semfs_dirlock = rwlock_create("semfs_dir");
 	if (semfs->semfs_dirlock == NULL) {
 		goto fail_sems;
 	}
@@ -186,17 +200,20 @@ semfs_create(void)
 	if (semfs->semfs_dents == NULL) {
 		goto fail_dirlock;
 	}
+	if (semfs_dir_init(semfs)) {
+		goto fail_dents;
+	}
 
 	semfs->semfs_absfs.fs_data = semfs;
 	semfs->semfs_absfs.fs_ops = &semfs_fsops;
 	return semfs;
 
+ fail_dents:
+	semfs_direntryarray_destroy(semfs->semfs_dents);
  fail_dirlock:
-	lock_destroy(semfs->semfs_dirlock);
+	rwlock_destroy(semfs->semfs_dirlock);
  fail_sems:
 	semfs_semarray_destroy(semfs->semfs_sems);
- fail_vnodes:
-	vnodearray_destroy(semfs->semfs_vnodes);
  fail_tablelock:
 	lock_destroy(semfs->semfs_tablelock);
  fail_semfs:
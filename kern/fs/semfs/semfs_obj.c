@@ -30,6 +30,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 
 #define SEMFS_INLINE
 #include "semfs.h"
@@ -44,31 +46,32 @@ struct semfs_sem *
 semfs_sem_create(const char *name)
 {
 	struct semfs_sem *sem;
-	char lockname[32];
-	char cvname[32];
+	char wchanname[32];
 
-	snprintf(lockname, sizeof(lockname), "sem:l.%s", name);
-	snprintf(cvname, sizeof(cvname), "sem:%s", name);
+	snprintf(wchanname, sizeof(wchanname), "sem:%s", name);
 
 	sem = kmalloc(sizeof(*sem));
 	if (sem == NULL) {
 		goto fail_return;
 	}
-	sem->sems_lock = lock_create(lockname);
-	if (sem->sems_lock == NULL) {
+	/* wchans don't copy their names */
+	sem->sems_name = kstrdup(wchanname);
+	if (sem->sems_name == NULL) {
 		goto fail_sem;
 	}
-	sem->sems_cv = cv_create(cvname);
-	if (sem->sems_cv == NULL) {
-		goto fail_lock;
+	sem->sems_wchan = wchan_create(sem->sems_name);
+	if (sem->sems_wchan == NULL) {
+		goto fail_name;
 	}
+	spinlock_init(&sem->sems_lock);
 	sem->sems_count = 0;
-	sem->sems_hasvnode = false;
+	sem->sems_sleepers = 0;
+	sem->sems_vnode = NULL;
 	sem->sems_linked = false;
 	return sem;
 
- fail_lock:
-	lock_destroy(sem->sems_lock);
+ fail_name:
+	kfree(sem->sems_name);
  fail_sem:
 	kfree(sem);
  fail_return:
@@ -81,33 +84,58 @@ semfs_sem_create(const char *name)
 void
 semfs_sem_destroy(struct semfs_sem *sem)
 {
-	cv_destroy(sem->sems_cv);
-	lock_destroy(sem->sems_lock);
+	KASSERT(sem->sems_sleepers == 0);
+	spinlock_cleanup(&sem->sems_lock);
+	wchan_destroy(sem->sems_wchan);
+	kfree(sem->sems_name);
 	kfree(sem);
 }
 
 /*
  * Helper to insert a semfs_sem into the semaphore table.
+ *
+ * semfs_semhint is kept at or below the lowest free slot, so when
+ * semaphores are only being created this doesn't rescan the table.
  */
 int
 semfs_sem_insert(struct semfs *semfs, struct semfs_sem *sem, unsigned *ret)
 {
 	unsigned i, num;
+	int result;
 
 	KASSERT(lock_do_i_hold(semfs->semfs_tablelock));
 	num = semfs_semarray_num(semfs->semfs_sems);
-	if (num == SEMFS_ROOTDIR) {
-		/* Too many */
-		return ENOSPC;
-	}
-	for (i=0; i<num; i++) {
+	for (i=semfs->semfs_semhint; i<num; i++) {
 		if (semfs_semarray_get(semfs->semfs_sems, i) == NULL) {
 			semfs_semarray_set(semfs->semfs_sems, i, sem);
+			semfs->semfs_semhint = i + 1;
 			*ret = i;
 			return 0;
 		}
 	}
-	return semfs_semarray_add(semfs->semfs_sems, sem, ret);
+	if (num == SEMFS_ROOTDIR) {
+		/* Too many */
+		return ENOSPC;
+	}
+	result = semfs_semarray_add(semfs->semfs_sems, sem, ret);
+	if (result) {
+		return result;
+	}
+	semfs->semfs_semhint = *ret + 1;
+	return 0;
+}
+
+/*
+ * Helper to take a semaphore number out of the semaphore table.
+ */
+void
+semfs_sem_remove(struct semfs *semfs, unsigned semnum)
+{
+	KASSERT(lock_do_i_hold(semfs->semfs_tablelock));
+	semfs_semarray_set(semfs->semfs_sems, semnum, NULL);
+	if (semnum < semfs->semfs_semhint) {
+		semfs->semfs_semhint = semnum;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -131,6 +159,8 @@ semfs_direntry_create(const char *name, unsigned semnum)
 		return NULL;
 	}
 	dent->semd_semnum = semnum;
+	dent->semd_slot = 0;
+	dent->semd_next = NULL;
 	return dent;
 }
 
@@ -143,3 +173,167 @@ semfs_direntry_destroy(struct semfs_direntry *dent)
 	kfree(dent->semd_name);
 	kfree(dent);
 }
+
+////////////////////////////////////////////////////////////
+// directory
+
+/*
+ * Hash function for names. (This is the same string hash used in
+ * many places; nothing special.)
+ */
+static
+unsigned
+semfs_dir_hashname(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name;
+		name++;
+	}
+	return h;
+}
+
+/*
+ * Set up the hash table for the directory.
+ */
+int
+semfs_dir_init(struct semfs *semfs)
+{
+	unsigned i;
+
+	semfs->semfs_dirhashsize = SEMFS_DIRHASH_MIN;
+	semfs->semfs_dirhash = kmalloc(SEMFS_DIRHASH_MIN *
+				       sizeof(struct semfs_direntry *));
+	if (semfs->semfs_dirhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SEMFS_DIRHASH_MIN; i++) {
+		semfs->semfs_dirhash[i] = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Destroy the hash table. The entries themselves belong to
+ * semfs_dents and are destroyed from there.
+ */
+void
+semfs_dir_cleanup(struct semfs *semfs)
+{
+	kfree(semfs->semfs_dirhash);
+	semfs->semfs_dirhash = NULL;
+	semfs->semfs_dirhashsize = 0;
+}
+
+/*
+ * Find a name. Caller must hold the dirlock, either way.
+ */
+struct semfs_direntry *
+semfs_dir_find(struct semfs *semfs, const char *name)
+{
+	struct semfs_direntry *dent;
+	unsigned h;
+
+	h = semfs_dir_hashname(name) & (semfs->semfs_dirhashsize - 1);
+	for (dent = semfs->semfs_dirhash[h]; dent != NULL;
+	     dent = dent->semd_next) {
+		if (!strcmp(dent->semd_name, name)) {
+			return dent;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the hash table once it gets too full. Failure isn't fatal;
+ * the chains just get longer.
+ */
+static
+void
+semfs_dir_grow(struct semfs *semfs)
+{
+	struct semfs_direntry **newtable, *dent;
+	unsigned newsize, i, num, h;
+
+	newsize = semfs->semfs_dirhashsize * 2;
+	newtable = kmalloc(newsize * sizeof(struct semfs_direntry *));
+	if (newtable == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newtable[i] = NULL;
+	}
+
+	num = semfs_direntryarray_num(semfs->semfs_dents);
+	for (i=0; i<num; i++) {
+		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
+		h = semfs_dir_hashname(dent->semd_name) & (newsize - 1);
+		dent->semd_next = newtable[h];
+		newtable[h] = dent;
+	}
+
+	kfree(semfs->semfs_dirhash);
+	semfs->semfs_dirhash = newtable;
+	semfs->semfs_dirhashsize = newsize;
+}
+
+/*
+ * Add an entry. Caller must hold the dirlock for writing and must
+ * have checked that the name isn't already there.
+ */
+int
+semfs_dir_insert(struct semfs *semfs, struct semfs_direntry *dent)
+{
+	unsigned h;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(semfs->semfs_dirlock));
+
+	result = semfs_direntryarray_add(semfs->semfs_dents, dent,
+					 &dent->semd_slot);
+	if (result) {
+		return result;
+	}
+	h = semfs_dir_hashname(dent->semd_name) &
+		(semfs->semfs_dirhashsize - 1);
+	dent->semd_next = semfs->semfs_dirhash[h];
+	semfs->semfs_dirhash[h] = dent;
+
+	if (semfs_direntryarray_num(semfs->semfs_dents) >
+	    2 * semfs->semfs_dirhashsize) {
+		semfs_dir_grow(semfs);
+	}
+	return 0;
+}
+
+/*
+ * Remove an entry. Caller must hold the dirlock for writing. The
+ * last entry in the array is moved into the hole, so the array stays
+ * packed; this means a concurrent getdirentry scan may miss the
+ * moved entry, which is allowed.
+ */
+void
+semfs_dir_remove(struct semfs *semfs, struct semfs_direntry *dent)
+{
+	struct semfs_direntry **dp, *last;
+	unsigned h, num;
+
+	KASSERT(rwlock_do_i_hold_write(semfs->semfs_dirlock));
+
+	h = semfs_dir_hashname(dent->semd_name) &
+		(semfs->semfs_dirhashsize - 1);
+	for (dp = &semfs->semfs_dirhash[h]; *dp != dent;
+	     dp = &(*dp)->semd_next) {
+		KASSERT(*dp != NULL);
+	}
+	*dp = dent->semd_next;
+	dent->semd_next = NULL;
+
+	num = semfs_direntryarray_num(semfs->semfs_dents);
+	KASSERT(dent->semd_slot < num);
+	last = semfs_direntryarray_get(semfs->semfs_dents, num - 1);
+	semfs_direntryarray_set(semfs->semfs_dents, dent->semd_slot, last);
+	last->semd_slot = dent->semd_slot;
+	semfs_direntryarray_remove(semfs->semfs_dents, num - 1);
+}
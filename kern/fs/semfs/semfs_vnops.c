@@ -33,6 +33,7 @@
 #include <stat.h>
 #include <uio.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -107,49 +108,34 @@ semfs_fsync(struct vnode *vn)
 // semaphore ops
 
 /*
- * XXX fold these two together
+ * Get the semaphore for a vnode. The pointer is cached in the vnode
+ * when the vnode is made, and the semaphore can't go away while the
+ * vnode exists, so this doesn't need the table lock.
  */
-
-static
-struct semfs_sem *
-semfs_getsembynum(struct semfs *semfs, unsigned semnum)
-{
-	struct semfs_sem *sem;
-
-	lock_acquire(semfs->semfs_tablelock);
-	sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-	lock_release(semfs->semfs_tablelock);
-
-	return sem;
-}
-
 static
 struct semfs_sem *
 semfs_getsem(struct semfs_vnode *semv)
 {
-	struct semfs *semfs = semv->semv_semfs;
-
-	return semfs_getsembynum(semfs, semv->semv_semnum);
+	KASSERT(semv->semv_sem != NULL);
+	return semv->semv_sem;
 }
 
 /*
- * Wakeup helper. We only need to wake up if there are sleepers, which
- * should only be the case if the old count is 0; and we only
- * potentially need to wake more than one sleeper if the new count
- * will be more than 1.
+ * Wakeup helper. We only need to wake up if there are sleepers; and
+ * since each sleeper can consume at least one unit, there's no point
+ * waking more sleepers than the new count. Each thread picked here
+ * is taken off sems_sleepers so a later V doesn't pick it again.
  */
 static
 void
 semfs_wakeup(struct semfs_sem *sem, unsigned newcount)
 {
-	if (sem->sems_count > 0 || newcount == 0) {
-		return;
-	}
-	if (newcount == 1) {
-		cv_signal(sem->sems_cv, sem->sems_lock);
-	}
-	else {
-		cv_broadcast(sem->sems_cv, sem->sems_lock);
+	KASSERT(spinlock_do_i_hold(&sem->sems_lock));
+
+	while (sem->sems_sleepers > 0 && newcount > 0) {
+		sem->sems_sleepers--;
+		newcount--;
+		wchan_wakeone(sem->sems_wchan, &sem->sems_lock);
 	}
 }
 
@@ -167,10 +153,11 @@ semfs_semstat(struct vnode *vn, struct stat *buf)
 
 	bzero(buf, sizeof(*buf));
 
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	buf->st_size = sem->sems_count;
+	spinlock_release(&sem->sems_lock);
+	/* not worth the table lock; this is only a snapshot anyway */
 	buf->st_nlink = sem->sems_linked ? 1 : 0;
-	lock_release(sem->sems_lock);
 
 	buf->st_mode = S_IFREG | 0666;
 	buf->st_blocks = 0;
@@ -194,7 +181,7 @@ semfs_read(struct vnode *vn, struct uio *uio)
 
 	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	while (uio->uio_resid > 0) {
 		if (sem->sems_count > 0) {
 			consume = uio->uio_resid;
@@ -215,10 +202,12 @@ semfs_read(struct vnode *vn, struct uio *uio)
 		if (sem->sems_count == 0) {
 			DEBUG(DB_SEMFS, "semfs: sem%u: blocking\n",
 			      semv->semv_semnum);
-			cv_wait(sem->sems_cv, sem->sems_lock);
+			/* semfs_wakeup takes us back off the count */
+			sem->sems_sleepers++;
+			wchan_sleep(sem->sems_wchan, &sem->sems_lock);
 		}
 	}
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 	return 0;
 }
 
@@ -236,12 +225,12 @@ semfs_write(struct vnode *vn, struct uio *uio)
 
 	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	while (uio->uio_resid > 0) {
 		newcount = sem->sems_count + uio->uio_resid;
 		if (newcount < sem->sems_count) {
 			/* overflow */
-			lock_release(sem->sems_lock);
+			spinlock_release(&sem->sems_lock);
 			return EFBIG;
 		}
 		DEBUG(DB_SEMFS, "semfs: sem%u: V, count %u -> %u\n",
@@ -251,7 +240,7 @@ semfs_write(struct vnode *vn, struct uio *uio)
 		uio->uio_offset += uio->uio_resid;
 		uio->uio_resid = 0;
 	}
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 	return 0;
 }
 
@@ -283,10 +272,10 @@ semfs_truncate(struct vnode *vn, off_t len)
 
 	sem = semfs_getsem(semv);
 
-	lock_acquire(sem->sems_lock);
+	spinlock_acquire(&sem->sems_lock);
 	semfs_wakeup(sem, newcount);
 	sem->sems_count = newcount;
-	lock_release(sem->sems_lock);
+	spinlock_release(&sem->sems_lock);
 
 	return 0;
 }
@@ -311,7 +300,7 @@ semfs_getdirentry(struct vnode *dirvn, struct uio *uio)
 	KASSERT(uio->uio_offset >= 0);
 	pos = uio->uio_offset;
 
-	lock_acquire(semfs->semfs_dirlock);
+	rwlock_acquire_read(semfs->semfs_dirlock);
 
 	num = semfs_direntryarray_num(semfs->semfs_dents);
 	if (pos >= num) {
@@ -324,7 +313,7 @@ semfs_getdirentry(struct vnode *dirvn, struct uio *uio)
 				 uio);
 	}
 
-	lock_release(semfs->semfs_dirlock);
+	rwlock_release_read(semfs->semfs_dirlock);
 	return result;
 }
 
@@ -340,9 +329,9 @@ semfs_dirstat(struct vnode *vn, struct stat *buf)
 
 	bzero(buf, sizeof(*buf));
 
-	lock_acquire(semfs->semfs_dirlock);
+	rwlock_acquire_read(semfs->semfs_dirlock);
 	buf->st_size = semfs_direntryarray_num(semfs->semfs_dents);
-	lock_release(semfs->semfs_dirlock);
+	rwlock_release_read(semfs->semfs_dirlock);
 
 	buf->st_mode = S_IFDIR | 1777;
 	buf->st_nlink = 2;
@@ -368,6 +357,10 @@ semfs_namefile(struct vnode *vn, struct uio *uio)
 
 /*
  * Create a semaphore.
+ *
+ * Opening an existing semaphore with O_CREAT is common, so check for
+ * it first with only the read lock held; only actual creation needs
+ * the directory to itself.
  */
 static
 int
@@ -378,7 +371,7 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
 	struct semfs_sem *sem;
-	unsigned i, num, empty, semnum;
+	unsigned semnum;
 	int result;
 
 	(void)mode;
@@ -386,28 +379,30 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 		return EEXIST;
 	}
 
-	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	empty = num;
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			if (empty == num) {
-				empty = i;
-			}
-			continue;
-		}
-		if (!strcmp(dent->semd_name, name)) {
-			/* found */
-			if (excl) {
-				lock_release(semfs->semfs_dirlock);
-				return EEXIST;
-			}
+	if (!excl) {
+		rwlock_acquire_read(semfs->semfs_dirlock);
+		dent = semfs_dir_find(semfs, name);
+		if (dent != NULL) {
 			result = semfs_getvnode(semfs, dent->semd_semnum,
 						resultvn);
-			lock_release(semfs->semfs_dirlock);
+			rwlock_release_read(semfs->semfs_dirlock);
 			return result;
 		}
+		rwlock_release_read(semfs->semfs_dirlock);
+	}
+
+	rwlock_acquire_write(semfs->semfs_dirlock);
+
+	/* look again; it may have appeared while we had no lock */
+	dent = semfs_dir_find(semfs, name);
+	if (dent != NULL) {
+		if (excl) {
+			rwlock_release_write(semfs->semfs_dirlock);
+			return EEXIST;
+		}
+		result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
+		rwlock_release_write(semfs->semfs_dirlock);
+		return result;
 	}
 
 	/* create it */
@@ -425,18 +420,13 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 
 	dent = semfs_direntry_create(name, semnum);
 	if (dent == NULL) {
+		result = ENOMEM;
 		goto fail_uninsert;
 	}
 
-	if (empty < num) {
-		semfs_direntryarray_set(semfs->semfs_dents, empty, dent);
-	}
-	else {
-		result = semfs_direntryarray_add(semfs->semfs_dents, dent,
-						 &empty);
-		if (result) {
-			goto fail_undent;
-		}
+	result = semfs_dir_insert(semfs, dent);
+	if (result) {
+		goto fail_undent;
 	}
 
 	result = semfs_getvnode(semfs, semnum, resultvn);
@@ -444,22 +434,24 @@ semfs_creat(struct vnode *dirvn, const char *name, bool excl, mode_t mode,
 		goto fail_undir;
 	}
 
+	lock_acquire(semfs->semfs_tablelock);
 	sem->sems_linked = true;
-	lock_release(semfs->semfs_dirlock);
+	lock_release(semfs->semfs_tablelock);
+	rwlock_release_write(semfs->semfs_dirlock);
 	return 0;
 
  fail_undir:
-	semfs_direntryarray_set(semfs->semfs_dents, empty, NULL);
+	semfs_dir_remove(semfs, dent);
  fail_undent:
 	semfs_direntry_destroy(dent);
  fail_uninsert:
 	lock_acquire(semfs->semfs_tablelock);
-	semfs_semarray_set(semfs->semfs_sems, semnum, NULL);
+	semfs_sem_remove(semfs, semnum);
 	lock_release(semfs->semfs_tablelock);
  fail_uncreate:
 	semfs_sem_destroy(sem);
  fail_unlock:
-	lock_release(semfs->semfs_dirlock);
+	rwlock_release_write(semfs->semfs_dirlock);
 	return result;
 }
 
@@ -475,47 +467,35 @@ semfs_remove(struct vnode *dirvn, const char *name)
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
 	struct semfs_sem *sem;
-	unsigned i, num;
-	int result;
 
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EINVAL;
 	}
 
-	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(name, dent->semd_name)) {
-			/* found */
-			sem = semfs_getsembynum(semfs, dent->semd_semnum);
-			lock_acquire(sem->sems_lock);
-			KASSERT(sem->sems_linked);
-			sem->sems_linked = false;
-			if (sem->sems_hasvnode == false) {
-				lock_acquire(semfs->semfs_tablelock);
-				semfs_semarray_set(semfs->semfs_sems,
-						   dent->semd_semnum, NULL);
-				lock_release(semfs->semfs_tablelock);
-				lock_release(sem->sems_lock);
-				semfs_sem_destroy(sem);
-			}
-			else {
-				lock_release(sem->sems_lock);
-			}
-			semfs_direntryarray_set(semfs->semfs_dents, i, NULL);
-			semfs_direntry_destroy(dent);
-			result = 0;
-			goto out;
-		}
+	rwlock_acquire_write(semfs->semfs_dirlock);
+	dent = semfs_dir_find(semfs, name);
+	if (dent == NULL) {
+		rwlock_release_write(semfs->semfs_dirlock);
+		return ENOENT;
 	}
-	result = ENOENT;
- out:
-	lock_release(semfs->semfs_dirlock);
-	return result;
+
+	lock_acquire(semfs->semfs_tablelock);
+	sem = semfs_semarray_get(semfs->semfs_sems, dent->semd_semnum);
+	KASSERT(sem->sems_linked);
+	sem->sems_linked = false;
+	if (sem->sems_vnode == NULL) {
+		semfs_sem_remove(semfs, dent->semd_semnum);
+		lock_release(semfs->semfs_tablelock);
+		semfs_sem_destroy(sem);
+	}
+	else {
+		lock_release(semfs->semfs_tablelock);
+	}
+
+	semfs_dir_remove(semfs, dent);
+	semfs_direntry_destroy(dent);
+	rwlock_release_write(semfs->semfs_dirlock);
+	return 0;
 }
 
 /*
@@ -528,7 +508,6 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 	struct semfs_vnode *dirsemv = dirvn->vn_data;
 	struct semfs *semfs = dirsemv->semv_semfs;
 	struct semfs_direntry *dent;
-	unsigned i, num;
 	int result;
 
 	if (!strcmp(path, ".") || !strcmp(path, "..")) {
@@ -537,22 +516,16 @@ semfs_lookup(struct vnode *dirvn, char *path, struct vnode **resultvn)
 		return 0;
 	}
 
-	lock_acquire(semfs->semfs_dirlock);
-	num = semfs_direntryarray_num(semfs->semfs_dents);
-	for (i=0; i<num; i++) {
-		dent = semfs_direntryarray_get(semfs->semfs_dents, i);
-		if (dent == NULL) {
-			continue;
-		}
-		if (!strcmp(path, dent->semd_name)) {
-			result = semfs_getvnode(semfs, dent->semd_semnum,
-						resultvn);
-			lock_release(semfs->semfs_dirlock);
-			return result;
-		}
+	rwlock_acquire_read(semfs->semfs_dirlock);
+	dent = semfs_dir_find(semfs, path);
+	if (dent == NULL) {
+		result = ENOENT;
 	}
-	lock_release(semfs->semfs_dirlock);
-	return ENOENT;
+	else {
+		result = semfs_getvnode(semfs, dent->semd_semnum, resultvn);
+	}
+	rwlock_release_read(semfs->semfs_dirlock);
+	return result;
 }
 
 /*
@@ -597,9 +570,7 @@ semfs_reclaim(struct vnode *vn)
 {
 	struct semfs_vnode *semv = vn->vn_data;
 	struct semfs *semfs = semv->semv_semfs;
-	struct vnode *vn2;
 	struct semfs_sem *sem;
-	unsigned i, num;
 
 	lock_acquire(semfs->semfs_tablelock);
 
@@ -616,26 +587,22 @@ semfs_reclaim(struct vnode *vn)
 
 	spinlock_release(&vn->vn_countlock);
 
-	/* remove from the table */
-	num = vnodearray_num(semfs->semfs_vnodes);
-	for (i=0; i<num; i++) {
-		vn2 = vnodearray_get(semfs->semfs_vnodes, i);
-		if (vn2 == vn) {
-			vnodearray_remove(semfs->semfs_vnodes, i);
-			break;
-		}
+	/* detach it from its semaphore (or the root pointer) */
+	if (semv->semv_semnum == SEMFS_ROOTDIR) {
+		KASSERT(semfs->semfs_rootvnode == semv);
+		semfs->semfs_rootvnode = NULL;
 	}
-
-	if (semv->semv_semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semv->semv_semnum);
-		KASSERT(sem->sems_hasvnode);
-		sem->sems_hasvnode = false;
+	else {
+		sem = semv->semv_sem;
+		KASSERT(sem->sems_vnode == semv);
+		sem->sems_vnode = NULL;
 		if (sem->sems_linked == false) {
-			semfs_semarray_set(semfs->semfs_sems,
-					   semv->semv_semnum, NULL);
+			semfs_sem_remove(semfs, semv->semv_semnum);
 			semfs_sem_destroy(sem);
 		}
 	}
+	KASSERT(semfs->semfs_nvnodes > 0);
+	semfs->semfs_nvnodes--;
 
 	/* done with the table */
 	lock_release(semfs->semfs_tablelock);
@@ -663,8 +630,11 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_gettype = semfs_gettype,
 	.vop_isseekable = semfs_isseekable,
 	.vop_fsync = semfs_fsync,
+	.vop_fdatasync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
+	.vop_punch = vopfail_punch_isdir,
 	.vop_namefile = semfs_namefile,
 
 	.vop_creat = semfs_creat,
@@ -696,8 +666,11 @@ static const struct vnode_ops semfs_semops = {
 	.vop_gettype = semfs_gettype,
 	.vop_isseekable = semfs_isseekable,
 	.vop_fsync = semfs_fsync,
+	.vop_fdatasync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_perm,
 	.vop_truncate = semfs_truncate,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_punch = vopfail_punch_nosys,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
@@ -736,6 +709,7 @@ semfs_vnode_create(struct semfs *semfs, unsigned semnum)
 
 	semv->semv_semfs = semfs;
 	semv->semv_semnum = semnum;
+	semv->semv_sem = NULL;
 
 	result = vnode_init(&semv->semv_absvn, optable,
 			    &semfs->semfs_absfs, semv);
@@ -747,31 +721,33 @@ semfs_vnode_create(struct semfs *semfs, unsigned semnum)
 
 /*
  * Look up the vnode for a semaphore by number; if it doesn't exist,
- * create it.
+ * create it. Each semaphore points at its vnode, so this doesn't
+ * need to search.
  */
 int
 semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 {
-	struct vnode *vn;
 	struct semfs_vnode *semv;
 	struct semfs_sem *sem;
-	unsigned i, num;
-	int result;
 
 	/* Lock the vnode table */
 	lock_acquire(semfs->semfs_tablelock);
 
 	/* Look for it */
-	num = vnodearray_num(semfs->semfs_vnodes);
-	for (i=0; i<num; i++) {
-		vn = vnodearray_get(semfs->semfs_vnodes, i);
-		semv = vn->vn_data;
-		if (semv->semv_semnum == semnum) {
-			VOP_INCREF(vn);
-			lock_release(semfs->semfs_tablelock);
-			*ret = vn;
-			return 0;
-		}
+	if (semnum == SEMFS_ROOTDIR) {
+		sem = NULL;
+		semv = semfs->semfs_rootvnode;
+	}
+	else {
+		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
+		KASSERT(sem != NULL);
+		semv = sem->sems_vnode;
+	}
+	if (semv != NULL) {
+		VOP_INCREF(&semv->semv_absvn);
+		lock_release(semfs->semfs_tablelock);
+		*ret = &semv->semv_absvn;
+		return 0;
 	}
 
 	/* Make it */
@@ -780,18 +756,14 @@ semfs_getvnode(struct semfs *semfs, unsigned semnum, struct vnode **ret)
 		lock_release(semfs->semfs_tablelock);
 		return ENOMEM;
 	}
-	result = vnodearray_add(semfs->semfs_vnodes, &semv->semv_absvn, NULL);
-	if (result) {
-		semfs_vnode_destroy(semv);
-		lock_release(semfs->semfs_tablelock);
-		return ENOMEM;
+	if (sem == NULL) {
+		semfs->semfs_rootvnode = semv;
 	}
-	if (semnum != SEMFS_ROOTDIR) {
-		sem = semfs_semarray_get(semfs->semfs_sems, semnum);
-		KASSERT(sem != NULL);
-		KASSERT(sem->sems_hasvnode == false);
-		sem->sems_hasvnode = true;
+	else {
+		sem->sems_vnode = semv;
+		semv->semv_sem = sem;
 	}
+	semfs->semfs_nvnodes++;
 	lock_release(semfs->semfs_tablelock);
 
 	*ret = &semv->semv_absvn;
@@ -30,62 +30,429 @@
 /*
  * SFS filesystem
  *
- * Block allocation.
+ * Block and inode allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This is done in its buffer; the zeros go to
+ * disk whenever the buffer is written back, which for a block that's
+ * about to be written anyway is with the real contents.
  */
 static
 int
-sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
+sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct sfs_vnode *owner)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *b;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, sfs->sfs_blocksize, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), sfs->sfs_blocksize);
+	buffer_mark_dirty(b, owner);
+	buffer_release(b);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Freemap bookkeeping
+
+/*
+ * Note that the bitmap block holding BIT has changed, so the next
+ * sync writes it out. DIRTY is sfs_freemapdirty or sfs_inodemapdirty.
+ * Caller holds sfs_freemaplock.
+ */
+static
+void
+sfs_mapdirty(struct sfs_fs *sfs, struct bitmap *dirty, uint32_t bit)
+{
+	uint32_t j;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	j = bit / SFS_BITSPERBLOCK(sfs->sfs_blocksize);
+	if (!bitmap_isset(dirty, j)) {
+		bitmap_mark(dirty, j);
+	}
+}
+
+/*
+ * Mark a free block in use. Caller holds sfs_freemaplock.
+ */
+static
+void
+sfs_bmark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	bitmap_mark(sfs->sfs_freemap, block);
+	KASSERT(sfs->sfs_groupfree[block / SFS_GROUPBLOCKS] > 0);
+	sfs->sfs_groupfree[block / SFS_GROUPBLOCKS]--;
+	sfs->sfs_nfree--;
+	sfs_mapdirty(sfs, sfs->sfs_freemapdirty, block);
+}
+
+/*
+ * Mark a block free. Caller holds sfs_freemaplock.
+ */
+static
+void
+sfs_bunmark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	bitmap_unmark(sfs->sfs_freemap, block);
+	sfs->sfs_groupfree[block / SFS_GROUPBLOCKS]++;
+	sfs->sfs_nfree++;
+	sfs_mapdirty(sfs, sfs->sfs_freemapdirty, block);
+}
+
+/*
+ * Find the first free block at or after GOAL, wrapping around to the
+ * start of the volume. Caller holds sfs_freemaplock.
+ */
+static
+int
+sfs_bsearch(struct sfs_fs *sfs, daddr_t goal, daddr_t *ret)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	unsigned g, goalgroup, k;
+	daddr_t block, start, end;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+	goalgroup = goal / SFS_GROUPBLOCKS;
+
+	/*
+	 * Look in the goal's group from the goal on, then in each
+	 * following group, and last in the goal's group before the
+	 * goal.
+	 */
+	for (k=0; k<=sfs->sfs_ngroups; k++) {
+		g = (goalgroup + k) % sfs->sfs_ngroups;
+		if (sfs->sfs_groupfree[g] == 0) {
+			continue;
+		}
+		start = g * SFS_GROUPBLOCKS;
+		end = start + SFS_GROUPBLOCKS;
+		if (end > nblocks) {
+			end = nblocks;
+		}
+		if (k == 0) {
+			start = goal;
+		}
+		else if (k == sfs->sfs_ngroups) {
+			end = goal;
+		}
+		for (block = start; block < end; block++) {
+			if (!bitmap_isset(sfs->sfs_freemap, block)) {
+				*ret = block;
+				return 0;
+			}
+		}
+	}
+	return ENOSPC;
+}
+
+////////////////////////////////////////////////////////////
+// Preallocation
+
+/*
+ * Give back a file's preallocated blocks. Caller holds
+ * sfs_freemaplock.
+ */
+static
+void
+sfs_prealloc_release(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	uint32_t i;
+	daddr_t block;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i=0; i<sv->sv_precount; i++) {
+		block = sv->sv_prestart + i;
+		KASSERT(bitmap_isset(sfs->sfs_resvmap, block));
+		bitmap_unmark(sfs->sfs_resvmap, block);
+		sfs_bunmark(sfs, block);
+	}
+	sfs->sfs_nprealloc -= sv->sv_precount;
+	sv->sv_prestart = 0;
+	sv->sv_precount = 0;
+}
+
+/*
+ * Preallocate to SV the free blocks immediately after BLOCK, up to
+ * SFS_PREALLOCBLOCKS of them. Caller holds sfs_freemaplock.
+ */
+static
+void
+sfs_prealloc_make(struct sfs_fs *sfs, struct sfs_vnode *sv, daddr_t block)
+{
+	uint32_t n;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(sv->sv_precount == 0);
+
+	for (n = 0; n < SFS_PREALLOCBLOCKS; n++) {
+		if (block + 1 + n >= sfs->sfs_sb.sb_nblocks ||
+		    bitmap_isset(sfs->sfs_freemap, block + 1 + n)) {
+			break;
+		}
+		sfs_bmark(sfs, block + 1 + n);
+		bitmap_mark(sfs->sfs_resvmap, block + 1 + n);
+	}
+	sfs->sfs_nprealloc += n;
+	sv->sv_prestart = block + 1;
+	sv->sv_precount = n;
+}
+
+/*
+ * Take back the preallocated blocks of every loaded file, when the
+ * volume has no other free space left. Called without
+ * sfs_freemaplock, since sfs_vnlock comes before it.
+ */
+static
+void
+sfs_prealloc_releaseall(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned i;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			sfs_prealloc_release(sfs, sv);
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+	lock_release(sfs->sfs_vnlock);
+}
+
+/*
+ * Free space, for the purposes of reservations: preallocated blocks
+ * count, since they can be taken back. Caller holds sfs_freemaplock.
+ */
+static
+unsigned
+sfs_bavail(struct sfs_fs *sfs)
+{
+	unsigned avail;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	avail = sfs->sfs_nfree + sfs->sfs_nprealloc;
+	KASSERT(avail >= sfs->sfs_ndlresv);
+	return avail - sfs->sfs_ndlresv;
 }
 
 /*
- * Allocate a block.
+ * Give back a file's preallocated blocks, for truncate and reclaim.
+ */
+void
+sfs_prealloc_discard(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_prealloc_release(sfs, sv);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+/*
+ * Allocate a block, as close after GOAL as possible. If SV is not
+ * NULL the block is for that file, and comes from (or starts) its
+ * preallocation. See sfs.h.
+ *
+ * The block is zeroed unless CLEAR is false, which the caller may
+ * only pass if it is going to overwrite the whole block right away.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, struct sfs_vnode *sv, daddr_t goal,
+	   bool clear, daddr_t *diskblock)
 {
+	bool retried = false, reserved = false;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+
+	if (sv != NULL && sv->sv_dlresv > 0) {
+		/* Flushing delayed blocks; use up their reservation. */
+		sv->sv_dlresv--;
+		sfs->sfs_ndlresv--;
+		reserved = true;
+	}
+	else if (sfs_bavail(sfs) == 0) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+
+	if (sv != NULL && sv->sv_precount > 0) {
+		if (goal == sv->sv_prestart) {
+			/*
+			 * Next preallocated block. It's already marked,
+			 * but only in memory until now.
+			 */
+			*diskblock = sv->sv_prestart;
+			bitmap_unmark(sfs->sfs_resvmap, *diskblock);
+			sfs_mapdirty(sfs, sfs->sfs_freemapdirty, *diskblock);
+			sv->sv_prestart++;
+			sv->sv_precount--;
+			sfs->sfs_nprealloc--;
+			goto got;
+		}
+		/* Going somewhere else; start over there. */
+		sfs_prealloc_release(sfs, sv);
+	}
+
+ again:
+	result = sfs_bsearch(sfs, goal, diskblock);
+	if (result == ENOSPC && !retried) {
+		lock_release(sfs->sfs_freemaplock);
+		sfs_prealloc_releaseall(sfs);
+		lock_acquire(sfs->sfs_freemaplock);
+		retried = true;
+		goto again;
+	}
 	if (result) {
+		if (reserved) {
+			/* Shouldn't happen, but don't lose track. */
+			sv->sv_dlresv++;
+			sfs->sfs_ndlresv++;
+		}
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_bmark(sfs, *diskblock);
+	if (sv != NULL) {
+		sfs_prealloc_make(sfs, sv, *diskblock);
+	}
+
+ got:
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
+	if (!clear) {
+		return 0;
+	}
+
+	/*
+	 * Clear block before returning it. The block is ours once
+	 * marked, so this doesn't need the freemap lock.
+	 */
+	result = sfs_clearblock(sfs, *diskblock, sv);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_bunmark(sfs, *diskblock);
+		if (reserved) {
+			sv->sv_dlresv++;
+			sfs->sfs_ndlresv++;
+		}
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
 /*
- * Free a block.
+ * Reserve NBLOCKS blocks of free space for SV's delayed blocks.
+ */
+int
+sfs_dlreserve(struct sfs_fs *sfs, struct sfs_vnode *sv, unsigned nblocks)
+{
+	int result = 0;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs_bavail(sfs) < nblocks) {
+		result = ENOSPC;
+	}
+	else {
+		sv->sv_dlresv += nblocks;
+		sfs->sfs_ndlresv += nblocks;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
+/*
+ * Give back whatever space SV still has reserved.
+ */
+void
+sfs_dlunreserve(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_ndlresv >= sv->sv_dlresv);
+	sfs->sfs_ndlresv -= sv->sv_dlresv;
+	sv->sv_dlresv = 0;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Free a block. With a journal, it only becomes free when the
+ * running transaction commits (see sfs.h); until then it is marked
+ * in sfs_freedmap.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	/*
+	 * Whatever is cached for the block is garbage now. Do this
+	 * while the block is still marked in use, so nobody can have
+	 * allocated it again already.
+	 */
+	sfs_jforget(sfs, diskblock);
+	buffer_invalidate(sfs->sfs_device, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_freedmap != NULL) {
+		bitmap_mark(sfs->sfs_freedmap, diskblock);
+		sfs->sfs_nfreed++;
+	}
+	else {
+		sfs_bunmark(sfs, diskblock);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Free the blocks freed since the last commit; called when
+ * committing, before the freemap is written.
+ */
+void
+sfs_bfree_commit(struct sfs_fs *sfs)
+{
+	daddr_t block;
+
+	if (sfs->sfs_freedmap == NULL) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (block = 0; sfs->sfs_nfreed > 0; block++) {
+		KASSERT(block < sfs->sfs_sb.sb_nblocks);
+		if (bitmap_isset(sfs->sfs_freedmap, block)) {
+			bitmap_unmark(sfs->sfs_freedmap, block);
+			sfs_bunmark(sfs, block);
+			sfs->sfs_nfreed--;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +461,165 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+}
+
+
+////////////////////////////////////////////////////////////
+// Inode allocation
+
+/*
+ * Allocate an inode. Without an inode table each inode is a block
+ * of its own and the inode number is the block number, so get a
+ * (zeroed) block; otherwise take a free slot in the table.
+ */
+int
+sfs_ialloc(struct sfs_fs *sfs, uint32_t *ino)
+{
+	daddr_t block;
+	unsigned index;
+	int result;
+
+	if (!SFS_FS_ITABLE(sfs)) {
+		result = sfs_balloc(sfs, NULL, 0, true, &block);
+		if (result) {
+			return result;
+		}
+		*ino = block;
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc(sfs->sfs_inodemap, &index);
+	if (result == 0) {
+		/* Inode 0 and the bits past the end are marked in use */
+		KASSERT(index > 0 && index < sfs->sfs_sb.sb_ninodes);
+		sfs_mapdirty(sfs, sfs->sfs_inodemapdirty, index);
+	}
+	lock_release(sfs->sfs_freemaplock);
+	if (result) {
+		return result;
+	}
+	*ino = index;
+	return 0;
+}
+
+/*
+ * Free an inode.
+ */
+void
+sfs_ifree(struct sfs_fs *sfs, uint32_t ino)
+{
+	if (!SFS_FS_ITABLE(sfs)) {
+		sfs_bfree(sfs, ino);
+		return;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(bitmap_isset(sfs->sfs_inodemap, ino));
+	bitmap_unmark(sfs->sfs_inodemap, ino);
+	sfs_mapdirty(sfs, sfs->sfs_inodemapdirty, ino);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Check if an inode is in use.
+ */
+int
+sfs_iused(struct sfs_fs *sfs, uint32_t ino)
+{
+	int ret;
+
+	if (!SFS_FS_ITABLE(sfs)) {
+		return sfs_bused(sfs, ino);
+	}
+
+	if (ino >= sfs->sfs_sb.sb_ninodes) {
+		panic("sfs: %s: sfs_iused called on out of range inode %u\n",
+		      sfs->sfs_sb.sb_volname, ino);
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_inodemap, ino);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Set up the allocator's state once the freemap has been loaded.
+ */
+int
+sfs_balloc_init(struct sfs_fs *sfs)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	daddr_t block;
+	unsigned i;
+
+	sfs->sfs_resvmap = bitmap_create(SFS_FREEMAPBITS(nblocks,
+						      sfs->sfs_blocksize));
+	if (sfs->sfs_resvmap == NULL) {
+		return ENOMEM;
+	}
+
+	sfs->sfs_ngroups = DIVROUNDUP(nblocks, SFS_GROUPBLOCKS);
+	sfs->sfs_groupfree = kmalloc(sfs->sfs_ngroups *
+				     sizeof(sfs->sfs_groupfree[0]));
+	if (sfs->sfs_groupfree == NULL) {
+		bitmap_destroy(sfs->sfs_resvmap);
+		sfs->sfs_resvmap = NULL;
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_ngroups; i++) {
+		sfs->sfs_groupfree[i] = 0;
+	}
+	sfs->sfs_nfree = 0;
+	for (block = 0; block < nblocks; block++) {
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			sfs->sfs_groupfree[block / SFS_GROUPBLOCKS]++;
+			sfs->sfs_nfree++;
+		}
+	}
+	sfs->sfs_nprealloc = 0;
+	sfs->sfs_ndlresv = 0;
+
+	if (sfs->sfs_sb.sb_features & SFS_FEATURE_JOURNAL) {
+		sfs->sfs_freedmap = bitmap_create(SFS_FREEMAPBITS(nblocks,
+						sfs->sfs_blocksize));
+		if (sfs->sfs_freedmap == NULL) {
+			sfs_balloc_cleanup(sfs);
+			return ENOMEM;
+		}
+	}
+	sfs->sfs_nfreed = 0;
+	return 0;
+}
+
+/*
+ * Free the allocator's state.
+ */
+void
+sfs_balloc_cleanup(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_resvmap != NULL) {
+		bitmap_destroy(sfs->sfs_resvmap);
+		sfs->sfs_resvmap = NULL;
+	}
+	kfree(sfs->sfs_groupfree);
+	sfs->sfs_groupfree = NULL;
+	if (sfs->sfs_freedmap != NULL) {
+		bitmap_destroy(sfs->sfs_freedmap);
+		sfs->sfs_freedmap = NULL;
+	}
+}
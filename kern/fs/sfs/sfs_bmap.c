@@ -35,39 +35,214 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Pick the goal for allocating entry IDX of the block map MAP (the
+ * direct blocks, or an indirect block): the disk block that would
+ * follow on from the nearest mapped entry before it, or failing that
+ * from BASE, the block the map lives in.
+ */
+static
+daddr_t
+sfs_bmap_goal(const uint32_t *map, uint32_t idx, daddr_t base)
+{
+	uint32_t i;
+
+	for (i = idx; i > 0; i--) {
+		if (map[i-1] != 0) {
+			return map[i-1] + (idx - (i-1));
+		}
+	}
+	return base + 1 + idx;
+}
+
+/*
+ * Find the tree of indirect blocks that maps file block FILEBLOCK,
+ * which must be past the direct blocks. Returns the field of the
+ * inode that names the top of the tree, and sets *LEVELS to the
+ * tree's depth and *BASE to the first file block it maps; or returns
+ * NULL if FILEBLOCK is past the largest file we can map. (With large
+ * blocks the file size limit is reached first, and the triple
+ * indirect tree spans more than 32 bits' worth of blocks.)
+ */
+static
+uint32_t *
+sfs_bmap_idtree(struct sfs_vnode *sv, uint32_t fileblock,
+		unsigned *levels, uint32_t *base)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint64_t start, span;
+
+	KASSERT(fileblock >= SFS_NDIRECT);
+
+	start = SFS_NDIRECT;
+	span = SFS_FS_DBPERIDB(sfs);
+	if (fileblock - start < span) {
+		*levels = 1;
+		*base = start;
+		return &sv->sv_i.sfi_indirect;
+	}
+
+	start += span;
+	span *= SFS_FS_DBPERIDB(sfs);
+	if (fileblock - start < span) {
+		*levels = 2;
+		*base = start;
+		return &sv->sv_i.sfi_dindirect;
+	}
+
+	start += span;
+	span *= SFS_FS_DBPERIDB(sfs);
+	if (fileblock - start < span) {
+		*levels = 3;
+		*base = start;
+		return &sv->sv_i.sfi_tindirect;
+	}
+
+	return NULL;
+}
+
+/*
+ * Make the vnode's indirect block cache hold the single indirect
+ * block that points to file block FILEBLOCK, walking down from the
+ * inode through any double and triple indirect blocks above it. If
+ * DOALLOC is set, missing indirect blocks are allocated on the way;
+ * if not, and one is missing, sv_ibblock is left 0.
+ *
+ * The cache is what makes sequential access cheap: the lookups for
+ * the rest of the blocks it maps find their indirect block already in
+ * hand, without walking the chain above it again. Nothing else writes
+ * a file's indirect blocks while we hold its lock, and sfs_itrunc
+ * empties the cache, so the copy is always current.
+ */
+static
+int
+sfs_bmap_getleaf(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *slot, *buf, *idbuf = NULL;
+	daddr_t idblock, parent, home;
+	uint32_t base, leafbase, span, idx = 0;
+	unsigned levels, i;
+	int result = 0;
+
+	slot = sfs_bmap_idtree(sv, fileblock, &levels, &base);
+	if (slot == NULL) {
+		return EFBIG;
+	}
+	leafbase = fileblock - (fileblock - base) % SFS_FS_DBPERIDB(sfs);
+	if (sv->sv_ibblock != 0 && sv->sv_ibbase == leafbase) {
+		return 0;
+	}
+
+	sv->sv_ibblock = 0;
+	if (sv->sv_ibcache == NULL) {
+		sv->sv_ibcache = kmalloc(sfs->sfs_blocksize);
+		if (sv->sv_ibcache == NULL) {
+			return ENOMEM;
+		}
+	}
+	if (levels > 1) {
+		/* for the double and triple indirect blocks */
+		idbuf = kmalloc(sfs->sfs_blocksize);
+		if (idbuf == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	/* File blocks mapped by each entry of the top block */
+	span = 1;
+	for (i=1; i<levels; i++) {
+		span *= SFS_FS_DBPERIDB(sfs);
+	}
+
+	/* SLOT names the block at level I; it lives in PARENT (0: inode) */
+	parent = 0;
+	home = sfs_inode_block(sfs, sv->sv_ino);
+	for (i=levels; ; i--) {
+		buf = (i == 1) ? sv->sv_ibcache : idbuf;
+		idblock = *slot;
+		if (idblock == 0) {
+			if (!doalloc) {
+				goto out;
+			}
+			result = sfs_balloc(sfs, sv,
+					    parent == 0 ?
+					    sfs_bmap_goal(sv->sv_i.sfi_direct,
+							  SFS_NDIRECT, home) :
+					    sfs_bmap_goal(idbuf, idx, parent),
+					    true, &idblock);
+			if (result) {
+				goto out;
+			}
+			*slot = idblock;
+			if (parent == 0) {
+				sv->sv_dirty = true;
+			}
+			else {
+				result = sfs_writeblock(sfs, parent, idbuf,
+							sfs->sfs_blocksize,
+							sv);
+				if (result) {
+					sfs_bfree(sfs, idblock);
+					goto out;
+				}
+			}
+			bzero(buf, sfs->sfs_blocksize);
+		}
+		else {
+			result = sfs_readblock(sfs, idblock, buf,
+					       sfs->sfs_blocksize);
+			if (result) {
+				goto out;
+			}
+		}
+
+		if (i == 1) {
+			break;
+		}
+		idx = ((fileblock - base) / span) % SFS_FS_DBPERIDB(sfs);
+		slot = &idbuf[idx];
+		parent = idblock;
+		span /= SFS_FS_DBPERIDB(sfs);
+	}
+
+	sv->sv_ibblock = idblock;
+	sv->sv_ibbase = leafbase;
+ out:
+	if (idbuf != NULL) {
+		kfree(idbuf);
+	}
+	return result;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated. FILL means the caller is about to write the whole
+ * block, so a newly allocated one needn't be zeroed first. The
+ * caller must hold the vnode's lock.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+	 bool fill, daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	daddr_t block, goal;
+	uint32_t idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_ext_bmap(sv, fileblock, doalloc, fill, diskblock);
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +257,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			goal = sfs_bmap_goal(sv->sv_i.sfi_direct, fileblock,
+					     sfs_inode_block(sfs, sv->sv_ino));
+			result = sfs_balloc(sfs, sv, goal, !fill, &block);
 			if (result) {
 				return result;
 			}
@@ -105,84 +282,46 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block; it's mapped by one of the trees of
+	 * indirect blocks. Get the indirect block that points to it.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	result = sfs_bmap_getleaf(sv, fileblock, doalloc);
+	if (result) {
+		return result;
 	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
+	if (sv->sv_ibblock == 0) {
 		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
+		 * There's no indirect block there, and we weren't
+		 * asked to allocate anything, so pretend it was
+		 * filled with all zeros.
 		 */
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
-	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Get the block out of the indirect block */
+	idoff = fileblock - sv->sv_ibbase;
+	block = sv->sv_ibcache[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = sfs_balloc(sfs, sv,
+				    sfs_bmap_goal(sv->sv_ibcache, idoff,
+						  sv->sv_ibblock),
+				    !fill, &block);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		sv->sv_ibcache[idoff] = block;
 
 		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_writeblock(sfs, sv->sv_ibblock, sv->sv_ibcache,
+					sfs->sfs_blocksize, sv);
 		if (result) {
+			sv->sv_ibcache[idoff] = 0;
+			sfs_bfree(sfs, block);
 			return result;
 		}
 	}
@@ -198,106 +337,412 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Check if block FILEBLOCK of the file could be mapped at all.
  */
-int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+bool
+sfs_bmap_inrange(struct sfs_vnode *sv, uint32_t fileblock)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned levels;
+	uint32_t base;
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return fileblock < SFS_EXTENT_MAXBLOCKS(sfs->sfs_blocksize);
+	}
+	return fileblock < SFS_NDIRECT ||
+		sfs_bmap_idtree(sv, fileblock, &levels, &base) != NULL;
+}
 
+/*
+ * Return how many indirect blocks mapping FILEBLOCK might still need
+ * allocated, for delayed allocation to reserve: none if the single
+ * indirect block it needs exists or another delayed block will
+ * already need it, else one per level of its tree.
+ */
+unsigned
+sfs_bmap_idneeded(struct sfs_vnode *sv, uint32_t fileblock)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned levels, i;
+	uint32_t base, leafbase, other;
 
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
-	int result;
-	int hasnonzero, iddirty;
+	if ((sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) ||
+	    fileblock < SFS_NDIRECT ||
+	    sfs_bmap_idtree(sv, fileblock, &levels, &base) == NULL) {
+		return 0;
+	}
+	leafbase = fileblock - (fileblock - base) % SFS_FS_DBPERIDB(sfs);
+
+	/* sfs_bmap has just been asked about it, so this is current */
+	if (sv->sv_ibblock != 0 && sv->sv_ibbase == leafbase) {
+		return 0;
+	}
+	for (i=0; i<sv->sv_ndelayed; i++) {
+		other = sv->sv_dlblock[i];
+		if (other >= leafbase &&
+		    other - leafbase < SFS_FS_DBPERIDB(sfs)) {
+			return 0;
+		}
+	}
+	return levels;
+}
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+/*
+ * Free the file blocks from FIRST up to END in the tree of indirect
+ * blocks named by *SLOT, which is LEVEL levels deep and maps the file
+ * blocks from BASE on. Subtrees that are missing or entirely outside
+ * the range are skipped without being read. Indirect blocks that end
+ * up empty are freed; *CHANGED is set if *SLOT changes.
+ */
+static
+int
+sfs_itrunc_ib(struct sfs_vnode *sv, uint32_t *slot, unsigned level,
+	      uint32_t base, uint32_t first, uint32_t end, bool *changed)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *idbuf;
+	uint32_t span, j;
+	uint64_t treespan;
+	unsigned k;
+	bool dirty, hasnonzero;
+	int result = 0;
+
+	/* File blocks mapped by each entry */
+	treespan = SFS_FS_DBPERIDB(sfs);
+	for (k=1; k<level; k++) {
+		treespan *= SFS_FS_DBPERIDB(sfs);
+	}
+
+	if (*slot == 0 || base + treespan <= first || base >= end) {
+		/* Nothing here, or none of it is in the range */
+		return 0;
+	}
+	span = treespan / SFS_FS_DBPERIDB(sfs);
 
-	vfs_biglock_acquire();
+	idbuf = kmalloc(sfs->sfs_blocksize);
+	if (idbuf == NULL) {
+		return ENOMEM;
+	}
+
+	result = sfs_readblock(sfs, *slot, idbuf, sfs->sfs_blocksize);
+	if (result) {
+		kfree(idbuf);
+		return result;
+	}
+
+	dirty = false;
+	hasnonzero = false;
+	for (j=0; j<SFS_FS_DBPERIDB(sfs); j++) {
+		if (level > 1) {
+			result = sfs_itrunc_ib(sv, &idbuf[j], level-1,
+					       base + j*span, first, end,
+					       &dirty);
+			if (result) {
+				break;
+			}
+		}
+		else if (base + j >= first && base + j < end &&
+			 idbuf[j] != 0) {
+			/* Discard blocks that are in the range */
+			sfs_bfree(sfs, idbuf[j]);
+			idbuf[j] = 0;
+			dirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero && result == 0) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *slot);
+		*slot = 0;
+		*changed = true;
+	}
+	else if (dirty) {
+		/* The indirect block is dirty; write it back */
+		int result2;
+
+		result2 = sfs_writeblock(sfs, *slot, idbuf,
+					 sfs->sfs_blocksize, sv);
+		if (result == 0) {
+			result = result2;
+		}
+	}
+	kfree(idbuf);
+	return result;
+}
+
+/*
+ * Truncate a file that is in its inode, if LEN still fits there.
+ * Returns false if the file must be spilled first.
+ */
+static
+bool
+sfs_itrunc_inline(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	off_t size = sv->sv_i.sfi_size;
+
+	if (len > (off_t)SFS_FS_INLINEMAX(sfs)) {
+		return false;
+	}
+	if (len < size) {
+		bzero((char *)sv->sv_i.sfi_waste + len, size - len);
+	}
+	sv->sv_i.sfi_size = len;
+	sv->sv_dirty = true;
+	return true;
+}
+
+/*
+ * Free the blocks from FIRST up to END of a file mapped by block
+ * pointers.
+ */
+static
+int
+sfs_itrunc_map(struct sfs_vnode *sv, uint32_t first, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *tops[3] = {
+		&sv->sv_i.sfi_indirect,
+		&sv->sv_i.sfi_dindirect,
+		&sv->sv_i.sfi_tindirect,
+	};
+	uint32_t i, base;
+	uint64_t span;
+	daddr_t block;
+	int result;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
+	 * in the range.
 	 */
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
+		if (i >= first && i < end && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
 			sv->sv_dirty = true;
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Then the trees of indirect blocks */
+	base = SFS_NDIRECT;
+	span = 1;
+	for (i=0; i<3; i++) {
+		span *= SFS_FS_DBPERIDB(sfs);
+		result = sfs_itrunc_ib(sv, tops[i], i+1, base, first, end,
+				       &sv->sv_dirty);
+		if (result) {
+			return result;
+		}
+		base += span;
+	}
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim.
+ * The caller must hold the vnode's lock.
+ *
+ * A file truncated to nothing on a volume with SFS_FEATURE_INLINE
+ * goes back to being inline, so rewriting a small file keeps it in
+ * its inode.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, sfs->sfs_blocksize);
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+	int result;
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (sfs_itrunc_inline(sv, len)) {
+			return 0;
+		}
+		result = sfs_inline_spill(sv);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+	}
 
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
+	/* Indirect blocks are about to change under the cache */
+	sv->sv_ibblock = 0;
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+	/*
+	 * Delayed blocks past the end have nothing on disk to free,
+	 * and blocks set aside for the file to grow into go back too.
+	 */
+	sfs_dlpunch(sv, blocklen, SFS_NOBLOCK);
+	sfs_prealloc_discard(sv);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		result = sfs_ext_trunc(sv, blocklen);
+	}
+	else {
+		result = sfs_itrunc_map(sv, blocklen, SFS_NOBLOCK);
+	}
+	if (result) {
+		return result;
+	}
+
+	/* Set the file size, and mark the inode dirty */
+	sv->sv_i.sfi_size = len;
+	sv->sv_dirty = true;
+
+	if (len == 0 && sv->sv_i.sfi_type == SFS_TYPE_FILE &&
+	    (sfs->sfs_sb.sb_features & SFS_FEATURE_INLINE)) {
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+	}
+	return 0;
+}
+
+/*
+ * Free the blocks of a file from FIRST up to END, leaving a hole.
+ * The caller must hold the vnode's lock, and the file must not be
+ * inline.
+ */
+int
+sfs_ipunch(struct sfs_vnode *sv, uint32_t first, uint32_t end)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
+
+	if (first >= end) {
+		return 0;
+	}
+
+	/* Indirect blocks are about to change under the cache */
+	sv->sv_ibblock = 0;
+
+	sfs_dlpunch(sv, first, end);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_ext_punch(sv, first, end);
+	}
+	return sfs_itrunc_map(sv, first, end);
+}
+
+/*
+ * Find the first block from FROM on that is mapped (or, if HOLE,
+ * that isn't) in the tree of indirect blocks IDBLOCK, which is LEVEL
+ * levels deep and maps the file blocks from BASE on. *RET is
+ * SFS_NOBLOCK if there is none in the tree. A missing subtree is all
+ * hole and isn't read.
+ */
+static
+int
+sfs_bmap_seek_ib(struct sfs_vnode *sv, daddr_t idblock, unsigned level,
+		 uint32_t base, uint32_t from, bool hole, uint32_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *idbuf;
+	uint32_t span, j;
+	unsigned k;
+	int result;
+
+	*ret = SFS_NOBLOCK;
+	if (idblock == 0) {
+		if (hole) {
+			*ret = from;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
+		return 0;
+	}
+
+	/* File blocks mapped by each entry */
+	span = 1;
+	for (k=1; k<level; k++) {
+		span *= SFS_FS_DBPERIDB(sfs);
+	}
+
+	idbuf = kmalloc(sfs->sfs_blocksize);
+	if (idbuf == NULL) {
+		return ENOMEM;
+	}
+	result = sfs_readblock(sfs, idblock, idbuf, sfs->sfs_blocksize);
+	if (result) {
+		kfree(idbuf);
+		return result;
+	}
+
+	for (j = (from - base) / span; j<SFS_FS_DBPERIDB(sfs); j++) {
+		if (level > 1) {
+			result = sfs_bmap_seek_ib(sv, idbuf[j], level-1,
+						  base + j*span,
+						  from > base + j*span ?
+						  from : base + j*span,
+						  hole, ret);
+			if (result || *ret != SFS_NOBLOCK) {
+				break;
 			}
 		}
+		else if ((idbuf[j] == 0) == hole) {
+			*ret = from > base + j ? from : base + j;
+			break;
+		}
 	}
+	kfree(idbuf);
+	return result;
+}
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+/*
+ * Find the first block of the file from FILEBLOCK on that has a disk
+ * block (or, if HOLE, that doesn't), for SEEK_DATA and SEEK_HOLE.
+ * *RET is SFS_NOBLOCK if there is none. Delayed blocks are not
+ * counted; see sfs_seekdata. The caller must hold the vnode's lock.
+ */
+int
+sfs_bmap_seek(struct sfs_vnode *sv, uint32_t fileblock, bool hole,
+	      uint32_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t tops[3] = {
+		sv->sv_i.sfi_indirect,
+		sv->sv_i.sfi_dindirect,
+		sv->sv_i.sfi_tindirect,
+	};
+	uint64_t base, span;
+	unsigned i;
+	int result;
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_ext_seek(sv, fileblock, hole, ret);
+	}
+
+	for (; fileblock < SFS_NDIRECT; fileblock++) {
+		if ((sv->sv_i.sfi_direct[fileblock] == 0) == hole) {
+			*ret = fileblock;
+			return 0;
+		}
+	}
 
-	vfs_biglock_release();
+	/* Then the trees, skipping those wholly before FILEBLOCK */
+	base = SFS_NDIRECT;
+	span = 1;
+	for (i=0; i<3; i++) {
+		span *= SFS_FS_DBPERIDB(sfs);
+		if (fileblock < base + span) {
+			result = sfs_bmap_seek_ib(sv, tops[i], i+1, base,
+						  fileblock, hole, ret);
+			if (result || *ret != SFS_NOBLOCK) {
+				return result;
+			}
+			fileblock = base + span;
+		}
+		base += span;
+	}
+	*ret = SFS_NOBLOCK;
 	return 0;
 }
-
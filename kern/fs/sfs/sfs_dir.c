@@ -35,41 +35,72 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Write (overwrite) the directory entry in slot SLOT of a directory
+ * vnode.
  */
 static
 int
-sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
+sfs_writedir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
 {
 	off_t actualpos;
 
-	/* Compute the actual position in the directory to read. */
+	/* Compute the actual position in the directory. */
+	KASSERT(slot>=0);
 	actualpos = slot * sizeof(struct sfs_direntry);
 
-	return sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_READ);
+	return sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_WRITE);
 }
 
 /*
- * Write (overwrite) the directory entry in slot SLOT of a directory
- * vnode.
+ * Read a whole block of the directory: entries or, in an indexed
+ * directory, possibly an index block. BLOCK is the block number
+ * within the directory; BUF must have room for a block. Unallocated
+ * blocks read as empty entries, and an inline directory as block 0.
  */
 static
 int
-sfs_writedir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
+sfs_readdirblock(struct sfs_vnode *sv, uint32_t block, void *buf)
 {
-	off_t actualpos;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock;
+	int result;
 
-	/* Compute the actual position in the directory. */
-	KASSERT(slot>=0);
-	actualpos = slot * sizeof(struct sfs_direntry);
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		bzero(buf, sfs->sfs_blocksize);
+		if (block == 0) {
+			memcpy(buf, sv->sv_i.sfi_waste, sv->sv_i.sfi_size);
+		}
+		return 0;
+	}
 
-	return sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_WRITE);
+	result = sfs_bmap(sv, block, false, false, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		bzero(buf, sfs->sfs_blocksize);
+		return 0;
+	}
+	return sfs_readblock(sfs, diskblock, buf, sfs->sfs_blocksize);
+}
+
+/*
+ * Write a whole block of the directory, extending it if necessary.
+ */
+static
+int
+sfs_writedirblock(struct sfs_vnode *sv, uint32_t block, const void *buf)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	return sfs_metaio(sv, (off_t)block * sfs->sfs_blocksize, (void *)buf,
+			  sfs->sfs_blocksize, UIO_WRITE);
 }
 
 /*
@@ -96,67 +127,662 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Search NENTRIES directory entries SDS, which begin at slot
+ * FIRSTSLOT, for NAME. Sets *FOUND and hands back the inode number
+ * and slot as in sfs_dir_findname.
  */
-int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+static
+void
+sfs_dir_scanblock(struct sfs_direntry *sds, int firstslot, int nentries,
+		  const char *name, uint32_t *ino, int *slot, int *emptyslot,
+		  int *found)
 {
-	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	struct sfs_direntry *tsd;
+	int i;
 
-	nentries = sfs_dir_nentries(sv);
-
-	/* For each slot... */
-	found = 0;
 	for (i=0; i<nentries; i++) {
+		tsd = &sds[i];
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, i, &tsd);
-		if (result) {
-			return result;
-		}
-		if (tsd.sfd_ino == SFS_NOINO) {
+		if (tsd->sfd_ino == SFS_NOINO) {
 			/* Free slot - report it back if one was requested */
 			if (emptyslot != NULL) {
-				*emptyslot = i;
+				*emptyslot = firstslot + i;
 			}
 		}
 		else {
 			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
+			tsd->sfd_name[sizeof(tsd->sfd_name)-1] = 0;
+			if (!strcmp(tsd->sfd_name, name)) {
 
 				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+				KASSERT(*found==0);
 
-				found = 1;
+				*found = 1;
 				if (slot != NULL) {
-					*slot = i;
+					*slot = firstslot + i;
 				}
 				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
+					*ino = tsd->sfd_ino;
 				}
 			}
 		}
 	}
+}
+
+////////////////////////////////////////////////////////////
+// Directory index
+//
+// See kern/sfs.h for the on-disk layout. A directory is converted
+// to an index when it first grows past one block, if the volume has
+// SFS_FEATURE_DIRINDEX set; after that a lookup reads one block per
+// index level plus a single leaf, instead of the whole directory.
+//
+// New leaves and index blocks are appended to the end of the
+// directory. Nothing is ever merged or freed again; unlinking a name
+// just clears its slot, which a later insert in that leaf reuses.
+
+/*
+ * Where a descent through the index went: the index block and entry
+ * chosen at each level, how full each index block was, and the leaf
+ * reached. There is one spare level for when the root is split.
+ */
+struct sfs_dirindex_path {
+	unsigned depth;
+	uint32_t block[SFS_DIRINDEX_MAXDEPTH + 2];
+	unsigned pos[SFS_DIRINDEX_MAXDEPTH + 2];
+	unsigned count[SFS_DIRINDEX_MAXDEPTH + 2];
+	uint32_t leaf;
+};
+
+/*
+ * Hash a name (32-bit FNV-1a).
+ */
+static
+uint32_t
+sfs_dirindex_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Number of blocks in a directory. Indexed directories are always a
+ * whole number of blocks.
+ */
+static
+uint32_t
+sfs_dir_nblocks(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	return sv->sv_i.sfi_size / sfs->sfs_blocksize;
+}
+
+/*
+ * Read and sanity-check index block BLOCK of directory SV.
+ */
+static
+int
+sfs_dirindex_read(struct sfs_vnode *sv, uint32_t block,
+		  struct sfs_dirindex *sdi)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	result = sfs_readdirblock(sv, block, sdi);
+	if (result) {
+		return result;
+	}
+	if (sdi->sdi_magic != SFS_DIRINDEX_MAGIC ||
+	    sdi->sdi_count == 0 || sdi->sdi_count > SFS_DIRINDEX_ENTRIES ||
+	    sdi->sdi_depth > SFS_DIRINDEX_MAXDEPTH) {
+		kprintf("sfs: %s: directory %u: bad index block %u\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, block);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Find the last entry in index block SDI whose hash is no greater
+ * than HASH. Entry 0 covers everything below entry 1.
+ */
+static
+unsigned
+sfs_dirindex_search(struct sfs_dirindex *sdi, uint32_t hash)
+{
+	unsigned lo, hi, mid;
+
+	/* The answer is in [lo, hi). */
+	lo = 0;
+	hi = sdi->sdi_count;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (SFS_DIRINDEX_ENTRY(sdi, mid).sdx_hash <= hash) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Walk down the index of SV from the root to the leaf for HASH,
+ * recording the way in PATH. SDI is scratch space for one block.
+ */
+static
+int
+sfs_dirindex_descend(struct sfs_vnode *sv, uint32_t hash,
+		     struct sfs_dirindex *sdi, struct sfs_dirindex_path *path)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t block, nblocks;
+	unsigned level, i;
+	int result;
 
+	nblocks = sfs_dir_nblocks(sv);
+	block = 0;
+	for (level = 0; ; level++) {
+		path->block[level] = block;
+		result = sfs_dirindex_read(sv, block, sdi);
+		if (result) {
+			return result;
+		}
+		if (level == 0) {
+			path->depth = sdi->sdi_depth;
+		}
+		else if (sdi->sdi_depth != path->depth - level) {
+			goto bad;
+		}
+
+		i = sfs_dirindex_search(sdi, hash);
+		path->pos[level] = i;
+		path->count[level] = sdi->sdi_count;
+
+		block = SFS_DIRINDEX_ENTRY(sdi, i).sdx_block;
+		if (block == 0 || block >= nblocks) {
+			goto bad;
+		}
+		if (sdi->sdi_depth == 0) {
+			path->leaf = block;
+			return 0;
+		}
+	}
+
+ bad:
+	kprintf("sfs: %s: directory %u: bad index entry in block %u\n",
+		sfs->sfs_sb.sb_volname, sv->sv_ino, path->block[level]);
+	return EIO;
+}
+
+/*
+ * Turn a flat one-block directory into an indexed one: copy its
+ * entries to block 1, which becomes the only leaf, and put the root
+ * index in block 0.
+ */
+static
+int
+sfs_dirindex_create(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex *sdi;
+	int result;
+
+	KASSERT(sizeof(struct sfs_dirindex) == SFS_BLOCKSIZE);
+	KASSERT(sv->sv_i.sfi_size == sfs->sfs_blocksize);
+
+	sdi = kmalloc(sfs->sfs_blocksize);
+	if (sdi == NULL) {
+		return ENOMEM;
+	}
+
+	result = sfs_readdirblock(sv, 0, sdi);
+	if (result) {
+		goto out;
+	}
+	result = sfs_writedirblock(sv, 1, sdi);
+	if (result) {
+		goto out;
+	}
+
+	bzero(sdi, sfs->sfs_blocksize);
+	sdi->sdi_magic = SFS_DIRINDEX_MAGIC;
+	sdi->sdi_depth = 0;
+	sdi->sdi_count = 1;
+	SFS_DIRINDEX_ENTRY(sdi, 0).sdx_hash = 0;
+	SFS_DIRINDEX_ENTRY(sdi, 0).sdx_block = 1;
+	result = sfs_writedirblock(sv, 0, sdi);
+	if (result) {
+		goto out;
+	}
+
+	sv->sv_i.sfi_flags |= SFS_IFLAG_DIRINDEX;
+	sv->sv_dirty = true;
+
+ out:
+	kfree(sdi);
+	return result;
+}
+
+/*
+ * Add an entry for HASH -> BLOCK at position POS of the index block
+ * at level LEVEL of PATH, splitting index blocks up the path as
+ * needed. The caller has checked there is room at the top.
+ */
+static
+int
+sfs_dirindex_insert(struct sfs_vnode *sv, struct sfs_dirindex_path *path,
+		    unsigned level, unsigned pos,
+		    uint32_t hash, uint32_t block)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex *sdi, *sdi2;
+	struct sfs_dirindex_entry newent, ent;
+	uint32_t newblock;
+	unsigned i, half;
+	int result;
+
+	sdi = kmalloc(sfs->sfs_blocksize);
+	sdi2 = kmalloc(sfs->sfs_blocksize);
+	if (sdi == NULL || sdi2 == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	for (;;) {
+		newent.sdx_hash = hash;
+		newent.sdx_block = block;
+
+		result = sfs_dirindex_read(sv, path->block[level], sdi);
+		if (result) {
+			goto out;
+		}
+
+		if (sdi->sdi_count < SFS_DIRINDEX_ENTRIES) {
+			/* Room here; shift the tail up and we're done. */
+			for (i = sdi->sdi_count; i > pos; i--) {
+				SFS_DIRINDEX_ENTRY(sdi, i) =
+					SFS_DIRINDEX_ENTRY(sdi, i-1);
+			}
+			SFS_DIRINDEX_ENTRY(sdi, pos) = newent;
+			sdi->sdi_count++;
+			result = sfs_writedirblock(sv, path->block[level],
+						   sdi);
+			goto out;
+		}
+
+		newblock = sfs_dir_nblocks(sv);
+
+		if (level == 0) {
+			/*
+			 * The root is full. Move its contents to a new
+			 * block under a one-entry root, so the tree grows
+			 * a level, and go around again to split the new
+			 * block.
+			 */
+			KASSERT(path->depth < SFS_DIRINDEX_MAXDEPTH);
+			result = sfs_writedirblock(sv, newblock, sdi);
+			if (result) {
+				goto out;
+			}
+			bzero(sdi2, sfs->sfs_blocksize);
+			sdi2->sdi_magic = SFS_DIRINDEX_MAGIC;
+			sdi2->sdi_depth = sdi->sdi_depth + 1;
+			sdi2->sdi_count = 1;
+			SFS_DIRINDEX_ENTRY(sdi2, 0).sdx_hash = 0;
+			SFS_DIRINDEX_ENTRY(sdi2, 0).sdx_block = newblock;
+			result = sfs_writedirblock(sv, 0, sdi2);
+			if (result) {
+				goto out;
+			}
+
+			for (i = path->depth + 1; i > 0; i--) {
+				path->block[i] = path->block[i-1];
+				path->pos[i] = path->pos[i-1];
+			}
+			path->block[1] = newblock;
+			path->pos[0] = 0;
+			path->depth++;
+			level = 1;
+			continue;
+		}
+
+		/*
+		 * Split: of the full block plus the new entry, the upper
+		 * half goes to a new block and the lower half stays.
+		 * Fill in the new block first, from the unmodified old
+		 * one.
+		 */
+		half = (SFS_DIRINDEX_ENTRIES + 1) / 2;
+		bzero(sdi2, sfs->sfs_blocksize);
+		sdi2->sdi_magic = SFS_DIRINDEX_MAGIC;
+		sdi2->sdi_depth = sdi->sdi_depth;
+		sdi2->sdi_count = SFS_DIRINDEX_ENTRIES + 1 - half;
+		for (i = half; i < SFS_DIRINDEX_ENTRIES + 1; i++) {
+			if (i < pos) {
+				ent = SFS_DIRINDEX_ENTRY(sdi, i);
+			}
+			else if (i == pos) {
+				ent = newent;
+			}
+			else {
+				ent = SFS_DIRINDEX_ENTRY(sdi, i-1);
+			}
+			SFS_DIRINDEX_ENTRY(sdi2, i - half) = ent;
+		}
+		if (pos < half) {
+			for (i = half - 1; i > pos; i--) {
+				SFS_DIRINDEX_ENTRY(sdi, i) =
+					SFS_DIRINDEX_ENTRY(sdi, i-1);
+			}
+			SFS_DIRINDEX_ENTRY(sdi, pos) = newent;
+		}
+		sdi->sdi_count = half;
+		for (i = half; i < SFS_DIRINDEX_ENTRIES; i++) {
+			SFS_DIRINDEX_ENTRY(sdi, i).sdx_hash = 0;
+			SFS_DIRINDEX_ENTRY(sdi, i).sdx_block = 0;
+		}
+
+		result = sfs_writedirblock(sv, newblock, sdi2);
+		if (result) {
+			goto out;
+		}
+		result = sfs_writedirblock(sv, path->block[level], sdi);
+		if (result) {
+			goto out;
+		}
+
+		/* Now add the new block to the parent. */
+		hash = SFS_DIRINDEX_ENTRY(sdi2, 0).sdx_hash;
+		block = newblock;
+		level--;
+		pos = path->pos[level] + 1;
+	}
+
+ out:
+	if (sdi2 != NULL) {
+		kfree(sdi2);
+	}
+	if (sdi != NULL) {
+		kfree(sdi);
+	}
+	return result;
+}
+
+/*
+ * Look up NAME in indexed directory SV. Same interface as
+ * sfs_dir_findname; only the one leaf the name hashes to is read.
+ */
+static
+int
+sfs_dirindex_findname(struct sfs_vnode *sv, const char *name,
+		      uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	const unsigned perblock = SFS_FS_DIRENTRIESPERBLOCK(sfs);
+	struct sfs_dirindex_path path;
+	void *buf;
+	int found, result;
+
+	buf = kmalloc(sfs->sfs_blocksize);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = sfs_dirindex_descend(sv, sfs_dirindex_hash(name), buf, &path);
+	if (result) {
+		kfree(buf);
+		return result;
+	}
+	result = sfs_readdirblock(sv, path.leaf, buf);
+	if (result) {
+		kfree(buf);
+		return result;
+	}
+
+	found = 0;
+	sfs_dir_scanblock(buf, path.leaf * perblock,
+			  perblock, name,
+			  ino, slot, emptyslot, &found);
+	kfree(buf);
+	return found ? 0 : ENOENT;
+}
+
+/*
+ * Add entry SD to indexed directory SV, splitting its leaf if the
+ * leaf is full, and hand back the slot it went in.
+ */
+static
+int
+sfs_dirindex_link(struct sfs_vnode *sv, struct sfs_direntry *sd, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	const unsigned perblock = SFS_FS_DIRENTRIESPERBLOCK(sfs);
+	struct sfs_dirindex_path path;
+	struct sfs_direntry *sds, *lower, *upper;
+	const unsigned n = perblock + 1;
+	uint32_t *hashes;
+	unsigned *order;
+	uint32_t hash, newleaf;
+	unsigned i, j, k, level, tmp;
+	int found, emptyslot, result;
+
+	/* Three blocks of entries, then N hashes and N indexes */
+	sds = kmalloc(3 * sfs->sfs_blocksize +
+		      n * (sizeof(*hashes) + sizeof(*order)));
+	if (sds == NULL) {
+		return ENOMEM;
+	}
+	hashes = (uint32_t *)(sds + 3 * perblock);
+	order = (unsigned *)(hashes + n);
+	lower = sds + perblock;
+	upper = lower + perblock;
+
+	hash = sfs_dirindex_hash(sd->sfd_name);
+	result = sfs_dirindex_descend(sv, hash, (struct sfs_dirindex *)sds,
+				      &path);
+	if (result) {
+		goto out;
+	}
+	result = sfs_readdirblock(sv, path.leaf, sds);
+	if (result) {
+		goto out;
+	}
+
+	found = 0;
+	emptyslot = -1;
+	sfs_dir_scanblock(sds, path.leaf * perblock,
+			  perblock, sd->sfd_name,
+			  NULL, NULL, &emptyslot, &found);
+	if (found) {
+		result = EEXIST;
+		goto out;
+	}
+	if (emptyslot >= 0) {
+		*slot = emptyslot;
+		result = sfs_writedir(sv, emptyslot, sd);
+		goto out;
+	}
+
+	/*
+	 * The leaf is full. Make sure the index can take another
+	 * entry: it can unless every block on the path is full and
+	 * the tree is already as deep as it is allowed to be.
+	 */
+	level = path.depth;
+	while (level > 0 && path.count[level] == SFS_DIRINDEX_ENTRIES) {
+		level--;
+	}
+	if (level == 0 && path.count[0] == SFS_DIRINDEX_ENTRIES &&
+	    path.depth == SFS_DIRINDEX_MAXDEPTH) {
+		result = ENOSPC;
+		goto out;
+	}
+
+	/*
+	 * Sort the leaf's entries plus the new one (index n-1) by
+	 * hash and split them as near the middle as possible, at a
+	 * point where the hash changes so no hash spans two leaves.
+	 */
+	for (i=0; i<n; i++) {
+		hashes[i] = (i < n-1) ? sfs_dirindex_hash(sds[i].sfd_name)
+			: hash;
+		order[i] = i;
+	}
+	for (i=1; i<n; i++) {
+		for (j=i; j>0 && hashes[order[j-1]] > hashes[order[j]]; j--) {
+			tmp = order[j];
+			order[j] = order[j-1];
+			order[j-1] = tmp;
+		}
+	}
+	k = 0;
+	for (i=0; i<n/2 && k==0; i++) {
+		if (hashes[order[n/2 - i - 1]] != hashes[order[n/2 - i]]) {
+			k = n/2 - i;
+		}
+		else if (n/2 + i + 1 < n &&
+			 hashes[order[n/2 + i]] != hashes[order[n/2 + i + 1]]) {
+			k = n/2 + i + 1;
+		}
+	}
+	if (k == 0) {
+		/* A whole leaf's worth of names with the same hash. */
+		result = ENOSPC;
+		goto out;
+	}
+
+	newleaf = sfs_dir_nblocks(sv);
+	bzero(lower, 2 * sfs->sfs_blocksize);
+	for (i=0; i<n; i++) {
+		struct sfs_direntry *src, *dst;
+
+		src = (order[i] < n-1) ? &sds[order[i]] : sd;
+		dst = (i < k) ? &lower[i] : &upper[i-k];
+		*dst = *src;
+		if (order[i] == n-1) {
+			*slot = (i < k) ?
+				path.leaf * perblock + i :
+				newleaf * perblock + (i-k);
+		}
+	}
+
+	/*
+	 * Write the new leaf, then hook it into the index, then cut
+	 * down the old leaf. Until the last step the moved names are
+	 * still found in the old leaf.
+	 */
+	result = sfs_writedirblock(sv, newleaf, upper);
+	if (result) {
+		goto out;
+	}
+	result = sfs_dirindex_insert(sv, &path, path.depth,
+				     path.pos[path.depth] + 1,
+				     hashes[order[k]], newleaf);
+	if (result) {
+		/* Don't leave a second copy of the names around. */
+		bzero(upper, sfs->sfs_blocksize);
+		sfs_writedirblock(sv, newleaf, upper);
+		goto out;
+	}
+	result = sfs_writedirblock(sv, path.leaf, lower);
+
+ out:
+	kfree(sds);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * This and the other sfs_dir functions must be called with the
+ * directory's lock held.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	const unsigned perblock = SFS_FS_DIRENTRIESPERBLOCK(sfs);
+	struct sfs_direntry *sds;
+	int found, nentries, i, n, result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_DIRINDEX) {
+		return sfs_dirindex_findname(sv, name, ino, slot, emptyslot);
+	}
+
+	nentries = sfs_dir_nentries(sv);
+
+	/* Buffer for one block of entries */
+	sds = kmalloc(sfs->sfs_blocksize);
+	if (sds == NULL) {
+		return ENOMEM;
+	}
+
+	/* For each block of slots... */
+	found = 0;
+	for (i=0; i<nentries; i += perblock) {
+		result = sfs_readdirblock(sv, i / perblock, sds);
+		if (result) {
+			kfree(sds);
+			return result;
+		}
+		n = nentries - i;
+		if (n > (int)perblock) {
+			n = perblock;
+		}
+		sfs_dir_scanblock(sds, i, n, name,
+				  ino, slot, emptyslot, &found);
+	}
+
+	kfree(sds);
 	return found ? 0 : ENOENT;
 }
 
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
+ *
+ * In an indexed directory the entries of the leaf the new name goes
+ * in may be moved around, so slots found before this call are no
+ * longer valid after it.
  */
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int emptyslot = -1;
+	int nentries;
 	int result;
 	struct sfs_direntry sd;
 
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	/* Set up the entry. */
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = ino;
+	strcpy(sd.sfd_name, name);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_DIRINDEX) {
+		return sfs_dirindex_link(sv, &sd, slot ? slot : &emptyslot);
+	}
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
@@ -166,20 +792,26 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return EEXIST;
 	}
 
-	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
-		return ENAMETOOLONG;
-	}
-
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+		nentries = sfs_dir_nentries(sv);
+
+		/*
+		 * If this would take the directory past its first
+		 * block, and the volume allows it, index it instead.
+		 */
+		if (nentries == (int)SFS_FS_DIRENTRIESPERBLOCK(sfs) &&
+		    (sfs->sfs_sb.sb_features & SFS_FEATURE_DIRINDEX)) {
+			result = sfs_dirindex_create(sv);
+			if (result) {
+				return result;
+			}
+			return sfs_dirindex_link(sv, &sd,
+						 slot ? slot : &emptyslot);
+		}
+		emptyslot = nentries;
 	}
 
-	/* Set up the entry. */
-	bzero(&sd, sizeof(sd));
-	sd.sfd_ino = ino;
-	strcpy(sd.sfd_name, name);
-
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
@@ -190,7 +822,8 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. In an indexed
+ * directory this leaves the slot free in its leaf.
  */
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
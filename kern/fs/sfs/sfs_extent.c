@@ -0,0 +1,1033 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Block mapping for extent-mapped files (SFS_IFLAG_EXTENTS).
+ *
+ * The tree is a B-tree keyed by file block; see kern/sfs.h for the
+ * on-disk layout. A file written sequentially stays a handful of
+ * extents in the inode itself, so mapping a block costs no I/O at
+ * all, and the tree only grows blocks once the file is badly
+ * fragmented. The vnode also caches the extent last looked up, so
+ * runs of lookups in the same extent don't walk the tree.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * One node of the tree, as we walk it: either the root in the inode
+ * (EN_BLOCK 0) or a copy of a tree block.
+ */
+struct sfs_extnode {
+	daddr_t en_block;			/* tree block, or 0 for root */
+	struct sfs_extent_block *en_data;	/* copy of it, or NULL */
+	struct sfs_extent *en_entries;		/* the entries */
+	uint16_t *en_count;			/* how many are in use */
+	unsigned en_max;			/* how many fit */
+	unsigned en_depth;			/* levels below this one */
+	unsigned en_pos;			/* entry we went down through */
+};
+
+////////////////////////////////////////////////////////////
+// Nodes
+
+/*
+ * Set up EN as the root of SV's tree.
+ */
+static
+int
+sfs_ext_root(struct sfs_vnode *sv, struct sfs_extnode *en)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent_root *ser = &sv->sv_i.sfi_extents;
+
+	if (ser->ser_depth > SFS_EXTENT_MAXDEPTH ||
+	    ser->ser_count > SFS_EXTENTS_ININODE ||
+	    (ser->ser_depth > 0 && ser->ser_count == 0)) {
+		kprintf("sfs: %s: file %u: bad extent root\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino);
+		return EIO;
+	}
+
+	en->en_block = 0;
+	en->en_data = NULL;
+	en->en_entries = ser->ser_entries;
+	en->en_count = &ser->ser_count;
+	en->en_max = SFS_EXTENTS_ININODE;
+	en->en_depth = ser->ser_depth;
+	en->en_pos = 0;
+	return 0;
+}
+
+/*
+ * Load tree block BLOCK, which should be at depth DEPTH, into EN.
+ */
+static
+int
+sfs_ext_read(struct sfs_vnode *sv, daddr_t block, unsigned depth,
+	     struct sfs_extnode *en)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent_block *seb;
+	int result;
+
+	if (block == 0 || block >= sfs->sfs_sb.sb_nblocks) {
+		kprintf("sfs: %s: file %u: bad extent block %u\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, block);
+		return EIO;
+	}
+
+	seb = kmalloc(SFS_BLOCKSIZE);
+	if (seb == NULL) {
+		return ENOMEM;
+	}
+	result = sfs_readblock(sfs, block, seb, SFS_BLOCKSIZE);
+	if (result) {
+		kfree(seb);
+		return result;
+	}
+	if (seb->seb_magic != SFS_EXTENT_MAGIC || seb->seb_depth != depth ||
+	    seb->seb_count > SFS_EXTENTS_PERBLOCK ||
+	    (depth > 0 && seb->seb_count == 0)) {
+		kprintf("sfs: %s: file %u: bad extent block %u\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, block);
+		kfree(seb);
+		return EIO;
+	}
+
+	en->en_block = block;
+	en->en_data = seb;
+	en->en_entries = seb->seb_entries;
+	en->en_count = &seb->seb_count;
+	en->en_max = SFS_EXTENTS_PERBLOCK;
+	en->en_depth = depth;
+	en->en_pos = 0;
+	return 0;
+}
+
+/*
+ * Allocate a new, empty tree block at depth DEPTH near GOAL.
+ */
+static
+int
+sfs_ext_new(struct sfs_vnode *sv, daddr_t goal, unsigned depth,
+	    struct sfs_extnode *en)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent_block *seb;
+	daddr_t block;
+	int result;
+
+	seb = kmalloc(SFS_BLOCKSIZE);
+	if (seb == NULL) {
+		return ENOMEM;
+	}
+	/*
+	 * We write the whole tree block ourselves; only the rest of a
+	 * larger disk block needs clearing.
+	 */
+	result = sfs_balloc(sfs, sv, goal, sfs->sfs_blocksize > sizeof(*seb),
+			    &block);
+	if (result) {
+		kfree(seb);
+		return result;
+	}
+	bzero(seb, SFS_BLOCKSIZE);
+	seb->seb_magic = SFS_EXTENT_MAGIC;
+	seb->seb_depth = depth;
+
+	en->en_block = block;
+	en->en_data = seb;
+	en->en_entries = seb->seb_entries;
+	en->en_count = &seb->seb_count;
+	en->en_max = SFS_EXTENTS_PERBLOCK;
+	en->en_depth = depth;
+	en->en_pos = 0;
+	return 0;
+}
+
+/*
+ * Write back a node we've changed.
+ */
+static
+int
+sfs_ext_write(struct sfs_vnode *sv, struct sfs_extnode *en)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (en->en_block == 0) {
+		sv->sv_dirty = true;
+		return 0;
+	}
+	return sfs_writeblock(sfs, en->en_block, en->en_data, SFS_BLOCKSIZE,
+			      sv);
+}
+
+/*
+ * Throw away the tree blocks loaded along a path.
+ */
+static
+void
+sfs_ext_putpath(struct sfs_extnode *path, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		if (path[i].en_data != NULL) {
+			kfree(path[i].en_data);
+		}
+	}
+}
+
+/*
+ * Find the last entry of EN starting at or before FILEBLOCK, or 0 if
+ * there is none.
+ */
+static
+unsigned
+sfs_ext_search(struct sfs_extnode *en, uint32_t fileblock)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = *en->en_count;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (en->en_entries[mid].se_fileblock <= fileblock) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Put entry SE into EN at slot IDX. There must be room.
+ */
+static
+void
+sfs_ext_put(struct sfs_extnode *en, unsigned idx,
+	    const struct sfs_extent *se)
+{
+	unsigned count = *en->en_count;
+
+	KASSERT(count < en->en_max);
+	KASSERT(idx <= count);
+	memmove(&en->en_entries[idx + 1], &en->en_entries[idx],
+		(count - idx) * sizeof(struct sfs_extent));
+	en->en_entries[idx] = *se;
+	*en->en_count = count + 1;
+}
+
+/*
+ * Walk from the root down to the leaf that covers FILEBLOCK, loading
+ * PATH[0..*NRET-1]. Each node's EN_POS is the entry for FILEBLOCK.
+ */
+static
+int
+sfs_ext_getpath(struct sfs_vnode *sv, uint32_t fileblock,
+		struct sfs_extnode *path, unsigned *nret)
+{
+	struct sfs_extnode *en;
+	unsigned i;
+	int result;
+
+	result = sfs_ext_root(sv, &path[0]);
+	if (result) {
+		return result;
+	}
+	for (i=0; ; i++) {
+		en = &path[i];
+		en->en_pos = sfs_ext_search(en, fileblock);
+		if (en->en_depth == 0) {
+			break;
+		}
+		result = sfs_ext_read(sv,
+				      en->en_entries[en->en_pos].se_diskblock,
+				      en->en_depth - 1, &path[i+1]);
+		if (result) {
+			sfs_ext_putpath(path, i+1);
+			return result;
+		}
+	}
+	*nret = i+1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Insertion
+
+static int sfs_ext_insert(struct sfs_vnode *sv, struct sfs_extnode *path,
+			  unsigned level, unsigned idx,
+			  const struct sfs_extent *se);
+
+/*
+ * The root is full: move its entries out into a new tree block and
+ * make the root an index with one entry, then insert SE at IDX in
+ * the new block.
+ */
+static
+int
+sfs_ext_grow(struct sfs_vnode *sv, struct sfs_extnode *root, unsigned idx,
+	     const struct sfs_extent *se)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode child;
+	unsigned count = *root->en_count;
+	int result;
+
+	if (root->en_depth >= SFS_EXTENT_MAXDEPTH) {
+		return EFBIG;
+	}
+
+	result = sfs_ext_new(sv, sfs_inode_block(sfs, sv->sv_ino),
+			     root->en_depth, &child);
+	if (result) {
+		return result;
+	}
+	memcpy(child.en_entries, root->en_entries,
+	       count * sizeof(struct sfs_extent));
+	*child.en_count = count;
+	sfs_ext_put(&child, idx, se);
+
+	result = sfs_ext_write(sv, &child);
+	if (result) {
+		sfs_bfree(sfs, child.en_block);
+		kfree(child.en_data);
+		return result;
+	}
+
+	bzero(root->en_entries, root->en_max * sizeof(struct sfs_extent));
+	root->en_entries[0].se_fileblock = child.en_entries[0].se_fileblock;
+	root->en_entries[0].se_diskblock = child.en_block;
+	*root->en_count = 1;
+	sv->sv_i.sfi_extents.ser_depth++;
+	sv->sv_dirty = true;
+
+	kfree(child.en_data);
+	return 0;
+}
+
+/*
+ * PATH[LEVEL] is a full tree block: split it in half, with SE going
+ * in at IDX, and insert an entry for the new half in the parent.
+ */
+static
+int
+sfs_ext_split(struct sfs_vnode *sv, struct sfs_extnode *path,
+	      unsigned level, unsigned idx, const struct sfs_extent *se)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode *en = &path[level];
+	struct sfs_extnode right;
+	struct sfs_extent ie;
+	unsigned count = *en->en_count;
+	unsigned mid = count / 2;
+	int result;
+
+	result = sfs_ext_new(sv, en->en_block, en->en_depth, &right);
+	if (result) {
+		return result;
+	}
+
+	memcpy(right.en_entries, &en->en_entries[mid],
+	       (count - mid) * sizeof(struct sfs_extent));
+	*right.en_count = count - mid;
+	bzero(&en->en_entries[mid], (count - mid) * sizeof(struct sfs_extent));
+	*en->en_count = mid;
+
+	if (idx <= mid) {
+		sfs_ext_put(en, idx, se);
+	}
+	else {
+		sfs_ext_put(&right, idx - mid, se);
+	}
+
+	/*
+	 * Hook the new block into the parent before writing anything,
+	 * so if that fails there's nothing to undo on disk.
+	 */
+	bzero(&ie, sizeof(ie));
+	ie.se_fileblock = right.en_entries[0].se_fileblock;
+	ie.se_diskblock = right.en_block;
+	result = sfs_ext_insert(sv, path, level - 1,
+				path[level - 1].en_pos + 1, &ie);
+	if (result) {
+		sfs_bfree(sfs, right.en_block);
+		kfree(right.en_data);
+		return result;
+	}
+
+	result = sfs_ext_write(sv, &right);
+	kfree(right.en_data);
+	if (result) {
+		return result;
+	}
+	return sfs_ext_write(sv, en);
+}
+
+/*
+ * Insert SE at slot IDX of PATH[LEVEL], splitting as needed.
+ */
+static
+int
+sfs_ext_insert(struct sfs_vnode *sv, struct sfs_extnode *path,
+	       unsigned level, unsigned idx, const struct sfs_extent *se)
+{
+	struct sfs_extnode *en = &path[level];
+
+	if (*en->en_count < en->en_max) {
+		sfs_ext_put(en, idx, se);
+		return sfs_ext_write(sv, en);
+	}
+	if (level == 0) {
+		return sfs_ext_grow(sv, en, idx, se);
+	}
+	return sfs_ext_split(sv, path, level, idx, se);
+}
+
+/*
+ * Record that FILEBLOCK is now disk block BLOCK, in the leaf at the
+ * end of PATH. Grow a neighbouring extent if the new block lines up
+ * with it; otherwise add a new extent.
+ */
+static
+int
+sfs_ext_add(struct sfs_vnode *sv, struct sfs_extnode *path, unsigned n,
+	    uint32_t fileblock, daddr_t block)
+{
+	struct sfs_extnode *leaf = &path[n-1];
+	struct sfs_extent *entries = leaf->en_entries;
+	struct sfs_extent *prev, *next, se;
+	unsigned count = *leaf->en_count;
+	unsigned nextidx;
+
+	prev = NULL;
+	nextidx = leaf->en_pos;
+	if (count > 0 && entries[nextidx].se_fileblock <= fileblock) {
+		prev = &entries[nextidx];
+		nextidx++;
+	}
+	next = nextidx < count ? &entries[nextidx] : NULL;
+
+	if (prev != NULL &&
+	    prev->se_fileblock + prev->se_nblocks == fileblock &&
+	    prev->se_diskblock + prev->se_nblocks == block) {
+		prev->se_nblocks++;
+		if (next != NULL && next->se_fileblock == fileblock + 1 &&
+		    next->se_diskblock == block + 1) {
+			/* Filled the gap between two extents; merge them */
+			prev->se_nblocks += next->se_nblocks;
+			memmove(next, next + 1,
+				(count - nextidx - 1) *
+				sizeof(struct sfs_extent));
+			bzero(&entries[count - 1], sizeof(struct sfs_extent));
+			*leaf->en_count = count - 1;
+		}
+		sv->sv_extcache = *prev;
+		return sfs_ext_write(sv, leaf);
+	}
+
+	if (next != NULL && next->se_fileblock == fileblock + 1 &&
+	    next->se_diskblock == block + 1) {
+		next->se_fileblock--;
+		next->se_diskblock--;
+		next->se_nblocks++;
+		sv->sv_extcache = *next;
+		return sfs_ext_write(sv, leaf);
+	}
+
+	se.se_fileblock = fileblock;
+	se.se_diskblock = block;
+	se.se_nblocks = 1;
+	sv->sv_extcache = se;
+	return sfs_ext_insert(sv, path, n-1, nextidx, &se);
+}
+
+////////////////////////////////////////////////////////////
+// Mapping
+
+/*
+ * sfs_bmap for extent-mapped files.
+ */
+int
+sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	     bool fill, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode path[SFS_EXTENT_MAXDEPTH + 1];
+	struct sfs_extent *ce = &sv->sv_extcache;
+	struct sfs_extent *se;
+	struct sfs_extnode *leaf;
+	daddr_t block, goal;
+	unsigned n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (fileblock >= SFS_EXTENT_MAXBLOCKS(sfs->sfs_blocksize)) {
+		return EFBIG;
+	}
+
+	/* Same extent as last time? */
+	if (fileblock >= ce->se_fileblock &&
+	    fileblock - ce->se_fileblock < ce->se_nblocks) {
+		*diskblock = ce->se_diskblock + (fileblock - ce->se_fileblock);
+		return 0;
+	}
+
+	result = sfs_ext_getpath(sv, fileblock, path, &n);
+	if (result) {
+		return result;
+	}
+	leaf = &path[n-1];
+
+	se = NULL;
+	if (*leaf->en_count > 0 &&
+	    leaf->en_entries[leaf->en_pos].se_fileblock <= fileblock) {
+		se = &leaf->en_entries[leaf->en_pos];
+	}
+
+	if (se != NULL && fileblock - se->se_fileblock < se->se_nblocks) {
+		block = se->se_diskblock + (fileblock - se->se_fileblock);
+		if (se->se_diskblock == 0 ||
+		    se->se_diskblock + se->se_nblocks >
+		    sfs->sfs_sb.sb_nblocks) {
+			kprintf("sfs: %s: file %u: bad extent in block %u\n",
+				sfs->sfs_sb.sb_volname, sv->sv_ino,
+				leaf->en_block);
+			sfs_ext_putpath(path, n);
+			return EIO;
+		}
+		*ce = *se;
+	}
+	else if (!doalloc) {
+		/* A hole */
+		block = 0;
+	}
+	else {
+		/* Try to carry on from the extent before */
+		if (se != NULL) {
+			goal = se->se_diskblock +
+				(fileblock - se->se_fileblock);
+		}
+		else {
+			goal = sfs_inode_block(sfs, sv->sv_ino) + 1;
+		}
+		result = sfs_balloc(sfs, sv, goal, !fill, &block);
+		if (result) {
+			sfs_ext_putpath(path, n);
+			return result;
+		}
+		result = sfs_ext_add(sv, path, n, fileblock, block);
+		if (result) {
+			ce->se_nblocks = 0;
+			sfs_bfree(sfs, block);
+			sfs_ext_putpath(path, n);
+			return result;
+		}
+	}
+	sfs_ext_putpath(path, n);
+
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Truncation
+
+/*
+ * Free NBLOCKS disk blocks starting at BLOCK.
+ */
+static
+void
+sfs_ext_freerun(struct sfs_fs *sfs, daddr_t block, uint32_t nblocks)
+{
+	uint32_t i;
+
+	for (i=0; i<nblocks; i++) {
+		sfs_bfree(sfs, block + i);
+	}
+}
+
+/*
+ * Free the subtree in tree block BLOCK at depth DEPTH, and everything
+ * it maps.
+ */
+static
+int
+sfs_ext_freetree(struct sfs_vnode *sv, daddr_t block, unsigned depth)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode en;
+	struct sfs_extent *se;
+	unsigned i;
+	int result;
+
+	result = sfs_ext_read(sv, block, depth, &en);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<*en.en_count; i++) {
+		se = &en.en_entries[i];
+		if (depth == 0) {
+			sfs_ext_freerun(sfs, se->se_diskblock,
+					se->se_nblocks);
+		}
+		else {
+			result = sfs_ext_freetree(sv, se->se_diskblock,
+						  depth - 1);
+			if (result) {
+				kfree(en.en_data);
+				return result;
+			}
+		}
+	}
+	kfree(en.en_data);
+	sfs_bfree(sfs, block);
+	return 0;
+}
+
+/*
+ * Drop everything at or past BLOCKLEN from node EN. Entries go from
+ * the end; once one is left that ends before BLOCKLEN, everything in
+ * front of it does too.
+ */
+static
+int
+sfs_ext_truncnode(struct sfs_vnode *sv, struct sfs_extnode *en,
+		  uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode child;
+	struct sfs_extent *se;
+	uint32_t keep;
+	bool changed = false;
+	int result = 0;
+
+	while (*en->en_count > 0) {
+		se = &en->en_entries[*en->en_count - 1];
+
+		if (en->en_depth == 0) {
+			if (se->se_fileblock >= blocklen) {
+				keep = 0;
+			}
+			else if (se->se_fileblock + se->se_nblocks >
+				 blocklen) {
+				keep = blocklen - se->se_fileblock;
+			}
+			else {
+				break;
+			}
+			sfs_ext_freerun(sfs, se->se_diskblock + keep,
+					se->se_nblocks - keep);
+			se->se_nblocks = keep;
+			changed = true;
+			if (keep > 0) {
+				break;
+			}
+		}
+		else if (*en->en_count > 1 && se->se_fileblock >= blocklen) {
+			/* The whole subtree goes */
+			result = sfs_ext_freetree(sv, se->se_diskblock,
+						  en->en_depth - 1);
+			if (result) {
+				break;
+			}
+		}
+		else {
+			result = sfs_ext_read(sv, se->se_diskblock,
+					      en->en_depth - 1, &child);
+			if (result) {
+				break;
+			}
+			result = sfs_ext_truncnode(sv, &child, blocklen);
+			if (result || *child.en_count > 0) {
+				kfree(child.en_data);
+				break;
+			}
+			kfree(child.en_data);
+			sfs_bfree(sfs, se->se_diskblock);
+		}
+
+		bzero(se, sizeof(*se));
+		(*en->en_count)--;
+		changed = true;
+	}
+
+	if (changed) {
+		int result2 = sfs_ext_write(sv, en);
+		if (result == 0) {
+			result = result2;
+		}
+	}
+	return result;
+}
+
+/*
+ * After entries have come out of the root: if it's empty, it's an
+ * empty leaf, and while it has one child that would fit in the inode,
+ * pull that child up into it.
+ */
+static
+int
+sfs_ext_shrink(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent_root *ser = &sv->sv_i.sfi_extents;
+	struct sfs_extnode child;
+	int result;
+
+	if (ser->ser_count == 0 && ser->ser_depth > 0) {
+		ser->ser_depth = 0;
+		sv->sv_dirty = true;
+	}
+
+	while (ser->ser_depth > 0 && ser->ser_count == 1) {
+		result = sfs_ext_read(sv, ser->ser_entries[0].se_diskblock,
+				      ser->ser_depth - 1, &child);
+		if (result) {
+			return result;
+		}
+		if (*child.en_count > SFS_EXTENTS_ININODE) {
+			kfree(child.en_data);
+			break;
+		}
+		bzero(ser->ser_entries, sizeof(ser->ser_entries));
+		memcpy(ser->ser_entries, child.en_entries,
+		       *child.en_count * sizeof(struct sfs_extent));
+		ser->ser_count = *child.en_count;
+		ser->ser_depth--;
+		sv->sv_dirty = true;
+		kfree(child.en_data);
+		sfs_bfree(sfs, child.en_block);
+	}
+
+	return 0;
+}
+
+/*
+ * sfs_itrunc for extent-mapped files: free everything from file
+ * block BLOCKLEN on.
+ */
+int
+sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_extnode root;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sv->sv_extcache.se_nblocks = 0;
+
+	result = sfs_ext_root(sv, &root);
+	if (result) {
+		return result;
+	}
+	result = sfs_ext_truncnode(sv, &root, blocklen);
+	if (result) {
+		return result;
+	}
+	return sfs_ext_shrink(sv);
+}
+
+////////////////////////////////////////////////////////////
+// Holes
+
+/*
+ * Take entry IDX out of node EN.
+ */
+static
+void
+sfs_ext_remove(struct sfs_extnode *en, unsigned idx)
+{
+	unsigned count = *en->en_count;
+
+	KASSERT(idx < count);
+	memmove(&en->en_entries[idx], &en->en_entries[idx + 1],
+		(count - idx - 1) * sizeof(struct sfs_extent));
+	bzero(&en->en_entries[count - 1], sizeof(struct sfs_extent));
+	*en->en_count = count - 1;
+}
+
+/*
+ * Free the blocks from FIRST up to END under node EN, which maps
+ * file blocks in [LO, HI). No single extent may reach across the
+ * whole range; sfs_ext_punch splits that case off first. Children
+ * left empty are freed and dropped.
+ */
+static
+int
+sfs_ext_punchnode(struct sfs_vnode *sv, struct sfs_extnode *en,
+		  uint32_t lo, uint32_t hi, uint32_t first, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode child;
+	struct sfs_extent *se;
+	uint32_t elo, ehi, cut;
+	bool changed = false;
+	unsigned i;
+	int result = 0;
+
+	i = 0;
+	while (i < *en->en_count) {
+		se = &en->en_entries[i];
+
+		if (en->en_depth == 0) {
+			elo = se->se_fileblock;
+			ehi = elo + se->se_nblocks;
+			if (elo >= end) {
+				break;
+			}
+			if (ehi <= first) {
+				i++;
+				continue;
+			}
+			KASSERT(elo >= first || ehi <= end);
+			if (elo >= first && ehi <= end) {
+				sfs_ext_freerun(sfs, se->se_diskblock,
+						se->se_nblocks);
+				sfs_ext_remove(en, i);
+			}
+			else if (elo < first) {
+				/* Keep the head */
+				cut = first - elo;
+				sfs_ext_freerun(sfs, se->se_diskblock + cut,
+						se->se_nblocks - cut);
+				se->se_nblocks = cut;
+				i++;
+			}
+			else {
+				/* Keep the tail */
+				cut = end - elo;
+				sfs_ext_freerun(sfs, se->se_diskblock, cut);
+				se->se_fileblock += cut;
+				se->se_diskblock += cut;
+				se->se_nblocks -= cut;
+				i++;
+			}
+			changed = true;
+			continue;
+		}
+
+		elo = i == 0 ? lo : se->se_fileblock;
+		ehi = i+1 < *en->en_count ?
+			en->en_entries[i+1].se_fileblock : hi;
+		if (elo >= end) {
+			break;
+		}
+		if (ehi <= first) {
+			i++;
+			continue;
+		}
+		if (elo >= first && ehi <= end) {
+			/* The whole subtree goes */
+			result = sfs_ext_freetree(sv, se->se_diskblock,
+						  en->en_depth - 1);
+			if (result) {
+				break;
+			}
+		}
+		else {
+			result = sfs_ext_read(sv, se->se_diskblock,
+					      en->en_depth - 1, &child);
+			if (result) {
+				break;
+			}
+			result = sfs_ext_punchnode(sv, &child, elo, ehi,
+						   first, end);
+			if (result || *child.en_count > 0) {
+				kfree(child.en_data);
+				if (result) {
+					break;
+				}
+				i++;
+				continue;
+			}
+			kfree(child.en_data);
+			sfs_bfree(sfs, se->se_diskblock);
+		}
+		sfs_ext_remove(en, i);
+		changed = true;
+	}
+
+	if (changed) {
+		int result2 = sfs_ext_write(sv, en);
+		if (result == 0) {
+			result = result2;
+		}
+	}
+	return result;
+}
+
+/*
+ * sfs_ipunch for extent-mapped files: free file blocks FIRST up to
+ * END. Cutting a hole out of the middle of one extent leaves two,
+ * which may take a new tree block.
+ */
+int
+sfs_ext_punch(struct sfs_vnode *sv, uint32_t first, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extnode path[SFS_EXTENT_MAXDEPTH + 1];
+	struct sfs_extnode *leaf, root;
+	struct sfs_extent *se, tail;
+	uint32_t oldlen;
+	daddr_t hole;
+	unsigned n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sv->sv_extcache.se_nblocks = 0;
+
+	result = sfs_ext_getpath(sv, first, path, &n);
+	if (result) {
+		return result;
+	}
+	leaf = &path[n-1];
+	se = &leaf->en_entries[leaf->en_pos];
+	if (*leaf->en_count > 0 && se->se_fileblock < first &&
+	    se->se_fileblock + se->se_nblocks > end) {
+		bzero(&tail, sizeof(tail));
+		tail.se_fileblock = end;
+		tail.se_diskblock = se->se_diskblock + (end - se->se_fileblock);
+		tail.se_nblocks = se->se_fileblock + se->se_nblocks - end;
+		hole = se->se_diskblock + (first - se->se_fileblock);
+		oldlen = se->se_nblocks;
+		se->se_nblocks = first - se->se_fileblock;
+
+		result = sfs_ext_insert(sv, path, n-1, leaf->en_pos + 1,
+					&tail);
+		if (result) {
+			/*
+			 * A tree block's copy just gets dropped, but the
+			 * root lives in the inode and needs putting back.
+			 */
+			if (leaf->en_block == 0) {
+				se->se_nblocks = oldlen;
+			}
+		}
+		else {
+			sfs_ext_freerun(sfs, hole, end - first);
+		}
+		sfs_ext_putpath(path, n);
+		return result;
+	}
+	sfs_ext_putpath(path, n);
+
+	result = sfs_ext_root(sv, &root);
+	if (result) {
+		return result;
+	}
+	result = sfs_ext_punchnode(sv, &root, 0, SFS_NOBLOCK, first, end);
+	if (result) {
+		return result;
+	}
+	return sfs_ext_shrink(sv);
+}
+
+/*
+ * sfs_bmap_seek for extent-mapped files. Walk the leaves from the
+ * one covering FILEBLOCK, moving to the next one through the first
+ * ancestor that has a next entry.
+ */
+int
+sfs_ext_seek(struct sfs_vnode *sv, uint32_t fileblock, bool hole,
+	     uint32_t *ret)
+{
+	struct sfs_extnode path[SFS_EXTENT_MAXDEPTH + 1];
+	struct sfs_extnode *leaf, *up;
+	struct sfs_extent *se;
+	uint32_t next;
+	unsigned n, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_ext_getpath(sv, fileblock, path, &n);
+	if (result) {
+		return result;
+	}
+	while (1) {
+		leaf = &path[n-1];
+		for (i = leaf->en_pos; i < *leaf->en_count; i++) {
+			se = &leaf->en_entries[i];
+			if (se->se_fileblock + se->se_nblocks <= fileblock) {
+				continue;
+			}
+			if (!hole) {
+				*ret = se->se_fileblock > fileblock ?
+					se->se_fileblock : fileblock;
+				goto done;
+			}
+			if (se->se_fileblock > fileblock) {
+				*ret = fileblock;
+				goto done;
+			}
+			fileblock = se->se_fileblock + se->se_nblocks;
+		}
+
+		for (i=n-1; i>0; i--) {
+			up = &path[i-1];
+			if (up->en_pos + 1 < *up->en_count) {
+				break;
+			}
+		}
+		if (i == 0) {
+			/* Past the last extent it's all hole */
+			*ret = hole ? fileblock : SFS_NOBLOCK;
+			goto done;
+		}
+		next = up->en_entries[up->en_pos + 1].se_fileblock;
+		sfs_ext_putpath(path, n);
+		result = sfs_ext_getpath(sv, next, path, &n);
+		if (result) {
+			return result;
+		}
+	}
+
+ done:
+	sfs_ext_putpath(path, n);
+	return 0;
+}
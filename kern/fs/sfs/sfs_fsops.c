@@ -39,114 +39,283 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
-#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
-#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
+#define SFS_FS_FREEMAPBITS(sfs) \
+	SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
+#define SFS_FS_FREEMAPBLOCKS(sfs) \
+	SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads load the whole bitmap; writes only write the blocks marked
+ * in sfs_freemapdirty, so a sync after a few allocations on a large
+ * volume costs a few writes rather than the whole bitmap.
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
- * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
- * "in use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of
+ * bits, one bit for each block on the filesystem. The number of
+ * blocks in the bitmap is thus rounded up to the nearest multiple of
+ * the bits in a block (4096 for 512-byte blocks). (This rounded
+ * number is SFS_FREEMAPBITS.) This means that the bitmap will (in
+ * general) contain space for some number of invalid blocks that are
+ * actually beyond the end of the disk device. This is ok. These
+ * blocks are supposed to be marked "in use" by mksfs and never get
+ * marked "free".
  *
- * The sectors used by the superblock and the bitmap itself are
+ * The blocks used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * Blocks preallocated to files are in use in memory but not on disk,
+ * so when writing they are cleared in a copy of each bitmap block.
+ * If FLUSH is set, each block written is also pushed out of the
+ * buffer cache.
+ *
+ * Caller holds sfs_freemaplock, or is mounting.
  */
 static
 int
-sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw, bool flush)
 {
-	uint32_t j, freemapblocks;
-	char *freemapdata;
-	int result;
+	uint32_t i, j, freemapblocks, blocksize;
+	char *freemapdata, *resvdata = NULL;
+	char *tmp = NULL;
+	int result = 0;
 
 	/* Number of blocks in the free block bitmap. */
 	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+	blocksize = sfs->sfs_blocksize;
 
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	if (rw == UIO_WRITE) {
+		resvdata = bitmap_getdata(sfs->sfs_resvmap);
+	}
 
 	/* For each block in the free block bitmap... */
 	for (j=0; j<freemapblocks; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+		void *ptr = freemapdata + j*blocksize;
 
-		/* and read or write it. The freemap starts at sector 2. */
+		/* and read or write it. The freemap starts at block 2. */
 		if (rw == UIO_READ) {
 			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
+					       blocksize);
 		}
 		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+			if (!bitmap_isset(sfs->sfs_freemapdirty, j)) {
+				continue;
+			}
+			if (tmp == NULL) {
+				tmp = kmalloc(blocksize);
+				if (tmp == NULL) {
+					return ENOMEM;
+				}
+			}
+			memcpy(tmp, ptr, blocksize);
+			for (i=0; i<blocksize; i++) {
+				tmp[i] &= ~resvdata[j*blocksize + i];
+			}
+			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, tmp,
+						blocksize, NULL);
+			if (result == 0 && flush) {
+				result = buffer_flush_block(sfs->sfs_device,
+							SFS_FREEMAP_START+j);
+			}
+			if (result == 0) {
+				bitmap_unmark(sfs->sfs_freemapdirty, j);
+			}
 		}
 
 		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
-	return 0;
+	kfree(tmp);
+	return result;
+}
+
+/*
+ * Routine for doing I/O on the inode bitmap, on volumes with an
+ * inode table. It is laid out like the free block bitmap, one bit
+ * per inode, and likewise only its dirty blocks are written.
+ */
+static
+int
+sfs_inodemapio(struct sfs_fs *sfs, enum uio_rw rw, bool flush)
+{
+	uint32_t j, mapblocks, blocksize;
+	char *mapdata;
+	int result = 0;
+
+	blocksize = sfs->sfs_blocksize;
+	mapblocks = SFS_INODEMAPBLOCKS(sfs->sfs_sb.sb_ninodes, blocksize);
+	mapdata = bitmap_getdata(sfs->sfs_inodemap);
+
+	for (j=0; j<mapblocks; j++) {
+		void *ptr = mapdata + j*blocksize;
+
+		if (rw == UIO_READ) {
+			result = sfs_readblock(sfs, sfs->sfs_sb.sb_inodemap+j,
+					       ptr, blocksize);
+		}
+		else {
+			if (!bitmap_isset(sfs->sfs_inodemapdirty, j)) {
+				continue;
+			}
+			result = sfs_writeblock(sfs, sfs->sfs_sb.sb_inodemap+j,
+						ptr, blocksize, NULL);
+			if (result == 0 && flush) {
+				result = buffer_flush_block(sfs->sfs_device,
+						sfs->sfs_sb.sb_inodemap+j);
+			}
+			if (result == 0) {
+				bitmap_unmark(sfs->sfs_inodemapdirty, j);
+			}
+		}
+		if (result) {
+			break;
+		}
+	}
+	return result;
 }
 
 /*
- * Sync routine for the vnode table.
+ * Check that no bit is set among the first NBITS of a dirty map.
+ */
+static
+bool
+sfs_mapclean(struct bitmap *dirty, uint32_t nbits)
+{
+	uint32_t j;
+
+	for (j=0; j<nbits; j++) {
+		if (bitmap_isset(dirty, j)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Sync routine for the vnode table. This only gets each file's
+ * delayed blocks and inode into the buffer cache; the caller writes
+ * the cache out (or commits) afterwards, once for everything.
+ *
+ * That takes the vnode lock, which comes before sfs_vnlock in the
+ * lock order, so take a reference to each vnode in the table and
+ * then sync them with the table unlocked. Idle vnodes were synced
+ * when they went idle and are skipped.
+ *
+ * If OLDDELAYED is set, this is for the syncer: only files with a
+ * delayed block from before CUTOFF are synced, and their blocks are
+ * written out too. sv_ndelayed and sv_dltime are only peeked at
+ * without the vnode lock; if that's stale, a file is just written
+ * a second late, or for nothing.
  */
 static
 int
-sfs_sync_vnodes(struct sfs_fs *sfs)
+sfs_sync_vnodes(struct sfs_fs *sfs, bool olddelayed, time_t cutoff)
 {
-	unsigned i, num;
+	struct vnode **vns;
+	struct sfs_vnode *sv;
+	unsigned i, num, max;
+
+	lock_acquire(sfs->sfs_vnlock);
+	max = sfs->sfs_nvnodes - sfs->sfs_nidle;
+	if (max == 0) {
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	vns = kmalloc(max * sizeof(vns[0]));
+	if (vns == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	num = 0;
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			if (sv->sv_idle) {
+				continue;
+			}
+			if (olddelayed && (sv->sv_ndelayed == 0 ||
+					   sv->sv_dltime >= cutoff)) {
+				continue;
+			}
+			KASSERT(num < max);
+			vns[num] = &sv->sv_absvn;
+			VOP_INCREF(vns[num]);
+			num++;
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* Go over the loaded vnodes, syncing as we go. */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sv = vns[i]->vn_data;
+		if (sfs_sync_file(sv) == 0 && olddelayed) {
+			buffer_flush_owner(sfs->sfs_device, sv);
+		}
+		VOP_DECREF(vns[i]);
 	}
+	kfree(vns);
 	return 0;
 }
 
 /*
- * Sync routine for the freemap.
+ * Write the changed blocks of the freemap and the inode bitmap,
+ * through to disk if FLUSH is set.
  */
 static
 int
-sfs_sync_freemap(struct sfs_fs *sfs)
+sfs_writemaps(struct sfs_fs *sfs, bool flush)
 {
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
-		if (result) {
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_freemapio(sfs, UIO_WRITE, flush);
+	if (result == 0 && SFS_FS_ITABLE(sfs)) {
+		result = sfs_inodemapio(sfs, UIO_WRITE, flush);
 	}
+	lock_release(sfs->sfs_freemaplock);
 
-	return 0;
+	return result;
+}
+
+/*
+ * Sync routine for the freemap and the inode bitmap. Only the bitmap
+ * blocks that have changed are written. With a journal this is part
+ * of each commit.
+ */
+int
+sfs_sync_freemap(struct sfs_fs *sfs)
+{
+	return sfs_writemaps(sfs, false);
+}
+
+/*
+ * For fsync without a journal: get the bitmaps onto disk, so the
+ * blocks and inode a file has just been given are marked in use
+ * there before its inode is written.
+ */
+int
+sfs_flush_freemap(struct sfs_fs *sfs)
+{
+	return sfs_writemaps(sfs, true);
 }
 
 /*
  * Sync routine for the superblock.
  */
-static
 int
 sfs_sync_superblock(struct sfs_fs *sfs)
 {
@@ -154,7 +323,7 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
-					sizeof(sfs->sfs_sb));
+					sizeof(sfs->sfs_sb), NULL);
 		if (result) {
 			return result;
 		}
@@ -174,8 +343,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -209,30 +376,54 @@ sfs_sync(struct fs *fs)
 	sfs = fs->fs_data;
 
 	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
+	result = sfs_sync_vnodes(sfs, false, 0);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	/* With a journal, committing does the rest of the metadata. */
+	if (sfs->sfs_journal != NULL) {
+		result = sfs_jcommit(sfs);
+		if (result) {
+			return result;
+		}
 	}
+	else {
+		/* If the free block map needs to be written, write it. */
+		result = sfs_sync_freemap(sfs);
+		if (result) {
+			return result;
+		}
 
-	/* If the superblock needs to be written, write it. */
-	result = sfs_sync_superblock(sfs);
+		/* If the superblock needs to be written, write it. */
+		result = sfs_sync_superblock(sfs);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* All of the above only went to the buffer cache; now write it. */
+	result = buffer_flush(sfs->sfs_device);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Writeback routine, called by the syncer: write out files whose
+ * delayed blocks have been waiting since before CUTOFF.
+ */
+static
+int
+sfs_writeback(struct fs *fs, time_t cutoff)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+
+	return sfs_sync_vnodes(sfs, true, cutoff);
+}
+
 /*
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
@@ -243,13 +434,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The superblock doesn't change after mount; no lock needed. */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -259,10 +446,24 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_jdestroy(sfs);
+	sfs_balloc_cleanup(sfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_freemapdirty != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirty);
+	}
+	if (sfs->sfs_inodemap != NULL) {
+		bitmap_destroy(sfs->sfs_inodemap);
+	}
+	if (sfs->sfs_inodemapdirty != NULL) {
+		bitmap_destroy(sfs->sfs_inodemapdirty);
+	}
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,18 +478,47 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount.
+	 *
+	 * Idle vnodes don't count. The VFS layer holds vfs_biglock
+	 * across the unmount, so no new vnode can be loaded once
+	 * we've seen that none are in use.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > sfs->sfs_nidle) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	sfs_flushidle(sfs);
+
+	/* Leave the journal empty. */
+	if (sfs->sfs_journal != NULL) {
+		result = sfs_jstop(sfs);
+		if (result) {
+			return result;
+		}
+	}
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs_mapclean(sfs->sfs_freemapdirty,
+			     SFS_FS_FREEMAPBLOCKS(sfs)));
+	KASSERT(!SFS_FS_ITABLE(sfs) ||
+		sfs_mapclean(sfs->sfs_inodemapdirty,
+			     SFS_INODEMAPBLOCKS(sfs->sfs_sb.sb_ninodes,
+						sfs->sfs_blocksize)));
+
+	/* Make sure nothing is left in the buffer cache. */
+	result = buffer_flush(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	buffer_dropdev(sfs->sfs_device);
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,7 +527,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -306,6 +535,7 @@ sfs_unmount(struct fs *fs)
  */
 static const struct fs_ops sfs_fsops = {
 	.fsop_sync = sfs_sync,
+	.fsop_writeback = sfs_writeback,
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
@@ -321,6 +551,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -350,24 +581,116 @@ sfs_fs_create(void)
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
+	/* block size; the superblock is read with the smallest one */
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
+
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASHSIZE * sizeof(sfs->sfs_vnhash[0]));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnlock;
+	}
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_idlehead = sfs->sfs_idletail = NULL;
+	sfs->sfs_nidle = 0;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnodes;
+	}
 	sfs->sfs_freemap = NULL;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirty = NULL;
+	sfs->sfs_inodemap = NULL;
+	sfs->sfs_inodemapdirty = NULL;
+	sfs->sfs_resvmap = NULL;
+	sfs->sfs_groupfree = NULL;
+	sfs->sfs_ngroups = 0;
+	sfs->sfs_nfree = 0;
+	sfs->sfs_nprealloc = 0;
+	sfs->sfs_ndlresv = 0;
+	sfs->sfs_freedmap = NULL;
+	sfs->sfs_nfreed = 0;
+
+	/* journal */
+	sfs->sfs_journal = NULL;
 
 	return sfs;
 
+cleanup_vnodes:
+	kfree(sfs->sfs_vnhash);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
 	return NULL;
 }
 
+/*
+ * Check the inode table fields of the superblock: the inode bitmap
+ * must come after the freemap, and the table after the bitmap and
+ * within the volume.
+ */
+static
+bool
+sfs_itable_valid(struct sfs_fs *sfs)
+{
+	const struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t blocksize = sfs->sfs_blocksize;
+
+	if (sb->sb_ninodes <= SFS_ROOTDIR_INO ||
+	    sb->sb_ninodes / SFS_INODESPERBLOCK(blocksize) >
+	    SFS_FS_NBLOCKS(sfs)) {
+		return false;
+	}
+	if (sb->sb_inodemap < SFS_FREEMAP_START + SFS_FS_FREEMAPBLOCKS(sfs) ||
+	    sb->sb_inodemap > SFS_FS_NBLOCKS(sfs)) {
+		return false;
+	}
+	if (sb->sb_itable < sb->sb_inodemap +
+	    SFS_INODEMAPBLOCKS(sb->sb_ninodes, blocksize)) {
+		return false;
+	}
+	if (sb->sb_itable > SFS_FS_NBLOCKS(sfs) ||
+	    SFS_ITABLEBLOCKS(sb->sb_ninodes, blocksize) >
+	    SFS_FS_NBLOCKS(sfs) - sb->sb_itable) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Check the journal fields of the superblock: the journal must come
+ * after the freemap and the inode table, if any, and fit in the
+ * volume.
+ */
+static
+bool
+sfs_journal_valid(struct sfs_fs *sfs)
+{
+	const struct sfs_superblock *sb = &sfs->sfs_sb;
+	uint32_t start;
+
+	start = SFS_FREEMAP_START + SFS_FS_FREEMAPBLOCKS(sfs);
+	if (SFS_FS_ITABLE(sfs)) {
+		start = sb->sb_itable +
+			SFS_ITABLEBLOCKS(sb->sb_ninodes, sfs->sfs_blocksize);
+	}
+	if (sb->sb_journal < start || sb->sb_journal > SFS_FS_NBLOCKS(sfs) ||
+	    sb->sb_journalblocks < SFS_JOURNAL_MINBLOCKS ||
+	    sb->sb_journalblocks > SFS_FS_NBLOCKS(sfs) - sb->sb_journal) {
+		return false;
+	}
+	return true;
+}
+
 /*
  * Mount routine.
  *
@@ -387,8 +710,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
-
-	vfs_biglock_acquire();
+	uint32_t blocksize, seq = 0;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -396,13 +718,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/*
 	 * We can't mount on devices with the wrong sector size.
 	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * (A filesystem block may be composed of several hardware
+	 * sectors; see below.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,20 +729,24 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
 	/* Set the device so we can use sfs_readblock() */
 	sfs->sfs_device = dev;
 
+	/*
+	 * Unmount drops the device's buffers, but a failed mount
+	 * might have left the superblock cached.
+	 */
+	buffer_dropdev(dev);
+
 	/* Load superblock */
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,38 +759,141 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
+	if (sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unknown features 0x%x in superblock\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	/*
+	 * Get the block size. The superblock was read as a block of
+	 * the smallest size; if the volume's blocks are larger, drop
+	 * it from the buffer cache, which wants each device used with
+	 * only one buffer size.
+	 */
+	if (sfs->sfs_sb.sb_features & SFS_FEATURE_BLOCKSIZE) {
+		blocksize = sfs->sfs_sb.sb_blocksize;
+		if (blocksize < SFS_BLOCKSIZE ||
+		    blocksize > SFS_MAXBLOCKSIZE ||
+		    (blocksize & (blocksize - 1)) != 0) {
+			kprintf("sfs: Invalid block size %u in superblock\n",
+				blocksize);
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return EINVAL;
+		}
+		buffer_dropdev(dev);
+		sfs->sfs_blocksize = blocksize;
+	}
+
+	if (sfs->sfs_sb.sb_nblocks >
+	    dev->d_blocks / (sfs->sfs_blocksize / SFS_BLOCKSIZE)) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u of %zu\n",
+			sfs->sfs_sb.sb_nblocks, sfs->sfs_blocksize,
+			dev->d_blocks, dev->d_blocksize);
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* The inode bitmap and table must fit between freemap and end */
+	if (SFS_FS_ITABLE(sfs) && !sfs_itable_valid(sfs)) {
+		kprintf("sfs: Invalid inode table in superblock\n");
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	/*
+	 * Replay the journal before reading anything else. It may
+	 * have held the superblock, so read that again afterwards;
+	 * the replayed copy was checked when it was mounted before.
+	 */
+	if (sfs->sfs_sb.sb_features & SFS_FEATURE_JOURNAL) {
+		if (!sfs_journal_valid(sfs)) {
+			kprintf("sfs: Invalid journal in superblock\n");
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return EINVAL;
+		}
+		result = sfs_jreplay(sfs, &seq);
+		if (result == 0) {
+			result = sfs_readblock(sfs, SFS_SUPER_BLOCK,
+					       &sfs->sfs_sb,
+					       sizeof(sfs->sfs_sb));
+		}
+		if (result) {
+			buffer_dropdev(dev);
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return result;
+		}
+		sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
+	sfs->sfs_freemapdirty = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_freemapdirty == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
-	result = sfs_freemapio(sfs, UIO_READ);
+	result = sfs_freemapio(sfs, UIO_READ, false);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
+	result = sfs_balloc_init(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	/* Load the inode bitmap */
+	if (SFS_FS_ITABLE(sfs)) {
+		sfs->sfs_inodemap = bitmap_create(
+			SFS_INODEMAPBLOCKS(sfs->sfs_sb.sb_ninodes,
+					   sfs->sfs_blocksize) *
+			SFS_BITSPERBLOCK(sfs->sfs_blocksize));
+		sfs->sfs_inodemapdirty = bitmap_create(
+			SFS_INODEMAPBLOCKS(sfs->sfs_sb.sb_ninodes,
+					   sfs->sfs_blocksize));
+		if (sfs->sfs_inodemap == NULL ||
+		    sfs->sfs_inodemapdirty == NULL) {
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return ENOMEM;
+		}
+		result = sfs_inodemapio(sfs, UIO_READ, false);
+		if (result) {
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return result;
+		}
+	}
+
+	/* Start journaling */
+	if (sfs->sfs_sb.sb_features & SFS_FEATURE_JOURNAL) {
+		result = sfs_jstart(sfs, seq);
+		if (result) {
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return result;
+		}
+	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,13 +35,56 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
+/*
+ * Return the disk block inode INO is in.
+ */
+daddr_t
+sfs_inode_block(struct sfs_fs *sfs, uint32_t ino)
+{
+	if (!SFS_FS_ITABLE(sfs)) {
+		return ino;
+	}
+	return sfs->sfs_sb.sb_itable +
+		ino / SFS_INODESPERBLOCK(sfs->sfs_blocksize);
+}
+
+/*
+ * Return the byte offset of inode INO within its block.
+ */
+static
+size_t
+sfs_inode_offset(struct sfs_fs *sfs, uint32_t ino)
+{
+	if (!SFS_FS_ITABLE(sfs)) {
+		return 0;
+	}
+	return (ino % SFS_INODESPERBLOCK(sfs->sfs_blocksize)) * SFS_ISIZE;
+}
+
+/*
+ * Return how much of struct sfs_dinode is stored on disk.
+ */
+static
+size_t
+sfs_inode_size(struct sfs_fs *sfs)
+{
+	return SFS_FS_ITABLE(sfs) ? SFS_ISIZE : sizeof(struct sfs_dinode);
+}
+
 /*
  * Write an on-disk inode structure back out to disk.
+ * The caller must hold the vnode's lock.
+ *
+ * The block is not tagged as ours: in the inode table several files
+ * share it, and in any case fsync must write the inode after the
+ * file's other blocks, so it writes it back by block number.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,17 +92,229 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = sfs_writepart(sfs, sfs_inode_block(sfs, sv->sv_ino),
+				       sfs_inode_offset(sfs, sv->sv_ino),
+				       &sv->sv_i, sfs_inode_size(sfs), NULL);
 		if (result) {
 			return result;
 		}
 		sv->sv_dirty = false;
+		sfs_jnote(sv);
 	}
 	return 0;
 }
 
+/*
+ * Get a file's delayed blocks and inode into the buffer cache; the
+ * first half of fsync, and all sync needs before it commits.
+ */
+int
+sfs_sync_file(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_dlflush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Vnode table
+
+/*
+ * Hash an inode number into the vnode table.
+ */
+static
+unsigned
+sfs_vnhashfunc(uint32_t ino)
+{
+	return (ino ^ (ino >> 7)) & (SFS_VNHASHSIZE - 1);
+}
+
+/*
+ * Find a loaded vnode by inode number. Call with sfs_vnlock held.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhashfunc(ino)];
+	     sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a vnode to the table. Call with sfs_vnlock held.
+ */
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	h = sfs_vnhashfunc(sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+/*
+ * Remove a vnode from the table. Call with sfs_vnlock held.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (pp = &sfs->sfs_vnhash[sfs_vnhashfunc(sv->sv_ino)];
+	     *pp != NULL; pp = &(*pp)->sv_hashnext) {
+		if (*pp == sv) {
+			*pp = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			KASSERT(sfs->sfs_nvnodes > 0);
+			sfs->sfs_nvnodes--;
+			return;
+		}
+	}
+	panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+/*
+ * Put a vnode at the tail (most recent end) of the idle list.
+ */
+static
+void
+sfs_idle_append(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_idle);
+
+	sv->sv_idlenext = NULL;
+	sv->sv_idleprev = sfs->sfs_idletail;
+	if (sfs->sfs_idletail != NULL) {
+		sfs->sfs_idletail->sv_idlenext = sv;
+	}
+	else {
+		sfs->sfs_idlehead = sv;
+	}
+	sfs->sfs_idletail = sv;
+	sv->sv_idle = true;
+	sfs->sfs_nidle++;
+}
+
+/*
+ * Take a vnode off the idle list.
+ */
+static
+void
+sfs_idle_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_idle);
+
+	if (sv->sv_idleprev != NULL) {
+		sv->sv_idleprev->sv_idlenext = sv->sv_idlenext;
+	}
+	else {
+		sfs->sfs_idlehead = sv->sv_idlenext;
+	}
+	if (sv->sv_idlenext != NULL) {
+		sv->sv_idlenext->sv_idleprev = sv->sv_idleprev;
+	}
+	else {
+		sfs->sfs_idletail = sv->sv_idleprev;
+	}
+	sv->sv_idleprev = sv->sv_idlenext = NULL;
+	sv->sv_idle = false;
+	KASSERT(sfs->sfs_nidle > 0);
+	sfs->sfs_nidle--;
+}
+
+/*
+ * Free a vnode structure that is no longer in the table.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_idle);
+	KASSERT(sv->sv_ndelayed == 0);
+	if (sv->sv_ibcache != NULL) {
+		kfree(sv->sv_ibcache);
+	}
+	vnode_cleanup(&sv->sv_absvn);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+}
+
+/*
+ * Free a vnode evicted from the idle list. Its dirty buffers name it
+ * as their owner, so fsync on a later vnode for the same file would
+ * skip them: write them out first, and commit any metadata changes
+ * it has in the running transaction. Must not be called in a handle.
+ */
+static
+void
+sfs_vnode_evict(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	int result;
+
+	result = buffer_flush_owner(sfs->sfs_device, sv);
+	if (result == 0 && sfs->sfs_journal != NULL) {
+		result = sfs_jsync(sv);
+	}
+	if (result) {
+		kprintf("sfs: %s: writing back evicted inode %u: %s\n",
+			sfs->sfs_sb.sb_volname, sv->sv_ino, strerror(result));
+	}
+	sfs_vnode_destroy(sv);
+}
+
+/*
+ * Discard all idle vnodes; used at unmount. Idle vnodes were synced
+ * when they went idle and have no users, so they can just be freed.
+ */
+void
+sfs_flushidle(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+
+	lock_acquire(sfs->sfs_vnlock);
+	while ((sv = sfs->sfs_idlehead) != NULL) {
+		sfs_idle_remove(sfs, sv);
+		sfs_vnhash_remove(sfs, sv);
+		sfs_vnode_destroy(sv);
+	}
+	lock_release(sfs->sfs_vnlock);
+}
+
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,34 +325,42 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode *victim = NULL;
+	bool keep;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Nobody is using the file. If it still exists, allocate its
+	 * delayed blocks; then give back its preallocation.
 	 */
-	spinlock_acquire(&v->vn_countlock);
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
-		return EBUSY;
+	if (sv->sv_i.sfi_linkcount > 0) {
+		result = sfs_dlflush(sv);
+		if (result) {
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
+			return result;
+		}
 	}
-	spinlock_release(&v->vn_countlock);
+	sfs_prealloc_discard(sv);
+
+	/*
+	 * Write the inode out before taking the vnode out of the
+	 * table, so that if it is loaded again right afterwards the
+	 * copy on disk is current. Nobody can pick up another
+	 * reference meanwhile except through sfs_loadvnode, which is
+	 * checked for below; and a file with no links cannot be
+	 * found by name, so truncating it early is harmless.
+	 */
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 	}
@@ -105,38 +368,75 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. sfs_loadvnode only takes
+	 * references with sfs_vnlock held, so once we've checked it
+	 * can't be found again.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	/*
+	 * If the file still exists, keep the vnode loaded on the idle
+	 * list; the list takes over the reference VOP_DECREF gave us.
+	 * If that makes too many idle vnodes, drop the oldest.
+	 */
+	keep = sv->sv_i.sfi_linkcount > 0;
+	if (keep) {
+		sfs_idle_append(sfs, sv);
+		if (sfs->sfs_nidle > SFS_MAXIDLEVNODES) {
+			victim = sfs->sfs_idlehead;
+			sfs_idle_remove(sfs, victim);
+			sfs_vnhash_remove(sfs, victim);
 		}
 	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	else {
+		/* Remove the vnode structure from the table. */
+		sfs_vnhash_remove(sfs, sv);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
-	vnode_cleanup(&sv->sv_absvn);
+	lock_release(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
+	if (keep) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		if (victim != NULL) {
+			sfs_vnode_evict(sfs, victim);
+		}
+		return 0;
+	}
+
+	/*
+	 * There are no on-disk references, so discard the inode. This
+	 * must come after the vnode leaves the table, or the inode
+	 * could be reallocated and the stale vnode found for it.
+	 */
+	sfs_ifree(sfs, sv->sv_ino);
+
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_destroy(sv);
 
 	/* Done */
 	return 0;
@@ -150,69 +450,82 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	lock_acquire(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
+	/* Look in the vnode table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
+		/* Every inode in memory must be allocated */
+		if (!sfs_iused(sfs, sv->sv_ino)) {
+			panic("sfs: %s: Found unallocated inode %u\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_idle) {
+			/* Take over the idle list's reference */
+			sfs_idle_remove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
-	/* Must be in an allocated block */
-	if (!sfs_bused(sfs, ino)) {
-		panic("sfs: %s: Tried to load inode %u from "
-		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
+	/* Must be allocated */
+	if (!sfs_iused(sfs, ino)) {
+		panic("sfs: %s: Tried to load unallocated inode %u\n",
+		      sfs->sfs_sb.sb_volname, ino);
 	}
 
-	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
-	if (result) {
-		kfree(sv);
-		return result;
+	/*
+	 * Read the inode. FORCETYPE is set if we're creating a new
+	 * file; then whatever is on disk is left over from a file that
+	 * was deleted (or, without an inode table, zeroed by
+	 * sfs_balloc), and the new inode starts out empty.
+	 */
+	bzero(&sv->sv_i, sizeof(sv->sv_i));
+	if (forcetype == SFS_TYPE_INVAL) {
+		result = sfs_readpart(sfs, sfs_inode_block(sfs, ino),
+				      sfs_inode_offset(sfs, ino),
+				      &sv->sv_i, sfs_inode_size(sfs));
+		if (result) {
+			kfree(sv);
+			lock_release(sfs->sfs_vnlock);
+			return result;
+		}
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
-	/*
-	 * FORCETYPE is set if we're creating a new file, because the
-	 * block on disk will have been zeroed out by sfs_balloc and
-	 * thus the type recorded there will be SFS_TYPE_INVAL.
-	 */
+	/* A new file gets its type, and is written out when synced. */
 	if (forcetype != SFS_TYPE_INVAL) {
-		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		if (sfs->sfs_sb.sb_features & SFS_FEATURE_EXTENTS) {
+			sv->sv_i.sfi_flags |= SFS_IFLAG_EXTENTS;
+		}
+		if ((sfs->sfs_sb.sb_features & SFS_FEATURE_INLINE) &&
+		    (forcetype == SFS_TYPE_FILE ||
+		     SFS_FS_INLINEMAX(sfs) >= sizeof(struct sfs_direntry))) {
+			sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+		}
 		sv->sv_dirty = true;
 	}
 
@@ -232,23 +545,46 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_hashnext = NULL;
+	sv->sv_idleprev = sv->sv_idlenext = NULL;
+	sv->sv_idle = false;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+	sv->sv_prestart = 0;
+	sv->sv_precount = 0;
+	sv->sv_ndelayed = 0;
+	sv->sv_dlresv = 0;
+	sv->sv_dltime = 0;
+	sv->sv_extcache.se_nblocks = 0;
+	sv->sv_ibcache = NULL;
+	sv->sv_ibblock = 0;
+	sv->sv_ibbase = 0;
+	sv->sv_newdir = 0;
+	sv->sv_jtxn = 0;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_insert(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -265,11 +601,10 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	int result;
 
 	/*
-	 * First, get an inode. (Each inode is a block, and the inode
-	 * number is the block number, so just get a block.)
+	 * First, get an inode.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_ialloc(sfs, &ino);
 	if (result) {
 		return result;
 	}
@@ -280,14 +615,14 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 
 	result = sfs_loadvnode(sfs, ino, type, ret);
 	if (result) {
-		sfs_bfree(sfs, ino);
+		sfs_ifree(sfs, ino);
 	}
 	return result;
 }
 
 /*
  * Get vnode for the root of the filesystem.
- * The root vnode is always found in block 1 (SFS_ROOTDIR_INO).
+ * The root vnode is always inode 1 (SFS_ROOTDIR_INO).
  */
 int
 sfs_getroot(struct fs *fs, struct vnode **ret)
@@ -296,25 +631,20 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
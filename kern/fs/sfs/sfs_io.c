@@ -36,8 +36,11 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
+#include <clock.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,89 +49,375 @@
 // Basic block-level I/O routines
 
 /*
+ * All block I/O goes through the buffer cache. sfs_readblock and
+ * sfs_writeblock copy a block in or out of its buffer; the buffer is
+ * written to disk later, when it's evicted, when the syncer gets to
+ * it, or when we sync. LEN may be less than the block size for the
+ * structures that only take up the start of their block (see
+ * kern/sfs.h). sfs_readpart and sfs_writepart do the same for LEN
+ * bytes at byte OFFSET in the block, for inodes in the inode table.
+ * Everything written this way is metadata, and goes in the running
+ * transaction if there is a journal.
+ *
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * except sfs_device and sfs_blocksize.
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read LEN bytes at OFFSET in a block.
+ */
+int
+sfs_readpart(struct sfs_fs *sfs, daddr_t block, size_t offset,
+	     void *data, size_t len)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(offset + len <= sfs->sfs_blocksize);
+
+	result = buffer_read(sfs->sfs_device, block, sfs->sfs_blocksize, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(data, (char *)buffer_map(b) + offset, len);
+	buffer_release(b);
+	return 0;
+}
+
+/*
+ * Write LEN bytes at OFFSET in a block; the rest is left as it was.
+ * OWNER is the file it belongs to, so fsync can find it, or NULL for
+ * the volume's own metadata.
+ */
+int
+sfs_writepart(struct sfs_fs *sfs, daddr_t block, size_t offset,
+	      const void *data, size_t len, struct sfs_vnode *owner)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(offset + len <= sfs->sfs_blocksize);
+
+	if (len == sfs->sfs_blocksize) {
+		result = buffer_get(sfs->sfs_device, block,
+				    sfs->sfs_blocksize, &b);
+	}
+	else {
+		result = buffer_read(sfs->sfs_device, block,
+				     sfs->sfs_blocksize, &b);
+	}
+	if (result) {
+		return result;
+	}
+	memcpy((char *)buffer_map(b) + offset, data, len);
+	sfs_jdirty(sfs, b, block, owner);
+	buffer_release(b);
+	return 0;
+}
+
+/*
+ * Read the first LEN bytes of a block.
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	return sfs_readpart(sfs, block, 0, data, len);
+}
+
+/*
+ * Write the first LEN bytes of a block.
+ */
+int
+sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len,
+	       struct sfs_vnode *owner)
+{
+	return sfs_writepart(sfs, block, 0, data, len, owner);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation (see sfs.h)
+
+/*
+ * Look for FILEBLOCK among SV's delayed blocks. Whether or not it's
+ * there, hand back in *SLOT where it is or would go in the sorted
+ * list.
+ */
+static
+bool
+sfs_dlfind(struct sfs_vnode *sv, uint32_t fileblock, unsigned *slot)
+{
+	unsigned i;
+
+	for (i=0; i<sv->sv_ndelayed; i++) {
+		if (sv->sv_dlblock[i] >= fileblock) {
+			break;
+		}
+	}
+	*slot = i;
+	return i < sv->sv_ndelayed && sv->sv_dlblock[i] == fileblock;
+}
+
+/*
+ * Get the data of block FILEBLOCK of a file if it is a delayed block,
+ * or NULL if it isn't. If CREATE is set and the block has no disk
+ * block either, make it a (zero-filled) delayed block and hand that
+ * back; unless there's no memory for one, in which case the caller
+ * gets NULL and writes the block in place.
  */
 static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_dlget(struct sfs_vnode *sv, uint32_t fileblock, bool create,
+	  char **ret)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct timespec now;
+	daddr_t diskblock;
+	unsigned slot, nblocks;
+	char *data;
 	int result;
-	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	*ret = NULL;
+	if (sv->sv_i.sfi_type != SFS_TYPE_FILE) {
+		return 0;
+	}
+	if (sfs_dlfind(sv, fileblock, &slot)) {
+		*ret = sv->sv_dldata[slot];
+		return 0;
+	}
+	if (!create) {
+		return 0;
+	}
+
+	/* Fail now if the block could never be mapped. */
+	if (!sfs_bmap_inrange(sv, fileblock)) {
+		return EFBIG;
+	}
+
+	/* If it's already on disk, it gets written in place. */
+	result = sfs_bmap(sv, fileblock, false, false, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock != 0) {
+		return 0;
+	}
 
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	/* Flush ours if we have a full set, or too much is dirty. */
+	if (sv->sv_ndelayed == SFS_DELAYBLOCKS ||
+	    (sv->sv_ndelayed > 0 &&
+	     !buffer_delay_room(sfs->sfs_blocksize))) {
+		result = sfs_dlflush(sv);
+		if (result) {
+			return result;
+		}
+		sfs_dlfind(sv, fileblock, &slot);
+	}
+
+	/*
+	 * Reserve the block, and indirect blocks too if it'll take
+	 * ones that nothing else has reserved yet. An extent tree may
+	 * need a block per level when the blocks go in; reserve that
+	 * once per batch.
+	 */
+	nblocks = 1 + sfs_bmap_idneeded(sv, fileblock);
+	if ((sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) &&
+	    sv->sv_ndelayed == 0) {
+		nblocks += sv->sv_i.sfi_extents.ser_depth + 1;
+	}
 
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
+	data = kmalloc(sfs->sfs_blocksize);
+	if (data == NULL) {
 		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
+		 * Give back the memory our delayed blocks are using,
+		 * and have the caller write this one in place.
 		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
+		return sfs_dlflush(sv);
+	}
+	result = sfs_dlreserve(sfs, sv, nblocks);
+	if (result) {
+		kfree(data);
+		return result;
+	}
+	bzero(data, sfs->sfs_blocksize);
+
+	memmove(&sv->sv_dlblock[slot + 1], &sv->sv_dlblock[slot],
+		(sv->sv_ndelayed - slot) * sizeof(sv->sv_dlblock[0]));
+	memmove(&sv->sv_dldata[slot + 1], &sv->sv_dldata[slot],
+		(sv->sv_ndelayed - slot) * sizeof(sv->sv_dldata[0]));
+	sv->sv_dlblock[slot] = fileblock;
+	sv->sv_dldata[slot] = data;
+	if (sv->sv_ndelayed == 0) {
+		gettime(&now);
+		sv->sv_dltime = now.tv_sec;
+	}
+	sv->sv_ndelayed++;
+	buffer_delay_add(sfs->sfs_blocksize);
+
+	*ret = data;
+	return 0;
+}
+
+/*
+ * Allocate disk blocks for all of a file's delayed blocks, in file
+ * order, and move their contents into the buffer cache. If this
+ * fails partway, the blocks not yet written stay delayed.
+ */
+int
+sfs_dlflush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *b;
+	daddr_t diskblock;
+	unsigned i;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (i=0; i<sv->sv_ndelayed; i++) {
+		result = sfs_bmap(sv, sv->sv_dlblock[i], true, true,
+				  &diskblock);
+		if (result) {
+			break;
 		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+		/* File data isn't journaled; skip sfs_writeblock. */
+		result = buffer_get(sfs->sfs_device, diskblock,
+				    sfs->sfs_blocksize, &b);
+		if (result) {
+			break;
 		}
+		memcpy(buffer_map(b), sv->sv_dldata[i], sfs->sfs_blocksize);
+		buffer_mark_dirty(b, sv);
+		buffer_release(b);
+		kfree(sv->sv_dldata[i]);
+	}
+
+	memmove(&sv->sv_dlblock[0], &sv->sv_dlblock[i],
+		(sv->sv_ndelayed - i) * sizeof(sv->sv_dlblock[0]));
+	memmove(&sv->sv_dldata[0], &sv->sv_dldata[i],
+		(sv->sv_ndelayed - i) * sizeof(sv->sv_dldata[0]));
+	sv->sv_ndelayed -= i;
+	buffer_delay_remove(i * sfs->sfs_blocksize);
+
+	if (sv->sv_ndelayed == 0) {
+		sfs_dlunreserve(sfs, sv);
 	}
 	return result;
 }
 
 /*
- * Read a block.
+ * Throw away a file's delayed blocks from FIRST up to END, for
+ * truncate (END is SFS_NOBLOCK) and for punching holes.
+ */
+void
+sfs_dlpunch(struct sfs_vnode *sv, uint32_t first, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned i, j;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (i=j=0; i<sv->sv_ndelayed; i++) {
+		if (sv->sv_dlblock[i] >= first && sv->sv_dlblock[i] < end) {
+			kfree(sv->sv_dldata[i]);
+			continue;
+		}
+		sv->sv_dlblock[j] = sv->sv_dlblock[i];
+		sv->sv_dldata[j] = sv->sv_dldata[i];
+		j++;
+	}
+	buffer_delay_remove((sv->sv_ndelayed - j) * sfs->sfs_blocksize);
+	sv->sv_ndelayed = j;
+
+	if (sv->sv_ndelayed == 0) {
+		sfs_dlunreserve(sfs, sv);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Inline data (see kern/sfs.h)
+
+/*
+ * Do I/O on a file whose contents are in its inode. A write must
+ * fit; the caller spills the file first if it doesn't.
  */
+static
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_inline_io(struct sfs_vnode *sv, struct uio *uio)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	char *data = (char *)sv->sv_i.sfi_waste;
+	off_t size = sv->sv_i.sfi_size;
+	int result;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	if (uio->uio_rw == UIO_READ) {
+		if (uio->uio_offset >= size) {
+			return 0;
+		}
+		return uiomove(data + uio->uio_offset,
+			       size - uio->uio_offset, uio);
+	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	KASSERT(uio->uio_offset + uio->uio_resid <= SFS_FS_INLINEMAX(sfs));
+	result = uiomove(data + uio->uio_offset, uio->uio_resid, uio);
+	if (uio->uio_offset > size) {
+		sv->sv_i.sfi_size = uio->uio_offset;
+	}
+	sv->sv_dirty = true;
+	return result;
 }
 
 /*
- * Write a block.
+ * Move a file's contents out of its inode into a block, because it
+ * is about to grow past what the inode holds. The caller must hold
+ * the vnode's lock.
  */
 int
-sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_inline_spill(struct sfs_vnode *sv)
 {
+	size_t len = sv->sv_i.sfi_size;
 	struct iovec iov;
 	struct uio ku;
+	char *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_INLINE);
+
+	sv->sv_dirty = true;
+	if (len == 0) {
+		sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
+		return 0;
+	}
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	data = kmalloc(len);
+	if (data == NULL) {
+		return ENOMEM;
+	}
+	memcpy(data, sv->sv_i.sfi_waste, len);
+	bzero(sv->sv_i.sfi_waste, len);
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	/* File data goes through the usual path, delayed allocation and all */
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		result = sfs_metaio(sv, 0, data, len, UIO_WRITE);
+	}
+	else {
+		uio_kinit(&iov, &ku, data, len, 0, UIO_WRITE);
+		result = sfs_io(sv, &ku);
+	}
+	if (result) {
+		/* Nothing gets allocated before these can fail. */
+		memcpy(sv->sv_i.sfi_waste, data, len);
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+	}
+	kfree(data);
+	return result;
 }
 
 ////////////////////////////////////////////////////////////
@@ -139,7 +428,7 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
  * we don't clobber the portion of the block we're not intending to
- * write over.
+ * write over. This is done in place in the block's buffer.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,33 +439,32 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *b;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	char *data;
 	int result;
 
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
+
+	/* If the block is (or is to be) delayed, use its data. */
+	result = sfs_dlget(sv, fileblock, doalloc, &data);
+	if (result) {
+		return result;
+	}
+	if (data != NULL) {
+		return uiomove(data + skipstart, len, uio);
+	}
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, false, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -184,64 +472,69 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block's buffer, and perform the requested operation
+	 * into/out of it.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, sfs->sfs_blocksize,
+			     &b);
 	if (result) {
 		return result;
 	}
+	result = uiomove((char *)buffer_map(b) + skipstart, len, uio);
 
-	/*
-	 * If it was a write, write back the modified block.
-	 */
+	/* If it was a write, the buffer is now dirty. */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(b, sv);
 	}
-
-	return 0;
+	buffer_release(b);
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of a single whole block, straight
+ * between the uio and the block's buffer.
  */
 static
 int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *b;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	char *data;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool fresh = false;
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* If the block is (or is to be) delayed, use its data. */
+	result = sfs_dlget(sv, fileblock, doalloc, &data);
+	if (result) {
+		return result;
+	}
+	if (data != NULL) {
+		return uiomove(data, sfs->sfs_blocksize, uio);
+	}
+
+	/*
+	 * Look up the disk block number. If writing, we overwrite the
+	 * whole block, so a new one doesn't need to be zeroed first.
+	 */
+	result = sfs_bmap(sv, fileblock, false, false, &diskblock);
+	if (result == 0 && diskblock == 0 && doalloc) {
+		fresh = true;
+		result = sfs_bmap(sv, fileblock, true, true, &diskblock);
+	}
 	if (result) {
 		return result;
 	}
@@ -254,35 +547,133 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(sfs->sfs_blocksize, uio);
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * There's no need to read in a new block we're about to
+	 * overwrite. An existing one is read, though: if uiomove
+	 * faults partway, what gets written back must be the old
+	 * contents past the fault, not zeros. (For a new block, zeros
+	 * are what we want, since it wasn't zeroed on disk.)
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (fresh) {
+		result = buffer_get(sfs->sfs_device, diskblock,
+				    sfs->sfs_blocksize, &b);
+	}
+	else {
+		result = buffer_read(sfs->sfs_device, diskblock,
+				     sfs->sfs_blocksize, &b);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = uiomove(buffer_map(b), sfs->sfs_blocksize, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		buffer_mark_dirty(b, sv);
+	}
+	buffer_release(b);
+	return result;
+}
 
-	result = sfs_rwblock(sfs, uio);
+/*
+ * Before reading NBLOCKS whole blocks of a file starting at
+ * FILEBLOCK, get the ones that are contiguous on disk into the
+ * buffer cache a run at a time, so sfs_blockio finds them there
+ * instead of going to disk once per block.
+ */
+static
+int
+sfs_readrun(struct sfs_vnode *sv, uint32_t fileblock, uint32_t nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock, runstart = 0;
+	uint32_t i, runlen = 0;
+	int result;
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	for (i=0; i<=nblocks; i++) {
+		diskblock = 0;
+		if (i < nblocks) {
+			result = sfs_bmap(sv, fileblock + i, false, false,
+					  &diskblock);
+			if (result) {
+				return result;
+			}
+			if (runlen > 0 && diskblock == runstart + runlen) {
+				runlen++;
+				continue;
+			}
+		}
+		/* End of a run (or holes, or the end). */
+		if (runlen > 1) {
+			result = buffer_readrun(sfs->sfs_device, runstart,
+						runlen, sfs->sfs_blocksize);
+			if (result) {
+				return result;
+			}
+		}
+		runstart = diskblock;
+		runlen = diskblock != 0 ? 1 : 0;
+	}
+	return 0;
+}
 
-	return result;
+/*
+ * Read-ahead after a successful read of [START, END) of a file. See
+ * sfs.h for the policy.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, limit, nblocks;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (start != 0 && start != sv->sv_ranext) {
+		/* Not sequential. */
+		sv->sv_ranext = end;
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		return;
+	}
+	sv->sv_ranext = end;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MINBLOCKS;
+	}
+	else if (sv->sv_rawindow < SFS_RA_MAXBLOCKS) {
+		sv->sv_rawindow *= 2;
+	}
+
+	/* Start after the last block read, or where we left off. */
+	fileblock = DIVROUNDUP(end, sfs->sfs_blocksize);
+	if (fileblock < sv->sv_raend) {
+		fileblock = sv->sv_raend;
+	}
+	limit = DIVROUNDUP(end, sfs->sfs_blocksize) + sv->sv_rawindow;
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, sfs->sfs_blocksize);
+	if (limit > nblocks) {
+		limit = nblocks;
+	}
+
+	for (; fileblock < limit; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, false, &diskblock);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock,
+					 sfs->sfs_blocksize);
+		}
+	}
+	if (fileblock > sv->sv_raend) {
+		sv->sv_raend = fileblock;
+	}
 }
 
 /*
@@ -291,12 +682,30 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* A file in its inode stays there until a write won't fit. */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <=
+		    SFS_FS_INLINEMAX(sfs)) {
+			return sfs_inline_io(sv, uio);
+		}
+		result = sfs_inline_spill(sv);
+		if (result) {
+			return result;
+		}
+	}
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -322,13 +731,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % sfs->sfs_blocksize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -350,8 +759,15 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	KASSERT(uio->uio_offset % sfs->sfs_blocksize == 0);
+	nblocks = uio->uio_resid / sfs->sfs_blocksize;
+	if (uio->uio_rw == UIO_READ && nblocks > 1) {
+		result = sfs_readrun(sv, uio->uio_offset / sfs->sfs_blocksize,
+				     nblocks);
+		if (result) {
+			goto out;
+		}
+	}
 	for (i=0; i<nblocks; i++) {
 		result = sfs_blockio(sv, uio);
 		if (result) {
@@ -362,7 +778,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -381,6 +797,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If reading and we got somewhere, read ahead */
+	if (uio->uio_rw == UIO_READ && result == 0 &&
+	    uio->uio_resid != origresid) {
+		sfs_readahead(sv, origoffset, uio->uio_offset);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -388,6 +810,192 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Holes
+
+/*
+ * Find the first block of a file from FROM on that holds data (or,
+ * if HOLE, that doesn't), counting delayed blocks as data. *RET is
+ * SFS_NOBLOCK if there is none.
+ */
+static
+int
+sfs_seekblock(struct sfs_vnode *sv, uint32_t from, bool hole, uint32_t *ret)
+{
+	unsigned slot;
+	int result;
+
+	if (!hole) {
+		result = sfs_bmap_seek(sv, from, false, ret);
+		if (result) {
+			return result;
+		}
+		sfs_dlfind(sv, from, &slot);
+		if (slot < sv->sv_ndelayed && sv->sv_dlblock[slot] < *ret) {
+			*ret = sv->sv_dlblock[slot];
+		}
+		return 0;
+	}
+
+	/* There are only a few delayed blocks to step over. */
+	while (1) {
+		result = sfs_bmap_seek(sv, from, true, ret);
+		if (result || *ret == SFS_NOBLOCK ||
+		    !sfs_dlfind(sv, *ret, &slot)) {
+			return result;
+		}
+		from = *ret + 1;
+	}
+}
+
+/*
+ * Find the first offset from POS on that is in data (or, if HOLE, in
+ * a hole), for SEEK_DATA and SEEK_HOLE. This works to block
+ * granularity; the end of the file counts as a hole. POS must be
+ * before the end of the file. The caller must hold the vnode's lock.
+ */
+int
+sfs_seekdata(struct sfs_vnode *sv, off_t pos, bool hole, off_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	off_t size = sv->sv_i.sfi_size;
+	uint32_t block;
+	off_t where;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(pos >= 0 && pos < size);
+
+	/* A file in its inode is all data. */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		*ret = hole ? size : pos;
+		return 0;
+	}
+
+	result = sfs_seekblock(sv, pos / sfs->sfs_blocksize, hole, &block);
+	if (result) {
+		return result;
+	}
+
+	if (block == SFS_NOBLOCK) {
+		where = size;
+	}
+	else {
+		where = (off_t)block * sfs->sfs_blocksize;
+		if (where < pos) {
+			where = pos;
+		}
+		if (where > size) {
+			where = size;
+		}
+	}
+	if (!hole && where == size) {
+		return ENXIO;
+	}
+	*ret = where;
+	return 0;
+}
+
+/*
+ * Write zeros over the bytes from POS up to END, which lie within one
+ * block, unless that block is a hole already.
+ */
+static
+int
+sfs_zeropart(struct sfs_vnode *sv, off_t pos, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock = pos / sfs->sfs_blocksize;
+	daddr_t diskblock;
+	struct iovec iov;
+	struct uio ku;
+	unsigned slot;
+	char *zeros;
+	int result;
+
+	if (pos >= end) {
+		return 0;
+	}
+	KASSERT((end - 1) / sfs->sfs_blocksize == fileblock);
+
+	if (!sfs_dlfind(sv, fileblock, &slot)) {
+		result = sfs_bmap(sv, fileblock, false, false, &diskblock);
+		if (result || diskblock == 0) {
+			return result;
+		}
+	}
+
+	zeros = kmalloc(end - pos);
+	if (zeros == NULL) {
+		return ENOMEM;
+	}
+	bzero(zeros, end - pos);
+	uio_kinit(&iov, &ku, zeros, end - pos, pos, UIO_WRITE);
+	result = sfs_io(sv, &ku);
+	kfree(zeros);
+	return result;
+}
+
+/*
+ * Make the bytes of a file from POS up to END read as zeros, freeing
+ * the whole blocks in between. END must not be past the end of the
+ * file, and the size doesn't change. The caller must hold the vnode's
+ * lock.
+ */
+int
+sfs_zerorange(struct sfs_vnode *sv, off_t pos, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	off_t size = sv->sv_i.sfi_size;
+	uint32_t first, last;
+	off_t headend;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(end <= size);
+
+	if (pos >= end) {
+		return 0;
+	}
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		bzero((char *)sv->sv_i.sfi_waste + pos, end - pos);
+		sv->sv_dirty = true;
+		return 0;
+	}
+
+	/*
+	 * Whole blocks are FIRST up to LAST. A partial last block of
+	 * the file goes whole, since its bytes past the end are not
+	 * part of the file.
+	 */
+	first = DIVROUNDUP(pos, sfs->sfs_blocksize);
+	last = end == size ? DIVROUNDUP(end, sfs->sfs_blocksize) :
+		end / sfs->sfs_blocksize;
+	if (first > last) {
+		return sfs_zeropart(sv, pos, end);
+	}
+
+	/* The last block may be partial; don't write past the end. */
+	headend = (off_t)first * sfs->sfs_blocksize;
+	if (headend > end) {
+		headend = end;
+	}
+	result = sfs_zeropart(sv, pos, headend);
+	if (result) {
+		return result;
+	}
+	if ((off_t)last * sfs->sfs_blocksize < end) {
+		result = sfs_zeropart(sv, (off_t)last * sfs->sfs_blocksize,
+				      end);
+		if (result) {
+			return result;
+		}
+	}
+	return sfs_ipunch(sv, first, last);
+}
+
 ////////////////////////////////////////////////////////////
 // Metadata I/O
 
@@ -411,28 +1019,47 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
+	struct buf *b;
+	char *ptr;
+	size_t max;
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		max = SFS_FS_INLINEMAX(sfs);
+		ptr = (char *)sv->sv_i.sfi_waste + actualpos;
+		if (rw == UIO_READ) {
+			/* Past the end of the inode is past EOF. */
+			bzero(data, len);
+			if (actualpos < max) {
+				memcpy(data, ptr, len < max - actualpos ?
+				       len : max - actualpos);
+			}
+			return 0;
+		}
+		if (actualpos + len <= max) {
+			memcpy(ptr, data, len);
+			if (actualpos + len > sv->sv_i.sfi_size) {
+				sv->sv_i.sfi_size = actualpos + len;
+			}
+			sv->sv_dirty = true;
+			return 0;
+		}
+		result = sfs_inline_spill(sv);
+		if (result) {
+			return result;
+		}
+	}
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
-	vnblock = actualpos / SFS_BLOCKSIZE;
-	blockoffset = actualpos % SFS_BLOCKSIZE;
+	vnblock = actualpos / sfs->sfs_blocksize;
+	blockoffset = actualpos % sfs->sfs_blocksize;
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, false, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -446,26 +1073,24 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block's buffer */
+	result = buffer_read(sfs->sfs_device, diskblock, sfs->sfs_blocksize,
+			     &b);
 	if (result) {
 		return result;
 	}
+	ptr = buffer_map(b);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ptr + blockoffset, len);
+		buffer_release(b);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ptr + blockoffset, data, len);
+		sfs_jdirty(sfs, b, diskblock, sv);
+		buffer_release(b);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
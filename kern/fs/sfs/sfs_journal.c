@@ -0,0 +1,948 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal (SFS_FEATURE_JOURNAL).
+ *
+ * See kern/sfs.h for the on-disk format and sfs.h for how the rest
+ * of SFS uses this. Journal blocks go through the buffer cache like
+ * everything else, tagged with the journal as owner so a commit can
+ * write out just them; since device I/O is synchronous, writing the
+ * commit block only after the rest have been written is enough to
+ * make it the point at which the transaction happens.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <clock.h>
+#include <synch.h>
+#include <vfs.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * In-memory journal state.
+ *
+ * The block and revoke lists belong to the running transaction and
+ * have room for a quarter of the journal each. A transaction that
+ * doesn't fit (J_OVERFLOW) is written in place instead, with a
+ * warning; it is then not atomic.
+ */
+struct sfs_journal {
+	struct lock *j_lock;		/* protects the next five fields */
+	struct cv *j_cv;		/* for handles and commits */
+	unsigned j_handles;		/* handles in progress */
+	bool j_committing;		/* a commit is in progress */
+	unsigned j_commits;		/* commits done (or failed) */
+	int j_result;			/* ...and how the last one went */
+
+	struct lock *j_listlock;	/* protects the next eight fields */
+	unsigned j_txn;			/* count of transactions made safe */
+	daddr_t *j_blocks;		/* blocks in this transaction */
+	unsigned j_nblocks;
+	daddr_t *j_revoked;		/* blocks revoked in it */
+	unsigned j_nrevoked;
+	bool j_overflow;		/* more than fit in the lists */
+	time_t j_start;			/* when it got its first block */
+	struct bitmap *j_logged;	/* blocks in the journal now */
+
+	/* The rest is only used while committing, or at mount. */
+	unsigned j_max;			/* room in j_blocks and j_revoked */
+	unsigned j_txnblocks;		/* commit at this many blocks */
+	uint32_t j_seq;			/* number of the next transaction */
+	uint32_t j_pos;			/* where it goes in the journal */
+	char *j_iobuf;			/* one block */
+};
+
+////////////////////////////////////////////////////////////
+// Journal I/O
+
+/*
+ * Fold a block into a transaction's checksum.
+ */
+static
+void
+sfs_jsum(uint32_t *sum, const void *data, size_t len)
+{
+	const uint32_t *words = data;
+	size_t i;
+
+	for (i=0; i<len / sizeof(uint32_t); i++) {
+		*sum = (*sum ^ words[i]) * 16777619;
+	}
+}
+
+/*
+ * Write a block of the journal, at journal block POS; if SUM isn't
+ * NULL, also fold it into the checksum. This only puts it in the
+ * buffer cache.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs, uint32_t pos, const void *data, uint32_t *sum)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(pos < sfs->sfs_sb.sb_journalblocks);
+
+	result = buffer_get(sfs->sfs_device, sfs->sfs_sb.sb_journal + pos,
+			    sfs->sfs_blocksize, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(b), data, sfs->sfs_blocksize);
+	buffer_mark_dirty(b, sfs->sfs_journal);
+	buffer_release(b);
+
+	if (sum != NULL) {
+		sfs_jsum(sum, data, sfs->sfs_blocksize);
+	}
+	return 0;
+}
+
+/*
+ * Read journal block POS.
+ */
+static
+int
+sfs_jread(struct sfs_fs *sfs, uint32_t pos, void *data)
+{
+	KASSERT(pos < sfs->sfs_sb.sb_journalblocks);
+	return sfs_readblock(sfs, sfs->sfs_sb.sb_journal + pos, data,
+			     sfs->sfs_blocksize);
+}
+
+/*
+ * Write the journal header, saying the next transaction is number
+ * SEQ. Uses BUF as scratch space.
+ */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs, char *buf, uint32_t seq)
+{
+	struct sfs_jheader *sjh = (struct sfs_jheader *)buf;
+
+	bzero(buf, sfs->sfs_blocksize);
+	sjh->sjh_magic = SFS_JOURNAL_MAGIC;
+	sjh->sjh_seq = seq;
+	return sfs_jwrite(sfs, 0, buf, NULL);
+}
+
+////////////////////////////////////////////////////////////
+// Committing
+
+/*
+ * Number of journal blocks the running transaction needs. Block
+ * numbers go in the descriptors first and revoked blocks after, so
+ * every descriptor but the last is full.
+ */
+static
+uint32_t
+sfs_jtxnsize(struct sfs_journal *j)
+{
+	uint32_t ndesc;
+
+	ndesc = DIVROUNDUP(j->j_nblocks + j->j_nrevoked, SFS_JDESC_ENTRIES);
+	if (ndesc == 0) {
+		ndesc = 1;
+	}
+	return ndesc + j->j_nblocks + 1;
+}
+
+/*
+ * Write the running transaction to the journal after the last one.
+ */
+static
+int
+sfs_jwritetxn(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdesc *sjd;
+	struct sfs_jcommit *sjc;
+	uint32_t pos = j->j_pos, sum = 0;
+	unsigned bi = 0, ri = 0, nb, nr, i;
+	int result;
+
+	do {
+		nb = j->j_nblocks - bi;
+		if (nb > SFS_JDESC_ENTRIES) {
+			nb = SFS_JDESC_ENTRIES;
+		}
+		nr = j->j_nrevoked - ri;
+		if (nr > SFS_JDESC_ENTRIES - nb) {
+			nr = SFS_JDESC_ENTRIES - nb;
+		}
+
+		bzero(j->j_iobuf, sfs->sfs_blocksize);
+		sjd = (struct sfs_jdesc *)j->j_iobuf;
+		sjd->sjd_magic = SFS_JDESC_MAGIC;
+		sjd->sjd_seq = j->j_seq;
+		sjd->sjd_nblocks = nb;
+		sjd->sjd_nrevoke = nr;
+		for (i=0; i<nb; i++) {
+			sjd->sjd_entries[i] = j->j_blocks[bi + i];
+		}
+		for (i=0; i<nr; i++) {
+			sjd->sjd_entries[nb + i] = j->j_revoked[ri + i];
+		}
+		result = sfs_jwrite(sfs, pos++, j->j_iobuf, &sum);
+		if (result) {
+			return result;
+		}
+
+		/* The blocks are pinned, so these are cache hits. */
+		for (i=0; i<nb; i++) {
+			result = sfs_readblock(sfs, j->j_blocks[bi + i],
+					       j->j_iobuf, sfs->sfs_blocksize);
+			if (result) {
+				return result;
+			}
+			result = sfs_jwrite(sfs, pos++, j->j_iobuf, &sum);
+			if (result) {
+				return result;
+			}
+		}
+		bi += nb;
+		ri += nr;
+	} while (bi < j->j_nblocks || ri < j->j_nrevoked);
+
+	/* All of that must be on disk before the commit block. */
+	result = buffer_flush_owner(sfs->sfs_device, j);
+	if (result) {
+		return result;
+	}
+
+	bzero(j->j_iobuf, sfs->sfs_blocksize);
+	sjc = (struct sfs_jcommit *)j->j_iobuf;
+	sjc->sjc_magic = SFS_JCOMMIT_MAGIC;
+	sjc->sjc_seq = j->j_seq;
+	sjc->sjc_nblocks = pos - j->j_pos;
+	sjc->sjc_sum = sum;
+	result = sfs_jwrite(sfs, pos++, j->j_iobuf, NULL);
+	if (result) {
+		return result;
+	}
+	result = buffer_flush_owner(sfs->sfs_device, j);
+	if (result) {
+		return result;
+	}
+
+	KASSERT(pos - j->j_pos == sfs_jtxnsize(j));
+	j->j_pos = pos;
+	return 0;
+}
+
+/*
+ * Empty the journal: write everything in place, and then the header,
+ * which makes what is in the journal stale.
+ */
+static
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	result = buffer_flush(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	result = sfs_jwriteheader(sfs, j->j_iobuf, j->j_seq);
+	if (result) {
+		return result;
+	}
+	result = buffer_flush_owner(sfs->sfs_device, j);
+	if (result) {
+		return result;
+	}
+
+	j->j_pos = 1;
+	bzero(bitmap_getdata(j->j_logged),
+	      SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks, sfs->sfs_blocksize) / 8);
+	return 0;
+}
+
+/*
+ * Let go of the running transaction's blocks.
+ */
+static
+void
+sfs_junpinall(struct sfs_fs *sfs, bool logged)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+
+	lock_acquire(j->j_listlock);
+	for (i=0; i<j->j_nblocks; i++) {
+		if (logged && !bitmap_isset(j->j_logged, j->j_blocks[i])) {
+			bitmap_mark(j->j_logged, j->j_blocks[i]);
+		}
+		buffer_unpin(sfs->sfs_device, j->j_blocks[i]);
+	}
+	j->j_nblocks = 0;
+	j->j_nrevoked = 0;
+	j->j_overflow = false;
+	lock_release(j->j_listlock);
+}
+
+/*
+ * The running transaction is on disk, in the journal or in place;
+ * start counting the next one.
+ */
+static
+void
+sfs_jdone(struct sfs_journal *j)
+{
+	lock_acquire(j->j_listlock);
+	j->j_txn++;
+	lock_release(j->j_listlock);
+}
+
+/*
+ * Commit the running transaction. No handles are in progress and
+ * none can start, so we have the lists to ourselves.
+ */
+static
+int
+sfs_jdocommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t jsize = sfs->sfs_sb.sb_journalblocks;
+	int result;
+
+	/* The bitmaps and superblock go in the transaction too. */
+	sfs_bfree_commit(sfs);
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_sync_superblock(sfs);
+	if (result) {
+		return result;
+	}
+
+	if (j->j_nblocks == 0 && j->j_nrevoked == 0 && !j->j_overflow) {
+		return 0;
+	}
+
+	if (j->j_overflow || j->j_pos + sfs_jtxnsize(j) > jsize) {
+		kprintf("sfs: %s: transaction too big for the journal; "
+			"writing it in place\n", sfs->sfs_sb.sb_volname);
+		sfs_junpinall(sfs, false);
+		result = sfs_jcheckpoint(sfs);
+		if (result == 0) {
+			sfs_jdone(j);
+		}
+		return result;
+	}
+
+	result = sfs_jwritetxn(sfs);
+	if (result) {
+		/* Leave it all pinned; maybe the next commit will work. */
+		return result;
+	}
+	sfs_junpinall(sfs, true);
+	sfs_jdone(j);
+	j->j_seq++;
+
+	if (jsize - j->j_pos < jsize / 2) {
+		result = sfs_jcheckpoint(sfs);
+	}
+	return result;
+}
+
+/*
+ * Commit the running transaction, or if a commit is already in
+ * progress, wait for it instead: it includes everything done in
+ * handles that had ended when it started, which is every handle
+ * that has ended now. Must not be called in a handle.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned commits;
+	int result;
+
+	KASSERT(j != NULL);
+
+	lock_acquire(j->j_lock);
+	if (j->j_committing) {
+		commits = j->j_commits;
+		while (j->j_commits == commits) {
+			cv_wait(j->j_cv, j->j_lock);
+		}
+		result = j->j_result;
+		lock_release(j->j_lock);
+		return result;
+	}
+	j->j_committing = true;
+	while (j->j_handles > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+
+	result = sfs_jdocommit(sfs);
+
+	lock_acquire(j->j_lock);
+	j->j_committing = false;
+	j->j_commits++;
+	j->j_result = result;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Handles
+
+/*
+ * Check if the running transaction should be committed.
+ */
+static
+bool
+sfs_jdue(struct sfs_journal *j)
+{
+	struct timespec now;
+	bool due;
+
+	lock_acquire(j->j_listlock);
+	due = j->j_overflow || j->j_nblocks >= j->j_txnblocks;
+	if (!due && j->j_nblocks > 0) {
+		gettime(&now);
+		due = now.tv_sec - j->j_start >= SFS_JCOMMITSECS;
+	}
+	lock_release(j->j_listlock);
+	return due;
+}
+
+/*
+ * Start a handle. Does nothing without a journal.
+ */
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool tried = false;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_committing || (!tried && sfs_jdue(j))) {
+		if (j->j_committing) {
+			cv_wait(j->j_cv, j->j_lock);
+			continue;
+		}
+		tried = true;
+		lock_release(j->j_lock);
+		/* If this fails, the next sync will say so. */
+		(void)sfs_jcommit(sfs);
+		lock_acquire(j->j_lock);
+	}
+	j->j_handles++;
+	lock_release(j->j_lock);
+}
+
+/*
+ * End a handle.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_handles > 0);
+	j->j_handles--;
+	if (j->j_handles == 0 && j->j_committing) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Mark a held buffer dirty after changing metadata in it, and add
+ * it to the running transaction. BLOCK is its block number.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, struct buf *b, daddr_t block,
+	   struct sfs_vnode *owner)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct timespec now;
+
+	buffer_mark_dirty(b, owner);
+	if (j == NULL) {
+		return;
+	}
+	if (owner != NULL) {
+		sfs_jnote(owner);
+	}
+	if (buffer_pinned(b)) {
+		return;
+	}
+	KASSERT(j->j_handles > 0 || j->j_committing);
+
+	lock_acquire(j->j_listlock);
+	if (j->j_nblocks < j->j_max) {
+		buffer_pin(b);
+		if (j->j_nblocks == 0) {
+			gettime(&now);
+			j->j_start = now.tv_sec;
+		}
+		j->j_blocks[j->j_nblocks++] = block;
+	}
+	else {
+		j->j_overflow = true;
+	}
+	lock_release(j->j_listlock);
+}
+
+/*
+ * A block is being freed: drop it from the running transaction, and
+ * if it is in the journal, revoke it.
+ */
+void
+sfs_jforget(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_listlock);
+	for (i=0; i<j->j_nblocks; i++) {
+		if (j->j_blocks[i] == block) {
+			j->j_blocks[i] = j->j_blocks[--j->j_nblocks];
+			buffer_unpin(sfs->sfs_device, block);
+			break;
+		}
+	}
+	if (bitmap_isset(j->j_logged, block)) {
+		if (j->j_nrevoked < j->j_max) {
+			j->j_revoked[j->j_nrevoked++] = block;
+		}
+		else {
+			j->j_overflow = true;
+		}
+	}
+	lock_release(j->j_listlock);
+}
+
+/*
+ * With a journal, write a changed inode through to its buffer so it
+ * goes in the same transaction as the rest of the operation. Call at
+ * the end of a handle with the vnode locked.
+ */
+int
+sfs_jinode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sfs->sfs_journal == NULL) {
+		return 0;
+	}
+	return sfs_sync_inode(sv);
+}
+
+/*
+ * Note that a file's metadata has been changed in the running
+ * transaction. Call with the vnode locked.
+ */
+void
+sfs_jnote(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(j->j_listlock);
+	sv->sv_jtxn = j->j_txn + 1;
+	lock_release(j->j_listlock);
+}
+
+/*
+ * For fsync: commit the running transaction if the file has changed
+ * metadata in it; otherwise its metadata is already safe. Must not
+ * be called in a handle.
+ */
+int
+sfs_jsync(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned txn;
+	bool safe;
+
+	lock_acquire(sv->sv_lock);
+	txn = sv->sv_jtxn;
+	lock_release(sv->sv_lock);
+
+	lock_acquire(j->j_listlock);
+	safe = txn <= j->j_txn;
+	lock_release(j->j_listlock);
+
+	if (safe) {
+		return 0;
+	}
+	return sfs_jcommit(sfs);
+}
+
+////////////////////////////////////////////////////////////
+// Replay
+
+/*
+ * Check for a complete transaction numbered SEQ at journal block
+ * POS. If there is one, set *END to the block after it; otherwise
+ * to 0. BUF is scratch space.
+ */
+static
+int
+sfs_jscan(struct sfs_fs *sfs, char *buf, uint32_t pos, uint32_t seq,
+	  uint32_t *end)
+{
+	uint32_t jsize = sfs->sfs_sb.sb_journalblocks;
+	struct sfs_jdesc *sjd = (struct sfs_jdesc *)buf;
+	struct sfs_jcommit *sjc = (struct sfs_jcommit *)buf;
+	uint32_t start = pos, sum = 0, nb, i;
+	int result;
+
+	*end = 0;
+	while (pos < jsize) {
+		result = sfs_jread(sfs, pos, buf);
+		if (result) {
+			return result;
+		}
+		if (sjd->sjd_magic == SFS_JCOMMIT_MAGIC) {
+			if (pos > start && sjc->sjc_seq == seq &&
+			    sjc->sjc_nblocks == pos - start &&
+			    sjc->sjc_sum == sum) {
+				*end = pos + 1;
+			}
+			return 0;
+		}
+		if (sjd->sjd_magic != SFS_JDESC_MAGIC || sjd->sjd_seq != seq ||
+		    sjd->sjd_nblocks > SFS_JDESC_ENTRIES ||
+		    sjd->sjd_nrevoke > SFS_JDESC_ENTRIES - sjd->sjd_nblocks) {
+			return 0;
+		}
+		nb = sjd->sjd_nblocks;
+		for (i=0; i<nb + sjd->sjd_nrevoke; i++) {
+			if (sjd->sjd_entries[i] >= sfs->sfs_sb.sb_nblocks) {
+				return 0;
+			}
+		}
+		sfs_jsum(&sum, buf, sfs->sfs_blocksize);
+		pos++;
+
+		for (i=0; i<nb && pos < jsize; i++) {
+			result = sfs_jread(sfs, pos, buf);
+			if (result) {
+				return result;
+			}
+			sfs_jsum(&sum, buf, sfs->sfs_blocksize);
+			pos++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the blocks of the transaction at journal block POS in place,
+ * except those marked in DONE; then mark them, and the blocks it
+ * revokes, in DONE.
+ */
+static
+int
+sfs_jredo(struct sfs_fs *sfs, char *desc, char *buf, uint32_t pos,
+	  struct bitmap *done)
+{
+	struct sfs_jdesc *sjd = (struct sfs_jdesc *)desc;
+	daddr_t block;
+	uint32_t i;
+	int result;
+
+	while (1) {
+		result = sfs_jread(sfs, pos, desc);
+		if (result) {
+			return result;
+		}
+		if (sjd->sjd_magic == SFS_JCOMMIT_MAGIC) {
+			return 0;
+		}
+		pos++;
+		for (i=0; i<sjd->sjd_nblocks; i++) {
+			block = sjd->sjd_entries[i];
+			if (bitmap_isset(done, block)) {
+				continue;
+			}
+			result = sfs_jread(sfs, pos + i, buf);
+			if (result) {
+				return result;
+			}
+			result = sfs_writeblock(sfs, block, buf,
+						sfs->sfs_blocksize, NULL);
+			if (result) {
+				return result;
+			}
+			bitmap_mark(done, block);
+		}
+		pos += sjd->sjd_nblocks;
+		for (i=0; i<sjd->sjd_nrevoke; i++) {
+			block = sjd->sjd_entries[sjd->sjd_nblocks + i];
+			if (!bitmap_isset(done, block)) {
+				bitmap_mark(done, block);
+			}
+		}
+	}
+}
+
+/*
+ * Replay the journal at mount, before anything else is read from the
+ * volume but the superblock. Finds the complete transactions, then
+ * goes through them newest first, so the last copy of each block is
+ * the one written and a block revoked in a transaction is skipped in
+ * the ones before it. Hands back the number of the next transaction.
+ */
+int
+sfs_jreplay(struct sfs_fs *sfs, uint32_t *seq)
+{
+	uint32_t jsize = sfs->sfs_sb.sb_journalblocks;
+	struct sfs_jheader *sjh;
+	struct bitmap *done = NULL;
+	uint32_t *starts = NULL;
+	char *buf, *desc = NULL;
+	uint32_t pos, end, ntx;
+	int result;
+
+	KASSERT(sfs->sfs_journal == NULL);
+
+	buf = kmalloc(sfs->sfs_blocksize);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = sfs_jread(sfs, 0, buf);
+	if (result) {
+		goto out;
+	}
+	sjh = (struct sfs_jheader *)buf;
+	if (sjh->sjh_magic != SFS_JOURNAL_MAGIC) {
+		kprintf("sfs: %s: Bad journal header\n",
+			sfs->sfs_sb.sb_volname);
+		result = EINVAL;
+		goto out;
+	}
+	*seq = sjh->sjh_seq;
+
+	/* Each transaction takes at least two blocks. */
+	starts = kmalloc((jsize / 2) * sizeof(starts[0]));
+	if (starts == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+	ntx = 0;
+	pos = 1;
+	while (1) {
+		result = sfs_jscan(sfs, buf, pos, *seq + ntx, &end);
+		if (result) {
+			goto out;
+		}
+		if (end == 0) {
+			break;
+		}
+		KASSERT(ntx < jsize / 2);
+		starts[ntx++] = pos;
+		pos = end;
+	}
+	if (ntx == 0) {
+		goto out;
+	}
+
+	desc = kmalloc(sfs->sfs_blocksize);
+	done = bitmap_create(SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks,
+					     sfs->sfs_blocksize));
+	if (desc == NULL || done == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+	for (pos = ntx; pos-- > 0; ) {
+		result = sfs_jredo(sfs, desc, buf, starts[pos], done);
+		if (result) {
+			goto out;
+		}
+	}
+	result = buffer_flush(sfs->sfs_device);
+	if (result) {
+		goto out;
+	}
+
+	/* Now they're in place; don't replay them again. */
+	*seq += ntx;
+	result = sfs_jwriteheader(sfs, buf, *seq);
+	if (result) {
+		goto out;
+	}
+	result = buffer_flush(sfs->sfs_device);
+	if (result) {
+		goto out;
+	}
+	kprintf("sfs: %s: Replayed %u journal transaction%s\n",
+		sfs->sfs_sb.sb_volname, ntx, ntx == 1 ? "" : "s");
+
+ out:
+	if (done != NULL) {
+		bitmap_destroy(done);
+	}
+	kfree(desc);
+	kfree(starts);
+	kfree(buf);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Setup and shutdown
+
+/*
+ * Set up the journal at mount, after sfs_jreplay; the next
+ * transaction is number SEQ.
+ */
+int
+sfs_jstart(struct sfs_fs *sfs, uint32_t seq)
+{
+	uint32_t jsize = sfs->sfs_sb.sb_journalblocks;
+	struct sfs_journal *j;
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	j->j_handles = 0;
+	j->j_committing = false;
+	j->j_commits = 0;
+	j->j_result = 0;
+	j->j_txn = 0;
+	j->j_nblocks = 0;
+	j->j_nrevoked = 0;
+	j->j_overflow = false;
+	j->j_start = 0;
+	j->j_max = jsize / 4;
+	j->j_txnblocks = SFS_JTXNBYTES / sfs->sfs_blocksize;
+	if (j->j_txnblocks > jsize / 8) {
+		j->j_txnblocks = jsize / 8;
+	}
+	if (j->j_txnblocks == 0) {
+		j->j_txnblocks = 1;
+	}
+	j->j_seq = seq;
+	j->j_pos = 1;
+
+	j->j_lock = lock_create("sfs_journal");
+	j->j_cv = cv_create("sfs_journal");
+	j->j_listlock = lock_create("sfs_jlist");
+	j->j_blocks = kmalloc(j->j_max * sizeof(j->j_blocks[0]));
+	j->j_revoked = kmalloc(j->j_max * sizeof(j->j_revoked[0]));
+	j->j_logged = bitmap_create(SFS_FREEMAPBITS(sfs->sfs_sb.sb_nblocks,
+						    sfs->sfs_blocksize));
+	j->j_iobuf = kmalloc(sfs->sfs_blocksize);
+	sfs->sfs_journal = j;
+
+	if (j->j_lock == NULL || j->j_cv == NULL || j->j_listlock == NULL ||
+	    j->j_blocks == NULL || j->j_revoked == NULL ||
+	    j->j_logged == NULL || j->j_iobuf == NULL) {
+		sfs_jdestroy(sfs);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * At unmount: commit whatever is left and empty the journal, so the
+ * volume needs no replay.
+ */
+int
+sfs_jstop(struct sfs_fs *sfs)
+{
+	int result;
+
+	result = sfs_jcommit(sfs);
+	if (result) {
+		return result;
+	}
+	return sfs_jcheckpoint(sfs);
+}
+
+/*
+ * Free the journal state.
+ */
+void
+sfs_jdestroy(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_handles == 0);
+	KASSERT(j->j_nblocks == 0);
+	kfree(j->j_iobuf);
+	if (j->j_logged != NULL) {
+		bitmap_destroy(j->j_logged);
+	}
+	kfree(j->j_revoked);
+	kfree(j->j_blocks);
+	if (j->j_listlock != NULL) {
+		lock_destroy(j->j_listlock);
+	}
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	kfree(j);
+	sfs->sfs_journal = NULL;
+}
@@ -35,10 +35,13 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/seek.h>
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -102,28 +105,47 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_io() does the work. With a journal, a big
+ * write is done SFS_JWRITEBYTES at a time, each in its own handle,
+ * so that one transaction doesn't have to hold all its metadata.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t resid, chunk;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	while (result == 0 && uio->uio_resid > 0) {
+		resid = uio->uio_resid;
+		chunk = resid;
+		if (sfs->sfs_journal != NULL && chunk > SFS_JWRITEBYTES) {
+			chunk = SFS_JWRITEBYTES;
+		}
+
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		uio->uio_resid = chunk;
+		result = sfs_io(sv, uio);
+		uio->uio_resid += resid - chunk;
+		if (result == 0) {
+			result = sfs_jinode(sv);
+		}
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+	}
 
 	return result;
 }
@@ -154,6 +176,7 @@ int
 sfs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	/* Fill in the stat structure */
@@ -164,12 +187,17 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
 
+	/* I/O in whole blocks is the most efficient */
+	statbuf->st_blksize = sfs->sfs_blocksize;
+
 	/* Fill in other fields as desired/possible... */
 
 	return 0;
@@ -177,6 +205,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type never changes once the vnode is loaded, so this doesn't
+ * need the vnode lock.
  */
 static
 int
@@ -185,16 +216,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -214,21 +241,91 @@ sfs_isseekable(struct vnode *v)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Write a file out, in dependency order: data and indirect blocks,
+ * then the bitmaps, then the inode, and then unless DATASYNC is set
+ * the directory a new file was created in. The inode is written back
+ * by block number; it isn't tagged as the file's, so the first flush
+ * doesn't send it out ahead of the blocks it points to. With a
+ * journal, the commit takes care of all the metadata at once.
  */
 static
 int
-sfs_fsync(struct vnode *v)
+sfs_dofsync(struct sfs_vnode *sv, bool datasync)
 {
-	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_vnode *dir;
+	uint32_t dirino;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	result = sfs_sync_file(sv);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	/* Push our data and indirect blocks out of the buffer cache. */
+	result = buffer_flush_owner(sfs->sfs_device, sv);
+	if (result) {
+		return result;
+	}
+
+	/* A new file's directory entry is in the same transaction. */
+	if (sfs->sfs_journal != NULL) {
+		return sfs_jsync(sv);
+	}
+
+	result = sfs_flush_freemap(sfs);
+	if (result) {
+		return result;
+	}
+	result = buffer_flush_block(sfs->sfs_device,
+				    sfs_inode_block(sfs, sv->sv_ino));
+	if (result || datasync) {
+		return result;
+	}
+
+	lock_acquire(sv->sv_lock);
+	dirino = sv->sv_newdir;
+	lock_release(sv->sv_lock);
+	if (dirino == 0) {
+		return 0;
+	}
+
+	result = sfs_loadvnode(sfs, dirino, SFS_TYPE_INVAL, &dir);
+	if (result) {
+		return result;
+	}
+	result = sfs_dofsync(dir, true);
+	VOP_DECREF(&dir->sv_absvn);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sv->sv_lock);
+	if (sv->sv_newdir == dirino) {
+		sv->sv_newdir = 0;
+	}
+	lock_release(sv->sv_lock);
+	return 0;
+}
+
+/*
+ * Called for fsync().
+ */
+static
+int
+sfs_fsync(struct vnode *v)
+{
+	return sfs_dofsync(v->vn_data, false);
+}
+
+/*
+ * Called for fdatasync().
+ */
+static
+int
+sfs_fdatasync(struct vnode *v)
+{
+	return sfs_dofsync(v->vn_data, true);
 }
 
 /*
@@ -250,8 +347,79 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
 
-	return sfs_itrunc(sv, len);
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	if (result == 0) {
+		result = sfs_jinode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
+}
+
+/*
+ * Find the next data or hole at or after POS, for SEEK_DATA and
+ * SEEK_HOLE.
+ */
+static
+int
+sfs_seekhole(struct vnode *v, off_t pos, int whence, off_t *result)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int err;
+
+	if ((whence != SEEK_DATA && whence != SEEK_HOLE) || pos < 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
+	if (pos >= sv->sv_i.sfi_size) {
+		err = ENXIO;
+	}
+	else {
+		err = sfs_seekdata(sv, pos, whence == SEEK_HOLE, result);
+	}
+	lock_release(sv->sv_lock);
+
+	return err;
+}
+
+/*
+ * Punch a hole of LEN bytes at POS. Nothing past the end of the file
+ * needs punching.
+ */
+static
+int
+sfs_punch(struct vnode *v, off_t pos, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	off_t end;
+	int result;
+
+	if (pos < 0 || len < 0) {
+		return EINVAL;
+	}
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	end = sv->sv_i.sfi_size;
+	if (len < end - pos) {
+		end = pos + len;
+	}
+	result = sfs_zerorange(sv, pos, end);
+	if (result == 0) {
+		result = sfs_jinode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
 }
 
 /*
@@ -289,18 +457,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
@@ -308,18 +479,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -329,20 +503,32 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
+	newguy->sv_newdir = sv->sv_ino;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	result = sfs_jinode(newguy);
+	lock_release(newguy->sv_lock);
+	if (result == 0) {
+		result = sfs_jinode(sv);
+	}
 
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	if (result) {
+		VOP_DECREF(&newguy->sv_absvn);
+		return result;
+	}
 	*ret = &newguy->sv_absvn;
-
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -357,31 +543,40 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	result = sfs_jinode(f);
+	lock_release(f->sv_lock);
+	if (result == 0) {
+		result = sfs_jinode(sv);
+	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	return result;
 }
 
 /*
@@ -392,16 +587,19 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -409,15 +607,23 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		result = sfs_jinode(victim);
+		lock_release(victim->sv_lock);
+	}
+	if (result==0) {
+		result = sfs_jinode(sv);
 	}
 
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -438,21 +644,25 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	lock_acquire(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -470,6 +680,12 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
 
+	/* Adding n2 may have moved n1 if the directory is indexed */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
+
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
 	if (result) {
@@ -484,11 +700,19 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	result = sfs_jinode(g1);
+	if (result == 0) {
+		result = sfs_jinode(sv);
+	}
+
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 
  puke_harder:
 	/*
@@ -505,9 +729,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -525,15 +751,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +763,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -559,22 +780,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -599,8 +817,11 @@ const struct vnode_ops sfs_fileops = {
 	.vop_gettype = sfs_gettype,
 	.vop_isseekable = sfs_isseekable,
 	.vop_fsync = sfs_fsync,
+	.vop_fdatasync = sfs_fdatasync,
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
+	.vop_seekhole = sfs_seekhole,
+	.vop_punch = sfs_punch,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
@@ -633,8 +854,11 @@ const struct vnode_ops sfs_dirops = {
 	.vop_gettype = sfs_gettype,
 	.vop_isseekable = sfs_isseekable,
 	.vop_fsync = sfs_fsync,
+	.vop_fdatasync = sfs_fdatasync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
+	.vop_punch = vopfail_punch_isdir,
 	.vop_namefile = sfs_namefile,
 
 	.vop_creat = sfs_creat,
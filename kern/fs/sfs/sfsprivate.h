@@ -32,25 +32,51 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf;
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
-/* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+/* Shortcuts for the size macros in kern/sfs.h */
+#define SFS_FS_DBPERIDB(sfs)    SFS_DBPERIDB((sfs)->sfs_blocksize)
+#define SFS_FS_DIRENTRIESPERBLOCK(sfs) \
+	SFS_DIRENTRIESPERBLOCK((sfs)->sfs_blocksize)
+#define SFS_FS_ITABLE(sfs) \
+	(((sfs)->sfs_sb.sb_features & SFS_FEATURE_ITABLE) != 0)
+#define SFS_FS_INLINEMAX(sfs) \
+	SFS_INLINE_MAX(SFS_FS_ITABLE(sfs) ? SFS_ISIZE : \
+		       sizeof(struct sfs_dinode))
+
+/* A file block past any file: "to the end" in ranges, "none" in searches */
+#define SFS_NOBLOCK 0xffffffff
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, struct sfs_vnode *sv, daddr_t goal,
+	       bool clear, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_ialloc(struct sfs_fs *sfs, uint32_t *ino);
+void sfs_ifree(struct sfs_fs *sfs, uint32_t ino);
+int sfs_iused(struct sfs_fs *sfs, uint32_t ino);
+void sfs_bfree_commit(struct sfs_fs *sfs);
+void sfs_prealloc_discard(struct sfs_vnode *sv);
+int sfs_dlreserve(struct sfs_fs *sfs, struct sfs_vnode *sv, unsigned nblocks);
+void sfs_dlunreserve(struct sfs_fs *sfs, struct sfs_vnode *sv);
+int sfs_balloc_init(struct sfs_fs *sfs);
+void sfs_balloc_cleanup(struct sfs_fs *sfs);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock);
+		bool fill, daddr_t *diskblock);
+bool sfs_bmap_inrange(struct sfs_vnode *sv, uint32_t fileblock);
+unsigned sfs_bmap_idneeded(struct sfs_vnode *sv, uint32_t fileblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+int sfs_ipunch(struct sfs_vnode *sv, uint32_t first, uint32_t end);
+int sfs_bmap_seek(struct sfs_vnode *sv, uint32_t fileblock, bool hole,
+		uint32_t *ret);
 
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -62,20 +88,61 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_extent.c */
+int sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		bool fill, daddr_t *diskblock);
+int sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen);
+int sfs_ext_punch(struct sfs_vnode *sv, uint32_t first, uint32_t end);
+int sfs_ext_seek(struct sfs_vnode *sv, uint32_t fileblock, bool hole,
+		uint32_t *ret);
+
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+int sfs_flush_freemap(struct sfs_fs *sfs);
+int sfs_sync_superblock(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+void sfs_flushidle(struct sfs_fs *sfs);
 int sfs_sync_inode(struct sfs_vnode *sv);
+int sfs_sync_file(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
+daddr_t sfs_inode_block(struct sfs_fs *sfs, uint32_t ino);
+
+/* Functions in sfs_journal.c */
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+void sfs_jdirty(struct sfs_fs *sfs, struct buf *b, daddr_t block,
+		struct sfs_vnode *owner);
+void sfs_jforget(struct sfs_fs *sfs, daddr_t block);
+int sfs_jinode(struct sfs_vnode *sv);
+void sfs_jnote(struct sfs_vnode *sv);
+int sfs_jsync(struct sfs_vnode *sv);
+int sfs_jreplay(struct sfs_fs *sfs, uint32_t *seq);
+int sfs_jstart(struct sfs_fs *sfs, uint32_t seq);
+int sfs_jstop(struct sfs_fs *sfs);
+void sfs_jdestroy(struct sfs_fs *sfs);
 
 /* Functions in sfs_io.c */
+int sfs_readpart(struct sfs_fs *sfs, daddr_t block, size_t offset,
+		 void *data, size_t len);
+int sfs_writepart(struct sfs_fs *sfs, daddr_t block, size_t offset,
+		  const void *data, size_t len, struct sfs_vnode *owner);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
-int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len,
+		   struct sfs_vnode *owner);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_dlflush(struct sfs_vnode *sv);
+void sfs_dlpunch(struct sfs_vnode *sv, uint32_t first, uint32_t end);
+int sfs_seekdata(struct sfs_vnode *sv, off_t pos, bool hole, off_t *ret);
+int sfs_zerorange(struct sfs_vnode *sv, off_t pos, off_t end);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
+int sfs_inline_spill(struct sfs_vnode *sv);
 
 
 #endif /* _SFSPRIVATE_H_ */
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Caches disk blocks, keyed by (device, block number), for file
+ * systems. A buffer handed out by buffer_read or buffer_get is held
+ * ("busy") by the caller until buffer_release; while it is held
+ * nobody else can get at it and it cannot be evicted. Modified
+ * buffers are marked dirty and written back later: when they are
+ * evicted, when the file system calls buffer_flush, or by the
+ * syncer thread once they have been dirty for a few seconds or too
+ * much memory is dirty. Writers that dirty buffers faster than they
+ * can be written are made to wait in buffer_release.
+ *
+ * A dirty buffer can be pinned, which keeps it from being written
+ * back (or evicted) at all until it is unpinned; a file system with a
+ * journal pins the blocks of a transaction until the transaction is
+ * in the journal.
+ *
+ * A file system may also hold dirty file data outside the cache for
+ * a while, as SFS does for delayed allocation. It reports how much
+ * with buffer_delay_add and buffer_delay_remove, and that counts
+ * against the memory budget and the dirty limits like dirty buffers
+ * do. The syncer has file systems write such data out through
+ * FSOP_WRITEBACK once it is as old as a dirty buffer may get, or
+ * when too much memory is dirty.
+ *
+ * Block number BLOCK of a device is at byte offset BLOCK * SIZE, so
+ * each device should always be used with the same buffer size.
+ *
+ * Functions:
+ *    buffer_bootstrap - Set up the cache and start the syncer; called
+ *                       by vfs_bootstrap.
+ *    buffer_read      - Get a held buffer for a block, reading it in
+ *                       from the device if it isn't cached.
+ *    buffer_get       - Get a held buffer for a block whose contents
+ *                       are about to be overwritten. If the block
+ *                       isn't cached it is not read; the buffer
+ *                       comes back zeroed instead.
+ *    buffer_readrun   - Make sure a range of consecutive blocks is in
+ *                       the cache, reading the ones that aren't in as
+ *                       few device I/Os as possible.
+ *    buffer_readahead - Start reading a block into the cache in the
+ *                       background, without waiting for it. Only a
+ *                       hint; it may do nothing.
+ *    buffer_map       - Return the data of a held buffer.
+ *    buffer_mark_dirty - Note that a held buffer has been modified
+ *                       on behalf of OWNER, which is only a tag (the
+ *                       file system uses its vnode, or NULL).
+ *    buffer_release   - Let go of a held buffer.
+ *    buffer_pin       - Keep a held, dirty buffer from being written
+ *                       back until buffer_unpin.
+ *    buffer_pinned    - Check if a held buffer is pinned.
+ *    buffer_unpin     - Let a pinned block of DEV be written back
+ *                       again. Needn't be held.
+ *    buffer_flush     - Write back all dirty buffers for DEV that
+ *                       aren't pinned.
+ *    buffer_flush_owner - Write back the dirty buffers for DEV that
+ *                       were last dirtied by OWNER; for fsync.
+ *    buffer_flush_block - Write back one block of DEV if it is cached
+ *                       and dirty; for blocks shared between files.
+ *    buffer_invalidate - Discard the cached copy of a block, dirty or
+ *                       not; for blocks that are being freed.
+ *    buffer_dropdev   - Discard all buffers for DEV, dirty or not;
+ *                       for unmount, after buffer_flush.
+ *    buffer_delay_add - Count SIZE bytes of dirty data held outside
+ *                       the cache.
+ *    buffer_delay_remove - Stop counting SIZE bytes of it, once it has
+ *                       been put in the cache or thrown away.
+ *    buffer_delay_room - Check whether SIZE more bytes of it would
+ *                       stay under the dirty limit. If not, the file
+ *                       system should put what it has in the cache
+ *                       first.
+ *    buffer_setmaxbytes - Set the cache's memory budget.
+ *    buffer_printstats - Print hit/miss/eviction/read-ahead counts.
+ *
+ * A thread should hold at most one buffer at a time, and should not
+ * call buffer_invalidate, buffer_flush, or buffer_dropdev while
+ * holding one.
+ */
+
+struct buf;		/* Opaque */
+struct device;
+
+/* Default memory budget, and the smallest one we'll accept */
+#define BUF_DEFAULT_MAXBYTES	(64*1024)
+#define BUF_MIN_MAXBYTES	(32*1024)
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, daddr_t block, size_t size,
+		struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, size_t size,
+	       struct buf **ret);
+int buffer_readrun(struct device *dev, daddr_t block, unsigned nblocks,
+		   size_t size);
+void buffer_readahead(struct device *dev, daddr_t block, size_t size);
+void *buffer_map(struct buf *b);
+void buffer_mark_dirty(struct buf *b, void *owner);
+void buffer_release(struct buf *b);
+void buffer_pin(struct buf *b);
+bool buffer_pinned(struct buf *b);
+void buffer_unpin(struct device *dev, daddr_t block);
+
+int buffer_flush(struct device *dev);
+int buffer_flush_owner(struct device *dev, void *owner);
+int buffer_flush_block(struct device *dev, daddr_t block);
+void buffer_invalidate(struct device *dev, daddr_t block);
+void buffer_dropdev(struct device *dev);
+
+void buffer_delay_add(size_t size);
+void buffer_delay_remove(size_t size);
+bool buffer_delay_room(size_t size);
+
+void buffer_setmaxbytes(size_t maxbytes);
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
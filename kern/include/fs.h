@@ -48,6 +48,10 @@ struct fs {
  * Abstraction operations on a file system:
  *
  *      fsop_sync       - Flush all dirty buffers to disk.
+ *      fsop_writeback  - Write out dirty file data the filesystem is
+ *                        holding outside the buffer cache (such as
+ *                        delayed-allocation blocks) that became dirty
+ *                        before CUTOFF. Called by the syncer.
  *      fsop_getvolname - Return volume name of filesystem.
  *      fsop_getroot    - Return root vnode of filesystem.
  *      fsop_unmount    - Attempt unmount of filesystem.
@@ -71,6 +75,7 @@ struct fs {
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
+	int           (*fsop_writeback)(struct fs *, time_t cutoff);
 	const char   *(*fsop_getvolname)(struct fs *);
 	int           (*fsop_getroot)(struct fs *, struct vnode **);
 	int           (*fsop_unmount)(struct fs *);
@@ -80,6 +85,7 @@ struct fs_ops {
  * Macros to shorten the calling sequences.
  */
 #define FSOP_SYNC(fs)        ((fs)->fs_ops->fsop_sync(fs))
+#define FSOP_WRITEBACK(fs, c) ((fs)->fs_ops->fsop_writeback(fs, c))
 #define FSOP_GETVOLNAME(fs)  ((fs)->fs_ops->fsop_getvolname(fs))
 #define FSOP_GETROOT(fs, ret) ((fs)->fs_ops->fsop_getroot(fs, ret))
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_ops->fsop_unmount(fs))
@@ -37,36 +37,84 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* smallest (and default) block size */
+#define SFS_MAXBLOCKSIZE  8192          /* largest block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
+#define SFS_ISIZE         128           /* size of an inode in the table */
+
+/*
+ * The block size of a volume is a power of 2 from SFS_BLOCKSIZE to
+ * SFS_MAXBLOCKSIZE, chosen when it is made. It is the unit of
+ * allocation and of disk I/O; block numbers and the freemap count
+ * blocks of this size. The superblock, inodes, and extent and
+ * directory index blocks are SFS_BLOCKSIZE bytes whatever the block
+ * size, and take up the start of their block; the rest of it is
+ * unused and zero. The macros below take the block size BS.
+ */
 
 /* Number of bits in a block */
-#define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BITSPERBLOCK(bs) ((bs) * CHAR_BIT)
+
+/* Number of directory entries in a block */
+#define SFS_DIRENTRIESPERBLOCK(bs) ((bs) / sizeof(struct sfs_direntry))
+
+/* Number of direct blocks per indirect block */
+#define SFS_DBPERIDB(bs) ((bs) / sizeof(uint32_t))
 
 /* Utility macro */
 #define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
 
 /* Size of free block bitmap (in bits) */
-#define SFS_FREEMAPBITS(nblocks) SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBITS(nblocks, bs) \
+	SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK(bs))
 
 /* Size of free block bitmap (in blocks) */
-#define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBLOCKS(nblocks, bs) \
+	(SFS_FREEMAPBITS(nblocks, bs) / SFS_BITSPERBLOCK(bs))
+
+/* Number of inodes in a block of the inode table */
+#define SFS_INODESPERBLOCK(bs) ((bs) / SFS_ISIZE)
+
+/* Size of inode bitmap (in blocks) */
+#define SFS_INODEMAPBLOCKS(ninodes, bs) \
+	(SFS_ROUNDUP(ninodes, SFS_BITSPERBLOCK(bs)) / SFS_BITSPERBLOCK(bs))
+
+/* Size of inode table (in blocks) */
+#define SFS_ITABLEBLOCKS(ninodes, bs) \
+	(SFS_ROUNDUP(ninodes, SFS_INODESPERBLOCK(bs)) / SFS_INODESPERBLOCK(bs))
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/* Feature flags for sb_features */
+#define SFS_FEATURE_DIRINDEX  0x1	/* large directories get an index */
+#define SFS_FEATURE_EXTENTS   0x2	/* new files are mapped by extents */
+#define SFS_FEATURE_BLOCKSIZE 0x4	/* sb_blocksize is not SFS_BLOCKSIZE */
+#define SFS_FEATURE_ITABLE    0x8	/* inodes are kept in a table */
+#define SFS_FEATURE_JOURNAL   0x10	/* metadata updates are journaled */
+#define SFS_FEATURE_INLINE    0x20	/* new files start out inline */
+#define SFS_FEATURES_KNOWN    (SFS_FEATURE_DIRINDEX | SFS_FEATURE_EXTENTS | \
+			       SFS_FEATURE_BLOCKSIZE | SFS_FEATURE_ITABLE | \
+			       SFS_FEATURE_JOURNAL | SFS_FEATURE_INLINE)
+
+/* Inode flags for sfi_flags */
+#define SFS_IFLAG_DIRINDEX    0x1	/* directory has an index */
+#define SFS_IFLAG_EXTENTS     0x2	/* blocks are mapped by extents */
+#define SFS_IFLAG_INLINE      0x4	/* contents are in sfi_waste */
+#define SFS_IFLAGS_KNOWN      (SFS_IFLAG_DIRINDEX | SFS_IFLAG_EXTENTS | \
+			       SFS_IFLAG_INLINE)
+
 /*
  * On-disk superblock
  */
@@ -74,9 +122,148 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_features;			/* SFS_FEATURE_* flags */
+	uint32_t sb_blocksize;			/* Block size (bytes) */
+	uint32_t sb_ninodes;			/* Inodes in the table */
+	uint32_t sb_inodemap;			/* 1st block of inode bitmap */
+	uint32_t sb_itable;			/* 1st block of inode table */
+	uint32_t sb_journal;			/* 1st block of journal */
+	uint32_t sb_journalblocks;		/* Size of journal (blocks) */
+	uint32_t reserved[111];			/* unused, set to 0 */
+};
+
+/*
+ * Inode table
+ *
+ * Ordinarily each inode takes up a block of its own and the inode
+ * number is the block number. On a volume with SFS_FEATURE_ITABLE,
+ * inodes are instead packed SFS_ISIZE bytes apiece into a table of
+ * SB_NINODES inodes starting at block SB_ITABLE, and the inode number
+ * is the index into the table. Only the first SFS_ISIZE bytes of
+ * struct sfs_dinode are stored; the rest of sfi_waste is taken to be
+ * zero. Which inodes are in use is recorded in the inode bitmap,
+ * which starts at block SB_INODEMAP and works like the freemap. Inode
+ * 0 (SFS_NOINO) is never used and is marked in use, as are the bits
+ * past SB_NINODES. The freemap shows the bitmap and table as in use.
+ */
+
+/*
+ * Journal
+ *
+ * A volume with SFS_FEATURE_JOURNAL has a journal of SB_JOURNALBLOCKS
+ * blocks starting at block SB_JOURNAL, shown in use in the freemap.
+ * Changes to metadata (everything but the contents of files) are
+ * written to the journal as transactions before they are written in
+ * place, so after a crash replaying the journal brings the volume to
+ * the state at the end of the last complete transaction.
+ *
+ * Block 0 of the journal is the header. Transactions follow it from
+ * block 1 on, numbered consecutively from SJH_SEQ; the first block
+ * that isn't part of a complete transaction with the next number ends
+ * the journal. When the journal is emptied, everything in it is first
+ * written in place, and then the header is rewritten with the number
+ * of the next transaction, which makes what's left there stale.
+ *
+ * A transaction is one or more descriptor blocks, each followed by
+ * copies of the SJD_NBLOCKS blocks it lists, and then a commit block.
+ * A descriptor also lists SJD_NREVOKE revoked blocks, which were
+ * freed in this transaction: copies of them in earlier transactions
+ * must not be replayed, as the blocks may since have been reused for
+ * file data, which is not journaled. SJC_SUM is a checksum over the
+ * whole of each block of the transaction before the commit block,
+ * computed 32 bits at a time as sum = (sum ^ word) * 16777619 (the
+ * FNV-1a prime) starting from zero, with the words in on-disk order.
+ *
+ * Like the superblock, the header, descriptor and commit blocks are
+ * SFS_BLOCKSIZE bytes at the start of their block, and the rest of
+ * the block is zero. A journal has at least SFS_JOURNAL_MINBLOCKS
+ * blocks.
+ */
+#define SFS_JOURNAL_MAGIC     0x4a524e4c	/* sjh_magic */
+#define SFS_JDESC_MAGIC       0x4a444553	/* sjd_magic */
+#define SFS_JCOMMIT_MAGIC     0x4a434d54	/* sjc_magic */
+#define SFS_JDESC_ENTRIES     124	/* block numbers per descriptor */
+#define SFS_JOURNAL_MINBLOCKS 64	/* smallest journal */
+
+struct sfs_jheader {
+	uint32_t sjh_magic;			/* SFS_JOURNAL_MAGIC */
+	uint32_t sjh_seq;			/* Number of 1st transaction */
+	uint32_t sjh_unused[126];		/* unused, set to 0 */
+};
+
+struct sfs_jdesc {
+	uint32_t sjd_magic;			/* SFS_JDESC_MAGIC */
+	uint32_t sjd_seq;			/* Transaction number */
+	uint32_t sjd_nblocks;			/* Blocks that follow */
+	uint32_t sjd_nrevoke;			/* Revoked blocks */
+	uint32_t sjd_entries[SFS_JDESC_ENTRIES]; /* Blocks, then revoked */
+};
+
+struct sfs_jcommit {
+	uint32_t sjc_magic;			/* SFS_JCOMMIT_MAGIC */
+	uint32_t sjc_seq;			/* Transaction number */
+	uint32_t sjc_nblocks;			/* Blocks before this one */
+	uint32_t sjc_sum;			/* Checksum of those blocks */
+	uint32_t sjc_unused[124];		/* unused, set to 0 */
 };
 
+/*
+ * On-disk extents
+ *
+ * An inode with SFS_IFLAG_EXTENTS set maps its blocks with a tree of
+ * extents instead of direct and indirect blocks; the root of the tree
+ * takes the place of the block pointers in the inode. At depth 0 the
+ * entries are extents: SE_NBLOCKS blocks of the file from
+ * SE_FILEBLOCK on are the disk blocks from SE_DISKBLOCK on. At higher
+ * depths they are index entries: SE_DISKBLOCK is a tree block one
+ * level down holding the entries from SE_FILEBLOCK on (entry 0 also
+ * covers everything below), and SE_NBLOCKS is 0. Within each node
+ * the entries are sorted by SE_FILEBLOCK and don't overlap; file
+ * blocks in no extent are holes.
+ */
+#define SFS_EXTENT_MAGIC      0xe7e7b10c	/* seb_magic */
+#define SFS_EXTENTS_ININODE   5		/* entries in the root */
+#define SFS_EXTENTS_PERBLOCK  41	/* entries in a tree block */
+#define SFS_EXTENT_MAXDEPTH   4		/* tree levels below the root */
+#define SFS_EXTENT_MAXBLOCKS(bs) (0xffffffffU / (bs)) /* file size */
+
+struct sfs_extent {
+	uint32_t se_fileblock;			/* First file block */
+	uint32_t se_diskblock;			/* First disk block */
+	uint32_t se_nblocks;			/* Length; 0 if index entry */
+};
+
+struct sfs_extent_root {
+	uint16_t ser_count;			/* Entries in use */
+	uint16_t ser_depth;			/* Tree levels below the root */
+	struct sfs_extent ser_entries[SFS_EXTENTS_ININODE];
+};
+
+struct sfs_extent_block {
+	uint32_t seb_magic;			/* SFS_EXTENT_MAGIC */
+	uint16_t seb_count;			/* Entries in use */
+	uint16_t seb_depth;			/* Tree levels below this one */
+	uint32_t seb_unused[2];			/* unused, set to 0 */
+	struct sfs_extent seb_entries[SFS_EXTENTS_PERBLOCK];
+	uint32_t seb_unused2;			/* unused, set to 0 */
+};
+
+/*
+ * Inline data
+ *
+ * An inode with SFS_IFLAG_INLINE set has no blocks: the file's
+ * contents are kept in sfi_waste, and the bytes there past the end
+ * of the file are zero. The block pointers (or extent root) are zero
+ * but still say how the file is mapped once it outgrows the inode.
+ * How much fits depends on how much of the inode is stored, which is
+ * SFS_ISIZE bytes on a volume with SFS_FEATURE_ITABLE and all of
+ * struct sfs_dinode otherwise. On a volume with SFS_FEATURE_INLINE,
+ * new files start out inline, and so do new directories if a
+ * directory entry fits.
+ */
+#define SFS_INLINE_OFFSET     ((6 + SFS_NDIRECT) * 4)	/* of sfi_waste */
+#define SFS_INLINE_MAX(isize) ((isize) - SFS_INLINE_OFFSET)
+
 /*
  * On-disk inode
  */
@@ -84,9 +271,17 @@ struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
 	uint16_t sfi_type;			/* One of SFS_TYPE_* above */
 	uint16_t sfi_linkcount;			/* # hard links to this file */
-	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
-	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	union {
+		struct {
+			uint32_t sfi_direct[SFS_NDIRECT]; /* Direct blocks */
+			uint32_t sfi_indirect;		/* Indirect block */
+		};
+		struct sfs_extent_root sfi_extents; /* SFS_IFLAG_EXTENTS */
+	};
+	uint32_t sfi_flags;			/* SFS_IFLAG_* flags */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
@@ -97,5 +292,52 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * On-disk directory index
+ *
+ * A directory with SFS_IFLAG_DIRINDEX set is a hash tree. Its block 0
+ * is the root index block; index blocks map ranges of name hashes to
+ * further index blocks or, at the bottom, to ordinary blocks of
+ * directory entries ("leaves"). Within an index block the entries are
+ * sorted by hash, and entry i covers hashes from its own sdx_hash up
+ * to the next entry's; entry 0 also covers everything below. All
+ * names with the same hash are in the same leaf.
+ *
+ * Every 64-byte slot of an index block begins with eight zero bytes,
+ * so read as directory entries an index block is a block of free
+ * slots and code that scans a directory linearly skips it.
+ *
+ * The hash is 32-bit FNV-1a of the name.
+ */
+#define SFS_DIRINDEX_MAGIC    0xd1b7ee00	/* sdi_magic */
+#define SFS_DIRINDEX_PERSLOT  7		/* index entries per 64-byte slot */
+#define SFS_DIRINDEX_NSLOTS   7		/* slots of entries per block */
+#define SFS_DIRINDEX_ENTRIES  (SFS_DIRINDEX_PERSLOT * SFS_DIRINDEX_NSLOTS)
+#define SFS_DIRINDEX_MAXDEPTH 2		/* max index levels below root */
+
+struct sfs_dirindex_entry {
+	uint32_t sdx_hash;			/* Lowest hash covered */
+	uint32_t sdx_block;			/* Directory block number */
+};
+
+struct sfs_dirindex_slot {
+	uint32_t sds_zero[2];			/* always 0 */
+	struct sfs_dirindex_entry sds_entries[SFS_DIRINDEX_PERSLOT];
+};
+
+struct sfs_dirindex {
+	uint32_t sdi_zero[2];			/* always 0 */
+	uint32_t sdi_magic;			/* SFS_DIRINDEX_MAGIC */
+	uint32_t sdi_depth;			/* index levels below this one */
+	uint32_t sdi_count;			/* number of entries in use */
+	uint32_t sdi_unused[11];		/* unused, set to 0 */
+	struct sfs_dirindex_slot sdi_slots[SFS_DIRINDEX_NSLOTS];
+};
+
+/* Index entry I of index block SDI */
+#define SFS_DIRINDEX_ENTRY(sdi, i) \
+	((sdi)->sdi_slots[(i) / SFS_DIRINDEX_PERSLOT] \
+		.sds_entries[(i) % SFS_DIRINDEX_PERSLOT])
+
 
 #endif /* _KERN_SFS_H_ */
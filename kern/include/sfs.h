@@ -48,6 +48,9 @@
  */
 #include <kern/sfs.h>
 
+/* Most file blocks a vnode holds for delayed allocation (see below) */
+#define SFS_DELAYBLOCKS		32
+
 /*
  * In-memory inode
  */
@@ -56,6 +59,27 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;		/* lock for sv_i and file contents */
+	struct sfs_vnode *sv_hashnext;	/* vnode table hash chain */
+	struct sfs_vnode *sv_idleprev;	/* idle list links */
+	struct sfs_vnode *sv_idlenext;
+	bool sv_idle;			/* true if unreferenced and cached */
+	off_t sv_ranext;		/* where a sequential read would start */
+	uint32_t sv_rawindow;		/* read-ahead window, in blocks */
+	uint32_t sv_raend;		/* file blocks read ahead up to here */
+	daddr_t sv_prestart;		/* blocks preallocated for this file */
+	uint32_t sv_precount;		/* ...and how many */
+	unsigned sv_ndelayed;		/* blocks written but not allocated */
+	unsigned sv_dlresv;		/* disk blocks reserved for them */
+	time_t sv_dltime;		/* when the oldest was written */
+	uint32_t sv_dlblock[SFS_DELAYBLOCKS]; /* their file blocks, sorted */
+	char *sv_dldata[SFS_DELAYBLOCKS];	/* ...and their contents */
+	struct sfs_extent sv_extcache;	/* extent last looked up */
+	uint32_t *sv_ibcache;		/* copy of last indirect block used */
+	daddr_t sv_ibblock;		/* ...its disk block, or 0 if none */
+	uint32_t sv_ibbase;		/* ...and the first file block it maps */
+	uint32_t sv_newdir;		/* dir it was created in, until fsync */
+	unsigned sv_jtxn;		/* transaction its metadata is in */
 };
 
 /*
@@ -66,11 +90,193 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	uint32_t sfs_blocksize;		/* block size (bytes) */
+	struct lock *sfs_vnlock;	/* lock for vnode table */
+	struct sfs_vnode **sfs_vnhash;	/* vnodes loaded, hashed by inode */
+	unsigned sfs_nvnodes;		/* number of vnodes loaded */
+	struct sfs_vnode *sfs_idlehead;	/* idle vnodes, least recent first */
+	struct sfs_vnode *sfs_idletail;
+	unsigned sfs_nidle;		/* number of idle vnodes */
+	struct lock *sfs_freemaplock;	/* lock for sfs_freemap */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirty; /* freemap blocks modified */
+	struct bitmap *sfs_inodemap;	/* inodes in use (SFS_FEATURE_ITABLE) */
+	struct bitmap *sfs_inodemapdirty; /* inodemap blocks modified */
+	struct bitmap *sfs_resvmap;	/* blocks preallocated to files */
+	unsigned *sfs_groupfree;	/* free blocks per allocation group */
+	unsigned sfs_ngroups;		/* number of allocation groups */
+	unsigned sfs_nfree;		/* free blocks */
+	unsigned sfs_nprealloc;		/* blocks preallocated to files */
+	unsigned sfs_ndlresv;		/* blocks reserved for delayed writes */
+	struct bitmap *sfs_freedmap;	/* blocks freed since last commit */
+	unsigned sfs_nfreed;		/* ...and how many */
+	struct sfs_journal *sfs_journal; /* journal state, or NULL */
 };
 
+/*
+ * The vnode table.
+ *
+ * Loaded vnodes are found by hashing the inode number into
+ * sfs_vnhash. When the last reference to a vnode for a file that
+ * still has links goes away, the vnode is written back and kept
+ * loaded on the idle list instead of being freed, so reopening it
+ * doesn't go to disk; the idle list holds the reference. At most
+ * SFS_MAXIDLEVNODES idle vnodes are kept per volume, and the least
+ * recently used is discarded when that is exceeded.
+ */
+#define SFS_VNHASHSIZE		128	/* hash buckets; power of 2 */
+#define SFS_MAXIDLEVNODES	64	/* idle vnodes kept per volume */
+
+/*
+ * Read-ahead. A read that starts at 0 or where the previous read of
+ * the same file ended is taken as sequential, and the buffer cache
+ * is asked to fetch the blocks after it in the background. The
+ * window starts at SFS_RA_MINBLOCKS and doubles on each sequential
+ * read up to SFS_RA_MAXBLOCKS; any other read turns it off again.
+ * This is per vnode rather than per open file, because the vnode
+ * layer doesn't tell us which open file a read came from.
+ */
+#define SFS_RA_MINBLOCKS	4
+#define SFS_RA_MAXBLOCKS	32
+
+/*
+ * Block allocation. The volume is divided into allocation groups of
+ * SFS_GROUPBLOCKS blocks, and sfs_groupfree counts the free blocks in
+ * each so the allocator can skip full groups without looking at the
+ * freemap. A block is allocated at or as soon after a goal block as
+ * possible: for file data, the block following the file's previous
+ * block, or following its inode.
+ *
+ * When a file allocates a block, up to SFS_PREALLOCBLOCKS free blocks
+ * right after it are preallocated to the file (sv_prestart and
+ * sv_precount), so files that grow at the same time don't end up
+ * interleaved. Preallocated blocks are marked in both sfs_freemap and
+ * sfs_resvmap. They are given back when the file is truncated or its
+ * vnode reclaimed, or taken back from every file if the volume is
+ * otherwise full, and are never written out to disk as in use.
+ */
+#define SFS_GROUPBLOCKS		256
+#define SFS_PREALLOCBLOCKS	16
+
+/*
+ * Delayed allocation. A write to a block of a regular file that has
+ * no disk block yet doesn't allocate one; the data is kept with the
+ * vnode (sv_dlblock, sv_dldata) and the block is only allocated when
+ * the vnode's delayed blocks are flushed, all at once and in file
+ * order so they come out contiguous. That happens on fsync (and so
+ * sync), when the vnode is reclaimed, and when it has
+ * SFS_DELAYBLOCKS of them. Truncating drops the ones past the new
+ * end of file, and punching a hole the ones inside it.
+ *
+ * Delayed blocks are dirty data the buffer cache doesn't hold, so
+ * they are counted with buffer_delay_add and are subject to its
+ * limits. A file flushes its delayed blocks before adding another
+ * if that would go over the dirty limit; if there's no memory for
+ * another, the block is written in place instead. And the syncer
+ * calls sfs_writeback to write out the files whose oldest delayed
+ * block (sv_dltime) has been waiting as long as a dirty buffer may.
+ *
+ * So that the flush can't run out of space, each delayed block
+ * reserves a disk block when it is created (plus one for the
+ * indirect block if that will be needed), counted in sv_dlresv and
+ * sfs_ndlresv. Other allocations fail with ENOSPC rather than eat
+ * into reserved space; the free space for this purpose is
+ * sfs_nfree plus sfs_nprealloc, since preallocated blocks can be
+ * taken back.
+ */
+
+/*
+ * Journaling. On a volume with SFS_FEATURE_JOURNAL (see kern/sfs.h)
+ * every change to metadata is made inside a handle, between
+ * sfs_jbegin and sfs_jend, and the handles since the last commit
+ * make up one transaction. Blocks changed by a transaction are
+ * pinned in the buffer cache until it has been committed to the
+ * journal, so the copy in place is always that of the last committed
+ * transaction or older, and replaying the journal at mount brings it
+ * up to date. Inodes are written through at the end of each handle
+ * so that they go in the same transaction as the rest.
+ *
+ * A transaction is committed when it has SFS_JTXNBYTES worth of
+ * blocks (or an eighth of the journal) or is SFS_JCOMMITSECS old,
+ * checked when the next handle starts, and on fsync and sync. A
+ * commit waits for the handles in progress to end and holds off new
+ * ones until it is written; an fsync that comes along meanwhile
+ * waits for that commit instead of starting another. When the
+ * journal is half full, it is emptied right after a commit.
+ *
+ * Blocks freed in a transaction stay marked in use (in sfs_freedmap)
+ * until it commits, so that they cannot be reused for file data,
+ * which is not journaled, while a crash could still bring back the
+ * metadata they held. File data itself is written in place with no
+ * ordering against the journal. Writes are split into handles of at
+ * most SFS_JWRITEBYTES.
+ */
+#define SFS_JTXNBYTES		32768
+#define SFS_JCOMMITSECS		5
+#define SFS_JWRITEBYTES		65536
+
+/*
+ * fsync writes out only the one file, in dependency order: its data
+ * and indirect blocks, then the bitmap blocks that mark them in use,
+ * then its inode, and, for a file created since its last fsync
+ * (sv_newdir), the directory it was created in. fdatasync skips the
+ * directory. SFS keeps no timestamps, so a write that neither
+ * extends a file nor fills a hole leaves the inode clean and costs
+ * only the data. With a journal the metadata is committed instead,
+ * and only if the file's last change to it (sv_jtxn) is still in the
+ * running transaction.
+ */
+
+/*
+ * Holes. A block with no disk block reads as zeros, so a file can
+ * be sparse. Punching a hole (VOP_PUNCH) zeros the partial blocks at
+ * either end of the range and frees the whole ones in between,
+ * along with any indirect or extent tree blocks left with nothing
+ * under them; truncation is the same thing from the new end of file
+ * on. Both skip over indirect blocks that are not there rather than
+ * visiting every block. SEEK_DATA and SEEK_HOLE (VOP_SEEKHOLE) go by
+ * whole blocks, counting delayed blocks as data and the end of the
+ * file as a hole, and likewise skip missing subtrees.
+ */
+
+/*
+ * Locking.
+ *
+ * Each vnode's sv_lock protects its inode (sv_i, sv_dirty) and the
+ * contents of the file or directory, and is held across the disk I/O
+ * for operations on it. sfs_vnlock protects the table of loaded
+ * vnodes, and sfs_freemaplock the free block and inode bitmaps,
+ * allocation group counts, free space counts, preallocated blocks
+ * (sfs_resvmap and every vnode's sv_prestart and sv_precount), and
+ * every vnode's sv_dlresv. A vnode's delayed blocks themselves are
+ * file contents, under its sv_lock. The superblock is read-only
+ * after mount. vfs_biglock is not used by SFS.
+ *
+ * The lock order is:
+ *
+ *     journal handle (sfs_jbegin)
+ *     sv_lock of a directory
+ *     sv_lock of a file within that directory
+ *     sfs_vnlock
+ *     sfs_freemaplock
+ *     journal list lock
+ *     vn_countlock (spinlock)
+ *
+ * sfs_reclaim holds the vnode's sv_lock and then takes sfs_vnlock to
+ * check the refcount and remove it from the table or make it idle;
+ * sfs_loadvnode takes references with sfs_vnlock held, so a vnode
+ * cannot be found once reclaim has decided to destroy it. The idle
+ * list is protected by sfs_vnlock. The journal's own lock is held
+ * only briefly, with no other lock but the journal list lock.
+ *
+ * All disk I/O goes through the buffer cache (buf.h), whose lock
+ * comes after all of the above. SFS holds a buffer only within
+ * sfs_readblock, sfs_writeblock, and sfs_blockio, and takes no other
+ * lock while holding one except the journal list lock. A thread in
+ * a handle must not start another one, so vnodes are let go of
+ * (which may call sfs_reclaim) only after sfs_jend.
+ */
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
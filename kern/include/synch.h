@@ -145,4 +145,48 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Once a writer is waiting, new readers wait too, so a steady stream
+ * of readers can't starve writers out.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rwlock_name;
+	struct spinlock rwlock_spinlock;	/* protects the following */
+	struct wchan *rwlock_rwchan;		/* readers wait here */
+	struct wchan *rwlock_wwchan;		/* writers wait here */
+	unsigned rwlock_readers;		/* readers holding the lock */
+	unsigned rwlock_waitingwriters;		/* writers waiting */
+	struct thread *rwlock_writer;		/* writer holding the lock */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Multiple threads
+ *                           may hold the lock for reading at once.
+ *    rwlock_release_read  - Free the lock after a read.
+ *    rwlock_acquire_write - Get the lock for writing. Only one thread
+ *                           may hold the lock for writing, and only
+ *                           when no threads hold it for reading.
+ *    rwlock_release_write - Free the lock after a write.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ *
+ * These operations must be atomic.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
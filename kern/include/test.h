@@ -86,6 +86,12 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int holetest(int, char **);
+int semfsstress(int, char **);
+int sfsjtest(int, char **);
+int sfsjcrash(int, char **);
+int sfsjcheck(int, char **);
+int sfssynctest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
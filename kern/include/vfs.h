@@ -55,6 +55,9 @@ struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
  *    vfs_clearcurdir - change current directory of current thread to "none"
  *    vfs_getcurdir - retrieve vnode of current directory of current thread
  *    vfs_sync      - force all dirty buffers to disk
+ *    vfs_writeback - have filesystems write out file data they hold
+ *                    outside the buffer cache that became dirty
+ *                    before CUTOFF (for the syncer)
  *    vfs_getroot   - get root vnode for the filesystem named DEVNAME
  *    vfs_getdevname - get mounted device name for the filesystem passed in
  */
@@ -63,6 +66,7 @@ int vfs_setcurdir(struct vnode *dir);
 int vfs_clearcurdir(void);
 int vfs_getcurdir(struct vnode **retdir);
 int vfs_sync(void);
+void vfs_writeback(time_t cutoff);
 int vfs_getroot(const char *devname, struct vnode **result);
 const char *vfs_getdevname(struct fs *fs);
 
@@ -114,6 +118,35 @@ int vfs_rename(char *oldpath, char *newpath);
 int vfs_chdir(char *path);
 int vfs_getcwd(struct uio *buf);
 
+/*
+ * Name cache (vfscache.c).
+ *
+ *    vfs_ncache_bootstrap - Set up the cache; called by vfs_bootstrap.
+ *    vfs_ncache_lookup  - Check the cache for NAME in DIR. Returns true
+ *                         on a hit, with *RESULT set to an incref'd
+ *                         vnode or to NULL if the name is known not to
+ *                         exist. On a miss, sets *GEN.
+ *    vfs_ncache_enter   - Record the result of a VOP_LOOKUP (VN, or
+ *                         NULL for ENOENT). GEN is from the preceding
+ *                         miss; stale results are discarded.
+ *    vfs_ncache_remove  - Invalidate NAME in DIR. Must be called after
+ *                         any operation that changes what NAME refers
+ *                         to.
+ *    vfs_ncache_purgevnode - Invalidate all names within DIR.
+ *    vfs_ncache_purgefs - Invalidate everything on FS.
+ *    vfs_ncache_printstats - Print hit/miss counts.
+ */
+
+void vfs_ncache_bootstrap(void);
+bool vfs_ncache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **result, unsigned *gen);
+void vfs_ncache_enter(struct vnode *dir, const char *name,
+		      struct vnode *vn, unsigned gen);
+void vfs_ncache_remove(struct vnode *dir, const char *name);
+void vfs_ncache_purgevnode(struct vnode *dir);
+void vfs_ncache_purgefs(struct fs *fs);
+void vfs_ncache_printstats(void);
+
 /*
  * Misc
  *
@@ -194,8 +227,10 @@ DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global one-big-lock for VFS-level state: the device list, the
+ * bootfs vnode, mount and unmount. It is recursive. Filesystems
+ * should do their own locking instead (see sfs.h for SFS's); path
+ * lookups only hold it while choosing the starting vnode.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -120,6 +120,10 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
+ *    vop_fdatasync   - Like vop_fsync, but metadata not needed to read
+ *                      the file's data back (such as a new file's
+ *                      directory entry) may be left unwritten.
+ *
  *    vop_mmap        - Map file into memory. If you implement this
  *                      feature, you're responsible for choosing the
  *                      arguments for this operation.
@@ -127,6 +131,20 @@ struct vnode {
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
  *
+ *    vop_seekhole    - For lseek's SEEK_DATA and SEEK_HOLE (WHENCE):
+ *                      hand back in *RESULT the offset of the first
+ *                      data, or of the first hole, at or after POS.
+ *                      The end of file counts as a hole, and data may
+ *                      be reported where there is a hole. If POS is
+ *                      at or past EOF, or there is no more data, fail
+ *                      with ENXIO. A filesystem that doesn't keep
+ *                      track of holes may return ENOSYS; the whole
+ *                      file is then data.
+ *
+ *    vop_punch       - Deallocate the LEN bytes at POS, which read as
+ *                      zeros afterwards. The size of the file does
+ *                      not change.
+ *
  *    vop_namefile    - Compute pathname relative to filesystem root
  *                      of the file and copy to the specified
  *                      uio. Need not work on objects that are not
@@ -193,8 +211,12 @@ struct vnode_ops {
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	bool (*vop_isseekable)(struct vnode *object);
 	int (*vop_fsync)(struct vnode *object);
+	int (*vop_fdatasync)(struct vnode *object);
 	int (*vop_mmap)(struct vnode *file /* add stuff */);
 	int (*vop_truncate)(struct vnode *file, off_t len);
+	int (*vop_seekhole)(struct vnode *file, off_t pos, int whence,
+			    off_t *result);
+	int (*vop_punch)(struct vnode *file, off_t pos, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
 
@@ -237,8 +259,11 @@ struct vnode_ops {
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_ISSEEKABLE(vn)              (__VOP(vn, isseekable)(vn))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
+#define VOP_FDATASYNC(vn)               (__VOP(vn, fdatasync)(vn))
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_SEEKHOLE(vn, pos, wh, res)  (__VOP(vn, seekhole)(vn, pos, wh, res))
+#define VOP_PUNCH(vn, pos, len)         (__VOP(vn, punch)(vn, pos, len))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
@@ -290,6 +315,12 @@ int vopfail_mmap_isdir(struct vnode *vn /* add stuff */);
 int vopfail_mmap_perm(struct vnode *vn /* add stuff */);
 int vopfail_mmap_nosys(struct vnode *vn /* add stuff */);
 int vopfail_truncate_isdir(struct vnode *vn, off_t pos);
+int vopfail_seekhole_isdir(struct vnode *vn, off_t pos, int whence,
+			   off_t *result);
+int vopfail_seekhole_nosys(struct vnode *vn, off_t pos, int whence,
+			   off_t *result);
+int vopfail_punch_isdir(struct vnode *vn, off_t pos, off_t len);
+int vopfail_punch_nosys(struct vnode *vn, off_t pos, off_t len);
 int vopfail_creat_notdir(struct vnode *vn, const char *name, bool excl,
 			 mode_t mode, struct vnode **result);
 int vopfail_symlink_notdir(struct vnode *vn, const char *contents,
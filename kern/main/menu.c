@@ -40,6 +40,7 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -494,6 +495,59 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_ncachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_ncache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_bufmax(int nargs, char **args)
+{
+	int kb;
+
+	if (nargs != 2) {
+		kprintf("Usage: bcmax kilobytes\n");
+		return EINVAL;
+	}
+
+	/*
+	 * Too small a budget thrashes or stalls writers behind the
+	 * dirty limit; more than there is RAM makes no sense.
+	 */
+	kb = atoi(args[1]);
+	if (kb < BUF_MIN_MAXBYTES / 1024 ||
+	    (size_t)kb > mainbus_ramsize() / 1024) {
+		kprintf("bcmax: budget must be between %d and %u KB\n",
+			BUF_MIN_MAXBYTES / 1024,
+			(unsigned)(mainbus_ramsize() / 1024));
+		return EINVAL;
+	}
+
+	buffer_setmaxbytes((size_t)kb * 1024);
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -577,6 +631,16 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] FS hole test                  ",
+#if OPT_SFS
+	"[fs8] SFS fsync/fdatasync test      ",
+#endif
+	"[semfs1] semfs create/open stress   ",
+#if OPT_SFS
+	"[sfsj1] SFS journal remount test    ",
+	"[sfsj2] SFS journal crash (poweroff)",
+	"[sfsj3] SFS journal crash check     ",
+#endif
 	NULL
 };
 
@@ -601,6 +665,9 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[ncs] Name cache stats              ",
+	"[bcs] Buffer cache stats            ",
+	"[bcmax] Set buffer cache budget (KB)",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -652,6 +719,9 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "ncs",        cmd_ncachestats },
+	{ "bcs",        cmd_bufstats },
+	{ "bcmax",      cmd_bufmax },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -706,6 +776,16 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	holetest },
+#if OPT_SFS
+	{ "fs8",	sfssynctest },
+#endif
+	{ "semfs1",	semfsstress },
+#if OPT_SFS
+	{ "sfsj1",	sfsjtest },
+	{ "sfsj2",	sfsjcrash },
+	{ "sfsj3",	sfsjcheck },
+#endif
 
 	{ NULL, NULL }
 };
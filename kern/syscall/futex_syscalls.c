@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * futex() system call.
+ *
+ * A futex is just an aligned 32-bit word in user memory. User-level
+ * lock code manipulates the word with atomic instructions and only
+ * enters the kernel when it has to sleep (FUTEX_WAIT) or when it
+ * knows there may be sleepers to wake (FUTEX_WAKE). The kernel keeps
+ * no per-futex state: sleepers are kept in a small hash table keyed
+ * by (address space, user address), and the entry exists only while
+ * somebody is sleeping on it.
+ *
+ * The "compare" half of FUTEX_WAIT is done with the bucket lock held,
+ * and FUTEX_WAKE takes the same lock, so a wakeup issued after the
+ * user-level code changed the word cannot be lost.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/* Number of hash buckets. Should be a power of 2. */
+#define FUTEX_NBUCKETS 32
+
+/*
+ * One sleeping thread. These live on the sleeper's stack and are
+ * linked into the bucket only for the duration of the wait.
+ */
+struct futex_waiter {
+	struct addrspace *fw_as;	/* address space of the sleeper */
+	userptr_t fw_uaddr;		/* user address slept on */
+	bool fw_woken;			/* set (and unlinked) by waker */
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;
+	struct cv *fb_cv;
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_NBUCKETS];
+
+/*
+ * Set up the hash table. Called once from boot().
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		futex_table[i].fb_cv = cv_create("futex");
+		if (futex_table[i].fb_lock == NULL ||
+		    futex_table[i].fb_cv == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_getbucket(struct addrspace *as, userptr_t uaddr)
+{
+	uintptr_t key;
+
+	/* futex words are aligned, so the low two bits carry nothing */
+	key = ((uintptr_t)uaddr >> 2) ^ ((uintptr_t)as >> 4);
+	key ^= key >> 7;
+	return &futex_table[key & (FUTEX_NBUCKETS - 1)];
+}
+
+/*
+ * Sleep on UADDR if it still contains VAL.
+ */
+static
+int
+futex_wait(struct addrspace *as, userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter me;
+	int32_t cur;
+	int result;
+
+	fb = futex_getbucket(as, uaddr);
+
+	lock_acquire(fb->fb_lock);
+	result = copyin((const_userptr_t)uaddr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		/* Somebody changed it already; don't sleep. */
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	me.fw_as = as;
+	me.fw_uaddr = uaddr;
+	me.fw_woken = false;
+	me.fw_next = fb->fb_waiters;
+	fb->fb_waiters = &me;
+
+	/*
+	 * Wakers unlink us before setting fw_woken, so once it is set
+	 * we are no longer on the list.
+	 */
+	while (!me.fw_woken) {
+		cv_wait(fb->fb_cv, fb->fb_lock);
+	}
+	lock_release(fb->fb_lock);
+	return 0;
+}
+
+/*
+ * Wake up to MAX threads sleeping on UADDR. Returns the number woken.
+ */
+static
+int
+futex_wake(struct addrspace *as, userptr_t uaddr, int max)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **fwp, *fw;
+	int count;
+
+	fb = futex_getbucket(as, uaddr);
+	count = 0;
+
+	lock_acquire(fb->fb_lock);
+	fwp = &fb->fb_waiters;
+	while (*fwp != NULL && count < max) {
+		fw = *fwp;
+		if (fw->fw_as == as && fw->fw_uaddr == uaddr) {
+			*fwp = fw->fw_next;
+			fw->fw_next = NULL;
+			fw->fw_woken = true;
+			count++;
+		}
+		else {
+			fwp = &fw->fw_next;
+		}
+	}
+	if (count > 0) {
+		/*
+		 * Threads on other addresses that hash here will also
+		 * wake, see they weren't picked, and go back to sleep.
+		 */
+		cv_broadcast(fb->fb_cv, fb->fb_lock);
+	}
+	lock_release(fb->fb_lock);
+	return count;
+}
+
+/*
+ * The system call.
+ */
+int
+sys_futex(userptr_t uaddr, int op, int val, int32_t *retval)
+{
+	struct addrspace *as;
+	int result;
+
+	if ((uintptr_t)uaddr % sizeof(int32_t) != 0) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		result = futex_wait(as, uaddr, val);
+		*retval = 0;
+		break;
+	    case FUTEX_WAKE:
+		if (val < 0) {
+			return EINVAL;
+		}
+		*retval = futex_wake(as, uaddr, val);
+		result = 0;
+		break;
+	    default:
+		return EINVAL;
+	}
+	return result;
+}
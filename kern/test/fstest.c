@@ -41,6 +41,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -674,6 +676,290 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Hole test. Punch holes in a file (in the middle, at the end, and in
+ * the partial last block) and check the size, that the holes read
+ * back as zeros and the rest is intact, and what SEEK_DATA and
+ * SEEK_HOLE find. The file is HOLEBLOCKS and a half blocks long, so
+ * it reaches past the direct blocks of an indirect-mapped file; run
+ * the test on volumes with and without extents to cover both.
+ */
+#define HOLEBLOCKS 48
+
+static
+char
+holes_byte(off_t pos)
+{
+	return 'a' + pos % 26;
+}
+
+/*
+ * Check bytes START up to END of the file: zeros if ZERO, otherwise
+ * what holes_write put there.
+ */
+static
+int
+holes_check(struct vnode *vn, const char *name, char *buf, size_t bufsize,
+	    off_t start, off_t end, bool zero)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	size_t len, i;
+	char want;
+	int err;
+
+	for (pos = start; pos < end; pos += len) {
+		len = bufsize;
+		if ((off_t)len > end - pos) {
+			len = end - pos;
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("%s: Read error: %s\n", name, strerror(err));
+			return -1;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short read at %lld\n", name,
+				(long long)pos);
+			return -1;
+		}
+		for (i=0; i<len; i++) {
+			want = zero ? 0 : holes_byte(pos + i);
+			if (buf[i] != want) {
+				kprintf("%s: Byte %lld is %d, should be %d\n",
+					name, (long long)(pos + i),
+					buf[i], want);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Seek from POS with WHENCE, and check that it gets error WANTERR or,
+ * if that's 0, offset WANT.
+ */
+static
+int
+holes_seek(struct vnode *vn, const char *name, off_t pos, int whence,
+	   int wanterr, off_t want)
+{
+	const char *how = whence == SEEK_DATA ? "SEEK_DATA" : "SEEK_HOLE";
+	off_t result = -1;
+	int err;
+
+	err = VOP_SEEKHOLE(vn, pos, whence, &result);
+	if (err != wanterr || (err == 0 && result != want)) {
+		kprintf("%s: %s from %lld: got %lld (%s), should be "
+			"%lld (%s)\n", name, how, (long long)pos,
+			(long long)result, strerror(err),
+			(long long)want, strerror(wanterr));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Punch LEN bytes at POS, and check that the size stays SIZE.
+ */
+static
+int
+holes_punch(struct vnode *vn, const char *name, off_t pos, off_t len,
+	    off_t size)
+{
+	struct stat st;
+	int err;
+
+	err = VOP_PUNCH(vn, pos, len);
+	if (err) {
+		kprintf("%s: Punch %lld at %lld: %s\n", name, (long long)len,
+			(long long)pos, strerror(err));
+		return -1;
+	}
+	err = VOP_STAT(vn, &st);
+	if (err) {
+		kprintf("%s: Stat: %s\n", name, strerror(err));
+		return -1;
+	}
+	if (st.st_size != size) {
+		kprintf("%s: Size is %lld after punch, should be %lld\n",
+			name, (long long)st.st_size, (long long)size);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fill the file with SIZE bytes of holes_byte.
+ */
+static
+int
+holes_write(struct vnode *vn, const char *name, char *buf, size_t bufsize,
+	    off_t size)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	size_t len, i;
+	int err;
+
+	for (pos = 0; pos < size; pos += len) {
+		len = bufsize;
+		if ((off_t)len > size - pos) {
+			len = size - pos;
+		}
+		for (i=0; i<len; i++) {
+			buf[i] = holes_byte(pos + i);
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err) {
+			kprintf("%s: Write error: %s\n", name, strerror(err));
+			return -1;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short write at %lld\n", name,
+				(long long)pos);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The checks themselves. BS is the filesystem's block size, and the
+ * file is SIZE bytes of holes_byte with no holes.
+ */
+static
+int
+holes_run(struct vnode *vn, const char *name, char *buf, off_t bs,
+	  off_t size)
+{
+	off_t tail = (off_t)HOLEBLOCKS * bs;
+
+	/* No holes yet: data from 0, and the only hole is at EOF */
+	if (holes_seek(vn, name, 0, SEEK_DATA, 0, 0) ||
+	    holes_seek(vn, name, 0, SEEK_HOLE, 0, size) ||
+	    holes_seek(vn, name, size, SEEK_DATA, ENXIO, 0) ||
+	    holes_seek(vn, name, size, SEEK_HOLE, ENXIO, 0)) {
+		return -1;
+	}
+
+	/*
+	 * The middle: partial blocks 4 and 20 get zeros, and blocks
+	 * 5 through 19 become a hole.
+	 */
+	if (holes_punch(vn, name, 4*bs + 100, 16*bs + 100, size) ||
+	    holes_check(vn, name, buf, bs, 0, 4*bs + 100, false) ||
+	    holes_check(vn, name, buf, bs, 4*bs + 100, 20*bs + 200, true) ||
+	    holes_check(vn, name, buf, bs, 20*bs + 200, size, false) ||
+	    holes_seek(vn, name, 0, SEEK_HOLE, 0, 5*bs) ||
+	    holes_seek(vn, name, 4*bs + 100, SEEK_HOLE, 0, 5*bs) ||
+	    holes_seek(vn, name, 5*bs, SEEK_DATA, 0, 20*bs) ||
+	    holes_seek(vn, name, 12*bs + 7, SEEK_HOLE, 0, 12*bs + 7) ||
+	    holes_seek(vn, name, 20*bs, SEEK_HOLE, 0, size)) {
+		return -1;
+	}
+
+	/* Part of the partial last block, asking for more than is there */
+	if (holes_punch(vn, name, tail + bs/4, bs, size) ||
+	    holes_check(vn, name, buf, bs, tail, tail + bs/4, false) ||
+	    holes_check(vn, name, buf, bs, tail + bs/4, size, true) ||
+	    holes_seek(vn, name, tail, SEEK_DATA, 0, tail) ||
+	    holes_seek(vn, name, tail + bs/4, SEEK_DATA, 0, tail + bs/4)) {
+		return -1;
+	}
+
+	/* The tail, from a block boundary to EOF */
+	if (holes_punch(vn, name, 30*bs, size - 30*bs, size) ||
+	    holes_check(vn, name, buf, bs, 20*bs + 200, 30*bs, false) ||
+	    holes_check(vn, name, buf, bs, 30*bs, size, true) ||
+	    holes_seek(vn, name, 20*bs, SEEK_HOLE, 0, 30*bs) ||
+	    holes_seek(vn, name, 30*bs, SEEK_DATA, ENXIO, 0) ||
+	    holes_seek(vn, name, size - 1, SEEK_HOLE, 0, size - 1)) {
+		return -1;
+	}
+
+	/* Everything that's left */
+	if (holes_punch(vn, name, 0, size, size) ||
+	    holes_check(vn, name, buf, bs, 0, size, true) ||
+	    holes_seek(vn, name, 0, SEEK_DATA, ENXIO, 0) ||
+	    holes_seek(vn, name, 0, SEEK_HOLE, 0, 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+static
+void
+doholetest(const char *filesys)
+{
+	const char *fs = filesys;
+	const char *namesuffix = "";
+	struct vnode *vn;
+	struct stat st;
+	char name[32];
+	char buf[32];
+	char *data;
+	off_t bs, size;
+	int err, result;
+
+	kprintf("*** Starting fs hole test on %s:\n", filesys);
+
+	MAKENAME();
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s: %s\n", name, strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	err = VOP_STAT(vn, &st);
+	if (err) {
+		kprintf("%s: Stat: %s\n", name, strerror(err));
+		vfs_close(vn);
+		fstest_remove(filesys, namesuffix);
+		kprintf("*** Test failed\n");
+		return;
+	}
+	bs = st.st_blksize;
+	size = (off_t)HOLEBLOCKS * bs + bs/2;
+
+	data = kmalloc(bs);
+	if (data == NULL) {
+		kprintf("%s: Out of memory\n", name);
+		vfs_close(vn);
+		fstest_remove(filesys, namesuffix);
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	result = holes_write(vn, name, data, bs, size);
+	if (result == 0) {
+		result = holes_run(vn, name, data, bs, size);
+	}
+
+	kfree(data);
+	vfs_close(vn);
+	if (fstest_remove(filesys, namesuffix)) {
+		result = -1;
+	}
+
+	if (result) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+	kprintf("*** fs hole test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -681,7 +967,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -714,6 +1000,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
+DEFTEST(holetest);
 
 ////////////////////////////////////////////////////////////
 
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * semfstest - semfs stress test
+ *
+ * Several threads each create many named semaphores in sem:, then
+ * every thread opens every semaphore (by name, concurrently) and
+ * does a V and a P on it, then each thread removes its own. This
+ * exercises the semfs name lookup and create/remove paths under
+ * contention.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define NTHREADS 8
+#define NSEMS    250
+
+static struct semaphore *donesem;
+static struct semaphore *phasesem[2];
+/*
+ * Each thread counts its own errors; semfsstress adds them up once the
+ * last barrier says every thread is done with its slot.
+ */
+static unsigned semfstest_errors[NTHREADS];
+
+static
+void
+semfstest_makename(char *buf, size_t len, unsigned long thread, unsigned num)
+{
+	snprintf(buf, len, "sem:st%lu.%u", thread, num);
+}
+
+/*
+ * Do one P or V of 1 on an open semaphore.
+ */
+static
+int
+semfstest_op(struct vnode *vn, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	char ch = 0;
+	int result;
+
+	uio_kinit(&iov, &ku, &ch, 1, 0, rw);
+	result = rw == UIO_READ ? VOP_READ(vn, &ku) : VOP_WRITE(vn, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+static
+void
+semfstest_fail(unsigned long thread, const char *what, const char *name,
+	       int result)
+{
+	kprintf("semfstest: %s %s: %s\n", what, name, strerror(result));
+	semfstest_errors[thread]++;
+}
+
+static
+void
+semfstest_thread(void *junk, unsigned long num)
+{
+	char name[32];
+	char buf[32];
+	struct vnode *vn;
+	unsigned i, t;
+	int result;
+
+	(void)junk;
+
+	/* Phase 1: create our own */
+	for (i=0; i<NSEMS; i++) {
+		semfstest_makename(name, sizeof(name), num, i);
+		/* vfs_open destroys the string it's passed */
+		strcpy(buf, name);
+		result = vfs_open(buf, O_RDWR|O_CREAT|O_EXCL, 0664, &vn);
+		if (result) {
+			semfstest_fail(num, "create", name, result);
+			continue;
+		}
+		vfs_close(vn);
+	}
+
+	/* Wait for everyone to finish creating */
+	V(donesem);
+	P(phasesem[0]);
+
+	/* Phase 2: open everyone's, starting with a neighbor's */
+	for (t=0; t<NTHREADS; t++) {
+		for (i=0; i<NSEMS; i++) {
+			semfstest_makename(name, sizeof(name),
+					   (num + t) % NTHREADS, i);
+			strcpy(buf, name);
+			result = vfs_open(buf, O_RDWR, 0664, &vn);
+			if (result) {
+				semfstest_fail(num, "open", name, result);
+				continue;
+			}
+			result = semfstest_op(vn, UIO_WRITE);
+			if (result == 0) {
+				result = semfstest_op(vn, UIO_READ);
+			}
+			if (result) {
+				semfstest_fail(num, "V/P", name, result);
+			}
+			vfs_close(vn);
+		}
+	}
+
+	V(donesem);
+	P(phasesem[1]);
+
+	/* Phase 3: remove our own, and make sure they're gone */
+	for (i=0; i<NSEMS; i++) {
+		semfstest_makename(name, sizeof(name), num, i);
+		strcpy(buf, name);
+		result = vfs_remove(buf);
+		if (result) {
+			semfstest_fail(num, "remove", name, result);
+			continue;
+		}
+		strcpy(buf, name);
+		result = vfs_open(buf, O_RDWR, 0664, &vn);
+		if (result == 0) {
+			vfs_close(vn);
+			semfstest_fail(num, "open after remove", name, EEXIST);
+		}
+	}
+
+	V(donesem);
+}
+
+/*
+ * Wait for all the threads to reach the end of a phase, then let them
+ * all continue. Each phase has its own semaphore so a fast thread
+ * can't use up a slow thread's wakeup from the previous phase.
+ */
+static
+void
+semfstest_barrier(struct semaphore *release)
+{
+	unsigned i;
+
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	if (release != NULL) {
+		for (i=0; i<NTHREADS; i++) {
+			V(release);
+		}
+	}
+}
+
+int
+semfsstress(int nargs, char **args)
+{
+	unsigned i, errors;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	donesem = sem_create("semfstest", 0);
+	phasesem[0] = sem_create("semfstest phase 1", 0);
+	phasesem[1] = sem_create("semfstest phase 2", 0);
+	if (donesem == NULL || phasesem[0] == NULL || phasesem[1] == NULL) {
+		panic("semfstest: sem_create failed\n");
+	}
+	bzero(semfstest_errors, sizeof(semfstest_errors));
+
+	kprintf("*** Starting semfs stress test (%u threads, %u sems each)\n",
+		NTHREADS, NSEMS);
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("semfstest", NULL,
+				     semfstest_thread, NULL, i);
+		if (result) {
+			panic("semfstest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	semfstest_barrier(phasesem[0]);
+	kprintf("semfstest: created\n");
+	semfstest_barrier(phasesem[1]);
+	kprintf("semfstest: opened\n");
+	semfstest_barrier(NULL);
+
+	sem_destroy(phasesem[1]);
+	sem_destroy(phasesem[0]);
+	sem_destroy(donesem);
+
+	errors = 0;
+	for (i=0; i<NTHREADS; i++) {
+		errors += semfstest_errors[i];
+	}
+	if (errors > 0) {
+		kprintf("*** semfs stress test failed: %u errors\n", errors);
+		return EIO;
+	}
+	kprintf("*** semfs stress test done\n");
+	return 0;
+}
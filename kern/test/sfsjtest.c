@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * sfsjtest - SFS journal tests. Use a volume made with mksfs -j.
+ *
+ * In each, several threads first churn through files big enough to
+ * need an indirect block, creating, fsyncing, and removing them, so
+ * that there are many commits, the journal wraps several times over,
+ * and freed metadata blocks get reused for data. Then each creates
+ * and fsyncs a set of files, with their handles and fsyncs
+ * overlapping so that commits are shared.
+ *
+ * sfsj1 then checks the files, unmounts the volume, mounts it again,
+ * and checks them again.
+ *
+ * sfsj2 instead powers off without syncing, leaving transactions
+ * committed to the journal but not yet written in place. Either run
+ * sfsck on the disk image, which should replay the journal and find
+ * nothing else to fix, or boot again, mount the volume (which
+ * replays the journal), and run sfsj3 to check the files.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <mainbus.h>
+#include <sfs.h>
+#include <test.h>
+
+#define NTHREADS  8
+#define NFILES    16	/* kept files per thread */
+#define NCHURN    100	/* enough to wrap a 1024-block journal */
+#define FILESIZE  700
+#define CHURNSIZE 8704	/* past the direct blocks, at 512 bytes */
+
+static struct semaphore *donesem;
+
+/* Failures are reported from inside the helpers, on any thread. */
+static struct spinlock sfsjtest_lock = SPINLOCK_INITIALIZER;
+static unsigned sfsjtest_errors;
+
+static
+void
+sfsjtest_fail(const char *what, const char *name, int result)
+{
+	kprintf("sfsjtest: %s %s: %s\n", what, name, strerror(result));
+	spinlock_acquire(&sfsjtest_lock);
+	sfsjtest_errors++;
+	spinlock_release(&sfsjtest_lock);
+}
+
+static
+unsigned
+sfsjtest_nerrors(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&sfsjtest_lock);
+	ret = sfsjtest_errors;
+	spinlock_release(&sfsjtest_lock);
+	return ret;
+}
+
+/*
+ * Name of file NUM of thread THREAD, or of its churn file if NUM is
+ * NFILES.
+ */
+static
+void
+sfsjtest_makename(char *buf, size_t len, const char *dev,
+		  unsigned long thread, unsigned num)
+{
+	if (num == NFILES) {
+		snprintf(buf, len, "%s:sjchurn%lu", dev, thread);
+	}
+	else {
+		snprintf(buf, len, "%s:sj%lu.%u", dev, thread, num);
+	}
+}
+
+static
+char
+sfsjtest_byte(unsigned long thread, unsigned num, off_t pos)
+{
+	return 'a' + (thread * 7 + num * 3 + pos) % 26;
+}
+
+/*
+ * Create file NUM of thread THREAD, SIZE bytes long, and fsync it.
+ */
+static
+int
+sfsjtest_create(const char *dev, unsigned long thread, unsigned num,
+		size_t size)
+{
+	char name[32];
+	char buf[128];
+	struct iovec iov;
+	struct uio ku;
+	struct vnode *vn;
+	size_t pos, len, i;
+	int result;
+
+	sfsjtest_makename(name, sizeof(name), dev, thread, num);
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	result = vfs_open(buf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (result) {
+		sfsjtest_fail("create", name, result);
+		return result;
+	}
+
+	for (pos = 0; pos < size; pos += len) {
+		len = size - pos < sizeof(buf) ? size - pos : sizeof(buf);
+		for (i=0; i<len; i++) {
+			buf[i] = sfsjtest_byte(thread, num, pos + i);
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+		result = VOP_WRITE(vn, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			result = EIO;
+		}
+		if (result) {
+			sfsjtest_fail("write", name, result);
+			vfs_close(vn);
+			return result;
+		}
+	}
+
+	result = VOP_FSYNC(vn);
+	if (result) {
+		sfsjtest_fail("fsync", name, result);
+	}
+	vfs_close(vn);
+	return result;
+}
+
+/*
+ * Check file NUM of thread THREAD: it should be exactly FILESIZE
+ * bytes of sfsjtest_byte.
+ */
+static
+void
+sfsjtest_verify(const char *dev, unsigned long thread, unsigned num)
+{
+	char name[32];
+	char buf[128];
+	struct iovec iov;
+	struct uio ku;
+	struct vnode *vn;
+	size_t pos, got, i;
+	int result;
+
+	sfsjtest_makename(name, sizeof(name), dev, thread, num);
+	strcpy(buf, name);
+	result = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (result) {
+		sfsjtest_fail("open", name, result);
+		return;
+	}
+
+	/* Read until a short read, then check where it stopped */
+	pos = 0;
+	do {
+		uio_kinit(&iov, &ku, buf, sizeof(buf), pos, UIO_READ);
+		result = VOP_READ(vn, &ku);
+		if (result) {
+			sfsjtest_fail("read", name, result);
+			vfs_close(vn);
+			return;
+		}
+		got = sizeof(buf) - ku.uio_resid;
+		for (i=0; i<got; i++) {
+			if (buf[i] != sfsjtest_byte(thread, num, pos + i)) {
+				sfsjtest_fail("contents of", name, EINVAL);
+				vfs_close(vn);
+				return;
+			}
+		}
+		pos += got;
+	} while (got == sizeof(buf));
+	vfs_close(vn);
+
+	if (pos != FILESIZE) {
+		sfsjtest_fail("size of", name, EINVAL);
+	}
+}
+
+/*
+ * Check that file NUM of thread THREAD is not there.
+ */
+static
+void
+sfsjtest_gone(const char *dev, unsigned long thread, unsigned num)
+{
+	char name[32];
+	char buf[32];
+	struct vnode *vn;
+	int result;
+
+	sfsjtest_makename(name, sizeof(name), dev, thread, num);
+	strcpy(buf, name);
+	result = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (result == 0) {
+		vfs_close(vn);
+		sfsjtest_fail("open of removed", name, EEXIST);
+	}
+	else if (result != ENOENT) {
+		sfsjtest_fail("open of removed", name, result);
+	}
+}
+
+static
+void
+sfsjtest_thread(void *dev, unsigned long num)
+{
+	char name[32];
+	unsigned i;
+	int result;
+
+	for (i=0; i<NCHURN; i++) {
+		if (sfsjtest_create(dev, num, NFILES, CHURNSIZE)) {
+			break;
+		}
+		sfsjtest_makename(name, sizeof(name), dev, num, NFILES);
+		result = vfs_remove(name);
+		if (result) {
+			sfsjtest_fail("remove", name, result);
+			break;
+		}
+	}
+
+	for (i=0; i<NFILES; i++) {
+		sfsjtest_create(dev, num, i, FILESIZE);
+	}
+
+	V(donesem);
+}
+
+/*
+ * Run the threads on DEV and wait for them.
+ */
+static
+void
+sfsjtest_run(const char *dev)
+{
+	unsigned i;
+	int result;
+
+	donesem = sem_create("sfsjtest", 0);
+	if (donesem == NULL) {
+		panic("sfsjtest: sem_create failed\n");
+	}
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("sfsjtest", NULL, sfsjtest_thread,
+				     (char *)dev, i);
+		if (result) {
+			panic("sfsjtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	sem_destroy(donesem);
+	donesem = NULL;
+}
+
+/*
+ * Check all the files on DEV, and that the churn files are gone. If
+ * REMOVE, remove them afterwards.
+ */
+static
+void
+sfsjtest_checkall(const char *dev, bool remove)
+{
+	char name[32];
+	unsigned long t;
+	unsigned i;
+	int result;
+
+	for (t=0; t<NTHREADS; t++) {
+		for (i=0; i<NFILES; i++) {
+			sfsjtest_verify(dev, t, i);
+		}
+		sfsjtest_gone(dev, t, NFILES);
+	}
+	if (!remove) {
+		return;
+	}
+	for (t=0; t<NTHREADS; t++) {
+		for (i=0; i<NFILES; i++) {
+			sfsjtest_makename(name, sizeof(name), dev, t, i);
+			result = vfs_remove(name);
+			if (result) {
+				sfsjtest_fail("remove", name, result);
+			}
+		}
+	}
+}
+
+/*
+ * Get the device name from the arguments, without its colon.
+ */
+static
+char *
+sfsjtest_args(int nargs, char **args, const char *test)
+{
+	char *device;
+
+	if (nargs != 2) {
+		kprintf("Usage: %s device:\n", test);
+		return NULL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+	return device;
+}
+
+static
+int
+sfsjtest_done(const char *test)
+{
+	unsigned errors;
+
+	errors = sfsjtest_nerrors();
+	if (errors > 0) {
+		kprintf("*** %s: %u errors\n", test, errors);
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+	kprintf("*** %s done\n", test);
+	return 0;
+}
+
+/*
+ * sfsj1: commit, unmount, mount, and check.
+ */
+int
+sfsjtest(int nargs, char **args)
+{
+	char *dev;
+	int result;
+
+	dev = sfsjtest_args(nargs, args, "sfsj1");
+	if (dev == NULL) {
+		return EINVAL;
+	}
+	sfsjtest_errors = 0;
+	kprintf("*** Starting SFS journal test on %s:\n", dev);
+
+	sfsjtest_run(dev);
+	sfsjtest_checkall(dev, false);
+
+	result = vfs_unmount(dev);
+	if (result) {
+		sfsjtest_fail("unmount", dev, result);
+		return sfsjtest_done("sfsj1");
+	}
+	result = sfs_mount(dev);
+	if (result) {
+		sfsjtest_fail("mount", dev, result);
+		return sfsjtest_done("sfsj1");
+	}
+
+	sfsjtest_checkall(dev, true);
+	return sfsjtest_done("sfsj1");
+}
+
+/*
+ * sfsj2: commit and power off without syncing.
+ */
+int
+sfsjcrash(int nargs, char **args)
+{
+	char *dev;
+
+	dev = sfsjtest_args(nargs, args, "sfsj2");
+	if (dev == NULL) {
+		return EINVAL;
+	}
+	sfsjtest_errors = 0;
+	kprintf("*** Starting SFS journal crash test on %s:\n", dev);
+
+	sfsjtest_run(dev);
+	if (sfsjtest_nerrors() > 0) {
+		/* Don't leave a broken image behind for sfsj3 */
+		return sfsjtest_done("sfsj2");
+	}
+
+	kprintf("*** Powering off without syncing; now run sfsck, or "
+		"mount %s: and run sfsj3\n", dev);
+	mainbus_poweroff();
+	return 0;
+}
+
+/*
+ * sfsj3: check the files sfsj2 left, after replay.
+ */
+int
+sfsjcheck(int nargs, char **args)
+{
+	char *dev;
+
+	dev = sfsjtest_args(nargs, args, "sfsj3");
+	if (dev == NULL) {
+		return EINVAL;
+	}
+	sfsjtest_errors = 0;
+	kprintf("*** Checking SFS journal crash test on %s:\n", dev);
+
+	sfsjtest_checkall(dev, true);
+	return sfsjtest_done("sfsj3");
+}
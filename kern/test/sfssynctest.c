@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * sfssynctest - fsync and fdatasync on an SFS volume made without -j.
+ *
+ * Without a journal, fsync on a file created since its last fsync
+ * also writes out the directory it was created in (sv_newdir);
+ * fdatasync doesn't. fs8 creates a file, writes to it, and checks
+ * that fdatasync leaves the directory step pending and that fsync
+ * then does it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/sfs.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <sfs.h>
+#include <test.h>
+
+#define SYNCNAME "sfssync.tmp"
+#define SYNCSIZE 3000	/* a few blocks */
+
+/*
+ * Check which directory VN still has to be written out with it.
+ */
+static
+int
+sfssync_check(struct vnode *vn, const char *name, const char *when,
+	      uint32_t expected)
+{
+	struct sfs_vnode *sv = vn->vn_data;
+	uint32_t dirino;
+
+	lock_acquire(sv->sv_lock);
+	dirino = sv->sv_newdir;
+	lock_release(sv->sv_lock);
+
+	if (dirino != expected) {
+		kprintf("%s: after %s, directory to sync is %u, not %u\n",
+			name, when, dirino, expected);
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+sfssync_run(struct vnode *vn, const char *name)
+{
+	struct sfs_fs *sfs = vn->vn_fs->fs_data;
+	char buf[128];
+	struct iovec iov;
+	struct uio ku;
+	size_t pos, len, i;
+	int result;
+
+	if (sfs->sfs_journal != NULL) {
+		kprintf("%s: volume has a journal; use one made "
+			"without -j\n", name);
+		return -1;
+	}
+	if (sfssync_check(vn, name, "create", SFS_ROOTDIR_INO)) {
+		return -1;
+	}
+
+	for (pos = 0; pos < SYNCSIZE; pos += len) {
+		len = SYNCSIZE - pos < sizeof(buf) ?
+			SYNCSIZE - pos : sizeof(buf);
+		for (i=0; i<len; i++) {
+			buf[i] = 'a' + (pos + i) % 26;
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+		result = VOP_WRITE(vn, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			result = EIO;
+		}
+		if (result) {
+			kprintf("%s: write: %s\n", name, strerror(result));
+			return -1;
+		}
+	}
+
+	/* fdatasync writes the file but leaves the directory... */
+	result = VOP_FDATASYNC(vn);
+	if (result) {
+		kprintf("%s: fdatasync: %s\n", name, strerror(result));
+		return -1;
+	}
+	if (sfssync_check(vn, name, "fdatasync", SFS_ROOTDIR_INO)) {
+		return -1;
+	}
+
+	/* ...for fsync, which writes it once. */
+	result = VOP_FSYNC(vn);
+	if (result) {
+		kprintf("%s: fsync: %s\n", name, strerror(result));
+		return -1;
+	}
+	if (sfssync_check(vn, name, "fsync", 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * fs8: fsync and fdatasync.
+ */
+int
+sfssynctest(int nargs, char **args)
+{
+	char *dev;
+	char name[32];
+	char buf[32];
+	struct vnode *vn;
+	int result, failed;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs8 filesystem:\n");
+		return EINVAL;
+	}
+	dev = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (dev[strlen(dev)-1]==':') {
+		dev[strlen(dev)-1] = 0;
+	}
+
+	kprintf("*** Starting SFS sync test on %s:\n", dev);
+	snprintf(name, sizeof(name), "%s:%s", dev, SYNCNAME);
+
+	/* It has to be a new file; get rid of any left over. */
+	strcpy(buf, name);
+	vfs_remove(buf);
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	result = vfs_open(buf, O_RDWR|O_CREAT|O_EXCL, 0664, &vn);
+	if (result) {
+		kprintf("Could not create %s: %s\n", name, strerror(result));
+		kprintf("*** Test failed\n");
+		return 0;
+	}
+
+	failed = sfssync_run(vn, name);
+	vfs_close(vn);
+
+	strcpy(buf, name);
+	result = vfs_remove(buf);
+	if (result) {
+		kprintf("Could not remove %s: %s\n", name, strerror(result));
+		failed = -1;
+	}
+
+	if (failed) {
+		kprintf("*** Test failed\n");
+		return 0;
+	}
+	kprintf("*** SFS sync test done\n");
+	return 0;
+}
@@ -440,3 +440,142 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 
         // panic("cv_broadcast() has not yet been implemented\n");
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rwlock_rwchan = wchan_create(rw->rwlock_name);
+	if (rw->rwlock_rwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rwlock_wwchan = wchan_create(rw->rwlock_name);
+	if (rw->rwlock_wwchan == NULL) {
+		wchan_destroy(rw->rwlock_rwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rwlock_spinlock);
+	rw->rwlock_readers = 0;
+	rw->rwlock_waitingwriters = 0;
+	rw->rwlock_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rwlock_readers == 0);
+	KASSERT(rw->rwlock_writer == NULL);
+
+	/* cleanup will assert if anyone's waiting on it */
+	spinlock_cleanup(&rw->rwlock_spinlock);
+	wchan_destroy(rw->rwlock_wwchan);
+	wchan_destroy(rw->rwlock_rwchan);
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rwlock_spinlock);
+	KASSERT(rw->rwlock_writer != curthread);
+	/* Stand aside for waiting writers so they don't starve. */
+	while (rw->rwlock_writer != NULL || rw->rwlock_waitingwriters > 0) {
+		wchan_sleep(rw->rwlock_rwchan, &rw->rwlock_spinlock);
+	}
+	rw->rwlock_readers++;
+	spinlock_release(&rw->rwlock_spinlock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwlock_spinlock);
+	KASSERT(rw->rwlock_readers > 0);
+	rw->rwlock_readers--;
+	if (rw->rwlock_readers == 0) {
+		wchan_wakeone(rw->rwlock_wwchan, &rw->rwlock_spinlock);
+	}
+	spinlock_release(&rw->rwlock_spinlock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rwlock_spinlock);
+	KASSERT(rw->rwlock_writer != curthread);
+	rw->rwlock_waitingwriters++;
+	while (rw->rwlock_writer != NULL || rw->rwlock_readers > 0) {
+		wchan_sleep(rw->rwlock_wwchan, &rw->rwlock_spinlock);
+	}
+	rw->rwlock_waitingwriters--;
+	rw->rwlock_writer = curthread;
+	spinlock_release(&rw->rwlock_spinlock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwlock_spinlock);
+	KASSERT(rw->rwlock_writer == curthread);
+	rw->rwlock_writer = NULL;
+	/*
+	 * Prefer the next writer if there is one; otherwise let all
+	 * the readers in.
+	 */
+	if (rw->rwlock_waitingwriters > 0) {
+		wchan_wakeone(rw->rwlock_wwchan, &rw->rwlock_spinlock);
+	}
+	else {
+		wchan_wakeall(rw->rwlock_rwchan, &rw->rwlock_spinlock);
+	}
+	spinlock_release(&rw->rwlock_spinlock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rwlock_spinlock);
+	ret = (rw->rwlock_writer == curthread);
+	spinlock_release(&rw->rwlock_spinlock);
+	return ret;
+}
@@ -0,0 +1,1239 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache.
+ *
+ * Buffers live in a hash table on (device, block) and on a single
+ * LRU list; the head of the list is the least recently used.
+ * Eviction takes the least recently used buffer that isn't held,
+ * writing it back first if it is dirty. Buffers are allocated on
+ * demand until the memory budget is reached; if every buffer is
+ * held, the budget is exceeded rather than waiting.
+ *
+ * Dirty buffers are also on a dirty list, in the order they became
+ * dirty. Writes are delayed: the syncer thread wakes up every
+ * BUF_SYNCER_INTERVAL seconds and writes back buffers that have been
+ * dirty for more than BUF_DIRTY_MAXAGE seconds, and also enough of
+ * the oldest ones to bring dirty memory down to BUF_DIRTY_BG. A
+ * thread that lets go of a dirty buffer when more than BUF_DIRTY_MAX
+ * is dirty is throttled: it does that writeback itself before going
+ * on.
+ *
+ * Pinned buffers are dirty buffers that must stay in memory unwritten;
+ * writeback, eviction, and flushing all pass them over.
+ *
+ * Dirty data file systems hold outside the cache (buf_delaybytes)
+ * counts as cache memory for the budget and as dirty memory for the
+ * limits above. The syncer can't write it itself; each time it runs,
+ * it first has file systems write out what has been held longer than
+ * BUF_DIRTY_MAXAGE, or all of it when more than BUF_DIRTY_BG is
+ * dirty.
+ *
+ * Read-ahead requests create a held, not yet valid buffer and put it
+ * on buf_raqueue; the read-ahead thread reads them in the order they
+ * were asked for and then lets go of them. Anyone who wants one of
+ * these blocks in the meantime just waits for it like any other held
+ * buffer.
+ *
+ * Device I/O is done in runs of up to BUF_MAXRUN consecutive blocks
+ * where possible: writing back a dirty buffer also writes any dirty
+ * neighbours that aren't held, the read-ahead thread merges
+ * consecutive requests, and buffer_readrun reads a whole range of
+ * blocks that aren't cached. Each run is a single DEVOP_IO, with one
+ * iovec per buffer.
+ *
+ * buf_lock protects all of the cache's state except buffer contents,
+ * which belong to whoever holds the buffer. It is never held across
+ * device I/O: a buffer is marked held (b_busy) instead, and threads
+ * that want a held buffer wait on buf_cv.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <clock.h>
+#include <thread.h>
+#include <device.h>
+#include <vfs.h>
+#include <buf.h>
+
+#define BUF_NBUCKETS	128	/* hash chains; must be a power of 2 */
+
+#define BUF_SYNCER_INTERVAL	1	/* seconds between syncer runs */
+#define BUF_DIRTY_MAXAGE	5	/* seconds a buffer may stay dirty */
+#define BUF_DIRTY_BG	(buf_maxbytes / 4)	/* syncer writes above this */
+#define BUF_DIRTY_MAX	(buf_maxbytes / 2)	/* writers throttled above this */
+
+/* Memory in use, and dirty, counting data held outside the cache */
+#define BUF_USEDBYTES	(buf_curbytes + buf_delaybytes)
+#define BUF_DIRTYBYTES	(buf_dirtybytes + buf_delaybytes)
+
+#define BUF_RAQUEUE	64	/* max read-ahead requests outstanding */
+#define BUF_MAXRUN	16	/* max blocks in one device I/O */
+
+struct buf {
+	struct device *b_dev;		/* device */
+	daddr_t b_block;		/* block number on device */
+	size_t b_size;			/* block size */
+	void *b_data;			/* contents */
+	bool b_valid;			/* contents have been loaded */
+	bool b_dirty;			/* contents need writing back */
+	bool b_busy;			/* held by some thread */
+	bool b_readahead;		/* read ahead and not yet used */
+	bool b_pinned;			/* must not be written back */
+	unsigned b_flushgen;		/* last flush pass to see it */
+	void *b_owner;			/* who last dirtied it */
+	time_t b_dirtytime;		/* when it became dirty */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list */
+	struct buf *b_lrunext;
+	struct buf *b_dirtyprev;	/* dirty list */
+	struct buf *b_dirtynext;
+};
+
+struct bufstats {
+	unsigned hits;			/* found in the cache */
+	unsigned misses;		/* not found */
+	unsigned reads;			/* blocks read from disk */
+	unsigned readios;		/* ...in this many device reads */
+	unsigned writes;		/* blocks written to disk */
+	unsigned writeios;		/* ...in this many device writes */
+	unsigned writebacks;		/* dirty blocks written on eviction */
+	unsigned flushes;		/* dirty blocks written by flush */
+	unsigned syncs;			/* dirty blocks written by syncer */
+	unsigned throttles;		/* writers made to wait */
+	unsigned throttlewrites;	/* dirty blocks they wrote */
+	unsigned evictions;		/* buffers freed to make room */
+	unsigned invalidations;		/* buffers thrown away */
+	unsigned rareads;		/* blocks read ahead */
+	unsigned rahits;		/* ...that were then used */
+	unsigned rawasted;		/* ...that were thrown away unused */
+	unsigned radropped;		/* requests dropped, queue full */
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+static struct buf *buf_buckets[BUF_NBUCKETS];
+static struct buf *buf_lruhead, *buf_lrutail;
+static struct buf *buf_dirtyhead, *buf_dirtytail;
+static unsigned buf_count;
+static size_t buf_curbytes, buf_maxbytes, buf_dirtybytes;
+static size_t buf_delaybytes;
+static unsigned buf_flushgen;
+static struct bufstats buf_stats;
+
+static struct cv *buf_racv;
+static struct buf *buf_raqueue[BUF_RAQUEUE];
+static unsigned buf_rahead, buf_racount;
+
+////////////////////////////////////////////////////////////
+// Lists
+
+static
+unsigned
+buffer_hash(struct device *dev, daddr_t block)
+{
+	return ((uintptr_t)dev / sizeof(void *) + block * 31U) &
+		(BUF_NBUCKETS - 1);
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	for (b = buf_buckets[buffer_hash(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buffer_lruappend(struct buf *b)
+{
+	b->b_lruprev = buf_lrutail;
+	b->b_lrunext = NULL;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/*
+ * Mark B dirty, putting it at the end of the dirty list.
+ */
+static
+void
+buffer_setdirty(struct buf *b)
+{
+	struct timespec now;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(!b->b_dirty);
+
+	gettime(&now);
+	b->b_dirty = true;
+	b->b_dirtytime = now.tv_sec;
+	b->b_dirtyprev = buf_dirtytail;
+	b->b_dirtynext = NULL;
+	if (buf_dirtytail != NULL) {
+		buf_dirtytail->b_dirtynext = b;
+	}
+	else {
+		buf_dirtyhead = b;
+	}
+	buf_dirtytail = b;
+	buf_dirtybytes += b->b_size;
+}
+
+/*
+ * Mark B clean, taking it off the dirty list.
+ */
+static
+void
+buffer_setclean(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_dirty);
+
+	if (b->b_dirtyprev != NULL) {
+		b->b_dirtyprev->b_dirtynext = b->b_dirtynext;
+	}
+	else {
+		buf_dirtyhead = b->b_dirtynext;
+	}
+	if (b->b_dirtynext != NULL) {
+		b->b_dirtynext->b_dirtyprev = b->b_dirtyprev;
+	}
+	else {
+		buf_dirtytail = b->b_dirtyprev;
+	}
+	b->b_dirtyprev = b->b_dirtynext = NULL;
+	b->b_dirty = false;
+	b->b_owner = NULL;
+	buf_dirtybytes -= b->b_size;
+}
+
+/*
+ * Take a buffer out of the cache and free it. The buffer must be
+ * held by the caller (or by nobody).
+ */
+static
+void
+buffer_destroy(struct buf *b)
+{
+	struct buf **pp;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	for (pp = &buf_buckets[buffer_hash(b->b_dev, b->b_block)];
+	     *pp != b; pp = &(*pp)->b_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = b->b_hashnext;
+	buffer_lruremove(b);
+	if (b->b_dirty) {
+		buffer_setclean(b);
+	}
+	if (b->b_readahead) {
+		buf_stats.rawasted++;
+	}
+
+	buf_count--;
+	buf_curbytes -= b->b_size;
+	kfree(b->b_data);
+	kfree(b);
+
+	/* Anyone waiting for it will find it gone and start over. */
+	cv_broadcast(buf_cv, buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Read or write the N held buffers in BUFS, which must be
+ * consecutive blocks of the same device, in one device I/O. Retries
+ * I/O errors. Called without buf_lock.
+ */
+static
+int
+buffer_iorun(struct buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUF_MAXRUN];
+	struct uio ku;
+	struct buf *b = bufs[0];
+	unsigned i;
+	int result;
+	int tries = 0;
+
+	KASSERT(n > 0 && n <= BUF_MAXRUN);
+	KASSERT(!lock_do_i_hold(buf_lock));
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_dev == b->b_dev);
+		KASSERT(bufs[i]->b_block == b->b_block + i);
+		KASSERT(bufs[i]->b_size == b->b_size);
+	}
+
+	DEBUG(DB_VFS, "buf: %s %u-%u\n", rw == UIO_READ ? "read" : "write",
+	      b->b_block, b->b_block + n - 1);
+
+ retry:
+	/* uiomove consumes the iovecs, so set them up each time. */
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = b->b_size;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)b->b_block * b->b_size;
+	ku.uio_resid = n * b->b_size;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	result = DEVOP_IO(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the block was out of range or something
+		 * else that's our fault.
+		 */
+		panic("buf: DEVOP_IO returned EINVAL for blocks %u-%u\n",
+		      b->b_block, b->b_block + n - 1);
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: blocks %u-%u I/O error, retrying\n",
+				b->b_block, b->b_block + n - 1);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: blocks %u-%u I/O error, giving up "
+				"after %d retries\n", b->b_block,
+				b->b_block + n - 1, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Read or write a single held buffer.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	return buffer_iorun(&b, 1, rw);
+}
+
+/*
+ * Check if the buffer for (DEV, BLOCK) is a dirty buffer nobody
+ * holds, which can go in the same write as a neighbour of size SIZE.
+ */
+static
+struct buf *
+buffer_clusterable(struct device *dev, daddr_t block, size_t size)
+{
+	struct buf *b;
+
+	b = buffer_find(dev, block);
+	if (b == NULL || !b->b_dirty || b->b_busy || b->b_pinned ||
+	    b->b_size != size) {
+		return NULL;
+	}
+	return b;
+}
+
+/*
+ * Write back held buffer B, along with whatever dirty, unheld
+ * buffers for the blocks on either side of it will fit in the same
+ * device I/O. Drops buf_lock around the I/O. Adds the number of
+ * buffers written to *WRITTEN.
+ */
+static
+int
+buffer_writeback(struct buf *b, unsigned *written)
+{
+	struct buf *run[BUF_MAXRUN];
+	struct buf *nb;
+	unsigned before, after, n, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+	KASSERT(!b->b_pinned);
+
+	/* Count dirty neighbours below B, then above it. */
+	for (before = 0; before + 1 < BUF_MAXRUN; before++) {
+		if (b->b_block < before + 1 ||
+		    buffer_clusterable(b->b_dev, b->b_block - before - 1,
+				       b->b_size) == NULL) {
+			break;
+		}
+	}
+	for (after = 0; before + after + 1 < BUF_MAXRUN; after++) {
+		if (buffer_clusterable(b->b_dev, b->b_block + after + 1,
+				       b->b_size) == NULL) {
+			break;
+		}
+	}
+
+	n = before + 1 + after;
+	for (i=0; i<n; i++) {
+		if (i == before) {
+			nb = b;
+		}
+		else {
+			nb = buffer_find(b->b_dev, b->b_block - before + i);
+			KASSERT(nb != NULL);
+			nb->b_busy = true;
+		}
+		run[i] = nb;
+	}
+
+	lock_release(buf_lock);
+	result = buffer_iorun(run, n, UIO_WRITE);
+	lock_acquire(buf_lock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			buffer_setclean(run[i]);
+		}
+		if (run[i] != b) {
+			run[i]->b_busy = false;
+		}
+	}
+	if (n > 1) {
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	if (result == 0) {
+		buf_stats.writes += n;
+		*written += n;
+	}
+	buf_stats.writeios++;
+	return result;
+}
+
+/*
+ * Write back dirty buffers, oldest first, until none is left that
+ * became dirty before CUTOFF and no more than TARGET bytes are
+ * dirty. Held buffers are skipped, and each buffer is tried at most
+ * once. Returns the number of buffers written.
+ */
+static
+unsigned
+buffer_cleanup(time_t cutoff, size_t target)
+{
+	struct buf *b;
+	unsigned gen, count = 0;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	gen = ++buf_flushgen;
+ again:
+	for (b = buf_dirtyhead; b != NULL; b = b->b_dirtynext) {
+		if (b->b_dirtytime >= cutoff && buf_dirtybytes <= target) {
+			/* Everything after this is younger still. */
+			break;
+		}
+		if (b->b_busy || b->b_pinned || b->b_flushgen == gen) {
+			continue;
+		}
+		b->b_flushgen = gen;
+		b->b_busy = true;
+		buffer_writeback(b, &count);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+		/* The list may have changed while we were writing. */
+		goto again;
+	}
+	return count;
+}
+
+////////////////////////////////////////////////////////////
+// Getting buffers
+
+/*
+ * Make room for one more buffer by evicting the least recently used
+ * one that isn't held. Returns ENOSPC if every buffer is held.
+ * May release buf_lock; if it does, the caller must look again for
+ * what it wanted, as anything might have happened.
+ */
+static
+int
+buffer_evict(void)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy && !b->b_pinned) {
+			break;
+		}
+	}
+	if (b == NULL) {
+		return ENOSPC;
+	}
+
+	if (b->b_dirty) {
+		b->b_busy = true;
+		result = buffer_writeback(b, &buf_stats.writebacks);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			/* Keep it, and try something else next time. */
+			buffer_lruremove(b);
+			buffer_lruappend(b);
+			return result;
+		}
+	}
+
+	buf_stats.evictions++;
+	buffer_destroy(b);
+	return 0;
+}
+
+/*
+ * Create a held, empty buffer for (DEV, BLOCK), which must not
+ * already be in the cache.
+ */
+static
+struct buf *
+buffer_create(struct device *dev, daddr_t block, size_t size)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(size);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_size = size;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = true;
+	b->b_readahead = false;
+	b->b_pinned = false;
+	b->b_flushgen = buf_flushgen;
+	b->b_owner = NULL;
+	b->b_dirtytime = 0;
+	b->b_dirtyprev = b->b_dirtynext = NULL;
+
+	b->b_hashnext = buf_buckets[buffer_hash(dev, block)];
+	buf_buckets[buffer_hash(dev, block)] = b;
+	buffer_lruappend(b);
+	buf_count++;
+	buf_curbytes += size;
+	return b;
+}
+
+/*
+ * Find or create the buffer for (DEV, BLOCK) and hold it. Counts a
+ * hit or a miss; the caller deals with loading the contents.
+ */
+static
+int
+buffer_acquire(struct device *dev, daddr_t block, size_t size,
+	       struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	while (1) {
+		b = buffer_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			KASSERT(b->b_size == size);
+			b->b_busy = true;
+			buffer_lruremove(b);
+			buffer_lruappend(b);
+			buf_stats.hits++;
+			if (b->b_readahead) {
+				b->b_readahead = false;
+				buf_stats.rahits++;
+			}
+			*ret = b;
+			return 0;
+		}
+
+		if (BUF_USEDBYTES + size > buf_maxbytes) {
+			result = buffer_evict();
+			if (result == 0) {
+				/* Made room; but look again. */
+				continue;
+			}
+			/* Otherwise go over budget for now. */
+		}
+		break;
+	}
+
+	b = buffer_create(dev, block, size);
+	if (b == NULL) {
+		return ENOMEM;
+	}
+	buf_stats.misses++;
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, size_t size,
+	    struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buffer_acquire(dev, block, size, &b);
+	if (result) {
+		lock_release(buf_lock);
+		return result;
+	}
+	if (b->b_valid) {
+		lock_release(buf_lock);
+		*ret = b;
+		return 0;
+	}
+	lock_release(buf_lock);
+
+	result = buffer_io(b, UIO_READ);
+
+	lock_acquire(buf_lock);
+	if (result) {
+		buffer_destroy(b);
+		lock_release(buf_lock);
+		return result;
+	}
+	b->b_valid = true;
+	buf_stats.reads++;
+	buf_stats.readios++;
+	lock_release(buf_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, size_t size,
+	   struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buffer_acquire(dev, block, size, &b);
+	lock_release(buf_lock);
+	if (result) {
+		return result;
+	}
+	if (!b->b_valid) {
+		bzero(b->b_data, b->b_size);
+		b->b_valid = true;
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Make sure blocks BLOCK through BLOCK+NBLOCKS-1 of DEV are in the
+ * cache, reading each run of them that isn't with one device I/O.
+ * Nothing is held afterwards; the caller gets at the blocks with
+ * buffer_read as usual.
+ */
+int
+buffer_readrun(struct device *dev, daddr_t block, unsigned nblocks,
+	       size_t size)
+{
+	struct buf *run[BUF_MAXRUN];
+	struct buf *b;
+	unsigned i, n, j;
+	int result = 0;
+
+	lock_acquire(buf_lock);
+	i = 0;
+	while (i < nblocks) {
+		if (buffer_find(dev, block + i) != NULL) {
+			i++;
+			continue;
+		}
+
+		/* Make held, empty buffers for as many as we can. */
+		n = 0;
+		while (i + n < nblocks && n < BUF_MAXRUN) {
+			if (buffer_find(dev, block + i + n) != NULL) {
+				break;
+			}
+			if (BUF_USEDBYTES + size > buf_maxbytes &&
+			    buffer_evict() == 0) {
+				/* Made room; but look again. */
+				continue;
+			}
+			b = buffer_create(dev, block + i + n, size);
+			if (b == NULL) {
+				break;
+			}
+			buf_stats.misses++;
+			run[n++] = b;
+		}
+		if (n == 0) {
+			/* Out of memory; let buffer_read deal with it. */
+			break;
+		}
+
+		lock_release(buf_lock);
+		result = buffer_iorun(run, n, UIO_READ);
+		lock_acquire(buf_lock);
+
+		for (j=0; j<n; j++) {
+			if (result) {
+				buffer_destroy(run[j]);
+				continue;
+			}
+			run[j]->b_valid = true;
+			run[j]->b_busy = false;
+		}
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			break;
+		}
+		buf_stats.reads += n;
+		buf_stats.readios++;
+		i += n;
+	}
+	lock_release(buf_lock);
+	return result;
+}
+
+/*
+ * Start reading (DEV, BLOCK) into the cache in the background, if it
+ * isn't there already. This is only a hint: if the queue is full, or
+ * there's no room without going over budget, nothing happens.
+ */
+void
+buffer_readahead(struct device *dev, daddr_t block, size_t size)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		if (buffer_find(dev, block) != NULL) {
+			lock_release(buf_lock);
+			return;
+		}
+		if (buf_racount == BUF_RAQUEUE) {
+			buf_stats.radropped++;
+			lock_release(buf_lock);
+			return;
+		}
+		if (BUF_USEDBYTES + size <= buf_maxbytes) {
+			break;
+		}
+		if (buffer_evict()) {
+			lock_release(buf_lock);
+			return;
+		}
+		/* buffer_evict may have slept; look again. */
+	}
+
+	b = buffer_create(dev, block, size);
+	if (b == NULL) {
+		lock_release(buf_lock);
+		return;
+	}
+	b->b_readahead = true;
+	buf_raqueue[(buf_rahead + buf_racount) % BUF_RAQUEUE] = b;
+	buf_racount++;
+	cv_signal(buf_racv, buf_lock);
+	lock_release(buf_lock);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b, void *owner)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	if (!b->b_dirty) {
+		buffer_setdirty(b);
+	}
+	b->b_owner = owner;
+	lock_release(buf_lock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	cv_broadcast(buf_cv, buf_lock);
+
+	if (b->b_dirty && BUF_DIRTYBYTES > BUF_DIRTY_MAX) {
+		/* Too much is dirty; help write it out. */
+		buf_stats.throttles++;
+		buf_stats.throttlewrites += buffer_cleanup(0, BUF_DIRTY_BG);
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_pin(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+	b->b_pinned = true;
+	lock_release(buf_lock);
+}
+
+bool
+buffer_pinned(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_pinned;
+}
+
+void
+buffer_unpin(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	b = buffer_find(dev, block);
+	KASSERT(b != NULL && b->b_pinned);
+	b->b_pinned = false;
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Per-device operations
+
+/*
+ * Write back every dirty buffer for DEV, or if ANYOWNER is false
+ * only those last dirtied by OWNER. Pinned buffers are skipped. Each
+ * buffer is tried once; if any write fails, the buffer stays dirty
+ * and the first error is returned after trying the rest.
+ */
+static
+int
+buffer_doflush(struct device *dev, bool anyowner, void *owner)
+{
+	struct buf *b;
+	unsigned gen;
+	int result, ret = 0;
+
+	lock_acquire(buf_lock);
+	gen = ++buf_flushgen;
+ again:
+	for (b = buf_dirtyhead; b != NULL; b = b->b_dirtynext) {
+		if (b->b_dev != dev || b->b_pinned || b->b_flushgen == gen) {
+			continue;
+		}
+		if (!anyowner && b->b_owner != owner) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		b->b_flushgen = gen;
+		b->b_busy = true;
+		result = buffer_writeback(b, &buf_stats.flushes);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		/* The list may have changed while we were writing. */
+		goto again;
+	}
+	lock_release(buf_lock);
+	return ret;
+}
+
+int
+buffer_flush(struct device *dev)
+{
+	return buffer_doflush(dev, true, NULL);
+}
+
+int
+buffer_flush_owner(struct device *dev, void *owner)
+{
+	return buffer_doflush(dev, false, owner);
+}
+
+int
+buffer_flush_block(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+	int result = 0;
+
+	lock_acquire(buf_lock);
+	while ((b = buffer_find(dev, block)) != NULL && b->b_busy) {
+		cv_wait(buf_cv, buf_lock);
+	}
+	if (b != NULL && b->b_dirty && !b->b_pinned) {
+		b->b_busy = true;
+		result = buffer_writeback(b, &buf_stats.flushes);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+	return result;
+}
+
+void
+buffer_invalidate(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	while ((b = buffer_find(dev, block)) != NULL) {
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			continue;
+		}
+		KASSERT(!b->b_pinned);
+		buf_stats.invalidations++;
+		buffer_destroy(b);
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_dropdev(struct device *dev)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+ again:
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		KASSERT(!b->b_pinned);
+		buffer_destroy(b);
+		goto again;
+	}
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Syncer
+
+/*
+ * The syncer thread. Runs forever.
+ */
+static
+void
+buffer_syncer(void *unused1, unsigned long unused2)
+{
+	struct timespec now;
+	time_t cutoff;
+	bool delayed;
+	unsigned count;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(BUF_SYNCER_INTERVAL);
+		gettime(&now);
+
+		/* First the data file systems are holding. */
+		lock_acquire(buf_lock);
+		delayed = buf_delaybytes > 0;
+		if (BUF_DIRTYBYTES > BUF_DIRTY_BG) {
+			cutoff = now.tv_sec + 1;
+		}
+		else {
+			cutoff = now.tv_sec - BUF_DIRTY_MAXAGE;
+		}
+		lock_release(buf_lock);
+		if (delayed) {
+			vfs_writeback(cutoff);
+		}
+
+		lock_acquire(buf_lock);
+		count = buffer_cleanup(now.tv_sec - BUF_DIRTY_MAXAGE,
+				       BUF_DIRTY_BG);
+		buf_stats.syncs += count;
+		lock_release(buf_lock);
+	}
+}
+
+/*
+ * The read-ahead thread. Runs forever.
+ */
+static
+void
+buffer_reader(void *unused1, unsigned long unused2)
+{
+	struct buf *run[BUF_MAXRUN];
+	struct buf *b;
+	unsigned n, i;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		while (buf_racount == 0) {
+			cv_wait(buf_racv, buf_lock);
+		}
+
+		/* Take the first request and any that follow on from it. */
+		n = 0;
+		while (buf_racount > 0 && n < BUF_MAXRUN) {
+			b = buf_raqueue[buf_rahead];
+			if (n > 0 && (b->b_dev != run[0]->b_dev ||
+				      b->b_block != run[0]->b_block + n ||
+				      b->b_size != run[0]->b_size)) {
+				break;
+			}
+			KASSERT(b->b_busy && !b->b_valid);
+			run[n++] = b;
+			buf_rahead = (buf_rahead + 1) % BUF_RAQUEUE;
+			buf_racount--;
+		}
+
+		lock_release(buf_lock);
+		result = buffer_iorun(run, n, UIO_READ);
+		lock_acquire(buf_lock);
+
+		for (i=0; i<n; i++) {
+			if (result) {
+				buffer_destroy(run[i]);
+				continue;
+			}
+			run[i]->b_valid = true;
+			run[i]->b_busy = false;
+		}
+		cv_broadcast(buf_cv, buf_lock);
+		if (result == 0) {
+			buf_stats.reads += n;
+			buf_stats.readios++;
+			buf_stats.rareads += n;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Setup and statistics
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buf_lock = lock_create("buffer cache");
+	if (buf_lock == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buf_cv = cv_create("buffer cache");
+	if (buf_cv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buf_racv = cv_create("buffer read-ahead");
+	if (buf_racv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buf_maxbytes = BUF_DEFAULT_MAXBYTES;
+
+	result = thread_fork("syncer", NULL, buffer_syncer, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+	result = thread_fork("readahead", NULL, buffer_reader, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Data held outside the cache
+
+void
+buffer_delay_add(size_t size)
+{
+	lock_acquire(buf_lock);
+	buf_delaybytes += size;
+	lock_release(buf_lock);
+}
+
+void
+buffer_delay_remove(size_t size)
+{
+	lock_acquire(buf_lock);
+	KASSERT(buf_delaybytes >= size);
+	buf_delaybytes -= size;
+	lock_release(buf_lock);
+}
+
+bool
+buffer_delay_room(size_t size)
+{
+	bool ret;
+
+	lock_acquire(buf_lock);
+	ret = BUF_DIRTYBYTES + size <= BUF_DIRTY_MAX;
+	lock_release(buf_lock);
+	return ret;
+}
+
+/*
+ * Change the memory budget, evicting buffers if we're now over it.
+ */
+void
+buffer_setmaxbytes(size_t maxbytes)
+{
+	lock_acquire(buf_lock);
+	buf_maxbytes = maxbytes;
+	while (BUF_USEDBYTES > buf_maxbytes) {
+		if (buffer_evict()) {
+			break;
+		}
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	struct bufstats stats;
+	struct buf *b;
+	unsigned count, ndirty, nbusy, npinned;
+	size_t curbytes, maxbytes, dirtybytes, delaybytes;
+
+	lock_acquire(buf_lock);
+	ndirty = nbusy = npinned = 0;
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dirty) {
+			ndirty++;
+		}
+		if (b->b_busy) {
+			nbusy++;
+		}
+		if (b->b_pinned) {
+			npinned++;
+		}
+	}
+	count = buf_count;
+	curbytes = buf_curbytes;
+	maxbytes = buf_maxbytes;
+	dirtybytes = buf_dirtybytes;
+	delaybytes = buf_delaybytes;
+	stats = buf_stats;
+	lock_release(buf_lock);
+
+	kprintf("Buffer cache: %u buffers, %zu/%zu bytes, %u dirty "
+		"(%zu bytes), %u held, %u pinned\n", count, curbytes,
+		maxbytes, ndirty, dirtybytes, nbusy, npinned);
+	kprintf("    %zu bytes of dirty data held outside the cache\n",
+		delaybytes);
+	kprintf("    %u hits, %u misses\n", stats.hits, stats.misses);
+	kprintf("    %u blocks read in %u I/Os, %u written in %u I/Os\n",
+		stats.reads, stats.readios, stats.writes, stats.writeios);
+	kprintf("    %u evictions, %u written on eviction, "
+		"%u written by flush, %u invalidations\n",
+		stats.evictions, stats.writebacks, stats.flushes,
+		stats.invalidations);
+	kprintf("    %u written by syncer, %u writers throttled "
+		"(%u written)\n", stats.syncs, stats.throttles,
+		stats.throttlewrites);
+	kprintf("    %u read ahead, %u used, %u unused, %u dropped\n",
+		stats.rareads, stats.rahits, stats.rawasted,
+		stats.radropped);
+}
@@ -226,7 +226,7 @@ dev_isseekable(struct vnode *v)
 }
 
 /*
- * For fsync() - meaningless, do nothing.
+ * For fsync() and fdatasync() - meaningless, do nothing.
  */
 static
 int
@@ -336,8 +336,11 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_gettype = dev_gettype,
 	.vop_isseekable = dev_isseekable,
 	.vop_fsync = null_fsync,
+	.vop_fdatasync = null_fsync,
 	.vop_mmap = dev_mmap,
 	.vop_truncate = dev_truncate,
+	.vop_seekhole = vopfail_seekhole_nosys,
+	.vop_punch = vopfail_punch_nosys,
 	.vop_namefile = dev_namefile,
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
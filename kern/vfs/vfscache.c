@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VFS name cache.
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or
+ * to nothing at all for names known not to exist. vfs_lookup consults
+ * this before calling VOP_LOOKUP, so repeated lookups of the same
+ * names (e.g. execv walking PATH) don't go to the filesystem.
+ *
+ * Each entry holds a reference to its directory and, for positive
+ * entries, to the target vnode. Entries are invalidated by the
+ * vfspath.c operations that change directory contents, and all
+ * entries for a filesystem are purged before it is unmounted.
+ *
+ * Only single path components up to NC_NAMELEN characters are
+ * cached; longer names are rare and just go to VOP_LOOKUP.
+ *
+ * The table is fixed-size; when it fills up the least recently used
+ * entry is recycled. References are always dropped after releasing
+ * nc_lock, since VOP_DECREF may call into the filesystem.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define NC_NAMELEN	31	/* longest cached name */
+#define NC_NENTRIES	256	/* number of entries */
+#define NC_NBUCKETS	64	/* hash chains; must be a power of 2 */
+
+struct ncentry {
+	struct vnode *nc_dir;		/* directory, or NULL if free */
+	struct vnode *nc_vn;		/* target, or NULL if negative */
+	char nc_name[NC_NAMELEN+1];	/* name within nc_dir */
+	unsigned nc_hash;		/* hash of nc_dir and nc_name */
+	struct ncentry *nc_hashnext;	/* hash chain */
+	struct ncentry *nc_lruprev;	/* LRU list; head is the oldest */
+	struct ncentry *nc_lrunext;
+};
+
+static struct spinlock nc_lock;
+static struct ncentry nc_entries[NC_NENTRIES];
+static struct ncentry *nc_buckets[NC_NBUCKETS];
+static struct ncentry *nc_lruhead, *nc_lrutail;
+
+/*
+ * Bumped by every invalidation. A lookup that misses notes the
+ * generation before calling VOP_LOOKUP, and the result is only
+ * entered if nothing was invalidated in the meantime; otherwise a
+ * concurrent create or remove could leave a stale entry behind.
+ */
+static unsigned nc_gen;
+
+struct ncstats {
+	unsigned hits;
+	unsigned neghits;
+	unsigned misses;
+	unsigned enters;
+	unsigned races;
+	unsigned recycles;
+	unsigned invalidations;
+};
+
+static struct ncstats nc_stats;
+
+/*
+ * Hash function (FNV-1a over the name, seeded with the directory).
+ */
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = 2166136261U ^ (unsigned)(uintptr_t)dir;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * LRU list manipulation.
+ */
+static
+void
+nc_lru_unlink(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+	nc->nc_lruprev = nc->nc_lrunext = NULL;
+}
+
+static
+void
+nc_lru_append(struct ncentry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = nc;
+	}
+	else {
+		nc_lruhead = nc;
+	}
+	nc_lrutail = nc;
+}
+
+static
+void
+nc_lru_prepend(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+/*
+ * Find an entry. Call with nc_lock held.
+ */
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct ncentry *nc;
+
+	for (nc = nc_buckets[hash & (NC_NBUCKETS-1)];
+	     nc != NULL; nc = nc->nc_hashnext) {
+		if (nc->nc_hash == hash && nc->nc_dir == dir &&
+		    !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of its hash chain and mark it free, moving it to
+ * the front of the LRU list so it gets reused first. Hands back the
+ * references it held, which the caller must drop after releasing
+ * nc_lock. Call with nc_lock held.
+ */
+static
+void
+nc_release(struct ncentry *nc, struct vnode **dir, struct vnode **vn)
+{
+	struct ncentry **pp;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	pp = &nc_buckets[nc->nc_hash & (NC_NBUCKETS-1)];
+	while (*pp != nc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+
+	*dir = nc->nc_dir;
+	*vn = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+	nc->nc_name[0] = 0;
+
+	nc_lru_unlink(nc);
+	nc_lru_prepend(nc);
+}
+
+/*
+ * Drop the references handed back by nc_release.
+ */
+static
+void
+nc_drop(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Setup function.
+ */
+void
+vfs_ncache_bootstrap(void)
+{
+	unsigned i;
+
+	spinlock_init(&nc_lock);
+	nc_lruhead = nc_lrutail = NULL;
+	for (i=0; i<NC_NBUCKETS; i++) {
+		nc_buckets[i] = NULL;
+	}
+	for (i=0; i<NC_NENTRIES; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_entries[i].nc_name[0] = 0;
+		nc_entries[i].nc_hash = 0;
+		nc_entries[i].nc_hashnext = NULL;
+		nc_lru_append(&nc_entries[i]);
+	}
+	nc_gen = 0;
+	bzero(&nc_stats, sizeof(nc_stats));
+}
+
+/*
+ * Look up NAME in DIR. On a hit, returns true and sets *RET to the
+ * vnode (with a new reference) or to NULL for a negative entry. On a
+ * miss, returns false and sets *GEN for passing to vfs_ncache_enter.
+ */
+bool
+vfs_ncache_lookup(struct vnode *dir, const char *name,
+		  struct vnode **ret, unsigned *gen)
+{
+	struct ncentry *nc;
+	unsigned hash;
+
+	if (strlen(name) > NC_NAMELEN) {
+		spinlock_acquire(&nc_lock);
+		nc_stats.misses++;
+		*gen = nc_gen;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+
+	hash = nc_hashfunc(dir, name);
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name, hash);
+	if (nc == NULL) {
+		nc_stats.misses++;
+		*gen = nc_gen;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+
+	nc_lru_unlink(nc);
+	nc_lru_append(nc);
+
+	*ret = nc->nc_vn;
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+		nc_stats.hits++;
+	}
+	else {
+		nc_stats.neghits++;
+	}
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+/*
+ * Record that NAME in DIR refers to VN, or that it does not exist if
+ * VN is NULL. GEN is the value returned by the vfs_ncache_lookup miss
+ * that preceded the VOP_LOOKUP call; if anything has been invalidated
+ * since, the result may be stale and is discarded.
+ */
+void
+vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned hash;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+
+	hash = nc_hashfunc(dir, name);
+
+	spinlock_acquire(&nc_lock);
+	if (gen != nc_gen) {
+		nc_stats.races++;
+		spinlock_release(&nc_lock);
+		return;
+	}
+	if (nc_find(dir, name, hash) != NULL) {
+		/* Someone else got here first */
+		spinlock_release(&nc_lock);
+		return;
+	}
+
+	nc = nc_lruhead;
+	KASSERT(nc != NULL);
+	if (nc->nc_dir != NULL) {
+		nc_release(nc, &olddir, &oldvn);
+		nc_stats.recycles++;
+		KASSERT(nc == nc_lruhead);
+	}
+
+	VOP_INCREF(dir);
+	nc->nc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+	nc->nc_hash = hash;
+	nc->nc_hashnext = nc_buckets[hash & (NC_NBUCKETS-1)];
+	nc_buckets[hash & (NC_NBUCKETS-1)] = nc;
+
+	nc_lru_unlink(nc);
+	nc_lru_append(nc);
+
+	nc_stats.enters++;
+	spinlock_release(&nc_lock);
+
+	nc_drop(olddir, oldvn);
+}
+
+/*
+ * Forget about NAME in DIR. Called after any operation that may have
+ * changed what NAME refers to. If the name referred to something
+ * that was a directory, entries for names within it are flushed too,
+ * so a removed directory isn't kept alive by the cache.
+ */
+void
+vfs_ncache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned hash;
+
+	spinlock_acquire(&nc_lock);
+	nc_gen++;
+	nc_stats.invalidations++;
+	if (strlen(name) > NC_NAMELEN) {
+		spinlock_release(&nc_lock);
+		return;
+	}
+	hash = nc_hashfunc(dir, name);
+	nc = nc_find(dir, name, hash);
+	if (nc != NULL) {
+		nc_release(nc, &olddir, &oldvn);
+	}
+	spinlock_release(&nc_lock);
+
+	if (oldvn != NULL) {
+		vfs_ncache_purgevnode(oldvn);
+	}
+	nc_drop(olddir, oldvn);
+}
+
+/*
+ * Flush every entry whose directory is DIR, or whose directory is on
+ * filesystem FS. References are collected in batches so they can be
+ * dropped with nc_lock released.
+ */
+#define NC_PURGEBATCH	16
+
+static
+void
+nc_purge(struct vnode *dir, struct fs *fs)
+{
+	struct vnode *dirs[NC_PURGEBATCH], *vns[NC_PURGEBATCH];
+	struct ncentry *nc;
+	unsigned i, j, n;
+
+	i = 0;
+	while (i < NC_NENTRIES) {
+		n = 0;
+		spinlock_acquire(&nc_lock);
+		for (; i<NC_NENTRIES && n<NC_PURGEBATCH; i++) {
+			nc = &nc_entries[i];
+			if (nc->nc_dir == NULL) {
+				continue;
+			}
+			if (nc->nc_dir != dir &&
+			    (fs == NULL || nc->nc_dir->vn_fs != fs)) {
+				continue;
+			}
+			nc_release(nc, &dirs[n], &vns[n]);
+			n++;
+		}
+		if (n > 0) {
+			nc_gen++;
+		}
+		spinlock_release(&nc_lock);
+
+		for (j=0; j<n; j++) {
+			nc_drop(dirs[j], vns[j]);
+		}
+	}
+}
+
+/*
+ * Flush every entry for names within DIR.
+ */
+void
+vfs_ncache_purgevnode(struct vnode *dir)
+{
+	nc_purge(dir, NULL);
+}
+
+/*
+ * Flush every entry for filesystem FS. Called before unmounting so
+ * the cache's references don't make the filesystem look busy.
+ */
+void
+vfs_ncache_purgefs(struct fs *fs)
+{
+	nc_purge(NULL, fs);
+}
+
+/*
+ * Print statistics.
+ */
+void
+vfs_ncache_printstats(void)
+{
+	unsigned used, i;
+	struct ncstats stats;
+
+	spinlock_acquire(&nc_lock);
+	used = 0;
+	for (i=0; i<NC_NENTRIES; i++) {
+		if (nc_entries[i].nc_dir != NULL) {
+			used++;
+		}
+	}
+	stats = nc_stats;
+	spinlock_release(&nc_lock);
+
+	kprintf("Name cache: %u/%u entries\n", used, NC_NENTRIES);
+	kprintf("    %u hits, %u negative hits, %u misses\n",
+		stats.hits, stats.neghits, stats.misses);
+	kprintf("    %u entered, %u lost races, %u recycled, "
+		"%u invalidations\n",
+		stats.enters, stats.races, stats.recycles,
+		stats.invalidations);
+}
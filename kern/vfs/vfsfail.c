@@ -114,6 +114,52 @@ vopfail_truncate_isdir(struct vnode *vn, off_t pos)
 	return EISDIR;
 }
 
+////////////////////////////////////////////////////////////
+// seekhole
+
+int
+vopfail_seekhole_isdir(struct vnode *vn, off_t pos, int whence,
+		       off_t *result)
+{
+	(void)vn;
+	(void)pos;
+	(void)whence;
+	(void)result;
+	return EISDIR;
+}
+
+int
+vopfail_seekhole_nosys(struct vnode *vn, off_t pos, int whence,
+		       off_t *result)
+{
+	(void)vn;
+	(void)pos;
+	(void)whence;
+	(void)result;
+	return ENOSYS;
+}
+
+////////////////////////////////////////////////////////////
+// punch
+
+int
+vopfail_punch_isdir(struct vnode *vn, off_t pos, off_t len)
+{
+	(void)vn;
+	(void)pos;
+	(void)len;
+	return EISDIR;
+}
+
+int
+vopfail_punch_nosys(struct vnode *vn, off_t pos, off_t len)
+{
+	(void)vn;
+	(void)pos;
+	(void)len;
+	return ENOSYS;
+}
+
 ////////////////////////////////////////////////////////////
 // creat
 
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -112,6 +113,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_ncache_bootstrap();
+	buffer_bootstrap();
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -190,6 +193,29 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Global writeback function - call FSOP_WRITEBACK on all devices.
+ * Called by the buffer cache's syncer thread.
+ */
+void
+vfs_writeback(time_t cutoff)
+{
+	struct knowndev *dev;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (dev->kd_fs != NULL && dev->kd_fs != SWAP_FS) {
+			/*result =*/ FSOP_WRITEBACK(dev->kd_fs, cutoff);
+		}
+	}
+
+	vfs_biglock_release();
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -654,6 +680,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop the name cache's references to it */
+	vfs_ncache_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -745,6 +774,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_ncache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -234,9 +234,98 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up a single component NAME in DIR through the name cache.
+ * "." and ".." are not cached: renaming a directory does not
+ * invalidate its ".." entry.
+ */
+static
+int
+lookup_once(struct vnode *dir, char *name, struct vnode **ret)
+{
+	unsigned gen;
+	int result;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return VOP_LOOKUP(dir, name, ret);
+	}
+
+	if (vfs_ncache_lookup(dir, name, ret, &gen)) {
+		return (*ret == NULL) ? ENOENT : 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, ret);
+	if (result == 0) {
+		vfs_ncache_enter(dir, name, *ret, gen);
+	}
+	else if (result == ENOENT) {
+		vfs_ncache_enter(dir, name, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Look up PATH relative to DIR. On a real filesystem, walk it one
+ * component at a time so each step can be answered from the name
+ * cache; devices get the whole path.
+ */
+static
+int
+lookup_cached(struct vnode *dir, char *path, struct vnode **ret)
+{
+	struct vnode *vn, *next;
+	char *name, *slash;
+	int result;
+
+	if (dir->vn_fs == NULL) {
+		return VOP_LOOKUP(dir, path, ret);
+	}
+
+	VOP_INCREF(dir);
+	vn = dir;
+	name = path;
+	while (1) {
+		while (*name == '/') {
+			name++;
+		}
+		if (*name == 0) {
+			/* trailing slash */
+			break;
+		}
+
+		/* Terminate the component in place; put the slash back after. */
+		slash = strchr(name, '/');
+		if (slash != NULL) {
+			*slash = 0;
+		}
+		result = lookup_once(vn, name, &next);
+		if (slash != NULL) {
+			*slash = '/';
+		}
+
+		VOP_DECREF(vn);
+		if (result) {
+			return result;
+		}
+		vn = next;
+
+		if (slash == NULL) {
+			break;
+		}
+		name = slash + 1;
+	}
+
+	*ret = vn;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * vfs_biglock is only needed to choose the starting vnode (it
+ * protects the device list and bootfs_vnode); it is released before
+ * calling into the filesystem, which does its own locking.
  */
 
 int
@@ -249,8 +338,8 @@ vfs_lookparent(char *path, struct vnode **retval,
 	vfs_biglock_acquire();
 
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -268,7 +357,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -281,20 +369,18 @@ vfs_lookup(char *path, struct vnode **retval)
 	vfs_biglock_acquire();
 
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = lookup_cached(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
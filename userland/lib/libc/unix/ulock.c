@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <ulock.h>
+
+/*
+ * User-level mutexes and condition variables built on futex().
+ *
+ * The mutex is the classic three-state futex lock: 0 is free, 1 is
+ * held with nobody waiting, and 2 is held with (possibly) somebody
+ * sleeping in the kernel. Only the 2 state makes unlock call into
+ * the kernel.
+ *
+ * The condition variable is a sequence number plus a count of
+ * waiters. A waiter samples the sequence number, drops the mutex,
+ * and sleeps only if it hasn't changed; signal and broadcast bump it
+ * and call into the kernel only if somebody is waiting.
+ */
+
+/*
+ * Atomic compare-and-swap: if *p == old, set *p = new. Returns the
+ * value *p had. Uses LL/SC the same way the kernel's spinlocks do.
+ */
+static
+int
+ulock_cas(volatile int *p, int old, int new)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"bne %0, %3, 2f;"	/*   if (x != old) fail */
+		"move %1, %4;"		/*   y = new */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   retry if the SC failed */
+		"2:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+	return x;
+}
+
+/*
+ * Atomic exchange, built on compare-and-swap.
+ */
+static
+int
+ulock_swap(volatile int *p, int new)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (ulock_cas(p, old, new) != old);
+	return old;
+}
+
+////////////////////////////////////////////////////////////
+// mutex
+
+void
+umutex_init(struct umutex *m)
+{
+	m->um_state = 0;
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+	if (ulock_cas(&m->um_state, 0, 1) != 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	return 0;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+	int c;
+
+	c = ulock_cas(&m->um_state, 0, 1);
+	if (c == 0) {
+		/* fast path: it was free */
+		return;
+	}
+
+	/*
+	 * Mark it contended and sleep until we are the ones who
+	 * move it out of the free state. Because we always set 2
+	 * here, whoever unlocks next will issue a wakeup even if
+	 * other sleepers are still around.
+	 */
+	if (c != 2) {
+		c = ulock_swap(&m->um_state, 2);
+	}
+	while (c != 0) {
+		futex(&m->um_state, FUTEX_WAIT, 2);
+		c = ulock_swap(&m->um_state, 2);
+	}
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+	if (ulock_swap(&m->um_state, 0) == 2) {
+		futex(&m->um_state, FUTEX_WAKE, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// condition variable
+
+void
+ucond_init(struct ucond *c)
+{
+	c->uc_seq = 0;
+	c->uc_waiters = 0;
+}
+
+/*
+ * Atomic add, built on compare-and-swap. Returns the new value.
+ */
+static
+int
+ulock_add(volatile int *p, int delta)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (ulock_cas(p, old, old + delta) != old);
+	return old + delta;
+}
+
+void
+ucond_wait(struct ucond *c, struct umutex *m)
+{
+	int seq;
+
+	/*
+	 * Register as a waiter while still holding the mutex, so a
+	 * signaler that takes the mutex after we drop it sees us.
+	 */
+	ulock_add(&c->uc_waiters, 1);
+	seq = c->uc_seq;
+	umutex_unlock(m);
+	/* EAGAIN here just means we were signaled before sleeping */
+	futex(&c->uc_seq, FUTEX_WAIT, seq);
+	ulock_add(&c->uc_waiters, -1);
+
+	/*
+	 * Reacquire in the contended state: other threads may have
+	 * been woken along with us and be sleeping on the mutex.
+	 */
+	while (ulock_swap(&m->um_state, 2) != 0) {
+		futex(&m->um_state, FUTEX_WAIT, 2);
+	}
+}
+
+void
+ucond_signal(struct ucond *c)
+{
+	ulock_add(&c->uc_seq, 1);
+	if (c->uc_waiters > 0) {
+		futex(&c->uc_seq, FUTEX_WAKE, 1);
+	}
+}
+
+void
+ucond_broadcast(struct ucond *c)
+{
+	int n;
+
+	ulock_add(&c->uc_seq, 1);
+	n = c->uc_waiters;
+	if (n > 0) {
+		futex(&c->uc_seq, FUTEX_WAKE, n);
+	}
+}
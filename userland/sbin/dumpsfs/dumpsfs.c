@@ -72,6 +72,8 @@ extern const char *hostcompat_progname;
 static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
+static uint32_t blocksize = SFS_BLOCKSIZE;
+static uint32_t itable;		/* inode table start, or 0 if none */
 
 ////////////////////////////////////////////////////////////
 // printouts
@@ -138,13 +140,44 @@ readsb(void)
 {
 	struct sfs_superblock sb;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	diskreadpart(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_BLOCKSIZE) {
+		blocksize = SWAP32(sb.sb_blocksize);
+		if (blocksize < SFS_BLOCKSIZE ||
+		    blocksize > SFS_MAXBLOCKSIZE ||
+		    (blocksize & (blocksize - 1)) != 0) {
+			errx(1, "Invalid block size %u", blocksize);
+		}
+	}
+	disksetblocksize(blocksize);
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_ITABLE) {
+		itable = SWAP32(sb.sb_itable);
+	}
 	return SWAP32(sb.sb_nblocks);
 }
 
+/*
+ * Read inode INO, from its own block or from the inode table.
+ */
+static
+void
+readinode(uint32_t ino, struct sfs_dinode *sfi)
+{
+	uint8_t buf[SFS_MAXBLOCKSIZE];
+	uint32_t perblock = SFS_INODESPERBLOCK(blocksize);
+
+	if (itable == 0) {
+		diskreadpart(sfi, sizeof(*sfi), ino);
+		return;
+	}
+	diskread(buf, itable + ino / perblock);
+	bzero(sfi, sizeof(*sfi));
+	memcpy(sfi, buf + (ino % perblock) * SFS_ISIZE, SFS_ISIZE);
+}
+
 static
 void
 dumpsb(void)
@@ -152,7 +185,7 @@ dumpsb(void)
 	struct sfs_superblock sb;
 	unsigned i;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	diskreadpart(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 	sb.sb_volname[sizeof(sb.sb_volname)-1] = 0;
 
 	printf("Superblock\n");
@@ -160,9 +193,42 @@ dumpsb(void)
 	dumpvalf("Magic", "0x%8x", SWAP32(sb.sb_magic));
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
-		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks), blocksize));
+	dumpvalf("Block size", "%u bytes", blocksize);
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("Features", "0x%x%s%s%s%s%s%s", SWAP32(sb.sb_features),
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_DIRINDEX) ?
+		 " (dirindex)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_EXTENTS) ?
+		 " (extents)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_BLOCKSIZE) ?
+		 " (blocksize)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_ITABLE) ?
+		 " (itable)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_JOURNAL) ?
+		 " (journal)" : "",
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_INLINE) ?
+		 " (inline)" : "");
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_ITABLE) {
+		dumpvalf("Inodes", "%u", SWAP32(sb.sb_ninodes));
+		dumpvalf("Inode bitmap", "block %u", SWAP32(sb.sb_inodemap));
+		dumpvalf("Inode table", "block %u", SWAP32(sb.sb_itable));
+	}
+	if (SWAP32(sb.sb_features) & SFS_FEATURE_JOURNAL) {
+		struct sfs_jheader sjh;
+
+		dumpvalf("Journal", "block %u, %u blocks",
+			 SWAP32(sb.sb_journal), SWAP32(sb.sb_journalblocks));
+		diskreadpart(&sjh, sizeof(sjh), SWAP32(sb.sb_journal));
+		if (SWAP32(sjh.sjh_magic) == SFS_JOURNAL_MAGIC) {
+			dumpvalf("Journal sequence", "%u",
+				 SWAP32(sjh.sjh_seq));
+		}
+		else {
+			dumpvalf("Journal header", "bad magic 0x%x",
+				 SWAP32(sjh.sjh_magic));
+		}
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -177,9 +243,10 @@ static
 void
 dumpfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(blocksize);
 	uint32_t i, j, k, bn;
-	uint8_t data[SFS_BLOCKSIZE], mask;
+	uint8_t data[SFS_MAXBLOCKSIZE], mask;
 	char tmp[16];
 
 	printf("Free block bitmap\n");
@@ -189,16 +256,16 @@ dumpfreemap(uint32_t fsblocks)
 		printf("    Freemap block #%u in disk block %u: blocks %u - %u"
 		       " (0x%x - 0x%x)\n",
 		       i, SFS_FREEMAP_START+i,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		       i*bitsperblock, (i+1)*bitsperblock - 1,
+		       i*bitsperblock, (i+1)*bitsperblock - 1);
+		for (j=0; j<blocksize; j++) {
 			if (j % 8 == 0) {
 				snprintf(tmp, sizeof(tmp), "0x%x",
-					 i*SFS_BITSPERBLOCK + j*8);
+					 i*bitsperblock + j*8);
 				printf("%-7s ", tmp);
 			}
 			for (k=0; k<8; k++) {
-				bn = i*SFS_BITSPERBLOCK + j*8 + k;
+				bn = i*bitsperblock + j*8 + k;
 				mask = 1U << k;
 				if (bn >= fsblocks) {
 					if (data[j] & mask) {
@@ -230,19 +297,22 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	static const char *const names[] = {
+		NULL, "Indirect", "Double indirect", "Triple indirect",
+	};
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	char tmp[128];
 	unsigned i;
 
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%s block %u\n", names[level], block);
 
 	diskread(ib, block);
-	for (i=0; i<ARRAYCOUNT(ib); i++) {
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
 		if (i % 4 == 0) {
 			printf("@%-3u   ", i);
 		}
@@ -253,14 +323,74 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+
+	if (level > 1) {
+		for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
+}
+
+static
+void
+dumpextents(const struct sfs_extent *se, unsigned count, unsigned depth)
+{
+	unsigned i;
+
+	for (i=0; i<count; i++) {
+		if (depth > 0) {
+			printf("@%-3u   file blocks %u and up -> "
+			       "tree block %u\n", i,
+			       SWAP32(se[i].se_fileblock),
+			       SWAP32(se[i].se_diskblock));
+		}
+		else {
+			printf("@%-3u   file blocks %u-%u -> "
+			       "disk blocks %u-%u\n", i,
+			       SWAP32(se[i].se_fileblock),
+			       SWAP32(se[i].se_fileblock) +
+			       SWAP32(se[i].se_nblocks) - 1,
+			       SWAP32(se[i].se_diskblock),
+			       SWAP32(se[i].se_diskblock) +
+			       SWAP32(se[i].se_nblocks) - 1);
+		}
+	}
+}
+
+static
+void
+dumpextblocks(const struct sfs_extent *se, unsigned count, unsigned depth)
+{
+	struct sfs_extent_block seb;
+	uint32_t block;
+	unsigned i;
+
+	if (depth == 0) {
+		return;
+	}
+	for (i=0; i<count; i++) {
+		block = SWAP32(se[i].se_diskblock);
+		diskreadpart(&seb, sizeof(seb), block);
+		printf("Extent block %u: magic 0x%x, %u levels below, "
+		       "%u entries\n", block, SWAP32(seb.seb_magic),
+		       SWAP16(seb.seb_depth), SWAP16(seb.seb_count));
+		if (SWAP32(seb.seb_magic) != SFS_EXTENT_MAGIC ||
+		    SWAP16(seb.seb_count) > SFS_EXTENTS_PERBLOCK) {
+			continue;
+		}
+		dumpextents(seb.seb_entries, SWAP16(seb.seb_count),
+			    SWAP16(seb.seb_depth));
+		dumpextblocks(seb.seb_entries, SWAP16(seb.seb_count),
+			      SWAP16(seb.seb_depth));
+	}
 }
 
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	unsigned i;
 
 	if (block == 0) {
@@ -269,8 +399,54 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 	else {
 		diskread(ib, block);
 	}
-	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+	for (i=0; i<SFS_DBPERIDB(blocksize) && fileblock < numblocks; i++) {
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
+	}
+	return fileblock;
+}
+
+static
+uint32_t
+traverse_ext(uint32_t fileblock, uint32_t numblocks,
+	     const struct sfs_extent *se, unsigned count, unsigned depth,
+	     void (*doblock)(uint32_t, uint32_t))
+{
+	struct sfs_extent_block seb;
+	uint32_t first, disk, n;
+	unsigned i;
+
+	for (i=0; i<count && fileblock < numblocks; i++) {
+		if (depth > 0) {
+			diskreadpart(&seb, sizeof(seb),
+				     SWAP32(se[i].se_diskblock));
+			if (SWAP32(seb.seb_magic) != SFS_EXTENT_MAGIC) {
+				warnx("Bad extent block %u",
+				      SWAP32(se[i].se_diskblock));
+				continue;
+			}
+			fileblock = traverse_ext(fileblock, numblocks,
+						 seb.seb_entries,
+						 SWAP16(seb.seb_count),
+						 depth - 1, doblock);
+			continue;
+		}
+		first = SWAP32(se[i].se_fileblock);
+		disk = SWAP32(se[i].se_diskblock);
+		n = SWAP32(se[i].se_nblocks);
+		while (fileblock < first && fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		while (fileblock < first + n && fileblock < numblocks) {
+			doblock(fileblock, disk + (fileblock - first));
+			fileblock++;
+		}
 	}
 	return fileblock;
 }
@@ -283,35 +459,65 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	uint32_t numblocks;
 	unsigned i;
 
-	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
+	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), blocksize);
 
 	fileblock = 0;
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_EXTENTS) {
+		fileblock = traverse_ext(fileblock, numblocks,
+					 sfi->sfi_extents.ser_entries,
+					 SWAP16(sfi->sfi_extents.ser_count),
+					 SWAP16(sfi->sfi_extents.ser_depth),
+					 doblock);
+		while (fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		return;
+	}
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
 		doblock(fileblock++, SWAP32(sfi->sfi_direct[i]));
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3,
+					doblock);
 	}
 	assert(fileblock == numblocks);
 }
 
+static bool dumpingindexeddir;
+
 static
 void
-dumpdirblock(uint32_t fileblock, uint32_t diskblock)
+dumpdirindexblock(uint32_t diskblock, const struct sfs_dirindex *sdi)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
-	int i;
+	unsigned i, count;
 
-	(void)fileblock;
-	if (diskblock == 0) {
-		printf("    [block %u - empty]\n", diskblock);
-		return;
+	count = SWAP32(sdi->sdi_count);
+	printf("    [block %u - index, %u levels below, %u entries]\n",
+	       diskblock, SWAP32(sdi->sdi_depth), count);
+	for (i=0; i<count && i<SFS_DIRINDEX_ENTRIES; i++) {
+		printf("        hash 0x%08x -> dir block %u\n",
+		       SWAP32(SFS_DIRINDEX_ENTRY(sdi, i).sdx_hash),
+		       SWAP32(SFS_DIRINDEX_ENTRY(sdi, i).sdx_block));
 	}
-	diskread(&sds, diskblock);
+}
+
+static
+void
+dumpdirentries(struct sfs_direntry *sds, int nsds)
+{
+	int i;
 
-	printf("    [block %u]\n", diskblock);
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAP32(sds[i].sfd_ino);
 		if (ino==SFS_NOINO) {
@@ -324,6 +530,54 @@ dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void
+dumpdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_direntry sds[SFS_DIRENTRIESPERBLOCK(SFS_MAXBLOCKSIZE)];
+	int nsds = SFS_DIRENTRIESPERBLOCK(blocksize);
+	const struct sfs_dirindex *sdi;
+
+	(void)fileblock;
+	if (diskblock == 0) {
+		printf("    [block %u - empty]\n", diskblock);
+		return;
+	}
+	diskread(&sds, diskblock);
+
+	sdi = (const struct sfs_dirindex *)sds;
+	if (dumpingindexeddir && sdi->sdi_zero[0] == 0 &&
+	    sdi->sdi_zero[1] == 0 &&
+	    SWAP32(sdi->sdi_magic) == SFS_DIRINDEX_MAGIC) {
+		dumpdirindexblock(diskblock, sdi);
+		return;
+	}
+
+	printf("    [block %u]\n", diskblock);
+	dumpdirentries(sds, nsds);
+}
+
+/*
+ * Copy the contents of an inline inode into BUF, which is zeroed
+ * past them, and return their size. Extra-large sizes are clamped.
+ */
+static
+uint32_t
+readinline(const struct sfs_dinode *sfi, void *buf, size_t buflen)
+{
+	uint32_t size;
+
+	size = SWAP32(sfi->sfi_size);
+	if (size > sizeof(sfi->sfi_waste)) {
+		warnx("Warning: inline size is larger than the inode");
+		size = sizeof(sfi->sfi_waste);
+	}
+	assert(size <= buflen);
+	bzero(buf, buflen);
+	memcpy(buf, sfi->sfi_waste, size);
+	return size;
+}
+
 static
 void
 dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
@@ -335,23 +589,27 @@ dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
 	printf("Directory contents for inode %u: %d entries\n", ino, nentries);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		struct sfs_direntry sds[DIVROUNDUP(sizeof(sfi->sfi_waste),
+						   sizeof(struct sfs_direntry))];
+
+		nentries = readinline(sfi, sds, sizeof(sds)) /
+			sizeof(struct sfs_direntry);
+		printf("    [in inode]\n");
+		dumpdirentries(sds, nentries);
+		return;
+	}
+	dumpingindexeddir = (SWAP32(sfi->sfi_flags) & SFS_IFLAG_DIRINDEX) != 0;
 	traverse(sfi, dumpdirblock);
+	dumpingindexeddir = false;
 }
 
 static
 void
-recursedirblock(uint32_t fileblock, uint32_t diskblock)
+recursedirentries(struct sfs_direntry *sds, int nsds)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
 	int i;
 
-	(void)fileblock;
-	if (diskblock == 0) {
-		return;
-	}
-	diskread(&sds, diskblock);
-
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAP32(sds[i].sfd_ino);
 		if (ino==SFS_NOINO) {
@@ -362,6 +620,21 @@ recursedirblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void
+recursedirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_direntry sds[SFS_DIRENTRIESPERBLOCK(SFS_MAXBLOCKSIZE)];
+	int nsds = SFS_DIRENTRIESPERBLOCK(blocksize);
+
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	diskread(&sds, diskblock);
+	recursedirentries(sds, nsds);
+}
+
 static
 void
 recursedir(uint32_t ino, const struct sfs_dinode *sfi)
@@ -370,27 +643,30 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 
 	nentries = SWAP32(sfi->sfi_size) / sizeof(struct sfs_direntry);
 	printf("Reading files in directory %u: %d entries\n", ino, nentries);
-	traverse(sfi, recursedirblock);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		struct sfs_direntry sds[DIVROUNDUP(sizeof(sfi->sfi_waste),
+						   sizeof(struct sfs_direntry))];
+
+		nentries = readinline(sfi, sds, sizeof(sds)) /
+			sizeof(struct sfs_direntry);
+		recursedirentries(sds, nentries);
+	}
+	else {
+		traverse(sfi, recursedirblock);
+	}
 	printf("Done with directory %u\n", ino);
 }
 
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpfiledata(uint32_t pos, const uint8_t *data, unsigned len)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", pos + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -415,42 +691,44 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_MAXBLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * blocksize);
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpfiledata(fileblock * blocksize, data, blocksize);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		/* Whole lines of 16, with zeros past EOF */
+		uint8_t data[DIVROUNDUP(sizeof(sfi->sfi_waste), 16) * 16];
+		uint32_t size;
+
+		size = readinline(sfi, data, sizeof(data));
+		dumpfiledata(0, data, DIVROUNDUP(size, 16) * 16);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
 static
 void
-dumpinode(uint32_t ino, const char *name)
+dumpblockptrs(const struct sfs_dinode *sfi)
 {
-	struct sfs_dinode sfi;
-	const char *typename;
 	char tmp[128];
 	unsigned i;
 
-	diskread(&sfi, ino);
-
-	printf("Inode %u", ino);
-	if (name != NULL) {
-		printf(" (%s)", name);
-	}
-	printf("\n");
-	printf("--------------\n");
-
-	switch (SWAP16(sfi.sfi_type)) {
-	    case SFS_TYPE_FILE: typename = "regular file"; break;
-	    case SFS_TYPE_DIR: typename = "directory"; break;
-	    default: typename = "invalid"; break;
-	}
-	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
-	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
-	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
-	printf("\n");
-
         printf("    Direct blocks:\n");
         for (i=0; i<SFS_NDIRECT; i++) {
 		if (i % 4 == 0) {
@@ -465,7 +743,8 @@ dumpinode(uint32_t ino, const char *name)
 		 * number print then needs up to 16 digits.
 		 */
 		snprintf(tmp, sizeof(tmp), "%u (0x%x)",
-			 SWAP32(sfi.sfi_direct[i]), SWAP32(sfi.sfi_direct[i]));
+			 SWAP32(sfi->sfi_direct[i]),
+			 SWAP32(sfi->sfi_direct[i]));
 		printf("  %-16s", tmp);
 		if (i % 4 == 3) {
 			printf("\n");
@@ -475,16 +754,82 @@ dumpinode(uint32_t ino, const char *name)
 		printf("\n");
 	}
 	printf("    Indirect block: %u (0x%x)\n",
-	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
+	       SWAP32(sfi->sfi_indirect), SWAP32(sfi->sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi->sfi_dindirect), SWAP32(sfi->sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi->sfi_tindirect), SWAP32(sfi->sfi_tindirect));
+}
+
+static
+void
+dumpinode(uint32_t ino, const char *name)
+{
+	struct sfs_dinode sfi;
+	const char *typename;
+	unsigned i, count = 0, depth = 0;
+
+	readinode(ino, &sfi);
+
+	printf("Inode %u", ino);
+	if (name != NULL) {
+		printf(" (%s)", name);
+	}
+	printf("\n");
+	printf("--------------\n");
+
+	switch (SWAP16(sfi.sfi_type)) {
+	    case SFS_TYPE_FILE: typename = "regular file"; break;
+	    case SFS_TYPE_DIR: typename = "directory"; break;
+	    default: typename = "invalid"; break;
+	}
+	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
+	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
+	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s%s%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_DIRINDEX) ?
+		 " (indexed)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) ?
+		 " (extents)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) ?
+		 " (inline)" : "");
+	printf("\n");
+
+	if (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) {
+		count = SWAP16(sfi.sfi_extents.ser_count);
+		depth = SWAP16(sfi.sfi_extents.ser_depth);
+		printf("    Extents: %u levels below the inode, "
+		       "%u entries\n", depth, count);
+		if (count > SFS_EXTENTS_ININODE) {
+			count = SFS_EXTENTS_ININODE;
+		}
+		dumpextents(sfi.sfi_extents.ser_entries, count, depth);
+	}
+	else {
+		dumpblockptrs(&sfi);
+	}
+	if (SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) {
+		printf("    Contents are in the inode\n");
+	}
+	else {
+		for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
+			if (sfi.sfi_waste[i] != 0) {
+				printf("    Word %u in waste area: 0x%x\n",
+				       i, SWAP32(sfi.sfi_waste[i]));
+			}
 		}
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		if (SWAP32(sfi.sfi_flags) & SFS_IFLAG_EXTENTS) {
+			dumpextblocks(sfi.sfi_extents.ser_entries,
+				      count, depth);
+		}
+		else {
+			dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+			dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+			dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
+		}
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
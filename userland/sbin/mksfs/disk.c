@@ -49,6 +49,7 @@
 
 static int fd=-1;
 static uint32_t nblocks;
+static uint32_t blocksize = BLOCKSIZE;
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
@@ -95,13 +96,26 @@ opendisk(const char *path)
 }
 
 /*
- * Return the block size. (This is fixed, but still...)
+ * Return the block size. This is the device's sector size unless
+ * disksetblocksize has been called.
  */
 uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return blocksize;
+}
+
+/*
+ * Use blocks of SIZE bytes, a multiple of the sector size, from now
+ * on. Block numbers count blocks of this size.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(fd>=0);
+	assert(size >= BLOCKSIZE && size % BLOCKSIZE == 0);
+	blocksize = size;
 }
 
 /*
@@ -111,7 +125,27 @@ uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nblocks / (blocksize / BLOCKSIZE);
+}
+
+/*
+ * Seek to block BLOCK.
+ */
+static
+void
+diskseek(uint32_t block)
+{
+	off_t pos;
+
+	pos = (off_t)block * blocksize;
+#ifdef HOST
+	// skip over disk file header
+	pos += BLOCKSIZE;
+#endif
+
+	if (lseek(fd, pos, SEEK_SET)<0) {
+		err(1, "lseek");
+	}
 }
 
 /*
@@ -119,24 +153,27 @@ diskblocks(void)
  */
 void
 diskwrite(const void *data, uint32_t block)
+{
+	diskwritepart(data, blocksize, block);
+}
+
+/*
+ * Write the first SIZE bytes of a block, leaving the rest alone.
+ */
+void
+diskwritepart(const void *data, uint32_t size, uint32_t block)
 {
 	const char *cdata = data;
 	uint32_t tot=0;
 	int len;
 
 	assert(fd>=0);
+	assert(size <= blocksize);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
+	diskseek(block);
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
-
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < size) {
+		len = write(fd, cdata + tot, size - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -155,24 +192,27 @@ diskwrite(const void *data, uint32_t block)
  */
 void
 diskread(void *data, uint32_t block)
+{
+	diskreadpart(data, blocksize, block);
+}
+
+/*
+ * Read the first SIZE bytes of a block.
+ */
+void
+diskreadpart(void *data, uint32_t size, uint32_t block)
 {
 	char *cdata = data;
 	uint32_t tot=0;
 	int len;
 
 	assert(fd>=0);
+	assert(size <= blocksize);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
+	diskseek(block);
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < size) {
+		len = read(fd, cdata + tot, size - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
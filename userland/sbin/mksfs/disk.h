@@ -30,9 +30,12 @@
 void opendisk(const char *path);
 
 uint32_t diskblocksize(void);
+void disksetblocksize(uint32_t size);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
 void diskread(void *data, uint32_t block);
+void diskwritepart(const void *data, uint32_t size, uint32_t block);
+void diskreadpart(void *data, uint32_t size, uint32_t block);
 
 void closedisk(void);
@@ -31,6 +31,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <err.h>
 
@@ -57,11 +58,22 @@
 
 #include "disk.h"
 
-/* Maximum size of freemap we support */
+/* Maximum size of freemap and inode bitmap we support */
 #define MAXFREEMAPBLOCKS 32
+#define MAXINODEMAPBLOCKS 32
+
+/* Default volume space per inode in the inode table (bytes) */
+#define BYTESPERINODE 4096
+
+/* Default journal size: this fraction of the volume, up to a maximum */
+#define JOURNALFRACTION 32
+#define MAXDEFJOURNALBLOCKS 1024
 
 /* Free block bitmap */
-static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
+static char freemapbuf[MAXFREEMAPBLOCKS * SFS_MAXBLOCKSIZE];
+
+/* Inode bitmap */
+static char inodemapbuf[MAXINODEMAPBLOCKS * SFS_MAXBLOCKSIZE];
 
 /*
  * Assert that the on-disk data structures are correctly sized.
@@ -73,6 +85,22 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dinode) -
+	       sizeof(((struct sfs_dinode *)NULL)->sfi_waste) <= SFS_ISIZE);
+}
+
+/*
+ * Mark a bit in a bitmap.
+ */
+static
+void
+markbit(char *map, uint32_t bit)
+{
+	uint32_t mapbyte = bit/CHAR_BIT;
+	unsigned char mask = (1<<(bit % CHAR_BIT));
+
+	assert((map[mapbyte] & mask) == 0);
+	map[mapbyte] |= mask;
 }
 
 /*
@@ -82,11 +110,22 @@ static
 void
 allocblock(uint32_t block)
 {
-	uint32_t mapbyte = block/CHAR_BIT;
-	unsigned char mask = (1<<(block % CHAR_BIT));
+	markbit(freemapbuf, block);
+}
 
-	assert((freemapbuf[mapbyte] & mask) == 0);
-	freemapbuf[mapbyte] |= mask;
+/*
+ * Write out a structure that takes up the start of a block, with the
+ * rest of the block zeroed.
+ */
+static
+void
+writestruct(const void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	bzero(buf, sizeof(buf));
+	memcpy(buf, data, len);
+	diskwrite(buf, block);
 }
 
 /*
@@ -94,10 +133,10 @@ allocblock(uint32_t block)
  */
 static
 void
-initfreemap(uint32_t fsblocks)
+initfreemap(uint32_t fsblocks, uint32_t blocksize, uint32_t features)
 {
-	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks, blocksize);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	uint32_t i;
 
 	if (freemapblocks > MAXFREEMAPBLOCKS) {
@@ -107,7 +146,9 @@ initfreemap(uint32_t fsblocks)
 
 	/* mark the superblock and root inode in use */
 	allocblock(SFS_SUPER_BLOCK);
-	allocblock(SFS_ROOTDIR_INO);
+	if (!(features & SFS_FEATURE_ITABLE)) {
+		allocblock(SFS_ROOTDIR_INO);
+	}
 
 	/* the freemap blocks must be in use */
 	for (i=0; i<freemapblocks; i++) {
@@ -120,12 +161,103 @@ initfreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Lay out the inode bitmap and inode table after the freemap, mark
+ * them in use, and initialize the bitmap. Returns the first block of
+ * the bitmap and of the table.
+ */
+static
+void
+inittable(uint32_t fsblocks, uint32_t blocksize, uint32_t ninodes,
+	  uint32_t *inodemap, uint32_t *itable)
+{
+	uint32_t mapblocks = SFS_INODEMAPBLOCKS(ninodes, blocksize);
+	uint32_t tableblocks = SFS_ITABLEBLOCKS(ninodes, blocksize);
+	uint32_t i;
+
+	if (mapblocks > MAXINODEMAPBLOCKS) {
+		errx(1, "Too many inodes -- "
+		     "increase MAXINODEMAPBLOCKS and recompile");
+	}
+
+	*inodemap = SFS_FREEMAP_START +
+		SFS_FREEMAPBLOCKS(fsblocks, blocksize);
+	*itable = *inodemap + mapblocks;
+	if (*itable + tableblocks >= fsblocks) {
+		errx(1, "Inode table does not fit on the volume");
+	}
+
+	for (i=0; i<mapblocks + tableblocks; i++) {
+		allocblock(*inodemap + i);
+	}
+
+	/* inode 0 is never used; the root is; so are bits past the end */
+	markbit(inodemapbuf, SFS_NOINO);
+	markbit(inodemapbuf, SFS_ROOTDIR_INO);
+	for (i=ninodes; i<mapblocks * SFS_BITSPERBLOCK(blocksize); i++) {
+		markbit(inodemapbuf, i);
+	}
+}
+
+/*
+ * Write out the inode bitmap, and zero the inode table.
+ */
+static
+void
+writetable(uint32_t blocksize, uint32_t ninodes, uint32_t inodemap,
+	   uint32_t itable)
+{
+	static char zeros[SFS_MAXBLOCKSIZE];
+	uint32_t i;
+
+	for (i=0; i<SFS_INODEMAPBLOCKS(ninodes, blocksize); i++) {
+		diskwrite(inodemapbuf + i*blocksize, inodemap + i);
+	}
+	for (i=0; i<SFS_ITABLEBLOCKS(ninodes, blocksize); i++) {
+		diskwrite(zeros, itable + i);
+	}
+}
+
+/*
+ * Put the journal at START, mark it in use, and write its header;
+ * also zero its first transaction block, so nothing left there from
+ * an old journal is taken for a transaction.
+ */
+static
+void
+initjournal(uint32_t fsblocks, uint32_t start, uint32_t jblocks)
+{
+	struct sfs_jheader sjh;
+	static char zeros[SFS_MAXBLOCKSIZE];
+	uint32_t i;
+
+	if (jblocks < SFS_JOURNAL_MINBLOCKS) {
+		errx(1, "Journal must have at least %u blocks",
+		     SFS_JOURNAL_MINBLOCKS);
+	}
+	if (start + jblocks >= fsblocks) {
+		errx(1, "Journal does not fit on the volume");
+	}
+
+	for (i=0; i<jblocks; i++) {
+		allocblock(start + i);
+	}
+
+	bzero((void *)&sjh, sizeof(sjh));
+	sjh.sjh_magic = SWAP32(SFS_JOURNAL_MAGIC);
+	sjh.sjh_seq = SWAP32(1);
+	writestruct(&sjh, sizeof(sjh), start);
+	diskwrite(zeros, start + 1);
+}
+
 /*
  * Initialize and write out the superblock.
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t blocksize,
+	   uint32_t features, uint32_t ninodes, uint32_t inodemap,
+	   uint32_t itable, uint32_t journal, uint32_t jblocks)
 {
 	struct sfs_superblock sb;
 
@@ -139,10 +271,24 @@ writesuper(const char *volname, uint32_t nblocks)
 	/* Initialize the superblock structure */
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
+	if (blocksize != SFS_BLOCKSIZE) {
+		features |= SFS_FEATURE_BLOCKSIZE;
+	}
+	sb.sb_features = SWAP32(features);
+	sb.sb_blocksize = SWAP32(blocksize);
+	if (features & SFS_FEATURE_ITABLE) {
+		sb.sb_ninodes = SWAP32(ninodes);
+		sb.sb_inodemap = SWAP32(inodemap);
+		sb.sb_itable = SWAP32(itable);
+	}
+	if (features & SFS_FEATURE_JOURNAL) {
+		sb.sb_journal = SWAP32(journal);
+		sb.sb_journalblocks = SWAP32(jblocks);
+	}
 	strcpy(sb.sb_volname, volname);
 
 	/* and write it out. */
-	diskwrite(&sb, SFS_SUPER_BLOCK);
+	writestruct(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 }
 
 /*
@@ -150,37 +296,59 @@ writesuper(const char *volname, uint32_t nblocks)
  */
 static
 void
-writefreemap(uint32_t fsblocks)
+writefreemap(uint32_t fsblocks, uint32_t blocksize)
 {
 	uint32_t freemapblocks;
 	char *ptr;
 	uint32_t i;
 
 	/* Write out each of the blocks in the free block bitmap. */
-	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
+		ptr = freemapbuf + i*blocksize;
 		diskwrite(ptr, SFS_FREEMAP_START+i);
 	}
 }
 
 /*
- * Write out the root directory inode.
+ * Write out the root directory inode, in its own block or in the
+ * inode table starting at ITABLE.
  */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t features, uint32_t blocksize, uint32_t itable)
 {
+	static char buf[SFS_MAXBLOCKSIZE];
 	struct sfs_dinode sfi;
+	uint32_t perblock, isize, flags = 0;
 
 	/* Initialize the dinode */
 	bzero((void *)&sfi, sizeof(sfi));
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	if (features & SFS_FEATURE_EXTENTS) {
+		flags |= SFS_IFLAG_EXTENTS;
+	}
+	/* The root starts out inline if a directory entry fits */
+	isize = (features & SFS_FEATURE_ITABLE) ? SFS_ISIZE : sizeof(sfi);
+	if ((features & SFS_FEATURE_INLINE) &&
+	    SFS_INLINE_MAX(isize) >= sizeof(struct sfs_direntry)) {
+		flags |= SFS_IFLAG_INLINE;
+	}
+	sfi.sfi_flags = SWAP32(flags);
 
 	/* Write it out */
-	diskwrite(&sfi, SFS_ROOTDIR_INO);
+	if (features & SFS_FEATURE_ITABLE) {
+		perblock = SFS_INODESPERBLOCK(blocksize);
+		diskread(buf, itable + SFS_ROOTDIR_INO / perblock);
+		memcpy(buf + (SFS_ROOTDIR_INO % perblock) * SFS_ISIZE,
+		       &sfi, SFS_ISIZE);
+		diskwrite(buf, itable + SFS_ROOTDIR_INO / perblock);
+	}
+	else {
+		writestruct(&sfi, sizeof(sfi), SFS_ROOTDIR_INO);
+	}
 }
 
 /*
@@ -189,15 +357,75 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, fsblocksize, features;
+	uint32_t ninodes, inodemap, itable, journal, jblocks;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/*
+	 * -i: index large directories; -e: map files with extents;
+	 * -b size: use blocks of SIZE bytes; -t: put the inodes in an
+	 * inode table; -n count: ...of COUNT inodes; -j: keep a
+	 * metadata journal; -J blocks: ...of BLOCKS blocks; -s: keep
+	 * small files and directories in their inodes
+	 */
+	features = 0;
+	fsblocksize = SFS_BLOCKSIZE;
+	ninodes = 0;
+	jblocks = 0;
+	while (argc > 3 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-i")) {
+			features |= SFS_FEATURE_DIRINDEX;
+		}
+		else if (!strcmp(argv[1], "-e")) {
+			features |= SFS_FEATURE_EXTENTS;
+		}
+		else if (!strcmp(argv[1], "-s")) {
+			features |= SFS_FEATURE_INLINE;
+		}
+		else if (!strcmp(argv[1], "-b") && argc > 4) {
+			fsblocksize = atoi(argv[2]);
+			argc--;
+			argv++;
+		}
+		else if (!strcmp(argv[1], "-t")) {
+			features |= SFS_FEATURE_ITABLE;
+		}
+		else if (!strcmp(argv[1], "-n") && argc > 4) {
+			features |= SFS_FEATURE_ITABLE;
+			ninodes = atoi(argv[2]);
+			argc--;
+			argv++;
+		}
+		else if (!strcmp(argv[1], "-j")) {
+			features |= SFS_FEATURE_JOURNAL;
+		}
+		else if (!strcmp(argv[1], "-J") && argc > 4) {
+			features |= SFS_FEATURE_JOURNAL;
+			jblocks = atoi(argv[2]);
+			argc--;
+			argv++;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-i] [-e] [-s] [-t] [-j] [-b blocksize] "
+		     "[-n inodes] [-J journalblocks] device/diskfile "
+		     "volume-name");
+	}
+
+	if (fsblocksize < SFS_BLOCKSIZE || fsblocksize > SFS_MAXBLOCKSIZE ||
+	    (fsblocksize & (fsblocksize - 1)) != 0) {
+		errx(1, "Block size must be a power of 2 from %u to %u",
+		     SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
 	}
 
 	check();
@@ -226,13 +454,54 @@ main(int argc, char **argv)
 		errx(1, "Device has wrong blocksize %u (should be %u)\n",
 		     blocksize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(fsblocksize);
 	size = diskblocks();
 
+	/* By default, one inode per BYTESPERINODE of volume */
+	if ((features & SFS_FEATURE_ITABLE) && ninodes == 0) {
+		ninodes = (uint64_t)size * fsblocksize / BYTESPERINODE;
+		ninodes = SFS_ROUNDUP(ninodes,
+				      SFS_INODESPERBLOCK(fsblocksize));
+	}
+	if ((features & SFS_FEATURE_ITABLE) &&
+	    ninodes <= SFS_ROOTDIR_INO) {
+		errx(1, "Too few inodes");
+	}
+
+	/* By default, a journal of 1/JOURNALFRACTION of the volume */
+	if ((features & SFS_FEATURE_JOURNAL) && jblocks == 0) {
+		jblocks = size / JOURNALFRACTION;
+		if (jblocks > MAXDEFJOURNALBLOCKS) {
+			jblocks = MAXDEFJOURNALBLOCKS;
+		}
+		if (jblocks < SFS_JOURNAL_MINBLOCKS) {
+			jblocks = SFS_JOURNAL_MINBLOCKS;
+		}
+	}
+
 	/* Write out the on-disk structures */
-	initfreemap(size);
-	writesuper(volname, size);
-	writefreemap(size);
-	writerootdir();
+	initfreemap(size, fsblocksize, features);
+	inodemap = itable = journal = 0;
+	if (features & SFS_FEATURE_ITABLE) {
+		inittable(size, fsblocksize, ninodes, &inodemap, &itable);
+	}
+	if (features & SFS_FEATURE_JOURNAL) {
+		/* The journal goes right after the freemap or table */
+		journal = SFS_FREEMAP_START +
+			SFS_FREEMAPBLOCKS(size, fsblocksize);
+		if (features & SFS_FEATURE_ITABLE) {
+			journal = itable +
+				SFS_ITABLEBLOCKS(ninodes, fsblocksize);
+		}
+		initjournal(size, journal, jblocks);
+	}
+	writesuper(volname, size, fsblocksize, features,
+		   ninodes, inodemap, itable, journal, jblocks);
+	writefreemap(size, fsblocksize);
+	if (features & SFS_FEATURE_ITABLE) {
+		writetable(fsblocksize, ninodes, inodemap, itable);
+	}
+	writerootdir(features, fsblocksize, itable);
 
 	closedisk();
 
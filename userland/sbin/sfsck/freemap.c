@@ -46,6 +46,39 @@
 static unsigned long blocksinuse = 0;
 static uint8_t *freemapdata;
 static uint8_t *tofreedata;
+static uint8_t *inodemapdata;
+
+/*
+ * Set up the inode bitmap: mark its blocks and the inode table's in
+ * use, and allocate space to keep track of it, with inode 0 and the
+ * bits past the table marked in use.
+ */
+static
+void
+inodemap_setup(void)
+{
+	size_t i, mapbytes;
+	uint32_t mapblocks;
+
+	mapblocks = SB_INODEMAPBLOCKS;
+	for (i=0; i < mapblocks; i++) {
+		freemap_blockinuse(sb_inodemapstart()+i, B_INODEMAPBLOCK, i);
+	}
+	for (i=0; i < SB_ITABLEBLOCKS; i++) {
+		freemap_blockinuse(sb_itablestart()+i, B_ITABLEBLOCK, i);
+	}
+
+	mapbytes = mapblocks * sb_blocksize();
+	inodemapdata = domalloc(mapbytes * sizeof(uint8_t));
+	for (i=0; i<mapbytes; i++) {
+		inodemapdata[i] = 0;
+	}
+	inodemapdata[SFS_NOINO / 8] |= 1 << (SFS_NOINO % 8);
+	for (i=sb_ninodes(); i < mapblocks*SFS_BITSPERBLOCK(sb_blocksize());
+	     i++) {
+		inodemapdata[i / 8] |= 1 << (i % 8);
+	}
+}
 
 /*
  * Allocate space to keep track of the free block bitmap. This is
@@ -60,7 +93,7 @@ freemap_setup(void)
 
 	fsblocks = sb_totalblocks();
 	mapblocks = sb_freemapblocks();
-	mapbytes = mapblocks * SFS_BLOCKSIZE;
+	mapbytes = mapblocks * sb_blocksize();
 
 	freemapdata = domalloc(mapbytes * sizeof(uint8_t));
 	tofreedata = domalloc(mapbytes * sizeof(uint8_t));
@@ -69,7 +102,7 @@ freemap_setup(void)
 	}
 
 	/* Mark off what's in the freemap but past the volume end. */
-	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK; i++) {
+	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK(sb_blocksize()); i++) {
 		freemap_blockinuse(i, B_PASTEND, 0);
 	}
 
@@ -78,6 +111,17 @@ freemap_setup(void)
 	for (i=0; i < mapblocks; i++) {
 		freemap_blockinuse(SFS_FREEMAP_START+i, B_FREEMAPBLOCK, i);
 	}
+
+	if (sb_hasfeature(SFS_FEATURE_ITABLE)) {
+		inodemap_setup();
+	}
+
+	if (sb_hasfeature(SFS_FEATURE_JOURNAL)) {
+		for (i=0; i < sb_journalblocks(); i++) {
+			freemap_blockinuse(sb_journalstart()+i,
+					   B_JOURNALBLOCK, i);
+		}
+	}
 }
 
 /*
@@ -95,6 +139,18 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "freemap block %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_INODEMAPBLOCK:
+		snprintf(rv, sizeof(rv), "inode bitmap block %lu",
+			 (unsigned long) howdesc);
+		break;
+	    case B_ITABLEBLOCK:
+		snprintf(rv, sizeof(rv), "inode table block %lu",
+			 (unsigned long) howdesc);
+		break;
+	    case B_JOURNALBLOCK:
+		snprintf(rv, sizeof(rv), "journal block %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_INODE:
 		snprintf(rv, sizeof(rv), "inode %lu",
 			 (unsigned long) howdesc);
@@ -175,6 +231,22 @@ freemap_blockfree(uint32_t block)
 	tofreedata[index] |= mask;
 }
 
+/*
+ * Mark inode INO in use. Without an inode table this means its block.
+ * pass1 only calls this once per inode.
+ */
+void
+freemap_inodeinuse(uint32_t ino)
+{
+	if (!sb_hasfeature(SFS_FEATURE_ITABLE)) {
+		freemap_blockinuse(ino, B_INODE, ino);
+		return;
+	}
+	assert(ino < sb_ninodes());
+	assert((inodemapdata[ino / 8] & (1 << (ino % 8))) == 0);
+	inodemapdata[ino / 8] |= 1 << (ino % 8);
+}
+
 /*
  * Count the number of bits set.
  */
@@ -207,7 +279,7 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = mapblock*SFS_BITSPERBLOCK +
+			blocknum = mapblock*SFS_BITSPERBLOCK(sb_blocksize()) +
 				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in freemap",
 			      (unsigned long) blocknum, what);
@@ -216,7 +288,68 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 }
 
 /*
- * Scan the freemap.
+ * Scan the inode bitmap. Inodes that were found are all valid, and
+ * the rest are unreachable, so unlike the freemap there's nothing to
+ * be freed on the side; what's there should just be what was found.
+ */
+static
+void
+inodemap_check(void)
+{
+	uint8_t actual[SFS_MAXBLOCKSIZE], *expected, tmp, x;
+	uint32_t alloccount=0, freecount=0, i, j, k;
+	int bchanged;
+
+	for (i=0; i<SB_INODEMAPBLOCKS; i++) {
+		sfs_readinodemapblock(i, actual);
+		expected = inodemapdata + i*sb_blocksize();
+		bchanged = 0;
+
+		for (j=0; j<sb_blocksize(); j++) {
+			if (actual[j] == expected[j]) {
+				continue;
+			}
+			for (x=1, k=0; x; x<<=1, k++) {
+				tmp = (actual[j] ^ expected[j]) & x;
+				if (tmp == 0) {
+					continue;
+				}
+				warnx("Inode %lu erroneously shown %s in "
+				      "inode bitmap",
+				      (unsigned long)
+				      (i*SFS_BITSPERBLOCK(sb_blocksize()) +
+				       j*CHAR_BIT + k),
+				      (expected[j] & x) ? "free" : "allocated");
+				if (expected[j] & x) {
+					alloccount++;
+				}
+				else {
+					freecount++;
+				}
+			}
+			actual[j] = expected[j];
+			bchanged = 1;
+		}
+
+		if (bchanged) {
+			sfs_writeinodemapblock(i, actual);
+		}
+	}
+
+	if (alloccount > 0) {
+		warnx("%lu inodes erroneously shown free in inode bitmap "
+		      "(fixed)", (unsigned long) alloccount);
+		setbadness(EXIT_RECOV);
+	}
+	if (freecount > 0) {
+		warnx("%lu inodes erroneously shown used in inode bitmap "
+		      "(fixed)", (unsigned long) freecount);
+		setbadness(EXIT_RECOV);
+	}
+}
+
+/*
+ * Scan the freemap (and the inode bitmap).
  *
  * This is called after (at the end of) pass 1, when we've recursively
  * found all the reachable blocks and marked them.
@@ -224,7 +357,7 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 void
 freemap_check(void)
 {
-	uint8_t actual[SFS_BLOCKSIZE], *expected, *tofree, tmp;
+	uint8_t actual[SFS_MAXBLOCKSIZE], *expected, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
 	int bchanged;
 	uint32_t bitblocks;
@@ -233,11 +366,11 @@ freemap_check(void)
 
 	for (i=0; i<bitblocks; i++) {
 		sfs_readfreemapblock(i, actual);
-		expected = freemapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		expected = freemapdata + i*sb_blocksize();
+		tofree = tofreedata + i*sb_blocksize();
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<sb_blocksize(); j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((expected[j] & tofree[j])==0);
 
@@ -297,6 +430,10 @@ freemap_check(void)
 		      (unsigned long) freecount);
 		setbadness(EXIT_RECOV);
 	}
+
+	if (sb_hasfeature(SFS_FEATURE_ITABLE)) {
+		inodemap_check();
+	}
 }
 
 /*
@@ -32,8 +32,8 @@
 
 /*
  * The freemap module accumulates information about the free block
- * bitmap as other checks are made, and then uses that information
- * to check and correct it.
+ * bitmap (and the inode bitmap, if there is one) as other checks are
+ * made, and then uses that information to check and correct it.
  */
 
 #include <stdint.h>
@@ -41,6 +41,9 @@
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_FREEMAPBLOCK,	/* Block used by free-block bitmap */
+	B_INODEMAPBLOCK,	/* Block used by inode bitmap */
+	B_ITABLEBLOCK,	/* Block of the inode table */
+	B_JOURNALBLOCK,	/* Block of the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -57,6 +60,9 @@ void freemap_blockinuse(uint32_t block, blockusage_t how, uint32_t howdesc);
 /* Note that a block has been found where it should be dropped. */
 void freemap_blockfree(uint32_t block);
 
+/* Call this to note that an inode has been found in use. */
+void freemap_inodeinuse(uint32_t ino);
+
 /* Call this after all checks that call freemap_block{inuse,free}. */
 void freemap_check(void);
 
@@ -141,19 +141,22 @@
 #define SET1_x(sfi, field, i)	(*((void)(i), &(sfi)->field))
 #define SETN_x(sfi, field, i)	((sfi)->field[(i)])
 
-/* region sizes */
+/*
+ * region sizes (these depend on the volume's block size, so need
+ * sb.h, and can exceed 32 bits)
+ */
 
-#define RANGE_D		1
-#define RANGE_I		(RANGE_D * SFS_DBPERIDB)
-#define RANGE_II	(RANGE_I * SFS_DBPERIDB)
-#define RANGE_III	(RANGE_II * SFS_DBPERIDB)
+#define RANGE_D		((uint64_t)1)
+#define RANGE_I		(RANGE_D * SB_DBPERIDB)
+#define RANGE_II	(RANGE_I * SB_DBPERIDB)
+#define RANGE_III	(RANGE_II * SB_DBPERIDB)
 
 /* max blocks */
 
 #define INOMAX_D 	NUM_D
-#define INOMAX_I 	(INOMAX_D + SFS_DBPERIDB * NUM_I)
-#define INOMAX_II	(INOMAX_I + SFS_DBPERIDB * NUM_II)
-#define INOMAX_III	(INOMAX_II + SFS_DBPERIDB * NUM_III)
+#define INOMAX_I 	(INOMAX_D + RANGE_I * NUM_I)
+#define INOMAX_II	(INOMAX_I + RANGE_II * NUM_II)
+#define INOMAX_III	(INOMAX_II + RANGE_III * NUM_III)
 
 
 #endif /* IBMACROS_H */
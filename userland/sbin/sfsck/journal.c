@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "utils.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+static uint8_t jbuf[SFS_MAXBLOCKSIZE];
+static uint8_t descbuf[SFS_MAXBLOCKSIZE];
+
+/*
+ * Read and write journal blocks, numbered from the journal's start.
+ */
+static
+void
+jread(void *data, uint32_t pos)
+{
+	diskread(data, sb_journalstart() + pos);
+}
+
+static
+void
+jwrite(const void *data, uint32_t pos)
+{
+	diskwrite(data, sb_journalstart() + pos);
+}
+
+/*
+ * Fold a block into a transaction's checksum. The sum is over the
+ * words as the kernel sees them, so they need swapping.
+ */
+static
+void
+jsum(uint32_t *sum, const uint8_t *data)
+{
+	const uint32_t *words = (const uint32_t *)data;
+	uint32_t i;
+
+	for (i=0; i<sb_blocksize() / sizeof(uint32_t); i++) {
+		*sum = (*sum ^ SWAP32(words[i])) * 16777619;
+	}
+}
+
+/*
+ * Write the journal header, saying the next transaction is SEQ.
+ */
+static
+void
+jwriteheader(uint32_t seq)
+{
+	struct sfs_jheader *sjh = (struct sfs_jheader *)jbuf;
+
+	memset(jbuf, 0, sizeof(jbuf));
+	sjh->sjh_magic = SWAP32(SFS_JOURNAL_MAGIC);
+	sjh->sjh_seq = SWAP32(seq);
+	jwrite(jbuf, 0);
+}
+
+/*
+ * Check for a complete transaction numbered SEQ at journal block
+ * POS. Returns the block after it, or 0 if there isn't one.
+ */
+static
+uint32_t
+jscan(uint32_t pos, uint32_t seq)
+{
+	struct sfs_jdesc *sjd = (struct sfs_jdesc *)jbuf;
+	struct sfs_jcommit *sjc = (struct sfs_jcommit *)jbuf;
+	uint32_t start = pos, sum = 0, nb, nr, i;
+
+	while (pos < sb_journalblocks()) {
+		jread(jbuf, pos);
+		if (SWAP32(sjd->sjd_magic) == SFS_JCOMMIT_MAGIC) {
+			if (pos > start && SWAP32(sjc->sjc_seq) == seq &&
+			    SWAP32(sjc->sjc_nblocks) == pos - start &&
+			    SWAP32(sjc->sjc_sum) == sum) {
+				return pos + 1;
+			}
+			return 0;
+		}
+		nb = SWAP32(sjd->sjd_nblocks);
+		nr = SWAP32(sjd->sjd_nrevoke);
+		if (SWAP32(sjd->sjd_magic) != SFS_JDESC_MAGIC ||
+		    SWAP32(sjd->sjd_seq) != seq ||
+		    nb > SFS_JDESC_ENTRIES || nr > SFS_JDESC_ENTRIES - nb) {
+			return 0;
+		}
+		for (i=0; i<nb + nr; i++) {
+			if (SWAP32(sjd->sjd_entries[i]) >= sb_totalblocks()) {
+				return 0;
+			}
+		}
+		jsum(&sum, jbuf);
+		pos++;
+
+		for (i=0; i<nb && pos < sb_journalblocks(); i++) {
+			jread(jbuf, pos);
+			jsum(&sum, jbuf);
+			pos++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the blocks of the transaction at journal block POS in place,
+ * except those marked in DONE; then mark them, and the blocks it
+ * revokes, in DONE.
+ */
+static
+void
+jredo(uint32_t pos, uint8_t *done)
+{
+	struct sfs_jdesc *sjd = (struct sfs_jdesc *)descbuf;
+	uint32_t block, nb, nr, i;
+
+	while (1) {
+		jread(descbuf, pos);
+		if (SWAP32(sjd->sjd_magic) == SFS_JCOMMIT_MAGIC) {
+			return;
+		}
+		pos++;
+		nb = SWAP32(sjd->sjd_nblocks);
+		nr = SWAP32(sjd->sjd_nrevoke);
+		for (i=0; i<nb; i++) {
+			block = SWAP32(sjd->sjd_entries[i]);
+			if (done[block / 8] & (1 << (block % 8))) {
+				continue;
+			}
+			jread(jbuf, pos + i);
+			diskwrite(jbuf, block);
+			done[block / 8] |= 1 << (block % 8);
+		}
+		pos += nb;
+		for (i=0; i<nr; i++) {
+			block = SWAP32(sjd->sjd_entries[nb + i]);
+			done[block / 8] |= 1 << (block % 8);
+		}
+	}
+}
+
+/*
+ * Replay the journal: find the complete transactions, then go
+ * through them newest first, so the last copy of each block is the
+ * one written and a block revoked in a transaction is skipped in the
+ * ones before it. Then rewrite the header so they aren't replayed
+ * again. A bad header is replaced with an empty journal.
+ */
+unsigned
+journal_replay(void)
+{
+	struct sfs_jheader *sjh = (struct sfs_jheader *)jbuf;
+	uint32_t seq, pos, end, *starts;
+	unsigned ntx, i;
+	uint8_t *done;
+
+	if (!sb_hasfeature(SFS_FEATURE_JOURNAL)) {
+		return 0;
+	}
+
+	jread(jbuf, 0);
+	if (SWAP32(sjh->sjh_magic) != SFS_JOURNAL_MAGIC) {
+		warnx("Journal header is invalid (journal cleared)");
+		jwriteheader(1);
+		memset(jbuf, 0, sizeof(jbuf));
+		jwrite(jbuf, 1);
+		setbadness(EXIT_RECOV);
+		return 0;
+	}
+	seq = SWAP32(sjh->sjh_seq);
+
+	/* Each transaction takes at least two blocks. */
+	starts = domalloc((sb_journalblocks() / 2) * sizeof(starts[0]));
+	ntx = 0;
+	pos = 1;
+	while ((end = jscan(pos, seq + ntx)) != 0) {
+		starts[ntx++] = pos;
+		pos = end;
+	}
+	if (ntx == 0) {
+		free(starts);
+		return 0;
+	}
+
+	done = domalloc(sb_totalblocks() / 8 + 1);
+	memset(done, 0, sb_totalblocks() / 8 + 1);
+	for (i = ntx; i-- > 0; ) {
+		jredo(starts[i], done);
+	}
+	jwriteheader(seq + ntx);
+	free(done);
+	free(starts);
+
+	warnx("Replayed %u journal transaction%s", ntx, ntx == 1 ? "" : "s");
+	setbadness(EXIT_RECOV);
+	return ntx;
+}
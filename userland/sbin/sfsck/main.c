@@ -38,6 +38,7 @@
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
+#include "journal.h"
 #include "inode.h"
 #include "passes.h"
 #include "main.h"
@@ -77,6 +78,10 @@ main(int argc, char **argv)
 
 	sfs_setup();
 	sb_load();
+	if (journal_replay() > 0) {
+		/* The superblock may have been in the journal */
+		sb_load();
+	}
 	sb_check();
 	freemap_setup();
 
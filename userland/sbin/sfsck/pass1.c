@@ -81,7 +81,7 @@ void
 check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		     int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	uint32_t i, ct;
 	uint32_t coveredblocks;
 	int localchanged = 0;
@@ -105,14 +105,14 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 		coveredblocks = 1;
 		for (j=0; j<indirection; j++) {
-			coveredblocks *= SFS_DBPERIDB;
+			coveredblocks *= SB_DBPERIDB;
 		}
 		ibs->curfileblock += coveredblocks;
 		return;
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<SB_DBPERIDB; i++) {
 			check_indirect_block(ibs, &entries[i], &localchanged,
 					     indirection-1);
 		}
@@ -120,7 +120,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<SB_DBPERIDB; i++) {
 			if (entries[i] >= ibs->volblocks) {
 				setbadness(EXIT_RECOV);
 				warnx("Inode %lu: direct block pointer for "
@@ -151,7 +151,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<SB_DBPERIDB; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -172,6 +172,171 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 }
 
+/*
+ * Check an extent tree node with entries SE[0..*COUNTP-1] and DEPTH
+ * levels below it, which may only map file blocks in [LO, HI).
+ * Blocks in use are recorded, extents past EOF are trimmed or
+ * dropped, and bad entries are dropped; the blocks these mapped are
+ * left for the freemap check to free. Child blocks left empty are
+ * freed.
+ *
+ * Returns nonzero if the node was changed and needs writing back.
+ */
+static
+int
+check_extent_node(struct ibstate *ibs, struct sfs_extent *se,
+		  uint16_t *countp, unsigned depth, uint32_t lo, uint32_t hi)
+{
+	struct sfs_extent_block seb;
+	struct sfs_extent e;
+	uint32_t next, ehi, keep, k;
+	unsigned i, j, count;
+	int changed = 0;
+
+	count = *countp;
+	next = lo;
+	for (i=j=0; i<count; i++) {
+		e = se[i];
+		if (depth == 0) {
+			if (e.se_nblocks == 0 || e.se_fileblock < next ||
+			    e.se_fileblock >= hi ||
+			    e.se_nblocks > hi - e.se_fileblock ||
+			    e.se_diskblock == 0 ||
+			    e.se_diskblock >= ibs->volblocks ||
+			    e.se_nblocks > ibs->volblocks - e.se_diskblock) {
+				warnx("Inode %lu: bad extent of %lu blocks "
+				      "at block %lu (dropped)",
+				      (unsigned long)ibs->ino,
+				      (unsigned long)e.se_nblocks,
+				      (unsigned long)e.se_fileblock);
+				setbadness(EXIT_RECOV);
+				changed = 1;
+				continue;
+			}
+
+			keep = e.se_nblocks;
+			if (e.se_fileblock >= ibs->fileblocks) {
+				keep = 0;
+			}
+			else if (keep > ibs->fileblocks - e.se_fileblock) {
+				keep = ibs->fileblocks - e.se_fileblock;
+			}
+			for (k=0; k<e.se_nblocks; k++) {
+				if (k < keep) {
+					freemap_blockinuse(e.se_diskblock + k,
+							   ibs->usagetype,
+							   ibs->ino);
+				}
+				else {
+					freemap_blockfree(e.se_diskblock + k);
+				}
+			}
+			if (keep < e.se_nblocks) {
+				setbadness(EXIT_RECOV);
+				ibs->pasteofcount += e.se_nblocks - keep;
+				e.se_nblocks = keep;
+				changed = 1;
+			}
+			if (keep == 0) {
+				continue;
+			}
+			next = e.se_fileblock + keep;
+		}
+		else {
+			ehi = i+1 < count ? se[i+1].se_fileblock : hi;
+			if (ehi > hi) {
+				ehi = hi;
+			}
+			if ((j > 0 && e.se_fileblock < next) ||
+			    e.se_fileblock >= hi ||
+			    e.se_diskblock == 0 ||
+			    e.se_diskblock >= ibs->volblocks) {
+				warnx("Inode %lu: bad extent index entry "
+				      "for block %lu (dropped)",
+				      (unsigned long)ibs->ino,
+				      (unsigned long)e.se_fileblock);
+				setbadness(EXIT_RECOV);
+				changed = 1;
+				continue;
+			}
+
+			sfs_readextblock(e.se_diskblock, &seb);
+			if (seb.seb_magic != SFS_EXTENT_MAGIC ||
+			    seb.seb_depth != depth-1 ||
+			    seb.seb_count > SFS_EXTENTS_PERBLOCK) {
+				warnx("Inode %lu: bad extent block %lu "
+				      "(dropped)", (unsigned long)ibs->ino,
+				      (unsigned long)e.se_diskblock);
+				setbadness(EXIT_RECOV);
+				changed = 1;
+				continue;
+			}
+			if (check_extent_node(ibs, seb.seb_entries,
+					      &seb.seb_count, depth-1,
+					      j == 0 ? lo : e.se_fileblock,
+					      ehi)) {
+				sfs_writeextblock(e.se_diskblock, &seb);
+			}
+			if (seb.seb_count == 0) {
+				freemap_blockfree(e.se_diskblock);
+				changed = 1;
+				continue;
+			}
+			freemap_blockinuse(e.se_diskblock, B_IBLOCK, ibs->ino);
+			next = e.se_fileblock + 1;
+		}
+		if (j != i) {
+			changed = 1;
+		}
+		se[j++] = e;
+	}
+
+	for (i=j; i<count; i++) {
+		bzero(&se[i], sizeof(se[i]));
+	}
+	*countp = j;
+	return changed;
+}
+
+/*
+ * Check the blocks of an extent-mapped inode. Arguments and return
+ * value are as for check_inode_blocks.
+ */
+static
+int
+check_inode_extents(struct ibstate *ibs, struct sfs_dinode *sfi)
+{
+	struct sfs_extent_root *ser = &sfi->sfi_extents;
+	int changed = 0;
+
+	if (ser->ser_depth > SFS_EXTENT_MAXDEPTH ||
+	    ser->ser_count > SFS_EXTENTS_ININODE) {
+		warnx("Inode %lu: bad extent root (cleared)",
+		      (unsigned long)ibs->ino);
+		setbadness(EXIT_RECOV);
+		bzero(ser, sizeof(*ser));
+		return 1;
+	}
+
+	if (check_extent_node(ibs, ser->ser_entries, &ser->ser_count,
+			      ser->ser_depth, 0,
+			      SFS_EXTENT_MAXBLOCKS(sb_blocksize()))) {
+		changed = 1;
+	}
+	if (ser->ser_count == 0 && ser->ser_depth > 0) {
+		ser->ser_depth = 0;
+		changed = 1;
+	}
+
+	if (ibs->pasteofcount > 0) {
+		warnx("Inode %lu: %u blocks after EOF (freed)",
+		     (unsigned long) ibs->ino, ibs->pasteofcount);
+		setbadness(EXIT_RECOV);
+	}
+
+	return changed;
+}
+
 /*
  * Check the blocks belonging to inode INO, whose inode has already
  * been loaded into SFI. ISDIR is a shortcut telling us if the inode
@@ -189,15 +354,19 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	size = SFS_ROUNDUP(sfi->sfi_size, sb_blocksize());
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
-	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	ibs.fileblocks = size/sb_blocksize();
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
 
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		return check_inode_extents(&ibs, sfi);
+	}
+
 	changed = 0;
 
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
@@ -247,6 +416,57 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Check inode INO, which has SFS_IFLAG_INLINE set and has already
+ * been loaded into SFI: the contents must fit in sfi_waste, with
+ * zeros after them, and there must be no blocks.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	char *data = (char *)sfi->sfi_waste;
+	uint32_t max;
+	int changed = 0;
+
+	max = sb_inlinemax();
+	if (isdir) {
+		max -= max % sizeof(struct sfs_direntry);
+	}
+	if (sfi->sfi_size > max) {
+		warnx("Inode %lu: Inline size %lu too large (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		sfi->sfi_size = max;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if (checkzeroed(data + sfi->sfi_size,
+			sizeof(sfi->sfi_waste) - sfi->sfi_size)) {
+		warnx("Inode %lu: Inline data past EOF not zeroed (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	/* Any blocks are left unreferenced, so get freed later */
+	if (checkzeroed(sfi->sfi_direct, sizeof(sfi->sfi_direct)) |
+	    checkzeroed(&sfi->sfi_indirect, sizeof(sfi->sfi_indirect)) |
+	    checkzeroed(&sfi->sfi_extents, sizeof(sfi->sfi_extents)) |
+	    checkzeroed(&sfi->sfi_dindirect, sizeof(sfi->sfi_dindirect)) |
+	    checkzeroed(&sfi->sfi_tindirect, sizeof(sfi->sfi_tindirect))) {
+		warnx("Inode %lu: Block pointers in inline inode (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -268,19 +488,59 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		return 1;
 	}
 
-	freemap_blockinuse(ino, B_INODE, ino);
+	freemap_inodeinuse(ino);
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
+	if (sfi->sfi_flags & ~SFS_IFLAGS_KNOWN) {
+		warnx("Inode %lu: Unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags & ~SFS_IFLAGS_KNOWN));
+		sfi->sfi_flags &= SFS_IFLAGS_KNOWN;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+	if (!isdir && (sfi->sfi_flags & SFS_IFLAG_DIRINDEX)) {
+		warnx("Inode %lu: Directory index flag on a file (cleared)",
 		      (unsigned long) ino);
+		sfi->sfi_flags &= ~SFS_IFLAG_DIRINDEX;
 		setbadness(EXIT_RECOV);
 		changed = 1;
 	}
 
-	if (check_inode_blocks(ino, sfi, isdir)) {
+	if ((sfi->sfi_flags & SFS_IFLAG_INLINE) &&
+	    !sb_hasfeature(SFS_FEATURE_INLINE)) {
+		warnx("Inode %lu: Inline data without the inline feature "
+		      "(discarded)", (unsigned long) ino);
+		sfi->sfi_flags &= ~SFS_IFLAG_INLINE;
+		sfi->sfi_size = 0;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+	if ((sfi->sfi_flags & SFS_IFLAG_INLINE) &&
+	    (sfi->sfi_flags & SFS_IFLAG_DIRINDEX)) {
+		warnx("Inode %lu: Directory index flag on an inline "
+		      "directory (cleared)", (unsigned long) ino);
+		sfi->sfi_flags &= ~SFS_IFLAG_DIRINDEX;
+		setbadness(EXIT_RECOV);
 		changed = 1;
 	}
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		if (check_inode_inline(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+	else {
+		if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
+			warnx("Inode %lu: sfi_waste section not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+		if (check_inode_blocks(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
@@ -296,9 +556,9 @@ int
 pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 {
 	int dchanged = 0;
-	uint32_t nblocks;
+	uint32_t ninodes;
 
-	nblocks = sb_totalblocks();
+	ninodes = sb_ninodes();
 
 	if (sfd->sfd_ino == SFS_NOINO) {
 		if (sfd->sfd_name[0] != 0) {
@@ -309,7 +569,7 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 			dchanged = 1;
 		}
 	}
-	else if (sfd->sfd_ino >= nblocks) {
+	else if (sfd->sfd_ino >= ninodes) {
 		setbadness(EXIT_RECOV);
 		warnx("Directory %s entry %lu has out of range "
 		      "inode (cleared)",
@@ -437,6 +697,9 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
+		if (sfi.sfi_flags & SFS_IFLAG_INLINE) {
+			sfs_writeinode(ino, &sfi);
+		}
 	}
 
 	free(direntries);
@@ -47,6 +47,44 @@
 #include "passes.h"
 #include "main.h"
 
+/*
+ * Try to add NAME/INO to the directory in D, which has ND entries
+ * and belongs to inode SFI, without allocating new space.
+ */
+static
+int
+pass2_tryadd(const struct sfs_dinode *sfi, struct sfs_direntry *d, int nd,
+	     const char *name, uint32_t ino)
+{
+	if (sfi->sfi_flags & SFS_IFLAG_DIRINDEX) {
+		return sfsdir_indexadd(d, nd, name, ino);
+	}
+	return sfsdir_tryadd(d, nd, name, ino);
+}
+
+/*
+ * If the directory in D (ND entries, inode SFI) has an index that
+ * is no good, remove it. Returns nonzero if it did.
+ */
+static
+int
+pass2_checkindex(struct sfs_dinode *sfi, struct sfs_direntry *d,
+		 unsigned nd, const char *pathsofar)
+{
+	if ((sfi->sfi_flags & SFS_IFLAG_DIRINDEX) == 0) {
+		return 0;
+	}
+	if (sb_hasfeature(SFS_FEATURE_DIRINDEX) &&
+	    sfsdir_checkindex(d, nd) == 0) {
+		return 0;
+	}
+	setbadness(EXIT_RECOV);
+	warnx("Directory %s: Invalid index (removed)", pathsofar);
+	sfsdir_dropindex(d, nd);
+	sfi->sfi_flags &= ~SFS_IFLAG_DIRINDEX;
+	return 1;
+}
+
 /*
  * Process a directory. INO is the inode number; PARENTINO is the
  * parent's inode number; PATHSOFAR is the path to this directory.
@@ -78,13 +116,18 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	/*
 	 * Load the directory. If there is any leftover room in the
-	 * last block, allocate space for it in case we want to insert
-	 * entries.
+	 * last block, or in the inode for an inline directory,
+	 * allocate space for it in case we want to insert entries.
 	 */
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
-	maxdirentries = SFS_ROUNDUP(ndirentries,
-				    SFS_BLOCKSIZE/sizeof(struct sfs_direntry));
+	if (sfi.sfi_flags & SFS_IFLAG_INLINE) {
+		maxdirentries = sb_inlinemax() / sizeof(struct sfs_direntry);
+	}
+	else {
+		maxdirentries = SFS_ROUNDUP(ndirentries,
+					    SB_DIRENTRIESPERBLOCK);
+	}
 	dirsize = maxdirentries * sizeof(struct sfs_direntry);
 	direntries = domalloc(dirsize);
 
@@ -96,6 +139,11 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		bzero(direntries[i].sfd_name, sizeof(direntries[i].sfd_name));
 	}
 
+	if (pass2_checkindex(&sfi, direntries, ndirentries, pathsofar)) {
+		dchanged = 1;
+		ichanged = 1;
+	}
+
 	/*
 	 * Sort by name and check for duplicate names.
 	 */
@@ -173,14 +221,14 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (!dotseen) {
-		if (sfsdir_tryadd(direntries, ndirentries, ".", ino)==0) {
+		if (pass2_tryadd(&sfi, direntries, ndirentries, ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `.' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (sfsdir_tryadd(direntries, maxdirentries, ".",
-				       ino)==0) {
+		else if (pass2_tryadd(&sfi, direntries, maxdirentries,
+				      ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `.' entry (added)",
 			      pathsofar);
@@ -201,15 +249,15 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (!dotdotseen) {
-		if (sfsdir_tryadd(direntries, ndirentries, "..",
-				  parentino)==0) {
+		if (pass2_tryadd(&sfi, direntries, ndirentries, "..",
+				 parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `..' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (sfsdir_tryadd(direntries, maxdirentries, "..",
-				    parentino)==0) {
+		else if (pass2_tryadd(&sfi, direntries, maxdirentries,
+				      "..", parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory %s: No `..' entry (added)",
 			      pathsofar);
@@ -301,8 +349,17 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 * Write back anything that changed, clean up, and return.
 	 */
 
+	/* Renaming or adding entries may have put them in the wrong leaf. */
+	if (dchanged && pass2_checkindex(&sfi, direntries, ndirentries,
+					 pathsofar)) {
+		ichanged = 1;
+	}
+
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
+		if (sfi.sfi_flags & SFS_IFLAG_INLINE) {
+			ichanged = 1;
+		}
 	}
 
 	if (ichanged) {
@@ -36,6 +36,7 @@
 #include "compat.h"
 #include <kern/sfs.h>
 
+#include "disk.h"
 #include "utils.h"
 #include "sfs.h"
 #include "sb.h"
@@ -43,9 +44,70 @@
 #include "main.h"
 
 static struct sfs_superblock sb;
+static uint32_t blocksize;
 
 /*
- * Load the superblock.
+ * Check the inode table fields. The bitmap must follow the freemap,
+ * and the table the bitmap, and the table must end within the
+ * volume. There's no recovering from a bad inode table, so these are
+ * fatal.
+ */
+static
+void
+sb_checktable(void)
+{
+	uint32_t mapstart;
+
+	mapstart = SFS_FREEMAP_START +
+		SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize);
+	if (sb.sb_ninodes <= SFS_ROOTDIR_INO ||
+	    sb.sb_ninodes / SFS_INODESPERBLOCK(blocksize) > sb.sb_nblocks) {
+		errx(EXIT_FATAL, "Invalid inode count %lu",
+		     (unsigned long)sb.sb_ninodes);
+	}
+	if (sb.sb_inodemap < mapstart || sb.sb_inodemap > sb.sb_nblocks ||
+	    sb.sb_itable < sb.sb_inodemap +
+	    SFS_INODEMAPBLOCKS(sb.sb_ninodes, blocksize) ||
+	    sb.sb_itable > sb.sb_nblocks ||
+	    SFS_ITABLEBLOCKS(sb.sb_ninodes, blocksize) >
+	    sb.sb_nblocks - sb.sb_itable) {
+		errx(EXIT_FATAL, "Invalid inode table location "
+		     "(bitmap %lu, table %lu)",
+		     (unsigned long)sb.sb_inodemap,
+		     (unsigned long)sb.sb_itable);
+	}
+}
+
+/*
+ * Check the journal fields. The journal must follow the freemap and
+ * the inode table, if any, and end within the volume. Like a bad
+ * inode table, these are fatal.
+ */
+static
+void
+sb_checkjournal(void)
+{
+	uint32_t start;
+
+	start = SFS_FREEMAP_START +
+		SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize);
+	if (sb.sb_features & SFS_FEATURE_ITABLE) {
+		start = sb.sb_itable +
+			SFS_ITABLEBLOCKS(sb.sb_ninodes, blocksize);
+	}
+	if (sb.sb_journal < start || sb.sb_journal > sb.sb_nblocks ||
+	    sb.sb_journalblocks < SFS_JOURNAL_MINBLOCKS ||
+	    sb.sb_journalblocks > sb.sb_nblocks - sb.sb_journal) {
+		errx(EXIT_FATAL, "Invalid journal location "
+		     "(start %lu, %lu blocks)",
+		     (unsigned long)sb.sb_journal,
+		     (unsigned long)sb.sb_journalblocks);
+	}
+}
+
+/*
+ * Load the superblock, and switch the disk over to the volume's
+ * block size.
  */
 void
 sb_load(void)
@@ -55,8 +117,27 @@ sb_load(void)
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
 
+	blocksize = SFS_BLOCKSIZE;
+	if (sb.sb_features & SFS_FEATURE_BLOCKSIZE) {
+		blocksize = sb.sb_blocksize;
+		if (blocksize < SFS_BLOCKSIZE ||
+		    blocksize > SFS_MAXBLOCKSIZE ||
+		    (blocksize & (blocksize - 1)) != 0) {
+			errx(EXIT_FATAL, "Invalid block size %lu",
+			     (unsigned long)blocksize);
+		}
+		disksetblocksize(blocksize);
+	}
+
 	assert(sb.sb_nblocks > 0);
-	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
+	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize) > 0);
+
+	if (sb.sb_features & SFS_FEATURE_ITABLE) {
+		sb_checktable();
+	}
+	if (sb.sb_features & SFS_FEATURE_JOURNAL) {
+		sb_checkjournal();
+	}
 }
 
 /*
@@ -83,6 +164,39 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		warnx("Unknown feature flags 0x%lx in superblock (cleared)",
+		      (unsigned long) (sb.sb_features & ~SFS_FEATURES_KNOWN));
+		sb.sb_features &= SFS_FEATURES_KNOWN;
+		setbadness(EXIT_RECOV);
+		schanged = 1;
+	}
+	if (sb.sb_blocksize != blocksize &&
+	    !(sb.sb_blocksize == 0 && blocksize == SFS_BLOCKSIZE)) {
+		warnx("Block size %lu in superblock without the block size "
+		      "feature flag (fixed)",
+		      (unsigned long) sb.sb_blocksize);
+		sb.sb_blocksize = blocksize;
+		setbadness(EXIT_RECOV);
+		schanged = 1;
+	}
+	if (!(sb.sb_features & SFS_FEATURE_ITABLE) &&
+	    (sb.sb_ninodes != 0 || sb.sb_inodemap != 0 ||
+	     sb.sb_itable != 0)) {
+		warnx("Inode table in superblock without the inode table "
+		      "feature flag (cleared)");
+		sb.sb_ninodes = sb.sb_inodemap = sb.sb_itable = 0;
+		setbadness(EXIT_RECOV);
+		schanged = 1;
+	}
+	if (!(sb.sb_features & SFS_FEATURE_JOURNAL) &&
+	    (sb.sb_journal != 0 || sb.sb_journalblocks != 0)) {
+		warnx("Journal in superblock without the journal "
+		      "feature flag (cleared)");
+		sb.sb_journal = sb.sb_journalblocks = 0;
+		setbadness(EXIT_RECOV);
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -111,7 +225,84 @@ sb_totalblocks(void)
 uint32_t
 sb_freemapblocks(void)
 {
-	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+	return SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize);
+}
+
+/*
+ * Return the volume's block size.
+ */
+uint32_t
+sb_blocksize(void)
+{
+	return blocksize;
+}
+
+/*
+ * Return the number of inode numbers: the size of the inode table,
+ * or without one the volume size, since inodes are blocks.
+ */
+uint32_t
+sb_ninodes(void)
+{
+	if (sb.sb_features & SFS_FEATURE_ITABLE) {
+		return sb.sb_ninodes;
+	}
+	return sb.sb_nblocks;
+}
+
+/*
+ * Return the first block of the inode bitmap and of the inode table.
+ * Only valid with SFS_FEATURE_ITABLE.
+ */
+uint32_t
+sb_inodemapstart(void)
+{
+	return sb.sb_inodemap;
+}
+
+uint32_t
+sb_itablestart(void)
+{
+	return sb.sb_itable;
+}
+
+/*
+ * Return the first block and the size of the journal. Only valid
+ * with SFS_FEATURE_JOURNAL.
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journal;
+}
+
+uint32_t
+sb_journalblocks(void)
+{
+	return sb.sb_journalblocks;
+}
+
+/*
+ * Return how many bytes of data fit in an inode with
+ * SFS_IFLAG_INLINE, which depends on how much of the inode is
+ * stored.
+ */
+uint32_t
+sb_inlinemax(void)
+{
+	if (sb.sb_features & SFS_FEATURE_ITABLE) {
+		return SFS_INLINE_MAX(SFS_ISIZE);
+	}
+	return SFS_INLINE_MAX(sizeof(struct sfs_dinode));
+}
+
+/*
+ * Return whether the volume has FEATURE (an SFS_FEATURE_* flag) set.
+ */
+int
+sb_hasfeature(uint32_t feature)
+{
+	return (sb.sb_features & feature) != 0;
 }
 
 /*
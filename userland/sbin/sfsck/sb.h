@@ -46,6 +46,34 @@ uint32_t sb_totalblocks(void);
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
+/* After the superblock is loaded: return the block size. */
+uint32_t sb_blocksize(void);
+
+/* After the superblock is loaded: return the number of inode numbers. */
+uint32_t sb_ninodes(void);
+
+/* With SFS_FEATURE_ITABLE: return where the inode bitmap and table are. */
+uint32_t sb_inodemapstart(void);
+uint32_t sb_itablestart(void);
+
+/* With SFS_FEATURE_JOURNAL: return where the journal is and its size. */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
+/* After the superblock is loaded: return the room for inline data. */
+uint32_t sb_inlinemax(void);
+
+/* The size macros from kern/sfs.h for the volume's block size. */
+#define SB_DIRENTRIESPERBLOCK	SFS_DIRENTRIESPERBLOCK(sb_blocksize())
+#define SB_DBPERIDB		SFS_DBPERIDB(sb_blocksize())
+#define SB_INODESPERBLOCK	SFS_INODESPERBLOCK(sb_blocksize())
+#define SB_INODEMAPBLOCKS \
+	SFS_INODEMAPBLOCKS(sb_ninodes(), sb_blocksize())
+#define SB_ITABLEBLOCKS		SFS_ITABLEBLOCKS(sb_ninodes(), sb_blocksize())
+
+/* After the superblock is loaded: check for an SFS_FEATURE_* flag. */
+int sb_hasfeature(uint32_t feature);
+
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
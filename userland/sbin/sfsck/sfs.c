@@ -40,6 +40,7 @@
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
+#include "sb.h"
 #include "main.h"
 
 ////////////////////////////////////////////////////////////
@@ -51,6 +52,11 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(SFS_MAXBLOCKSIZE % SFS_BLOCKSIZE == 0);
+	assert(sizeof(struct sfs_dirindex)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_extent_block)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_extent_root) ==
+	       sizeof(uint32_t)*(SFS_NDIRECT+SFS_NINDIRECT));
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +68,13 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_features = SWAP32(sb->sb_features);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
+	sb->sb_ninodes = SWAP32(sb->sb_ninodes);
+	sb->sb_inodemap = SWAP32(sb->sb_inodemap);
+	sb->sb_itable = SWAP32(sb->sb_itable);
+	sb->sb_journal = SWAP32(sb->sb_journal);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
 }
 
 static
@@ -74,20 +87,50 @@ swapbits(uint8_t *bits)
 
 static
 void
-swapinode(struct sfs_dinode *sfi)
+swapextents(struct sfs_extent *se, unsigned num)
 {
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		se[i].se_fileblock = SWAP32(se[i].se_fileblock);
+		se[i].se_diskblock = SWAP32(se[i].se_diskblock);
+		se[i].se_nblocks = SWAP32(se[i].se_nblocks);
+	}
+}
+
+/*
+ * Swap an inode. TOHOST says which way we're going, since the flags
+ * (which say how to swap the rest) are only readable in host order.
+ */
+static
+void
+swapinode(struct sfs_dinode *sfi, int tohost)
+{
+	uint32_t flags;
 	int i;
 
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
-
-	for (i=0; i<NUM_D; i++) {
-		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
+	flags = tohost ? SWAP32(sfi->sfi_flags) : sfi->sfi_flags;
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+
+	if (flags & SFS_IFLAG_EXTENTS) {
+		sfi->sfi_extents.ser_count =
+			SWAP16(sfi->sfi_extents.ser_count);
+		sfi->sfi_extents.ser_depth =
+			SWAP16(sfi->sfi_extents.ser_depth);
+		swapextents(sfi->sfi_extents.ser_entries,
+			    SFS_EXTENTS_ININODE);
 	}
+	else {
+		for (i=0; i<NUM_D; i++) {
+			SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
+		}
 
-	for (i=0; i<NUM_I; i++) {
-		SET_I(sfi, i) = SWAP32(GET_I(sfi, i));
+		for (i=0; i<NUM_I; i++) {
+			SET_I(sfi, i) = SWAP32(GET_I(sfi, i));
+		}
 	}
 
 	for (i=0; i<NUM_II; i++) {
@@ -110,12 +153,22 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<SB_DBPERIDB; i++) {
 		entries[i] = SWAP32(entries[i]);
 	}
 }
 
+static
+void
+swapextblock(struct sfs_extent_block *seb)
+{
+	seb->seb_magic = SWAP32(seb->seb_magic);
+	seb->seb_count = SWAP16(seb->seb_count);
+	seb->seb_depth = SWAP16(seb->seb_depth);
+	swapextents(seb->seb_entries, SFS_EXTENTS_PERBLOCK);
+}
+
 ////////////////////////////////////////////////////////////
 // bmap()
 
@@ -132,7 +185,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	if (iblock == 0) {
 		return 0;
@@ -144,14 +197,55 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset,
+			     entrysize/SB_DBPERIDB);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < SB_DBPERIDB);
 		return entries[offset];
 	}
 }
 
+/*
+ * Extent bmap: look FILEBLOCK up in the extent tree node with entries
+ * SE[0..COUNT-1] and DEPTH levels below it. Anything that doesn't
+ * look right reads as a hole; pass1 has the job of fixing it.
+ */
+static
+uint32_t
+extbmap(const struct sfs_extent *se, unsigned count, unsigned depth,
+	uint32_t fileblock)
+{
+	struct sfs_extent_block seb;
+	unsigned i;
+
+	if (count == 0 || count > SFS_EXTENTS_PERBLOCK) {
+		return 0;
+	}
+	for (i=count-1; i>0 && se[i].se_fileblock > fileblock; i--) {
+		/* nothing */
+	}
+
+	if (depth == 0) {
+		if (se[i].se_fileblock <= fileblock &&
+		    fileblock - se[i].se_fileblock < se[i].se_nblocks) {
+			return se[i].se_diskblock +
+				(fileblock - se[i].se_fileblock);
+		}
+		return 0;
+	}
+
+	if (depth > SFS_EXTENT_MAXDEPTH || se[i].se_diskblock == 0 ||
+	    se[i].se_diskblock >= sb_totalblocks()) {
+		return 0;
+	}
+	sfs_readextblock(se[i].se_diskblock, &seb);
+	if (seb.seb_magic != SFS_EXTENT_MAGIC || seb.seb_depth != depth-1) {
+		return 0;
+	}
+	return extbmap(seb.seb_entries, seb.seb_count, depth-1, fileblock);
+}
+
 /*
  * bmap() for SFS.
  *
@@ -163,6 +257,12 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
 
+	if (sfi->sfi_flags & SFS_IFLAG_EXTENTS) {
+		return extbmap(sfi->sfi_extents.ser_entries,
+			       sfi->sfi_extents.ser_count,
+			       sfi->sfi_extents.ser_depth, fileblock);
+	}
+
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
 	}
@@ -194,7 +294,7 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 void
 sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb)
 {
-	diskread(sb, blocknum);
+	diskreadpart(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -202,7 +302,7 @@ void
 sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 {
 	swapsb(sb);
-	diskwrite(sb, blocknum);
+	diskwritepart(sb, sizeof(*sb), blocknum);
 	swapsb(sb);
 }
 
@@ -226,23 +326,66 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 	swapbits(bits);
 }
 
+/*
+ * inode bitmap blocks - whichblock is a block number within the
+ * inode bitmap.
+ */
+
+void
+sfs_readinodemapblock(uint32_t whichblock, uint8_t *bits)
+{
+	diskread(bits, sb_inodemapstart() + whichblock);
+	swapbits(bits);
+}
+
+void
+sfs_writeinodemapblock(uint32_t whichblock, uint8_t *bits)
+{
+	swapbits(bits);
+	diskwrite(bits, sb_inodemapstart() + whichblock);
+	swapbits(bits);
+}
+
 /*
  *  inodes - ino is an inode number, which is a disk block number.
+ *  The inode takes up the start of the block. With an inode table,
+ *  it is instead the index of an SFS_ISIZE slot in the table, and
+ *  the rest of the structure reads as zeros.
  */
 
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
-	swapinode(sfi);
+	uint8_t buf[SFS_MAXBLOCKSIZE];
+
+	if (sb_hasfeature(SFS_FEATURE_ITABLE)) {
+		diskread(buf, sb_itablestart() + ino / SB_INODESPERBLOCK);
+		bzero(sfi, sizeof(*sfi));
+		memcpy(sfi, buf + (ino % SB_INODESPERBLOCK) * SFS_ISIZE,
+		       SFS_ISIZE);
+	}
+	else {
+		diskreadpart(sfi, sizeof(*sfi), ino);
+	}
+	swapinode(sfi, 1);
 }
 
 void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	swapinode(sfi);
-	diskwrite(sfi, ino);
-	swapinode(sfi);
+	uint8_t buf[SFS_MAXBLOCKSIZE];
+
+	swapinode(sfi, 0);
+	if (sb_hasfeature(SFS_FEATURE_ITABLE)) {
+		diskread(buf, sb_itablestart() + ino / SB_INODESPERBLOCK);
+		memcpy(buf + (ino % SB_INODESPERBLOCK) * SFS_ISIZE, sfi,
+		       SFS_ISIZE);
+		diskwrite(buf, sb_itablestart() + ino / SB_INODESPERBLOCK);
+	}
+	else {
+		diskwritepart(sfi, sizeof(*sfi), ino);
+	}
+	swapinode(sfi, 1);
 }
 
 /*
@@ -264,6 +407,26 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  extent tree blocks - blocknum is a disk block number. The tree
+ *  block takes up the start of the disk block.
+ */
+
+void
+sfs_readextblock(uint32_t blocknum, struct sfs_extent_block *seb)
+{
+	diskreadpart(seb, sizeof(*seb), blocknum);
+	swapextblock(seb);
+}
+
+void
+sfs_writeextblock(uint32_t blocknum, struct sfs_extent_block *seb)
+{
+	swapextblock(seb);
+	diskwritepart(seb, sizeof(*seb), blocknum);
+	swapextblock(seb);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -274,7 +437,7 @@ static
 void
 sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SB_DIRENTRIESPERBLOCK;
 	unsigned j;
 
 	if (diskblock != 0) {
@@ -285,7 +448,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	}
 	else {
 		warnx("Warning: sparse directory found");
-		bzero(d, SFS_BLOCKSIZE);
+		bzero(d, sb_blocksize());
 	}
 }
 
@@ -297,13 +460,24 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SB_DIRENTRIESPERBLOCK;
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
-	struct sfs_direntry buffer[atonce];
+	struct sfs_direntry buffer[SFS_DIRENTRIESPERBLOCK(SFS_MAXBLOCKSIZE)];
+	const struct sfs_direntry *inl;
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		assert(nd * sizeof(*d) <= sizeof(sfi->sfi_waste));
+		inl = (const struct sfs_direntry *)sfi->sfi_waste;
+		for (i=0; i<nd; i++) {
+			d[i] = inl[i];
+			swapdir(&d[i]);
+		}
+		return;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -330,7 +504,7 @@ static
 void
 sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SB_DIRENTRIESPERBLOCK;
 	unsigned j, bad;
 
 	if (diskblock != 0) {
@@ -357,18 +531,30 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 /*
  * Write out a directory, from the inode SFI, using D, which is a
  * buffer with ND slots. The caller is assumed to have set the inode
- * size accordingly.
+ * size accordingly. An inline directory goes into SFI, and the
+ * caller writes the inode back.
  */
 void
-sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
+sfs_writedir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = SB_DIRENTRIESPERBLOCK;
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
-	struct sfs_direntry buffer[atonce];
+	struct sfs_direntry buffer[SFS_DIRENTRIESPERBLOCK(SFS_MAXBLOCKSIZE)];
+	struct sfs_direntry *inl;
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		assert(nd * sizeof(*d) <= sb_inlinemax());
+		inl = (struct sfs_direntry *)sfi->sfi_waste;
+		for (i=0; i<nd; i++) {
+			inl[i] = d[i];
+			swapdir(&inl[i]);
+		}
+		return;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -462,3 +648,265 @@ sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
 	}
 	return -1;
 }
+
+////////////////////////////////////////////////////////////
+// directory index
+
+/*
+ * Directory index state. The index is checked in place in the
+ * directory buffer, where (apart from sfd_ino) everything is still
+ * in disk byte order.
+ */
+#define IDX_NONE  0
+#define IDX_INDEX 1
+#define IDX_LEAF  2
+
+static struct sfs_direntry *idx_dir;
+static unsigned idx_nblocks;
+static unsigned char *idx_seen;
+
+/*
+ * The name hash used by the index (32-bit FNV-1a). This must match
+ * the kernel's.
+ */
+static
+uint32_t
+dirindex_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static
+struct sfs_dirindex *
+dirindex_block(struct sfs_direntry *d, uint32_t block)
+{
+	return (struct sfs_dirindex *)&d[block * SB_DIRENTRIESPERBLOCK];
+}
+
+static
+uint32_t
+dirindex_hashat(struct sfs_dirindex *sdi, unsigned i)
+{
+	return SWAP32(SFS_DIRINDEX_ENTRY(sdi, i).sdx_hash);
+}
+
+static
+uint32_t
+dirindex_blockat(struct sfs_dirindex *sdi, unsigned i)
+{
+	return SWAP32(SFS_DIRINDEX_ENTRY(sdi, i).sdx_block);
+}
+
+/*
+ * Check that the directory block BLOCK is a leaf holding only names
+ * whose hashes are in [LO, HI]. Returns nonzero if not.
+ */
+static
+int
+dirindex_checkleaf(uint32_t block, uint32_t lo, uint32_t hi)
+{
+	struct sfs_direntry *sds;
+	uint32_t hash;
+	unsigned i;
+
+	if (block == 0 || block >= idx_nblocks || idx_seen[block] != IDX_NONE) {
+		return 1;
+	}
+	idx_seen[block] = IDX_LEAF;
+
+	sds = &idx_dir[block * SB_DIRENTRIESPERBLOCK];
+	for (i=0; i<SB_DIRENTRIESPERBLOCK; i++) {
+		if (sds[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		hash = dirindex_hash(sds[i].sfd_name);
+		if (hash < lo || hash > hi) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check the index block BLOCK, which should have DEPTH levels below
+ * it, and everything under it. All hashes under it should be in
+ * [LO, HI]. Returns nonzero if something is wrong.
+ */
+static
+int
+dirindex_checkblock(uint32_t block, uint32_t depth, uint32_t lo, uint32_t hi)
+{
+	struct sfs_dirindex *sdi;
+	uint32_t count, hash, childlo, childhi, child;
+	unsigned i;
+
+	if (block >= idx_nblocks || idx_seen[block] != IDX_NONE) {
+		return 1;
+	}
+	idx_seen[block] = IDX_INDEX;
+
+	sdi = dirindex_block(idx_dir, block);
+	count = SWAP32(sdi->sdi_count);
+	if (SWAP32(sdi->sdi_magic) != SFS_DIRINDEX_MAGIC ||
+	    SWAP32(sdi->sdi_depth) != depth ||
+	    count == 0 || count > SFS_DIRINDEX_ENTRIES) {
+		return 1;
+	}
+	if (sdi->sdi_zero[0] != 0 || sdi->sdi_zero[1] != 0) {
+		return 1;
+	}
+	for (i=0; i<SFS_DIRINDEX_NSLOTS; i++) {
+		if (sdi->sdi_slots[i].sds_zero[0] != 0 ||
+		    sdi->sdi_slots[i].sds_zero[1] != 0) {
+			return 1;
+		}
+	}
+	/* With larger blocks, the rest of the block is free slots */
+	for (i=sizeof(*sdi)/sizeof(struct sfs_direntry);
+	     i<SB_DIRENTRIESPERBLOCK; i++) {
+		if (idx_dir[block * SB_DIRENTRIESPERBLOCK + i].sfd_ino !=
+		    SFS_NOINO) {
+			return 1;
+		}
+	}
+
+	for (i=0; i<count; i++) {
+		hash = dirindex_hashat(sdi, i);
+		if (i > 0 && (hash <= dirindex_hashat(sdi, i-1) ||
+			      hash < lo || hash > hi)) {
+			return 1;
+		}
+		childlo = (i == 0) ? lo : hash;
+		childhi = (i+1 < count) ? dirindex_hashat(sdi, i+1) - 1 : hi;
+		child = dirindex_blockat(sdi, i);
+		if (depth > 0) {
+			if (child == 0 ||
+			    dirindex_checkblock(child, depth-1,
+						childlo, childhi)) {
+				return 1;
+			}
+		}
+		else {
+			if (dirindex_checkleaf(child, childlo, childhi)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check the index of the directory in D (with ND entries, in the
+ * order sfs_readdir produces). Every name must be in the leaf the
+ * index sends its hash to, and every block of the directory must be
+ * either an index block or a leaf.
+ *
+ * Returns 0 if the index is good and nonzero otherwise.
+ */
+int
+sfsdir_checkindex(struct sfs_direntry *d, unsigned nd)
+{
+	struct sfs_dirindex *root;
+	unsigned i, j;
+	int bad;
+
+	if (nd == 0 || nd % SB_DIRENTRIESPERBLOCK != 0) {
+		return 1;
+	}
+
+	idx_dir = d;
+	idx_nblocks = nd / SB_DIRENTRIESPERBLOCK;
+	idx_seen = domalloc(idx_nblocks);
+	bzero(idx_seen, idx_nblocks);
+
+	root = dirindex_block(d, 0);
+	bad = SWAP32(root->sdi_depth) > SFS_DIRINDEX_MAXDEPTH ||
+		dirindex_checkblock(0, SWAP32(root->sdi_depth),
+				    0, 0xffffffff);
+
+	/* Names anywhere else can't be found. */
+	for (i=0; i<idx_nblocks && !bad; i++) {
+		if (idx_seen[i] != IDX_NONE) {
+			continue;
+		}
+		for (j=0; j<SB_DIRENTRIESPERBLOCK; j++) {
+			if (d[i*SB_DIRENTRIESPERBLOCK + j].sfd_ino !=
+			    SFS_NOINO) {
+				bad = 1;
+			}
+		}
+	}
+
+	free(idx_seen);
+	idx_seen = NULL;
+	idx_dir = NULL;
+	return bad;
+}
+
+/*
+ * Remove the index from the directory in D (with ND entries), so it
+ * becomes an ordinary flat directory. The leaves are ordinary blocks
+ * of entries already; the index blocks turn into free slots. The
+ * caller clears SFS_IFLAG_DIRINDEX.
+ */
+void
+sfsdir_dropindex(struct sfs_direntry *d, unsigned nd)
+{
+	struct sfs_dirindex *sdi;
+	unsigned i;
+
+	for (i=0; i+SB_DIRENTRIESPERBLOCK <= nd;
+	     i += SB_DIRENTRIESPERBLOCK) {
+		sdi = dirindex_block(d, i / SB_DIRENTRIESPERBLOCK);
+		if (sdi->sdi_zero[0] == 0 && sdi->sdi_zero[1] == 0 &&
+		    SWAP32(sdi->sdi_magic) == SFS_DIRINDEX_MAGIC) {
+			bzero(sdi, sizeof(*sdi));
+		}
+	}
+}
+
+/*
+ * Like sfsdir_tryadd, but for the indexed directory in D: the entry
+ * can only go in the leaf the index sends its name to. The index
+ * must already have passed sfsdir_checkindex.
+ */
+int
+sfsdir_indexadd(struct sfs_direntry *d, int nd, const char *name,
+		uint32_t ino)
+{
+	struct sfs_dirindex *sdi;
+	uint32_t hash, block;
+	unsigned lo, hi, mid;
+
+	(void)nd;
+	hash = dirindex_hash(name);
+	sdi = dirindex_block(d, 0);
+	for (;;) {
+		/* last entry whose hash is <= hash; entry 0 if none */
+		lo = 0;
+		hi = SWAP32(sdi->sdi_count);
+		while (hi - lo > 1) {
+			mid = (lo + hi) / 2;
+			if (dirindex_hashat(sdi, mid) <= hash) {
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		block = dirindex_blockat(sdi, lo);
+		assert(block * SB_DIRENTRIESPERBLOCK < (unsigned)nd);
+		if (SWAP32(sdi->sdi_depth) == 0) {
+			break;
+		}
+		sdi = dirindex_block(d, block);
+	}
+	return sfsdir_tryadd(&d[block * SB_DIRENTRIESPERBLOCK],
+			     SB_DIRENTRIESPERBLOCK, name, ino);
+}
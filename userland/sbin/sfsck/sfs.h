@@ -41,6 +41,7 @@
 struct sfs_superblock;
 struct sfs_dinode;
 struct sfs_direntry;
+struct sfs_extent_block;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
@@ -57,6 +58,10 @@ void sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb);
 void sfs_readfreemapblock(uint32_t whichblock, uint8_t *bits);
 void sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits);
 
+/* inode bitmap blocks; whichblock starts at 0 as for the freemap */
+void sfs_readinodemapblock(uint32_t whichblock, uint8_t *bits);
+void sfs_writeinodemapblock(uint32_t whichblock, uint8_t *bits);
+
 /* inode */
 void sfs_readinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
@@ -65,15 +70,28 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
-/* directory - ND should be the number of directory entries D points to */
+/* extent tree block */
+void sfs_readextblock(uint32_t blocknum, struct sfs_extent_block *seb);
+void sfs_writeextblock(uint32_t blocknum, struct sfs_extent_block *seb);
+
+/*
+ * directory - ND should be the number of directory entries D points
+ * to; an inline directory is written into SFI, which the caller must
+ * then write back.
+ */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
-void sfs_writedir(const struct sfs_dinode *sfi,
-		  struct sfs_direntry *d, unsigned nd);
+void sfs_writedir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 
 /* Try to add an entry to a directory. */
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
 
+/* Check, remove, or add an entry via a directory's index. */
+int sfsdir_checkindex(struct sfs_direntry *d, unsigned nd);
+void sfsdir_dropindex(struct sfs_direntry *d, unsigned nd);
+int sfsdir_indexadd(struct sfs_direntry *d, int nd,
+		    const char *name, uint32_t ino);
+
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * futextest.c
+ *
+ * 	Tests the futex system call and the user-level mutexes and
+ * 	condition variables in libc that are built on it.
+ *
+ * OS/161 processes are single-threaded, so this checks the
+ * uncontended paths and the error returns of futex() rather than
+ * actual sleeping.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <ulock.h>
+
+static struct umutex m = UMUTEX_INITIALIZER;
+static struct ucond c = UCOND_INITIALIZER;
+static volatile int word;
+
+int
+main(int argc, char *argv[])
+{
+	int r;
+
+	(void)argc;
+	(void)argv;
+
+	umutex_lock(&m);
+	if (m.um_state != 1) {
+		errx(1, "umutex_lock: state %d, expected 1", m.um_state);
+	}
+	if (umutex_trylock(&m) == 0) {
+		errx(1, "umutex_trylock succeeded on a held mutex");
+	}
+	if (errno != EBUSY) {
+		err(1, "umutex_trylock: unexpected error");
+	}
+	umutex_unlock(&m);
+	if (m.um_state != 0) {
+		errx(1, "umutex_unlock: state %d, expected 0", m.um_state);
+	}
+	if (umutex_trylock(&m) != 0) {
+		err(1, "umutex_trylock on a free mutex");
+	}
+	umutex_unlock(&m);
+	printf("Uncontended mutex: passed\n");
+
+	/* Nobody waits, so these must not sleep or fail. */
+	ucond_signal(&c);
+	ucond_broadcast(&c);
+	printf("Condition variable with no waiters: passed\n");
+
+	word = 5;
+	r = futex(&word, FUTEX_WAIT, 4);
+	if (r != -1 || errno != EAGAIN) {
+		errx(1, "FUTEX_WAIT on a changed word: got %d (errno %d)",
+		     r, errno);
+	}
+	r = futex(&word, FUTEX_WAKE, 1);
+	if (r != 0) {
+		err(1, "FUTEX_WAKE with no sleepers returned %d", r);
+	}
+	r = futex((volatile int *)((char *)&word + 1), FUTEX_WAKE, 1);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "misaligned futex: got %d (errno %d)", r, errno);
+	}
+	r = futex(&word, 12345, 0);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "bad futex op: got %d (errno %d)", r, errno);
+	}
+	r = futex(NULL, FUTEX_WAIT, 0);
+	if (r != -1 || errno != EFAULT) {
+		errx(1, "futex on NULL: got %d (errno %d)", r, errno);
+	}
+	printf("futex error handling: passed\n");
+
+	printf("Passed futextest.\n");
+	return 0;
+}